@@ -70,6 +70,20 @@ static inline int32_t divmodi64(int64_t a, int32_t b, int32_t* rem) {
     return q;
 }
 
+// Unlike divmodi64, the quotient may take the full 64 bits.
+static inline uint64_t divmodu64(uint64_t a, uint32_t b, uint32_t* rem) {
+    uint32_t hi = a >> 32;
+    uint32_t q_hi = hi / b;
+    uint32_t q_lo;
+    uint32_t r;
+    __asm__("divl %[b]"
+            : "=a"(q_lo), "=d"(r)
+            : "d"(hi % b), "a"((uint32_t)(a & 0xffffffff)), [b] "rm"(b));
+    if (rem)
+        *rem = r;
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
 static inline bool str_is_uint(const char* s) {
     while (*s) {
         if (!isdigit(*s))
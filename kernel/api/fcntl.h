@@ -13,3 +13,8 @@
 #define O_TRUNC 00001000
 #define O_NONBLOCK 00004000
 #define O_NOFOLLOW 00400000
+
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+#define SPLICE_F_MORE 4
+#define SPLICE_F_GIFT 8
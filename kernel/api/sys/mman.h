@@ -8,5 +8,6 @@
 #define MAP_FIXED 0x10
 #define MAP_ANONYMOUS 0x20
 #define MAP_ANON MAP_ANONYMOUS
+#define MAP_HUGETLB 0x40000
 
 #define MAP_FAILED ((void*)-1)
@@ -105,6 +105,13 @@ static inline noreturn void ud2(void) {
 
 static inline void pause(void) { __asm__ volatile("pause"); }
 
+static inline uint64_t rdtsc(void) {
+    uint32_t lo;
+    uint32_t hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 // NOLINTBEGIN(readability-non-const-parameter)
 static inline void cpuid(uint32_t function, uint32_t* eax, uint32_t* ebx,
                          uint32_t* ecx, uint32_t* edx) {
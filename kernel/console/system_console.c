@@ -33,12 +33,19 @@ static short system_console_device_poll(struct file* file, short events) {
     return file_poll(active_console, events);
 }
 
+static struct waitqueue*
+system_console_device_get_waitqueue(struct file* file) {
+    (void)file;
+    return file_get_waitqueue(active_console);
+}
+
 static struct inode* system_console_device_get(void) {
     static const struct file_ops fops = {
         .pread = system_console_device_pread,
         .pwrite = system_console_device_pwrite,
         .ioctl = system_console_device_ioctl,
         .poll = system_console_device_poll,
+        .get_waitqueue = system_console_device_get_waitqueue,
     };
     static struct inode inode = {
         .fops = &fops,
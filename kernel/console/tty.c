@@ -39,8 +39,12 @@ static ssize_t tty_pread(struct file* file, void* buf, size_t count,
         spinlock_unlock(&tty->lock);
     }
 
+    // Writing to the buffer may fault, so read into a local buffer and
+    // copy it out after releasing the lock.
+    char local_buf[256];
+    count = MIN(count, sizeof(local_buf));
     ssize_t ret = 0;
-    char* dest = buf;
+    char* dest = local_buf;
     while (count) {
         struct attr_char ac;
         ssize_t nread = ring_buf_read(&tty->input_buf, &ac, sizeof(ac));
@@ -60,6 +64,9 @@ static ssize_t tty_pread(struct file* file, void* buf, size_t count,
     }
 
     spinlock_unlock(&tty->lock);
+
+    if (ret > 0)
+        memcpy(buf, local_buf, ret);
     return ret;
 }
 
@@ -86,78 +93,91 @@ static ssize_t tty_pwrite(struct file* file, const void* buf, size_t count,
                           uint64_t offset) {
     (void)offset;
     struct tty* tty = tty_from_file(file);
-    spinlock_lock(&tty->lock);
-    processed_echo(tty, buf, count);
-    spinlock_unlock(&tty->lock);
+
+    // Reading the buffer may fault, so copy it into a local buffer before
+    // taking the lock.
+    const char* src = buf;
+    char local_buf[256];
+    for (size_t i = 0; i < count; i += sizeof(local_buf)) {
+        size_t n = MIN(count - i, sizeof(local_buf));
+        memcpy(local_buf, src + i, n);
+        spinlock_lock(&tty->lock);
+        processed_echo(tty, local_buf, n);
+        spinlock_unlock(&tty->lock);
+    }
     return count;
 }
 
+// Copying from and to userland may fault, so it is done without holding
+// tty->lock.
 static int tty_ioctl(struct file* file, int request, void* user_argp) {
     struct tty* tty = tty_from_file(file);
-    struct termios* termios = &tty->termios;
-    int ret = 0;
-    spinlock_lock(&tty->lock);
     switch (request) {
-    case TIOCGPGRP:
-        if (copy_to_user(user_argp, &tty->pgid, sizeof(pid_t))) {
-            ret = -EFAULT;
-            goto done;
-        }
-        break;
-    case TIOCSPGRP:
-        if (copy_from_user(&tty->pgid, user_argp, sizeof(pid_t))) {
-            ret = -EFAULT;
-            goto done;
-        }
-        break;
-    case TCGETS:
-        if (copy_to_user(user_argp, termios, sizeof(struct termios))) {
-            ret = -EFAULT;
-            goto done;
-        }
-        break;
+    case TIOCGPGRP: {
+        spinlock_lock(&tty->lock);
+        pid_t pgid = tty->pgid;
+        spinlock_unlock(&tty->lock);
+        if (copy_to_user(user_argp, &pgid, sizeof(pid_t)))
+            return -EFAULT;
+        return 0;
+    }
+    case TIOCSPGRP: {
+        pid_t pgid;
+        if (copy_from_user(&pgid, user_argp, sizeof(pid_t)))
+            return -EFAULT;
+        spinlock_lock(&tty->lock);
+        tty->pgid = pgid;
+        spinlock_unlock(&tty->lock);
+        return 0;
+    }
+    case TCGETS: {
+        spinlock_lock(&tty->lock);
+        struct termios termios = tty->termios;
+        spinlock_unlock(&tty->lock);
+        if (copy_to_user(user_argp, &termios, sizeof(struct termios)))
+            return -EFAULT;
+        return 0;
+    }
     case TCSETS:
     case TCSETSW:
-    case TCSETSF:
-        if (copy_from_user(termios, user_argp, sizeof(struct termios))) {
-            ret = -EFAULT;
-            goto done;
-        }
+    case TCSETSF: {
+        struct termios termios;
+        if (copy_from_user(&termios, user_argp, sizeof(struct termios)))
+            return -EFAULT;
+        spinlock_lock(&tty->lock);
+        tty->termios = termios;
         if (request == TCSETSF) {
             tty->line_len = 0;
             ring_buf_clear(&tty->input_buf);
         }
-        break;
+        spinlock_unlock(&tty->lock);
+        return 0;
+    }
     case TIOCGWINSZ: {
+        spinlock_lock(&tty->lock);
         struct winsize winsize = {
             .ws_col = tty->num_columns,
             .ws_row = tty->num_rows,
             .ws_xpixel = 0,
             .ws_ypixel = 0,
         };
-        if (copy_to_user(user_argp, &winsize, sizeof(struct winsize))) {
-            ret = -EFAULT;
-            goto done;
-        }
-        break;
+        spinlock_unlock(&tty->lock);
+        if (copy_to_user(user_argp, &winsize, sizeof(struct winsize)))
+            return -EFAULT;
+        return 0;
     }
     case TIOCSWINSZ: {
         struct winsize winsize;
-        if (copy_from_user(&winsize, user_argp, sizeof(struct winsize))) {
-            ret = -EFAULT;
-            goto done;
-        }
+        if (copy_from_user(&winsize, user_argp, sizeof(struct winsize)))
+            return -EFAULT;
+        spinlock_lock(&tty->lock);
         tty->num_columns = winsize.ws_col;
         tty->num_rows = winsize.ws_row;
-        break;
+        spinlock_unlock(&tty->lock);
+        return 0;
     }
-    default:
-        ret = -EINVAL;
-        break;
     }
-done:
-    spinlock_unlock(&tty->lock);
-    return ret;
+    return -EINVAL;
 }
 
 static short tty_poll(struct file* file, short events) {
@@ -311,6 +331,7 @@ ssize_t tty_emit(struct tty* tty, const char* buf, size_t count) {
             break;
     }
     spinlock_unlock(&tty->lock);
+    waitqueue_wake_all(&tty->inode.waitqueue);
     if (IS_ERR(ret))
         return ret;
     return count;
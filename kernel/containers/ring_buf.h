@@ -1,5 +1,6 @@
 #pragma once
 
+#include <common/string.h>
 #include <kernel/api/errno.h>
 #include <kernel/api/sys/types.h>
 #include <kernel/memory/memory.h>
@@ -29,32 +30,32 @@ static inline bool ring_buf_is_full(const struct ring_buf* b) {
     return (b->write_index + 1) % b->capacity == b->read_index;
 }
 
+// Data may wrap around the end of the ring, so it is copied in at most two
+// chunks.
+
 NODISCARD static inline ssize_t ring_buf_read(struct ring_buf* b, void* bytes,
                                               size_t count) {
-    size_t nread = 0;
-    unsigned char* dest = bytes;
-    const unsigned char* src = b->ring;
-    while (nread < count) {
-        dest[nread++] = src[b->read_index];
-        b->read_index = (b->read_index + 1) % b->capacity;
-        if (b->read_index == b->write_index)
-            break;
-    }
-    return nread;
+    size_t read_index = b->read_index;
+    size_t available =
+        (b->write_index + b->capacity - read_index) % b->capacity;
+    count = MIN(count, available);
+    size_t n = MIN(count, b->capacity - read_index);
+    memcpy(bytes, b->ring + read_index, n);
+    memcpy((unsigned char*)bytes + n, b->ring, count - n);
+    b->read_index = (read_index + count) % b->capacity;
+    return count;
 }
 
 NODISCARD static inline ssize_t
 ring_buf_write(struct ring_buf* b, const void* bytes, size_t count) {
-    size_t nwritten = 0;
-    unsigned char* dest = b->ring;
-    const unsigned char* src = bytes;
-    while (nwritten < count) {
-        dest[b->write_index] = src[nwritten++];
-        b->write_index = (b->write_index + 1) % b->capacity;
-        if ((b->write_index + 1) % b->capacity == b->read_index)
-            break;
-    }
-    return nwritten;
+    size_t write_index = b->write_index;
+    size_t used = (write_index + b->capacity - b->read_index) % b->capacity;
+    count = MIN(count, b->capacity - 1 - used);
+    size_t n = MIN(count, b->capacity - write_index);
+    memcpy(b->ring + write_index, bytes, n);
+    memcpy(b->ring, (const unsigned char*)bytes + n, count - n);
+    b->write_index = (write_index + count) % b->capacity;
+    return count;
 }
 
 static inline ssize_t ring_buf_write_evicting_oldest(struct ring_buf* b,
@@ -25,9 +25,6 @@ NODISCARD ssize_t vec_pwrite(struct vec*, const void* bytes, size_t count,
                              uint64_t offset);
 NODISCARD ssize_t vec_append(struct vec*, const void* bytes, size_t count);
 
-NODISCARD void* vec_mmap(struct vec*, size_t length, uint64_t offset,
-                         int flags);
-
 int vec_printf(struct vec*, const char* format, ...) PRINTF_LIKE(2, 3);
 int vec_vsprintf(struct vec*, const char* format, va_list args)
     PRINTF_LIKE(2, 0);
@@ -271,6 +271,9 @@ static void init_cpu(struct cpu* cpu) {
         write_cr4(read_cr4() | X86_CR4_OSFXSR | X86_CR4_OSXMMEXCPT);
     }
 
+    if (cpu_has_feature(cpu, X86_FEATURE_PSE))
+        write_cr4(read_cr4() | X86_CR4_PSE);
+
     if (cpu_has_feature(cpu, X86_FEATURE_PGE))
         write_cr4(read_cr4() | X86_CR4_PGE);
 
@@ -406,10 +409,8 @@ void cpu_process_messages(void) {
                 hlt();
             break;
         case IPI_MESSAGE_FLUSH_TLB:
-            for (uintptr_t addr = msg->flush_tlb.virt_addr;
-                 addr < msg->flush_tlb.virt_addr + msg->flush_tlb.size;
-                 addr += PAGE_SIZE)
-                flush_tlb_single(addr);
+            flush_tlb_range_local(msg->flush_tlb.virt_addr,
+                                  msg->flush_tlb.size);
             break;
         default:
             UNREACHABLE();
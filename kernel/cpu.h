@@ -1,6 +1,7 @@
 #pragma once
 
 #include "gdt.h"
+#include "lock.h"
 #include <common/extra.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -220,6 +221,12 @@ struct cpu {
     struct task* current_task;
     struct task* idle_task;
 
+    // Tasks that are ready to run on this CPU
+    struct task* ready_queue_head;
+    struct task* ready_queue_tail;
+    atomic_size_t num_ready_tasks;
+    struct spinlock ready_queue_lock;
+
     struct mpsc* msg_queue;
 };
 
@@ -67,6 +67,8 @@ static void pci_device_callback(const struct pci_addr* addr, uint16_t vendor_id,
 static atomic_bool dma_is_running = false;
 static atomic_bool buffer_descriptor_list_is_full = false;
 
+static struct inode* ac97_device_get(void);
+
 static void irq_handler(struct registers* regs) {
     (void)regs;
 
@@ -82,6 +84,7 @@ static void irq_handler(struct registers* regs) {
         dma_is_running = false;
 
     buffer_descriptor_list_is_full = false;
+    waitqueue_wake_all(&ac97_device_get()->waitqueue);
 }
 
 #define OUTPUT_BUF_NUM_PAGES 4
@@ -290,7 +293,7 @@ void ac97_init(void) {
         delay(50);
 
     uint8_t irq_num = pci_get_interrupt_line(&device_addr);
-    idt_set_interrupt_handler(IRQ(irq_num), irq_handler);
+    idt_add_shared_irq_handler(irq_num, irq_handler);
 
     ASSERT_OK(vfs_register_device("dsp", ac97_device_get()));
 }
@@ -1,5 +1,6 @@
 #include "hid.h"
 #include "ps2.h"
+#include <common/string.h>
 #include <kernel/api/hid.h>
 #include <kernel/api/sys/poll.h>
 #include <kernel/api/sys/sysmacros.h>
@@ -249,6 +250,8 @@ static struct spinlock queue_lock;
 
 static ps2_key_event_handler_fn event_handler = NULL;
 
+static struct inode* ps2_keyboard_device_get(void);
+
 static void irq_handler(struct registers* reg) {
     (void)reg;
 
@@ -320,6 +323,7 @@ static void irq_handler(struct registers* reg) {
     *(queue + queue_write_idx) = event;
     queue_write_idx = (queue_write_idx + 1) % QUEUE_SIZE;
     spinlock_unlock(&queue_lock);
+    waitqueue_wake_all(&ps2_keyboard_device_get()->waitqueue);
 }
 
 void ps2_set_key_event_handler(ps2_key_event_handler_fn handler) {
@@ -352,18 +356,19 @@ static ssize_t ps2_keyboard_device_pread(struct file* file, void* buffer,
             continue;
         }
 
-        size_t nread = 0;
-        struct key_event* out = (struct key_event*)buffer;
-        while (count > 0) {
-            if (queue_read_idx == queue_write_idx ||
-                count < sizeof(struct key_event))
-                break;
-            *out++ = queue[queue_read_idx];
-            nread += sizeof(struct key_event);
-            count -= sizeof(struct key_event);
+        // Writing to the buffer may fault, so copy the events out of
+        // the queue first and write them after releasing the lock.
+        struct key_event events[16];
+        size_t n = MIN(count / sizeof(struct key_event), ARRAY_SIZE(events));
+        size_t nevents = 0;
+        while (nevents < n && queue_read_idx != queue_write_idx) {
+            events[nevents++] = queue[queue_read_idx];
             queue_read_idx = (queue_read_idx + 1) % QUEUE_SIZE;
         }
         spinlock_unlock(&queue_lock);
+
+        size_t nread = nevents * sizeof(struct key_event);
+        memcpy(buffer, events, nread);
         return nread;
     }
 }
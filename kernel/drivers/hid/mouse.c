@@ -1,4 +1,5 @@
 #include "ps2.h"
+#include <common/string.h>
 #include <kernel/api/hid.h>
 #include <kernel/api/sys/poll.h>
 #include <kernel/api/sys/sysmacros.h>
@@ -23,6 +24,8 @@ static size_t queue_read_idx = 0;
 static size_t queue_write_idx = 0;
 static struct spinlock queue_lock;
 
+static struct inode* ps2_mouse_device_get(void);
+
 static void irq_handler(struct registers* reg) {
     (void)reg;
 
@@ -50,6 +53,7 @@ static void irq_handler(struct registers* reg) {
         queue[queue_write_idx] = (struct mouse_event){dx, -dy, buf[0] & 7};
         queue_write_idx = (queue_write_idx + 1) % QUEUE_SIZE;
         spinlock_unlock(&queue_lock);
+        waitqueue_wake_all(&ps2_mouse_device_get()->waitqueue);
 
         state = 0;
         return;
@@ -84,18 +88,19 @@ static ssize_t ps2_mouse_device_pread(struct file* file, void* buffer,
             continue;
         }
 
-        size_t nread = 0;
-        struct mouse_event* out = (struct mouse_event*)buffer;
-        while (count > 0) {
-            if (queue_read_idx == queue_write_idx ||
-                count < sizeof(struct mouse_event))
-                break;
-            *out++ = queue[queue_read_idx];
-            nread += sizeof(struct mouse_event);
-            count -= sizeof(struct mouse_event);
+        // Writing to the buffer may fault, so copy the events out of
+        // the queue first and write them after releasing the lock.
+        struct mouse_event events[16];
+        size_t n = MIN(count / sizeof(struct mouse_event), ARRAY_SIZE(events));
+        size_t nevents = 0;
+        while (nevents < n && queue_read_idx != queue_write_idx) {
+            events[nevents++] = queue[queue_read_idx];
             queue_read_idx = (queue_read_idx + 1) % QUEUE_SIZE;
         }
         spinlock_unlock(&queue_lock);
+
+        size_t nread = nevents * sizeof(struct mouse_event);
+        memcpy(buffer, events, nread);
         return nread;
     }
 }
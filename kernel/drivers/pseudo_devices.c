@@ -153,7 +153,16 @@ static ssize_t kmsg_device_pwrite(struct file* file, const void* buffer,
                                   size_t count, uint64_t offset) {
     (void)file;
     (void)offset;
-    kmsg_write(buffer, count);
+
+    // kmsg_write reads the buffer under a spinlock, where faulting in user
+    // pages is not possible, so go through a local buffer.
+    const char* src = buffer;
+    char local_buf[256];
+    for (size_t i = 0; i < count; i += sizeof(local_buf)) {
+        size_t n = MIN(count - i, sizeof(local_buf));
+        memcpy(local_buf, src + i, n);
+        kmsg_write(local_buf, n);
+    }
     return count;
 }
 
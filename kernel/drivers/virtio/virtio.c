@@ -5,6 +5,7 @@
 #include <kernel/api/err.h>
 #include <kernel/api/sys/sysmacros.h>
 #include <kernel/drivers/pci.h>
+#include <kernel/interrupts/interrupts.h>
 #include <kernel/kmsg.h>
 #include <kernel/memory/memory.h>
 #include <kernel/panic.h>
@@ -29,7 +30,8 @@ static struct virtq* virtq_create(uint16_t queue_size) {
     alloc_size = ROUND_UP(alloc_size + avail_size, USED_ALIGN);
     alloc_size += used_size;
 
-    struct virtq* virtq = kaligned_alloc(DESC_ALIGN, alloc_size);
+    // The device accesses the queue by physical address.
+    struct virtq* virtq = kmalloc_contiguous(alloc_size);
     if (!virtq)
         return NULL;
     memset(virtq, 0, alloc_size);
@@ -55,9 +57,6 @@ static struct virtq* virtq_create(uint16_t queue_size) {
         virtq->desc[i].next = i + 1;
     }
 
-    // virtq_wait_completion uses polling, not interrupts.
-    virtq->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
-
     return virtq;
 }
 
@@ -154,8 +153,9 @@ int virtq_desc_chain_submit(struct virtq_desc_chain* chain) {
     if (!(virtq->used->flags & VIRTQ_USED_F_NO_NOTIFY))
         *virtq->notify = virtq->index;
 
-    int rc =
-        sched_block((unblock_fn)virtq_is_ready, virtq, BLOCK_UNINTERRUPTIBLE);
+    // The interrupt handler wakes us up when the device has used the chain.
+    int rc = sched_block(&virtq->waitqueue, (unblock_fn)virtq_is_ready, virtq,
+                         BLOCK_UNINTERRUPTIBLE);
     full_memory_barrier();
 
     // Return the descriptors to the free list.
@@ -169,6 +169,24 @@ int virtq_desc_chain_submit(struct virtq_desc_chain* chain) {
     return rc;
 }
 
+// Devices whose interrupts are handled by irq_handler
+static struct virtio_device* devices;
+static struct spinlock devices_lock;
+
+static void irq_handler(struct registers* regs) {
+    (void)regs;
+    spinlock_lock(&devices_lock);
+    // The interrupt line may be shared, so check every device.
+    for (struct virtio_device* it = devices; it; it = it->next) {
+        // Reading the ISR status deasserts the interrupt.
+        if (!(*it->isr & VIRTIO_PCI_ISR_QUEUE))
+            continue;
+        for (size_t i = 0; i < it->num_virtqs; ++i)
+            waitqueue_wake_all(&it->virtqs[i]->waitqueue);
+    }
+    spinlock_unlock(&devices_lock);
+}
+
 static struct virtio_pci_cap read_cap(const struct pci_addr* addr,
                                       uint8_t pointer) {
     return (struct virtio_pci_cap){
@@ -260,6 +278,17 @@ struct virtio_device* virtio_device_create(const struct pci_addr* addr,
     virtio->notify_space = notify_space;
     uint16_t* notify = (uint16_t*)(notify_space + notify_offset);
 
+    struct virtio_pci_cap isr_cap;
+    if (!virtio_find_pci_cap(addr, VIRTIO_PCI_CAP_ISR_CFG, &isr_cap)) {
+        kprint("virtio: device is missing VIRTIO_PCI_CAP_ISR_CFG\n");
+        goto fail_discovery;
+    }
+    unsigned char* isr_space = pci_map_bar(addr, isr_cap.bar);
+    if (IS_ERR(isr_space))
+        goto fail_discovery;
+    virtio->isr_space = isr_space;
+    virtio->isr = isr_space + isr_cap.offset;
+
     // 3.1.1 Driver Requirements: Device Initialization
 
     // 1. Reset the device.
@@ -336,6 +365,14 @@ struct virtio_device* virtio_device_create(const struct pci_addr* addr,
     //    continue initialization in that case.
     common_cfg->device_status |= VIRTIO_CONFIG_S_DRIVER_OK;
 
+    spinlock_lock(&devices_lock);
+    virtio->next = devices;
+    devices = virtio;
+    spinlock_unlock(&devices_lock);
+
+    idt_add_shared_irq_handler(pci_get_interrupt_line(addr), irq_handler);
+    pci_set_interrupt_line_enabled(addr, true);
+
     return virtio;
 
 fail_initialization:
@@ -349,6 +386,16 @@ fail_discovery:
 void virtio_device_destroy(struct virtio_device* virtio) {
     if (!virtio)
         return;
+
+    spinlock_lock(&devices_lock);
+    for (struct virtio_device** it = &devices; *it; it = &(*it)->next) {
+        if (*it == virtio) {
+            *it = virtio->next;
+            break;
+        }
+    }
+    spinlock_unlock(&devices_lock);
+
     for (size_t i = 0; i < virtio->num_virtqs; ++i) {
         struct virtq* virtq = virtio->virtqs[i];
         if (virtq) {
@@ -357,5 +404,6 @@ void virtio_device_destroy(struct virtio_device* virtio) {
         }
     }
     kfree(virtio->notify_space);
+    kfree(virtio->isr_space);
     kfree(virtio);
 }
@@ -7,6 +7,9 @@ struct pci_addr;
 
 struct virtio_device {
     void* notify_space;
+    void* isr_space;
+    volatile uint8_t* isr; // The ISR status, cleared on read
+    struct virtio_device* next;
     size_t num_virtqs;
     struct virtq* virtqs[];
 };
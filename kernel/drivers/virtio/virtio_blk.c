@@ -3,64 +3,54 @@
 #include <common/stdio.h>
 #include <kernel/api/sys/sysmacros.h>
 #include <kernel/drivers/pci.h>
-#include <kernel/fs/fs.h>
+#include <kernel/fs/block.h>
 #include <kernel/kmsg.h>
 #include <kernel/memory/memory.h>
 #include <kernel/panic.h>
-#include <kernel/sched.h>
 
-#define SECTOR_SIZE 512
+// Limits of a single request. A request uses a descriptor for each segment,
+// and one each for the header and the footer.
+#define MAX_SECTORS 1024
+#define MAX_SEGMENTS 128
 
 typedef struct {
-    struct inode inode;
-    struct mutex lock;
+    struct block_device block;
     struct virtio_device* virtio;
-    uint64_t capacity;
 } virtio_blk_device;
 
-static virtio_blk_device* device_from_inode(struct inode* inode) {
-    return CONTAINER_OF(inode, virtio_blk_device, inode);
+static virtio_blk_device* device_from_block(struct block_device* block) {
+    return CONTAINER_OF(block, virtio_blk_device, block);
 }
 
-static void virtio_blk_destroy_inode(struct inode* inode) {
-    virtio_blk_device* node = device_from_inode(inode);
-    virtio_device_destroy(node->virtio);
-    kfree(node);
+static void virtio_blk_destroy(struct block_device* block) {
+    virtio_blk_device* device = device_from_block(block);
+    virtio_device_destroy(device->virtio);
+    kfree(device);
 }
 
-static bool unblock_request(struct file* file) {
-    virtio_blk_device* node = device_from_inode(file->inode);
-    return node->virtio->virtqs[0]->num_free_descs >= 3;
-}
-
-static int submit_request(struct file* file, void* buffer, size_t count,
-                          uint64_t sector, uint32_t type,
-                          bool device_writable) {
-    virtio_blk_device* node = device_from_inode(file->inode);
-    struct virtq* virtq = node->virtio->virtqs[0];
+// The block layer submits one request at a time, so all the descriptors
+// are available.
+static int virtio_blk_submit(struct block_device* block,
+                             struct block_request* request) {
+    virtio_blk_device* device = device_from_block(block);
+    struct virtq* virtq = device->virtio->virtqs[0];
     struct virtio_blk_req_header header = {
-        .type = type,
-        .sector = sector,
+        .type = request->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+        .sector = request->sector,
     };
     struct virtio_blk_req_footer footer = {0};
 
-    int rc;
-retry:
-    rc = file_block(file, unblock_request, BLOCK_UNINTERRUPTIBLE);
-    if (IS_ERR(rc))
-        return rc;
-
-    mutex_lock(&node->lock);
     struct virtq_desc_chain chain;
-    if (!virtq_desc_chain_init(&chain, virtq, 3)) {
-        mutex_unlock(&node->lock);
-        goto retry;
-    }
+    if (!virtq_desc_chain_init(&chain, virtq, request->num_segments + 2))
+        return -EIO;
     virtq_desc_chain_push_buf(&chain, &header, sizeof(header), false);
-    virtq_desc_chain_push_buf(&chain, buffer, count, device_writable);
+    for (size_t i = 0; i < request->num_segments; ++i) {
+        struct block_segment* segment = &request->segments[i];
+        virtq_desc_chain_push_buf(&chain, segment->data, segment->size,
+                                  !request->write);
+    }
     virtq_desc_chain_push_buf(&chain, &footer, sizeof(footer), true);
-    rc = virtq_desc_chain_submit(&chain);
-    mutex_unlock(&node->lock);
+    int rc = virtq_desc_chain_submit(&chain);
     if (IS_ERR(rc))
         return rc;
 
@@ -74,39 +64,6 @@ retry:
     }
 }
 
-static ssize_t virtio_blk_do_io(struct file* file, void* buffer, size_t count,
-                                uint64_t offset, uint32_t type,
-                                bool device_writable) {
-    if (count % SECTOR_SIZE != 0)
-        return -EINVAL;
-
-    if (offset % SECTOR_SIZE != 0)
-        return -EINVAL;
-    uint64_t sector = offset / SECTOR_SIZE;
-
-    virtio_blk_device* node = device_from_inode(file->inode);
-    if (sector >= node->capacity)
-        return 0;
-    count = MIN(count, (node->capacity - sector) * SECTOR_SIZE);
-
-    int rc = submit_request(file, buffer, count, sector, type, device_writable);
-    if (IS_ERR(rc))
-        return rc;
-
-    return count;
-}
-
-static ssize_t virtio_blk_pread(struct file* file, void* buffer, size_t count,
-                                uint64_t offset) {
-    return virtio_blk_do_io(file, buffer, count, offset, VIRTIO_BLK_T_IN, true);
-}
-
-static ssize_t virtio_blk_pwrite(struct file* file, const void* buffer,
-                                 size_t count, uint64_t offset) {
-    return virtio_blk_do_io(file, (void*)buffer, count, offset,
-                            VIRTIO_BLK_T_OUT, false);
-}
-
 static void virtio_blk_device_init(const struct pci_addr* addr) {
     struct virtio_pci_cap device_cfg_cap;
     if (!virtio_find_pci_cap(addr, VIRTIO_PCI_CAP_DEVICE_CFG,
@@ -150,22 +107,20 @@ static void virtio_blk_device_init(const struct pci_addr* addr) {
     if (!device)
         goto fail;
     *device = (virtio_blk_device){0};
-
     device->virtio = virtio;
-    device->capacity = capacity;
 
-    struct inode* inode = &device->inode;
-    static const struct file_ops fops = {
-        .destroy_inode = virtio_blk_destroy_inode,
-        .pread = virtio_blk_pread,
-        .pwrite = virtio_blk_pwrite,
+    struct block_device* block = &device->block;
+    static const struct block_device_ops ops = {
+        .destroy = virtio_blk_destroy,
+        .submit = virtio_blk_submit,
     };
-    inode->fops = &fops;
-    inode->mode = S_IFBLK;
-    inode->rdev = rdev;
-    inode->ref_count = 1;
+    block->ops = &ops;
+    block->num_sectors = capacity;
+    block->max_sectors = MAX_SECTORS;
+    block->max_segments = MIN(MAX_SEGMENTS, virtio->virtqs[0]->size - 2);
+    block->inode.rdev = rdev;
 
-    ASSERT_OK(vfs_register_device(name, inode));
+    ASSERT_OK(block_device_register(name, block));
     return;
 
 fail:
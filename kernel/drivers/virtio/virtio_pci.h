@@ -17,6 +17,10 @@
 /* Vendor-specific data */
 #define VIRTIO_PCI_CAP_VENDOR_CFG 9
 
+/* Bits of the ISR status */
+#define VIRTIO_PCI_ISR_QUEUE 0x1
+#define VIRTIO_PCI_ISR_CONFIG 0x2
+
 struct virtio_pci_cap {
     uint8_t cap_vndr;   /* Generic PCI field: PCI_CAP_ID_VNDR */
     uint8_t cap_next;   /* Generic PCI field: next ptr. */
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <kernel/sched.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -64,6 +65,9 @@ struct virtq {
     volatile struct virtq_used* used;
 
     uint16_t* notify; // The notification address
+
+    // Woken up when the device has used buffers
+    struct waitqueue waitqueue;
 };
 
 bool virtq_is_ready(struct virtq*);
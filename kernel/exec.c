@@ -162,10 +162,85 @@ NODISCARD static int push_ptrs(uintptr_t* sp, uintptr_t stack_base,
     return 0;
 }
 
+// Maps a PT_LOAD segment to its virtual address range.
+// Segments are mapped from the page cache of the executable when possible,
+// so that processes running the same executable share the pages until they
+// write to them. The pages are mapped on first access, so only the pages
+// that are actually used are ever mapped. Otherwise, the contents are read
+// from the file.
+static int load_segment(struct file* file, const Elf32_Phdr* phdr) {
+    if (phdr->p_memsz == 0)
+        return 0;
+
+    int vm_flags = VM_READ | VM_USER;
+    if (phdr->p_flags & PF_W)
+        vm_flags |= VM_WRITE;
+
+    uintptr_t region_start = ROUND_DOWN(phdr->p_vaddr, PAGE_SIZE);
+    uintptr_t region_end = ROUND_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
+    uintptr_t file_end = phdr->p_vaddr + phdr->p_filesz;
+
+    struct inode* inode = file->inode;
+    if (inode->page_cache && phdr->p_filesz > 0 &&
+        phdr->p_vaddr % PAGE_SIZE == phdr->p_offset % PAGE_SIZE) {
+        uintptr_t mapped_end = ROUND_UP(file_end, PAGE_SIZE);
+
+        // The rest of the last page comes from the file, but it has to be
+        // zeros if it is a part of the bss.
+        bool clear_tail =
+            file_end < mapped_end && phdr->p_memsz > phdr->p_filesz;
+
+        void* addr = vm_map_file(
+            (void*)region_start, inode, mapped_end - region_start,
+            ROUND_DOWN(phdr->p_offset, PAGE_SIZE),
+            clear_tail ? vm_flags | VM_WRITE : vm_flags);
+        if (IS_ERR(addr))
+            return PTR_ERR(addr);
+
+        if (clear_tail) {
+            // This faults in a private copy of the last page, which is the
+            // only page mapped up front.
+            memset((void*)file_end, 0, mapped_end - file_end);
+            if (!(vm_flags & VM_WRITE)) {
+                int rc = vm_set_flags((void*)region_start,
+                                      mapped_end - region_start, vm_flags);
+                if (IS_ERR(rc))
+                    return rc;
+            }
+        }
+
+        // The rest of the bss is populated with zero-filled pages on demand
+        if (mapped_end < region_end) {
+            addr = vm_alloc_at((void*)mapped_end, region_end - mapped_end,
+                               vm_flags);
+            if (IS_ERR(addr))
+                return PTR_ERR(addr);
+        }
+        return 0;
+    }
+
+    void* addr = vm_alloc_at((void*)region_start, region_end - region_start,
+                             VM_READ | VM_WRITE | VM_USER);
+    if (IS_ERR(addr))
+        return PTR_ERR(addr);
+
+    ssize_t nread =
+        file_pread(file, (void*)phdr->p_vaddr, phdr->p_filesz, phdr->p_offset);
+    if (IS_ERR(nread))
+        return nread;
+    if ((size_t)nread != phdr->p_filesz)
+        return -ENOEXEC;
+
+    if (!(vm_flags & VM_WRITE))
+        return vm_set_flags((void*)region_start, region_end - region_start,
+                            vm_flags);
+    return 0;
+}
+
 static int execve(const char* pathname, struct string_vec* argv,
                   struct string_vec* envp) {
     int ret = 0;
-    unsigned char* exe_buf = NULL;
+    Elf32_Phdr* phdrs = NULL;
     struct file* file = NULL;
 
     struct kstat stat;
@@ -194,21 +269,18 @@ static int execve(const char* pathname, struct string_vec* argv,
         goto fail_exe;
     }
 
-    exe_buf = kmalloc(stat.st_size);
-    if (!exe_buf) {
-        ret = -ENOMEM;
-        goto fail_exe;
-    }
-
-    ssize_t nread = file_read_to_end(file, exe_buf, stat.st_size);
-    file_close(file);
-    file = NULL;
+    Elf32_Ehdr ehdr_buf;
+    Elf32_Ehdr* ehdr = &ehdr_buf;
+    ssize_t nread = file_pread(file, ehdr, sizeof(Elf32_Ehdr), 0);
     if (IS_ERR(nread)) {
         ret = nread;
         goto fail_exe;
     }
+    if ((size_t)nread != sizeof(Elf32_Ehdr)) {
+        ret = -ENOEXEC;
+        goto fail_exe;
+    }
 
-    Elf32_Ehdr* ehdr = (Elf32_Ehdr*)exe_buf;
     if (!IS_ELF(*ehdr) || ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
         ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
         ehdr->e_ident[EI_VERSION] != EV_CURRENT ||
@@ -233,6 +305,28 @@ static int execve(const char* pathname, struct string_vec* argv,
         ret = -ENOEXEC;
         goto fail_exe;
     }
+    if (ehdr->e_phentsize != sizeof(Elf32_Phdr)) {
+        ret = -ENOEXEC;
+        goto fail_exe;
+    }
+
+    // Only the program headers are read here. The segments are mapped
+    // from the file.
+    size_t phdrs_size = ehdr->e_phnum * sizeof(Elf32_Phdr);
+    phdrs = kmalloc(phdrs_size);
+    if (!phdrs) {
+        ret = -ENOMEM;
+        goto fail_exe;
+    }
+    nread = file_pread(file, phdrs, phdrs_size, ehdr->e_phoff);
+    if (IS_ERR(nread)) {
+        ret = nread;
+        goto fail_exe;
+    }
+    if ((size_t)nread != phdrs_size) {
+        ret = -ENOEXEC;
+        goto fail_exe;
+    }
 
     struct vm* prev_vm = current->vm;
 
@@ -248,11 +342,12 @@ static int execve(const char* pathname, struct string_vec* argv,
     struct ptr_vec argv_ptrs = (struct ptr_vec){0};
 
     uintptr_t phdr_virt_addr = 0;
-    Elf32_Phdr* phdr = (Elf32_Phdr*)(exe_buf + ehdr->e_phoff);
+    Elf32_Phdr* phdr = phdrs;
     for (size_t i = 0; i < ehdr->e_phnum; ++i, ++phdr) {
         if (phdr->p_type != PT_LOAD)
             continue;
-        if (phdr->p_filesz > phdr->p_memsz) {
+        if (phdr->p_filesz > phdr->p_memsz ||
+            (uint64_t)phdr->p_offset + phdr->p_filesz > stat.st_size) {
             ret = -ENOEXEC;
             goto fail_vm;
         }
@@ -261,30 +356,16 @@ static int execve(const char* pathname, struct string_vec* argv,
             ehdr->e_phoff < phdr->p_offset + phdr->p_filesz)
             phdr_virt_addr = ehdr->e_phoff - phdr->p_offset + phdr->p_vaddr;
 
-        uintptr_t region_start = ROUND_DOWN(phdr->p_vaddr, PAGE_SIZE);
-        uintptr_t region_end =
-            ROUND_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
-        size_t region_size = region_end - region_start;
-        void* addr = vm_alloc_at((void*)region_start, region_size,
-                                 VM_READ | VM_WRITE | VM_USER);
-        if (IS_ERR(addr)) {
-            ret = PTR_ERR(addr);
+        ret = load_segment(file, phdr);
+        if (IS_ERR(ret))
             goto fail_vm;
-        }
-
-        memset((void*)region_start, 0, phdr->p_vaddr - region_start);
-        memcpy((void*)phdr->p_vaddr, exe_buf + phdr->p_offset, phdr->p_filesz);
-        memset((void*)(phdr->p_vaddr + phdr->p_filesz), 0,
-               region_end - phdr->p_vaddr - phdr->p_filesz);
-
-        if (!(phdr->p_flags & PF_W)) {
-            ret = vm_set_flags((void*)region_start, region_size,
-                               VM_READ | VM_USER);
-            if (IS_ERR(ret))
-                goto fail_vm;
-        }
     }
 
+    kfree(phdrs);
+    phdrs = NULL;
+    file_close(file);
+    file = NULL;
+
     void* stack_region =
         vm_alloc(2 * PAGE_SIZE + STACK_SIZE, VM_READ | VM_WRITE | VM_USER);
     if (IS_ERR(stack_region)) {
@@ -303,8 +384,8 @@ static int execve(const char* pathname, struct string_vec* argv,
     if (IS_ERR(ret))
         goto fail_vm;
 
+    // The stack is populated with zero-filled pages on demand
     uintptr_t sp = stack_base + STACK_SIZE;
-    memset((void*)stack_base, 0, STACK_SIZE);
 
     ret = push_value(&sp, stack_base, 0); // Sentinel
     if (IS_ERR(ret))
@@ -356,9 +437,6 @@ static int execve(const char* pathname, struct string_vec* argv,
         {AT_NULL, {0}},
     };
 
-    kfree(exe_buf);
-    exe_buf = NULL;
-
     sp = ROUND_DOWN(sp, 16);
 
     for (ssize_t i = ARRAY_SIZE(auxv) - 1; i >= 0; --i) {
@@ -445,7 +523,7 @@ fail_vm:
     vm_enter(prev_vm);
 
 fail_exe:
-    kfree(exe_buf);
+    kfree(phdrs);
     if (file)
         file_close(file);
     string_vec_destroy(envp);
@@ -0,0 +1,485 @@
+#include "block.h"
+#include <common/string.h>
+#include <kernel/api/err.h>
+#include <kernel/memory/memory.h>
+#include <kernel/panic.h>
+#include <kernel/sched.h>
+#include <kernel/time.h>
+
+// Requests are dispatched in sector order unless they have waited this long.
+// Reads are given a shorter deadline, as tasks usually wait for them.
+#define READ_EXPIRE (CLK_TCK / 2)
+#define WRITE_EXPIRE (5 * CLK_TCK)
+
+// Reads and writes of device files are done in chunks of up to this size.
+#define MAX_TRANSFER_SIZE (1024 * 1024)
+
+static size_t count_pages(const void* data, size_t size) {
+    uintptr_t start = (uintptr_t)data;
+    return (start + size - 1) / PAGE_SIZE - start / PAGE_SIZE + 1;
+}
+
+static void complete_bio(struct bio* bio, int status) {
+    struct bio* parent = bio->parent;
+    if (!parent) {
+        bio->status = status;
+        bio->done = true;
+        return;
+    }
+    if (IS_ERR(status))
+        parent->status = status;
+    kfree(bio);
+    if (--parent->num_children == 0)
+        parent->done = true;
+}
+
+static bool can_merge(const struct block_device* device,
+                      const struct block_request* request,
+                      const struct bio* bio) {
+    return request->write == bio->write &&
+           request->num_sectors + (bio->size >> SECTOR_SHIFT) <=
+               device->max_sectors &&
+           request->num_segments + bio->num_segments <= device->max_segments;
+}
+
+// Merges the bio into a queued request adjacent to it. Returns false if
+// there is no such request.
+static bool merge_bio(struct block_device* device, struct bio* bio) {
+    size_t num_sectors = bio->size >> SECTOR_SHIFT;
+    for (struct block_request* it = device->sorted_head; it;
+         it = it->sorted_next) {
+        if (!can_merge(device, it, bio))
+            continue;
+        if (it->sector + it->num_sectors == bio->sector) {
+            it->bios_tail->request_next = bio;
+            it->bios_tail = bio;
+        } else if (bio->sector + num_sectors == it->sector) {
+            bio->request_next = it->bios_head;
+            it->bios_head = bio;
+            it->sector = bio->sector;
+        } else {
+            continue;
+        }
+        // The request may now be adjacent to its neighbor as well, but
+        // requests are not merged with each other. Bios mostly arrive in
+        // ascending order, which only ever extends a request at the back.
+        it->num_sectors += num_sectors;
+        it->num_segments += bio->num_segments;
+        return true;
+    }
+    return false;
+}
+
+static int queue_request(struct block_device* device, struct bio* bio) {
+    struct block_request* request = kmalloc(sizeof(struct block_request));
+    if (!request)
+        return -ENOMEM;
+    *request = (struct block_request){
+        .sector = bio->sector,
+        .num_sectors = bio->size >> SECTOR_SHIFT,
+        .write = bio->write,
+        .deadline = uptime + (bio->write ? WRITE_EXPIRE : READ_EXPIRE),
+        .bios_head = bio,
+        .bios_tail = bio,
+        .num_segments = bio->num_segments,
+    };
+
+    struct block_request* prev = NULL;
+    struct block_request* next = device->sorted_head;
+    while (next && next->sector < request->sector) {
+        prev = next;
+        next = next->sorted_next;
+    }
+    request->sorted_prev = prev;
+    request->sorted_next = next;
+    if (prev)
+        prev->sorted_next = request;
+    else
+        device->sorted_head = request;
+    if (next)
+        next->sorted_prev = request;
+
+    struct block_request** tail = &device->fifo_tails[request->write];
+    request->fifo_prev = *tail;
+    if (*tail)
+        (*tail)->fifo_next = request;
+    else
+        device->fifo_heads[request->write] = request;
+    *tail = request;
+
+    ++device->num_queued;
+    return 0;
+}
+
+static void dequeue_request(struct block_device* device,
+                            struct block_request* request) {
+    if (request->sorted_prev)
+        request->sorted_prev->sorted_next = request->sorted_next;
+    else
+        device->sorted_head = request->sorted_next;
+    if (request->sorted_next)
+        request->sorted_next->sorted_prev = request->sorted_prev;
+
+    if (request->fifo_prev)
+        request->fifo_prev->fifo_next = request->fifo_next;
+    else
+        device->fifo_heads[request->write] = request->fifo_next;
+    if (request->fifo_next)
+        request->fifo_next->fifo_prev = request->fifo_prev;
+    else
+        device->fifo_tails[request->write] = request->fifo_prev;
+
+    --device->num_queued;
+}
+
+static void insert_bio(struct block_device* device, struct bio* bio) {
+    mutex_lock(&device->lock);
+    int rc = 0;
+    if (!merge_bio(device, bio))
+        rc = queue_request(device, bio);
+    mutex_unlock(&device->lock);
+    if (IS_ERR(rc))
+        complete_bio(bio, rc);
+}
+
+// Returns the largest size at the start of the data that fits in a single
+// request.
+static size_t split_size(const struct block_device* device,
+                         const unsigned char* data, size_t size) {
+    size_t max_size = device->max_sectors << SECTOR_SHIFT;
+    uintptr_t page = ROUND_DOWN((uintptr_t)data, PAGE_SIZE);
+    size_t segments_size =
+        page + device->max_segments * PAGE_SIZE - (uintptr_t)data;
+    max_size = ROUND_DOWN(MIN(max_size, segments_size), SECTOR_SIZE);
+    return MIN(size, max_size);
+}
+
+static void queue_bio(struct bio* bio) {
+    struct block_device* device = bio->device;
+    size_t num_sectors = bio->size >> SECTOR_SHIFT;
+    if (bio->size == 0 || bio->size % SECTOR_SIZE != 0) {
+        complete_bio(bio, -EINVAL);
+        return;
+    }
+    if (bio->sector >= device->num_sectors ||
+        num_sectors > device->num_sectors - bio->sector) {
+        complete_bio(bio, -EIO);
+        return;
+    }
+
+    unsigned char* data = bio->data;
+    if (split_size(device, data, bio->size) == bio->size) {
+        bio->num_segments = count_pages(data, bio->size);
+        insert_bio(device, bio);
+        return;
+    }
+
+    size_t num_children = 0;
+    for (size_t offset = 0; offset < bio->size;
+         offset += split_size(device, data + offset, bio->size - offset))
+        ++num_children;
+    bio->num_children = num_children;
+
+    for (size_t offset = 0; offset < bio->size;) {
+        size_t size = split_size(device, data + offset, bio->size - offset);
+        struct bio* child = kmalloc(sizeof(struct bio));
+        if (child) {
+            *child = (struct bio){
+                .device = device,
+                .sector = bio->sector + (offset >> SECTOR_SHIFT),
+                .data = data + offset,
+                .size = size,
+                .write = bio->write,
+                .parent = bio,
+                .num_segments = count_pages(data + offset, size),
+            };
+            insert_bio(device, child);
+        } else {
+            bio->status = -ENOMEM;
+            if (--bio->num_children == 0)
+                bio->done = true;
+        }
+        offset += size;
+    }
+}
+
+// Deadline scheduling: the oldest request is dispatched if it has expired.
+// Otherwise requests are dispatched in ascending sector order, wrapping around
+// at the end of the device.
+static struct block_request* pick_request(struct block_device* device) {
+    for (size_t i = 0; i < ARRAY_SIZE(device->fifo_heads); ++i) {
+        struct block_request* request = device->fifo_heads[i];
+        if (request && (int)(uptime - request->deadline) >= 0)
+            return request;
+    }
+    for (struct block_request* it = device->sorted_head; it;
+         it = it->sorted_next) {
+        if (it->sector >= device->next_sector)
+            return it;
+    }
+    return device->sorted_head;
+}
+
+static void build_segments(struct block_device* device,
+                           struct block_request* request) {
+    struct block_segment* segments = device->segments;
+    size_t n = 0;
+    for (struct bio* bio = request->bios_head; bio; bio = bio->request_next) {
+        unsigned char* data = bio->data;
+        for (size_t offset = 0; offset < bio->size;) {
+            unsigned char* start = data + offset;
+            size_t size = MIN(bio->size - offset,
+                              PAGE_SIZE - (uintptr_t)start % PAGE_SIZE);
+            offset += size;
+
+            // Coalesce with the previous segment if they are contiguous
+            // in physical memory.
+            if (n > 0) {
+                struct block_segment* prev = &segments[n - 1];
+                unsigned char* prev_end =
+                    (unsigned char*)prev->data + prev->size;
+                if (prev_end == start &&
+                    virt_to_phys(prev->data) + prev->size ==
+                        virt_to_phys(start)) {
+                    prev->size += size;
+                    continue;
+                }
+            }
+            ASSERT(n < device->max_segments);
+            segments[n++] = (struct block_segment){start, size};
+        }
+    }
+    request->segments = segments;
+    request->num_segments = n;
+}
+
+// Transfers one queued request if the device is idle.
+static void dispatch(struct block_device* device) {
+    mutex_lock(&device->lock);
+    if (device->busy || !device->sorted_head) {
+        mutex_unlock(&device->lock);
+        return;
+    }
+    struct block_request* request = pick_request(device);
+    dequeue_request(device, request);
+    device->busy = true;
+    device->next_sector = request->sector + request->num_sectors;
+    mutex_unlock(&device->lock);
+
+    // Only the task that set busy uses device->segments.
+    build_segments(device, request);
+    int rc = device->ops->submit(device, request);
+
+    for (struct bio* bio = request->bios_head; bio;) {
+        struct bio* next = bio->request_next;
+        complete_bio(bio, rc);
+        bio = next;
+    }
+    kfree(request);
+
+    device->busy = false;
+    waitqueue_wake_all(&device->inode.waitqueue);
+}
+
+static bool unblock_wait(void* data) {
+    struct bio* bio = data;
+    struct block_device* device = bio->device;
+    return bio->done || (!device->busy && device->num_queued > 0);
+}
+
+static void wait_bio(struct bio* bio) {
+    struct block_device* device = bio->device;
+    for (;;) {
+        // Requests of other tasks are dispatched as well, so that the device
+        // keeps busy while any task is waiting for it.
+        dispatch(device);
+        if (bio->done)
+            break;
+        ASSERT_OK(sched_block(&device->inode.waitqueue, unblock_wait, bio,
+                              BLOCK_UNINTERRUPTIBLE));
+    }
+}
+
+void block_plug_add(struct block_plug* plug, struct bio* bio) {
+    bio->status = 0;
+    bio->done = false;
+    bio->parent = NULL;
+    bio->num_children = 0;
+    bio->num_segments = 0;
+    bio->next = NULL;
+    bio->request_next = NULL;
+    if (plug->tail)
+        plug->tail->next = bio;
+    else
+        plug->head = bio;
+    plug->tail = bio;
+}
+
+int block_plug_finish(struct block_plug* plug) {
+    struct bio* bios = plug->head;
+    plug->head = plug->tail = NULL;
+
+    // All the bios are queued before any of them is dispatched, so that
+    // adjacent bios are merged.
+    for (struct bio* bio = bios; bio; bio = bio->next)
+        queue_bio(bio);
+
+    int ret = 0;
+    for (struct bio* bio = bios; bio; bio = bio->next) {
+        wait_bio(bio);
+        if (IS_ERR(bio->status) && IS_OK(ret))
+            ret = bio->status;
+    }
+    return ret;
+}
+
+int block_rw(struct block_device* device, uint64_t sector, void* data,
+             size_t size, bool write) {
+    struct bio bio = {
+        .device = device,
+        .sector = sector,
+        .data = data,
+        .size = size,
+        .write = write,
+    };
+    struct block_plug plug = {0};
+    block_plug_add(&plug, &bio);
+    return block_plug_finish(&plug);
+}
+
+static struct block_device* device_from_inode(struct inode* inode) {
+    return CONTAINER_OF(inode, struct block_device, inode);
+}
+
+static void block_destroy_inode(struct inode* inode) {
+    struct block_device* device = device_from_inode(inode);
+    kfree(device->segments);
+    device->ops->destroy(device);
+}
+
+// Device files can be accessed at any offset. The transfers go through
+// a bounce buffer, as bios can only refer to kernel memory.
+
+static ssize_t block_pread(struct file* file, void* buffer, size_t count,
+                           uint64_t offset) {
+    struct block_device* device = device_from_inode(file->inode);
+    uint64_t capacity = device->num_sectors << SECTOR_SHIFT;
+    if (offset >= capacity)
+        return 0;
+    count = MIN(count, capacity - offset);
+
+    unsigned char* dest = buffer;
+    size_t nread = 0;
+    int rc = 0;
+    while (nread < count) {
+        uint64_t start = ROUND_DOWN(offset, SECTOR_SIZE);
+        size_t head = offset - start;
+        size_t n = MIN(count - nread, MAX_TRANSFER_SIZE - head);
+        size_t size = ROUND_UP(head + n, SECTOR_SIZE);
+        unsigned char* bounce = kmalloc(size);
+        if (!bounce) {
+            rc = -ENOMEM;
+            break;
+        }
+        rc = block_rw(device, start >> SECTOR_SHIFT, bounce, size, false);
+        if (IS_OK(rc))
+            memcpy(dest + nread, bounce + head, n);
+        kfree(bounce);
+        if (IS_ERR(rc))
+            break;
+        nread += n;
+        offset += n;
+    }
+    if (nread > 0)
+        return nread;
+    return rc;
+}
+
+static ssize_t block_pwrite(struct file* file, const void* buffer,
+                            size_t count, uint64_t offset) {
+    struct block_device* device = device_from_inode(file->inode);
+    uint64_t capacity = device->num_sectors << SECTOR_SHIFT;
+    if (offset >= capacity)
+        return count > 0 ? -ENOSPC : 0;
+    count = MIN(count, capacity - offset);
+
+    const unsigned char* src = buffer;
+    size_t nwritten = 0;
+    int rc = 0;
+    while (nwritten < count) {
+        uint64_t start = ROUND_DOWN(offset, SECTOR_SIZE);
+        size_t head = offset - start;
+        size_t n = MIN(count - nwritten, MAX_TRANSFER_SIZE - head);
+        size_t size = ROUND_UP(head + n, SECTOR_SIZE);
+        size_t tail = (head + n) % SECTOR_SIZE;
+        unsigned char* bounce = kmalloc(size);
+        if (!bounce) {
+            rc = -ENOMEM;
+            break;
+        }
+
+        // Sectors that are partially overwritten are read first.
+        struct block_plug plug = {0};
+        struct bio bios[2];
+        uint64_t sector = start >> SECTOR_SHIFT;
+        if (head) {
+            bios[0] = (struct bio){
+                .device = device,
+                .sector = sector,
+                .data = bounce,
+                .size = SECTOR_SIZE,
+            };
+            block_plug_add(&plug, &bios[0]);
+        }
+        if (tail && !(head && size == SECTOR_SIZE)) {
+            size_t last = size - SECTOR_SIZE;
+            bios[1] = (struct bio){
+                .device = device,
+                .sector = sector + (last >> SECTOR_SHIFT),
+                .data = bounce + last,
+                .size = SECTOR_SIZE,
+            };
+            block_plug_add(&plug, &bios[1]);
+        }
+        rc = block_plug_finish(&plug);
+        if (IS_OK(rc)) {
+            memcpy(bounce + head, src + nwritten, n);
+            rc = block_rw(device, sector, bounce, size, true);
+        }
+        kfree(bounce);
+        if (IS_ERR(rc))
+            break;
+        nwritten += n;
+        offset += n;
+    }
+    if (nwritten > 0)
+        return nwritten;
+    return rc;
+}
+
+static const struct file_ops block_fops = {
+    .destroy_inode = block_destroy_inode,
+    .pread = block_pread,
+    .pwrite = block_pwrite,
+};
+
+int block_device_register(const char* name, struct block_device* device) {
+    ASSERT(device->max_sectors > 0);
+    ASSERT(device->max_segments >= 2);
+    device->segments =
+        kmalloc(device->max_segments * sizeof(struct block_segment));
+    if (!device->segments)
+        return -ENOMEM;
+
+    struct inode* inode = &device->inode;
+    inode->fops = &block_fops;
+    inode->mode = S_IFBLK;
+    inode->ref_count = 1;
+    return vfs_register_device(name, inode);
+}
+
+struct block_device* block_device_from_inode(struct inode* inode) {
+    if (inode->fops != &block_fops)
+        return NULL;
+    return device_from_inode(inode);
+}
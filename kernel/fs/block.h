@@ -0,0 +1,122 @@
+#pragma once
+
+#include "fs.h"
+
+// Generic block layer between file systems and block device drivers.
+//
+// I/O is described with bios, each a range of sectors transferred to or from
+// a kernel buffer. Bios are collected in a plug, and handed to the queue of
+// the device together when the plug is finished, so that adjacent bios are
+// merged into a single request. Bios that exceed the limits of the device are
+// split. Queued requests are dispatched one at a time in ascending sector
+// order, unless a request has waited past its deadline.
+//
+// There is no dispatcher task. Tasks waiting for their bios dispatch queued
+// requests while the device is idle, including those of other tasks.
+
+#define SECTOR_SHIFT 9
+#define SECTOR_SIZE (1 << SECTOR_SHIFT)
+
+struct block_device;
+
+struct bio {
+    struct block_device* device;
+    uint64_t sector;
+    void* data;  // Has to be in kernel memory
+    size_t size; // Multiple of SECTOR_SIZE
+    bool write;
+
+    // Set when the bio completes
+    int status;
+    atomic_bool done;
+
+    // Private to the block layer
+    struct bio* parent;         // The bio this bio was split from
+    atomic_size_t num_children; // Number of split bios in flight
+    size_t num_segments;
+    struct bio* next;           // Next bio in the plug
+    struct bio* request_next;   // Next bio in the request
+};
+
+// A physically contiguous piece of the data of a request
+struct block_segment {
+    void* data;
+    size_t size;
+};
+
+// Adjacent bios merged into one transfer
+struct block_request {
+    uint64_t sector;
+    size_t num_sectors;
+    bool write;
+    unsigned deadline; // Dispatched before other requests after this tick
+
+    struct bio* bios_head;
+    struct bio* bios_tail;
+
+    // Filled in before the request is passed to the driver
+    struct block_segment* segments;
+    size_t num_segments;
+
+    struct block_request* sorted_prev;
+    struct block_request* sorted_next;
+    struct block_request* fifo_prev;
+    struct block_request* fifo_next;
+};
+
+struct block_device_ops {
+    void (*destroy)(struct block_device*);
+
+    // Transfers the segments of the request and returns when the transfer
+    // completes. Called for one request at a time.
+    int (*submit)(struct block_device*, struct block_request*);
+};
+
+struct block_device {
+    struct inode inode;
+    const struct block_device_ops* ops;
+    uint64_t num_sectors;
+
+    // Limits of a single request. Larger bios are split.
+    size_t max_sectors;
+    size_t max_segments; // At least 2
+
+    struct mutex lock; // Protects the queue
+
+    // Queued requests in ascending sector order
+    struct block_request* sorted_head;
+
+    // Queued requests in arrival order, for reads and writes
+    struct block_request* fifo_heads[2];
+    struct block_request* fifo_tails[2];
+
+    atomic_size_t num_queued;
+    atomic_bool busy;     // Whether a request is being transferred
+    uint64_t next_sector; // Sector following the last dispatched request
+    struct block_segment* segments;
+};
+
+// Initializes the queue of the device and registers it as /dev/<name>.
+NODISCARD int block_device_register(const char* name, struct block_device*);
+
+// Returns the block device of the inode, or NULL if the inode is not one.
+struct block_device* block_device_from_inode(struct inode*);
+
+// A batch of bios handed to the device queues together.
+// A zero-initialized plug is empty.
+struct block_plug {
+    struct bio* head;
+    struct bio* tail;
+};
+
+// Adds the bio to the plug. Only `device`, `sector`, `data`, `size` and
+// `write` of the bio have to be set.
+void block_plug_add(struct block_plug*, struct bio*);
+
+// Queues the bios in the plug and waits for them to complete.
+// Returns the first error of the bios.
+NODISCARD int block_plug_finish(struct block_plug*);
+
+// Transfers `size` bytes at the sector and waits for the transfer.
+NODISCARD int block_rw(struct block_device*, uint64_t sector, void* data,
+                       size_t size, bool write);
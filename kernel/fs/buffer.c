@@ -0,0 +1,371 @@
+#include "buffer.h"
+#include <common/string.h>
+#include <kernel/api/err.h>
+#include <kernel/kmsg.h>
+#include <kernel/memory/memory.h>
+#include <kernel/panic.h>
+#include <kernel/sched.h>
+#include <kernel/task.h>
+#include <kernel/time.h>
+
+#define NUM_BUCKETS 1024
+
+// Unused buffers are evicted once the cache grows beyond this size.
+#define MAX_CACHED_SIZE (16 * 1024 * 1024)
+
+// The writeback task is woken up early once this much data is dirty.
+#define DIRTY_THRESHOLD (MAX_CACHED_SIZE / 4)
+
+// Dirty buffers are written back at least this often.
+#define WRITEBACK_INTERVAL (5 * CLK_TCK)
+
+static struct buffer* buckets[NUM_BUCKETS];
+
+// Most recently used first
+static struct buffer* lru_head;
+static struct buffer* lru_tail;
+
+static size_t cached_size;
+
+// Protects the hash table, the LRU list and cached_size
+static struct mutex lock;
+
+// Serializes buffer_sync, which links the buffers to write with sync_next
+static struct mutex sync_lock;
+
+static atomic_size_t dirty_size;
+
+static struct waitqueue writeback_waitqueue;
+static atomic_bool writeback_requested;
+
+static void wake_writeback(void) {
+    if (!atomic_exchange(&writeback_requested, true))
+        waitqueue_wake_all(&writeback_waitqueue);
+}
+
+static struct buffer** bucket_for(struct block_device* device, uint64_t block) {
+    size_t hash = (size_t)block + ((uintptr_t)device >> 4) * 31;
+    return buckets + hash % NUM_BUCKETS;
+}
+
+static struct buffer* find(struct block_device* device, uint64_t block) {
+    for (struct buffer* it = *bucket_for(device, block); it;
+         it = it->hash_next) {
+        if (it->device == device && it->block == block)
+            return it;
+    }
+    return NULL;
+}
+
+static void lru_remove(struct buffer* buffer) {
+    if (buffer->lru_prev)
+        buffer->lru_prev->lru_next = buffer->lru_next;
+    else
+        lru_head = buffer->lru_next;
+    if (buffer->lru_next)
+        buffer->lru_next->lru_prev = buffer->lru_prev;
+    else
+        lru_tail = buffer->lru_prev;
+    buffer->lru_prev = buffer->lru_next = NULL;
+}
+
+static void lru_push_front(struct buffer* buffer) {
+    buffer->lru_prev = NULL;
+    buffer->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = buffer;
+    else
+        lru_tail = buffer;
+    lru_head = buffer;
+}
+
+static void touch(struct buffer* buffer) {
+    ++buffer->ref_count;
+    lru_remove(buffer);
+    lru_push_front(buffer);
+}
+
+static struct buffer* alloc_buffer(struct block_device* device, uint64_t block,
+                                   size_t block_size) {
+    struct buffer* buffer = kmalloc(sizeof(struct buffer));
+    if (!buffer)
+        return NULL;
+    *buffer = (struct buffer){
+        .device = device,
+        .block = block,
+        .size = block_size,
+        .ref_count = 1,
+    };
+    buffer->data = kmalloc(block_size);
+    if (!buffer->data) {
+        kfree(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+// Returns the number of bytes freed.
+static size_t free_buffers(struct buffer* list) {
+    size_t num_freed = 0;
+    while (list) {
+        struct buffer* next = list->sync_next;
+        num_freed += sizeof(struct buffer) + list->size;
+        kfree(list->data);
+        kfree(list);
+        list = next;
+    }
+    return num_freed;
+}
+
+// Removes unused clean buffers in LRU order until at most `target` bytes
+// are cached. Returns the removed buffers linked with sync_next.
+static struct buffer* evict(size_t target) {
+    struct buffer* evicted = NULL;
+    for (struct buffer* it = lru_tail; it && cached_size > target;) {
+        struct buffer* prev = it->lru_prev;
+        if (it->ref_count == 0 && !it->dirty) {
+            struct buffer** link = bucket_for(it->device, it->block);
+            while (*link != it)
+                link = &(*link)->hash_next;
+            *link = it->hash_next;
+            lru_remove(it);
+            cached_size -= it->size;
+            it->sync_next = evicted;
+            evicted = it;
+        }
+        it = prev;
+    }
+    return evicted;
+}
+
+// Inserts the buffer into the cache unless the block is already cached.
+// Returns the cached buffer with a reference taken.
+static struct buffer* insert(struct buffer* new_buffer) {
+    struct buffer* evicted = NULL;
+    bool over_limit = false;
+    mutex_lock(&lock);
+    struct buffer* buffer = find(new_buffer->device, new_buffer->block);
+    if (buffer) {
+        touch(buffer);
+    } else {
+        buffer = new_buffer;
+        struct buffer** bucket = bucket_for(buffer->device, buffer->block);
+        buffer->hash_next = *bucket;
+        *bucket = buffer;
+        lru_push_front(buffer);
+        cached_size += buffer->size;
+        evicted = evict(MAX_CACHED_SIZE);
+        over_limit = cached_size > MAX_CACHED_SIZE;
+    }
+    mutex_unlock(&lock);
+
+    free_buffers(evicted);
+    if (buffer != new_buffer) {
+        new_buffer->sync_next = NULL;
+        free_buffers(new_buffer);
+    }
+    if (over_limit) {
+        // The remaining buffers are in use or dirty. Clean the dirty ones
+        // so that they can be evicted.
+        wake_writeback();
+    }
+    return buffer;
+}
+
+static uint64_t first_sector(uint64_t block, size_t block_size) {
+    return block * (block_size >> SECTOR_SHIFT);
+}
+
+struct buffer* buffer_get(struct block_device* device, uint64_t block,
+                          size_t block_size) {
+    mutex_lock(&lock);
+    struct buffer* buffer = find(device, block);
+    if (buffer)
+        touch(buffer);
+    mutex_unlock(&lock);
+    if (buffer) {
+        ASSERT(buffer->size == block_size);
+        return buffer;
+    }
+
+    buffer = alloc_buffer(device, block, block_size);
+    if (!buffer)
+        return ERR_PTR(-ENOMEM);
+    return insert(buffer);
+}
+
+struct buffer* buffer_read(struct block_device* device, uint64_t block,
+                           size_t block_size) {
+    struct buffer* buffer = buffer_get(device, block, block_size);
+    if (IS_ERR(buffer) || buffer->uptodate)
+        return buffer;
+
+    int rc = 0;
+    mutex_lock(&buffer->lock);
+    if (!buffer->uptodate) {
+        rc = block_rw(device, first_sector(block, block_size), buffer->data,
+                      block_size, false);
+        if (IS_OK(rc))
+            buffer->uptodate = true;
+    }
+    mutex_unlock(&buffer->lock);
+    if (IS_ERR(rc)) {
+        buffer_release(buffer);
+        return ERR_PTR(rc);
+    }
+    return buffer;
+}
+
+void buffer_readahead(struct block_device* device, uint64_t block,
+                      size_t count, size_t block_size) {
+    size_t n = 0;
+    mutex_lock(&lock);
+    while (n < count && !find(device, block + n))
+        ++n;
+    mutex_unlock(&lock);
+    if (n == 0)
+        return;
+
+    // The blocks are read straight into new buffers. The bios are merged
+    // into a single request.
+    struct block_plug plug = {0};
+    struct buffer* list = NULL;
+    for (size_t i = n; i-- > 0;) {
+        struct buffer* buffer = alloc_buffer(device, block + i, block_size);
+        if (!buffer)
+            continue;
+        buffer->sync_next = list;
+        list = buffer;
+    }
+    for (struct buffer* it = list; it; it = it->sync_next) {
+        it->bio = (struct bio){
+            .device = device,
+            .sector = first_sector(it->block, block_size),
+            .data = it->data,
+            .size = block_size,
+        };
+        block_plug_add(&plug, &it->bio);
+    }
+    bool all_read = IS_OK(block_plug_finish(&plug));
+
+    while (list) {
+        struct buffer* next = list->sync_next;
+        if (all_read || IS_OK(list->bio.status)) {
+            list->uptodate = true;
+            buffer_release(insert(list));
+        } else {
+            list->sync_next = NULL;
+            free_buffers(list);
+        }
+        list = next;
+    }
+}
+
+void buffer_release(struct buffer* buffer) {
+    if (!buffer)
+        return;
+    ASSERT(buffer->ref_count > 0);
+    --buffer->ref_count;
+}
+
+void buffer_mark_dirty(struct buffer* buffer) {
+    buffer->uptodate = true;
+    if (atomic_exchange(&buffer->dirty, true))
+        return;
+    if ((dirty_size += buffer->size) >= DIRTY_THRESHOLD)
+        wake_writeback();
+}
+
+int buffer_sync(struct block_device* device) {
+    mutex_lock(&sync_lock);
+
+    struct buffer* list = NULL;
+    mutex_lock(&lock);
+    for (struct buffer* it = lru_head; it; it = it->lru_next) {
+        if (it->dirty && (!device || it->device == device)) {
+            ++it->ref_count;
+            it->sync_next = list;
+            list = it;
+        }
+    }
+    mutex_unlock(&lock);
+
+    // Buffers are only marked clean here, under sync_lock, so all the
+    // collected buffers are still dirty. They are marked clean before
+    // writing, so that modifications made during the write mark them dirty
+    // again.
+    struct block_plug plug = {0};
+    for (struct buffer* it = list; it; it = it->sync_next) {
+        mutex_lock(&it->lock);
+        it->dirty = false;
+        dirty_size -= it->size;
+        it->bio = (struct bio){
+            .device = it->device,
+            .sector = first_sector(it->block, it->size),
+            .data = it->data,
+            .size = it->size,
+            .write = true,
+        };
+        block_plug_add(&plug, &it->bio);
+    }
+    int ret = block_plug_finish(&plug);
+
+    while (list) {
+        struct buffer* next = list->sync_next;
+        if (IS_ERR(list->bio.status) &&
+            !atomic_exchange(&list->dirty, true))
+            dirty_size += list->size;
+        mutex_unlock(&list->lock);
+        buffer_release(list);
+        list = next;
+    }
+
+    mutex_unlock(&sync_lock);
+    return ret;
+}
+
+static bool unblock_writeback(void* data) {
+    unsigned deadline = *(unsigned*)data;
+    return writeback_requested || (int)(uptime - deadline) >= 0;
+}
+
+static void writeback_task(void) {
+    for (;;) {
+        unsigned deadline = uptime + WRITEBACK_INTERVAL;
+        struct waiter waiter;
+        waitqueue_add(&writeback_waitqueue, &waiter);
+        ASSERT_OK(sched_block_until(deadline, unblock_writeback, &deadline,
+                                    BLOCK_UNINTERRUPTIBLE));
+        waitqueue_remove(&writeback_waitqueue, &waiter);
+        writeback_requested = false;
+
+        int rc = buffer_sync(NULL);
+        if (IS_ERR(rc))
+            kprintf("writeback: failed to write back buffers (error %d)\n",
+                    rc);
+    }
+}
+
+void writeback_start(void) {
+    ASSERT_OK(task_spawn("writeback", writeback_task));
+}
+
+static size_t shrink_buffers(size_t target) {
+    if (!mutex_try_lock_exclusive(&lock))
+        return 0;
+    size_t target_bytes = target * PAGE_SIZE;
+    struct buffer* evicted =
+        evict(cached_size > target_bytes ? cached_size - target_bytes : 0);
+    mutex_unlock(&lock);
+
+    // The buffers go back to the kmalloc caches, which are shrunk afterwards,
+    // so this is only an estimate of the pages that become free.
+    return free_buffers(evicted) / PAGE_SIZE;
+}
+
+static struct shrinker buffer_shrinker = {
+    .name = "buffer",
+    .shrink = shrink_buffers,
+};
+
+void buffer_init(void) { shrinker_register(&buffer_shrinker); }
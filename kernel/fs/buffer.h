@@ -0,0 +1,59 @@
+#pragma once
+
+#include "block.h"
+
+// Cache of blocks of block devices, shared by all file systems that live on
+// block devices. Buffers that are not in use are evicted in LRU order once
+// the cache grows beyond its limit. Modified buffers are written back by the
+// writeback task, or by buffer_sync.
+
+struct buffer {
+    struct block_device* device;
+    uint64_t block;
+    size_t size;
+    unsigned char* data;
+
+    atomic_bool uptodate; // Whether data holds the contents of the block
+    atomic_bool dirty;    // Whether data has to be written to the device
+    struct mutex lock;    // Serializes I/O on the buffer
+
+    atomic_size_t ref_count;
+
+    // Protected by the lock of the cache
+    struct buffer* hash_next;
+    struct buffer* lru_prev;
+    struct buffer* lru_next;
+    struct buffer* sync_next; // Links buffers being written back or evicted
+
+    struct bio bio; // Used for write-back and read-ahead
+};
+
+void buffer_init(void);
+
+// Returns the buffer of the block, reading it from the device if it is not
+// cached. The block number is in units of block_size.
+NODISCARD struct buffer* buffer_read(struct block_device*, uint64_t block,
+                                     size_t block_size);
+
+// Returns the buffer of the block without reading it from the device.
+// If the buffer is not uptodate, the caller has to fill the whole block and
+// mark it dirty.
+NODISCARD struct buffer* buffer_get(struct block_device*, uint64_t block,
+                                    size_t block_size);
+
+// Reads up to `count` blocks starting at `block` into the cache with a
+// single request. Stops at the first block that is already cached.
+void buffer_readahead(struct block_device*, uint64_t block, size_t count,
+                      size_t block_size);
+
+void buffer_release(struct buffer*);
+
+// Marks the buffer as modified. The data becomes uptodate.
+void buffer_mark_dirty(struct buffer*);
+
+// Writes back the dirty buffers of the device, or of all devices if the
+// device is NULL. Writes of adjacent blocks are merged into single requests.
+NODISCARD int buffer_sync(struct block_device*);
+
+// Starts the task that periodically writes back dirty buffers.
+void writeback_start(void);
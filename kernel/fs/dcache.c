@@ -0,0 +1,347 @@
+#include "dcache.h"
+#include "dentry.h"
+#include <common/string.h>
+#include <kernel/api/err.h>
+#include <kernel/cpu.h>
+#include <kernel/memory/memory.h>
+#include <kernel/panic.h>
+#include <kernel/sched.h>
+#include <kernel/task.h>
+#include <stdalign.h>
+
+#define NUM_BUCKETS 1024
+
+// Longer chains drop their oldest entries, which bounds the size of the cache.
+#define MAX_CHAIN_LEN 8
+
+struct dcache_entry {
+    struct inode* parent;
+    struct inode* inode; // NULL for a negative entry
+    uint32_t hash;
+    _Atomic(struct dcache_entry*) next;
+    struct dcache_entry* retired_next;
+    char name[];
+};
+
+struct dcache_bucket {
+    _Atomic(struct dcache_entry*) head;
+
+    // Incremented whenever entries of the bucket are invalidated
+    atomic_uint seq;
+};
+
+static struct dcache_bucket buckets[NUM_BUCKETS];
+
+// Serializes modifications of the chains. Readers don't take it.
+static struct spinlock lock;
+
+// Entries removed from the chains may still be visited by readers that
+// started before the removal, so they are retired and freed by the dcache
+// task after a grace period.
+//
+// Readers count themselves in per-CPU counters of the current epoch. Once
+// the readers of the previous epoch have finished, no reader can reach the
+// entries retired before the current epoch began, and the epoch advances.
+// New readers count in the other counter, so the old ones drain even while
+// lookups keep coming.
+struct reader_counts {
+    alignas(64) atomic_size_t counts[2]; // Indexed by the parity of the epoch
+};
+
+static struct reader_counts reader_counts[MAX_NUM_CPUS];
+static atomic_uint epoch;
+
+// Entries retired in the current epoch
+static struct spinlock retired_lock;
+static struct dcache_entry* retired_head;
+static struct dcache_entry* retired_tail;
+
+// Entries retired before the current epoch began. Only the dcache task
+// touches them.
+static struct dcache_entry* expired;
+
+static struct waitqueue reaper_waitqueue;
+static atomic_bool reaper_requested;
+
+// Hash of the name mixed with the parent
+static uint32_t hash_of(const struct inode* parent, const char* name) {
+    uint32_t hash = dentry_hash_name(name);
+    hash ^= (uintptr_t)parent >> 4;
+    hash *= 16777619u;
+    return hash;
+}
+
+static struct dcache_bucket* bucket_for(uint32_t hash) {
+    return buckets + hash % NUM_BUCKETS;
+}
+
+static bool matches(const struct dcache_entry* entry,
+                    const struct inode* parent, const char* name,
+                    uint32_t hash) {
+    return entry->hash == hash && entry->parent == parent &&
+           !strcmp(entry->name, name);
+}
+
+static void destroy_entry(struct dcache_entry* entry) {
+    inode_unref(entry->parent);
+    inode_unref(entry->inode);
+    kfree(entry);
+}
+
+// Appends the entries from head to tail, linked with retired_next, to the
+// retired list, and wakes up the dcache task to free them.
+static void retire(struct dcache_entry* head, struct dcache_entry* tail) {
+    if (!head)
+        return;
+    ASSERT(!tail->retired_next);
+    spinlock_lock(&retired_lock);
+    if (retired_tail)
+        retired_tail->retired_next = head;
+    else
+        retired_head = head;
+    retired_tail = tail;
+    spinlock_unlock(&retired_lock);
+
+    if (!atomic_exchange(&reaper_requested, true))
+        waitqueue_wake_all(&reaper_waitqueue);
+}
+
+// Returns the counter to decrement when the reader finishes.
+static atomic_size_t* begin_read(void) {
+    for (;;) {
+        unsigned e = epoch;
+        atomic_size_t* count = reader_counts[cpu_get_id()].counts + e % 2;
+        ++*count;
+
+        // If the epoch has advanced in the meantime, the dcache task may
+        // have missed the increment.
+        if (epoch == e)
+            return count;
+        --*count;
+    }
+}
+
+static bool readers_finished(unsigned parity) {
+    for (size_t i = 0; i < num_cpus; ++i) {
+        if (reader_counts[i].counts[parity])
+            return false;
+    }
+    return true;
+}
+
+// Frees the expired entries and advances the epoch if the readers of the
+// previous epoch have finished. Returns false if they have not.
+static bool advance_epoch(void) {
+    if (!readers_finished((epoch - 1) % 2))
+        return false;
+
+    struct dcache_entry* list = expired;
+    spinlock_lock(&retired_lock);
+    expired = retired_head;
+    retired_head = retired_tail = NULL;
+    ++epoch;
+    spinlock_unlock(&retired_lock);
+
+    while (list) {
+        struct dcache_entry* next = list->retired_next;
+        destroy_entry(list);
+        list = next;
+    }
+    return true;
+}
+
+static bool has_retired(void) {
+    spinlock_lock(&retired_lock);
+    bool ret = retired_head;
+    spinlock_unlock(&retired_lock);
+    return ret;
+}
+
+static bool unblock_reaper(void* data) {
+    (void)data;
+    return reaper_requested;
+}
+
+// Entries are freed here rather than where they are retired, as dropping
+// the references to the inodes may destroy them, which is not allowed in
+// every context that retires entries, such as the shrinker.
+static void dcache_task(void) {
+    for (;;) {
+        ASSERT_OK(sched_block(&reaper_waitqueue, unblock_reaper, NULL,
+                              BLOCK_UNINTERRUPTIBLE));
+        reaper_requested = false;
+
+        // Retired entries are freed after two epochs.
+        while (expired || has_retired()) {
+            if (!advance_epoch())
+                sched_yield(true);
+        }
+    }
+}
+
+void dcache_start(void) { ASSERT_OK(task_spawn("dcache", dcache_task)); }
+
+struct inode* dcache_lookup(struct inode* parent, const char* name) {
+    uint32_t hash = hash_of(parent, name);
+    struct dcache_bucket* bucket = bucket_for(hash);
+    struct inode* result = NULL;
+    atomic_size_t* reader_count = begin_read();
+    for (struct dcache_entry* it = bucket->head; it; it = it->next) {
+        if (!matches(it, parent, name, hash))
+            continue;
+        if (it->inode) {
+            // The entry holds a reference until it is freed, so the inode
+            // stays alive even if the entry is removed concurrently.
+            inode_ref(it->inode);
+            result = it->inode;
+        } else {
+            result = ERR_PTR(-ENOENT);
+        }
+        break;
+    }
+    --*reader_count;
+    return result;
+}
+
+unsigned dcache_begin_insert(struct inode* parent, const char* name) {
+    return bucket_for(hash_of(parent, name))->seq;
+}
+
+void dcache_insert(struct inode* parent, const char* name,
+                   struct inode* child, unsigned token) {
+    size_t len = strlen(name);
+    struct dcache_entry* entry = kmalloc(sizeof(struct dcache_entry) + len + 1);
+    if (!entry)
+        return;
+    *entry = (struct dcache_entry){
+        .parent = parent,
+        .inode = child,
+        .hash = hash_of(parent, name),
+    };
+    memcpy(entry->name, name, len + 1);
+    inode_ref(parent);
+    if (child)
+        inode_ref(child);
+
+    struct dcache_bucket* bucket = bucket_for(entry->hash);
+    spinlock_lock(&lock);
+    if (bucket->seq != token) {
+        // The directory was modified after the lookup started.
+        spinlock_unlock(&lock);
+        destroy_entry(entry);
+        return;
+    }
+    for (struct dcache_entry* it = bucket->head; it; it = it->next) {
+        if (matches(it, parent, name, entry->hash)) {
+            // Another task has inserted the same result.
+            spinlock_unlock(&lock);
+            destroy_entry(entry);
+            return;
+        }
+    }
+
+    // The entry is fully initialized before it is published to readers.
+    entry->next = bucket->head;
+    bucket->head = entry;
+
+    struct dcache_entry* last = entry;
+    for (size_t i = 1; i < MAX_CHAIN_LEN && last->next; ++i)
+        last = last->next;
+    struct dcache_entry* evicted = last->next;
+    last->next = NULL;
+    spinlock_unlock(&lock);
+
+    // The evicted entries are still linked with next, which readers may be
+    // following.
+    struct dcache_entry* evicted_tail = NULL;
+    for (struct dcache_entry* it = evicted; it; it = it->next) {
+        it->retired_next = it->next;
+        evicted_tail = it;
+    }
+    retire(evicted, evicted_tail);
+}
+
+void dcache_invalidate(struct inode* parent, const char* name) {
+    uint32_t hash = hash_of(parent, name);
+    struct dcache_bucket* bucket = bucket_for(hash);
+    struct dcache_entry* removed = NULL;
+    spinlock_lock(&lock);
+    ++bucket->seq;
+    _Atomic(struct dcache_entry*)* link = &bucket->head;
+    for (struct dcache_entry* it = *link; it; it = *link) {
+        if (matches(it, parent, name, hash)) {
+            // Readers visiting the entry can still follow its next pointer.
+            *link = it->next;
+            removed = it;
+            break;
+        }
+        link = &it->next;
+    }
+    spinlock_unlock(&lock);
+
+    retire(removed, removed);
+}
+
+// Removes the entries for which the predicate returns true from all the
+// chains, and retires them. Returns the number of bytes they take up.
+static size_t remove_all(bool (*pred)(struct dcache_entry*, void*),
+                         void* ctx) {
+    struct dcache_entry* removed = NULL;
+    struct dcache_entry* removed_tail = NULL;
+    size_t size = 0;
+    spinlock_lock(&lock);
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        struct dcache_bucket* bucket = buckets + i;
+        // Lookups in progress may be about to insert entries that satisfy
+        // the predicate.
+        ++bucket->seq;
+        _Atomic(struct dcache_entry*)* link = &bucket->head;
+        for (struct dcache_entry* it = *link; it; it = *link) {
+            if (pred(it, ctx)) {
+                *link = it->next;
+                it->retired_next = removed;
+                removed = it;
+                if (!removed_tail)
+                    removed_tail = it;
+                size += sizeof(struct dcache_entry) + strlen(it->name) + 1;
+            } else {
+                link = &it->next;
+            }
+        }
+    }
+    spinlock_unlock(&lock);
+
+    retire(removed, removed_tail);
+    return size;
+}
+
+static bool is_child_of(struct dcache_entry* entry, void* dir) {
+    return entry->parent == dir;
+}
+
+void dcache_invalidate_dir(struct inode* dir) {
+    remove_all(is_child_of, dir);
+}
+
+static bool any_entry(struct dcache_entry* entry, void* ctx) {
+    (void)entry;
+    (void)ctx;
+    return true;
+}
+
+static size_t shrink_dcache(size_t target) {
+    (void)target;
+    size_t size = remove_all(any_entry, NULL);
+
+    // The entries are freed by the dcache task shortly, and go back to the
+    // slab caches, so this is only an estimate of the pages that become
+    // free.
+    return size / PAGE_SIZE;
+}
+
+static struct shrinker dcache_shrinker = {
+    .name = "dcache",
+    .shrink = shrink_dcache,
+};
+
+void dcache_init(void) { shrinker_register(&dcache_shrinker); }
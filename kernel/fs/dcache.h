@@ -0,0 +1,33 @@
+#pragma once
+
+#include "fs.h"
+
+// System-wide cache of directory lookups, mapping (parent inode, name) to the
+// child inode. Names that do not exist are cached as negative entries.
+// Lookups don't take any lock, so that path resolution that hits the cache
+// doesn't contend on directory locks.
+
+void dcache_init(void);
+
+// Starts the task that frees the entries dropped from the cache.
+void dcache_start(void);
+
+// Returns the cached child with a reference taken, ERR_PTR(-ENOENT) if the
+// name is cached as nonexistent, or NULL if the name is not cached.
+struct inode* dcache_lookup(struct inode* parent, const char* name);
+
+// Returns a token to pass to dcache_insert. Obtain it before looking up the
+// name in the file system, so that results that were invalidated during the
+// lookup are not inserted.
+unsigned dcache_begin_insert(struct inode* parent, const char* name);
+
+// Caches the result of a lookup. child is NULL for a negative entry.
+void dcache_insert(struct inode* parent, const char* name,
+                   struct inode* child, unsigned token);
+
+// Drops the entry of the name. Must be called after the directory is
+// modified.
+void dcache_invalidate(struct inode* parent, const char* name);
+
+// Drops all the entries whose parent is the directory.
+void dcache_invalidate_dir(struct inode* dir);
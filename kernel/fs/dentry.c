@@ -25,106 +25,283 @@ static uint8_t mode_to_dirent_type(mode_t mode) {
     UNREACHABLE();
 }
 
-struct inode* dentry_find(const struct dentry* head, const char* name) {
-    const struct dentry* dentry = head;
-    while (dentry) {
-        if (!strcmp(dentry->name, name)) {
-            inode_ref(dentry->inode);
-            return dentry->inode;
+#define INITIAL_NUM_BUCKETS 8
+
+// Each node of the radix tree covers 2^SLOT_BITS times the range of its
+// children. The bottom level holds the dentries.
+#define SLOT_BITS 6
+#define NUM_SLOTS (1 << SLOT_BITS)
+#define SLOT_MASK (NUM_SLOTS - 1)
+
+#define COOKIE_BITS (sizeof(size_t) * 8)
+
+struct dentry_node {
+    void* slots[NUM_SLOTS]; // Child nodes, or dentries at the bottom level
+    size_t count;           // Number of non-empty slots
+};
+
+uint32_t dentry_hash_name(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)name; *p; ++p) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct dentry* find(const struct dentry_dir* dir, const char* name,
+                           uint32_t hash) {
+    if (!dir->num_buckets)
+        return NULL;
+    struct dentry* it = dir->buckets[hash & (dir->num_buckets - 1)];
+    for (; it; it = it->next) {
+        if (it->hash == hash && !strcmp(it->name, name))
+            return it;
+    }
+    return NULL;
+}
+
+static int grow_buckets(struct dentry_dir* dir) {
+    size_t num_buckets =
+        dir->num_buckets ? dir->num_buckets * 2 : INITIAL_NUM_BUCKETS;
+    struct dentry** buckets = kmalloc(num_buckets * sizeof(struct dentry*));
+    if (!buckets)
+        return -ENOMEM;
+    memset(buckets, 0, num_buckets * sizeof(struct dentry*));
+
+    for (size_t i = 0; i < dir->num_buckets; ++i) {
+        for (struct dentry* it = dir->buckets[i]; it;) {
+            struct dentry* next = it->next;
+            struct dentry** bucket = buckets + (it->hash & (num_buckets - 1));
+            it->next = *bucket;
+            *bucket = it;
+            it = next;
         }
-        dentry = dentry->next;
     }
-    return ERR_PTR(-ENOENT);
+
+    kfree(dir->buckets);
+    dir->buckets = buckets;
+    dir->num_buckets = num_buckets;
+    return 0;
 }
 
-int dentry_getdents(struct file* file, const struct dentry* head,
-                    getdents_callback_fn callback, void* ctx) {
-    const struct dentry* dentry = head;
-    if (!dentry)
-        return 0;
+static bool fits(size_t height, size_t cookie) {
+    size_t bits = height * SLOT_BITS;
+    return bits >= COOKIE_BITS || (cookie >> bits) == 0;
+}
 
-    for (uint64_t i = 0; i < file->offset; ++i) {
-        dentry = dentry->next;
-        if (!dentry)
-            return 0;
+static struct dentry_node* alloc_node(void) {
+    struct dentry_node* node = kmalloc(sizeof(struct dentry_node));
+    if (node)
+        *node = (struct dentry_node){0};
+    return node;
+}
+
+static int tree_insert(struct dentry_dir* dir, struct dentry* dentry) {
+    size_t cookie = dentry->cookie;
+    while (!dir->root || !fits(dir->height, cookie)) {
+        // Grow the tree by adding a new root above the current one
+        struct dentry_node* root = alloc_node();
+        if (!root)
+            return -ENOMEM;
+        if (dir->root) {
+            root->slots[0] = dir->root;
+            root->count = 1;
+        }
+        dir->root = root;
+        ++dir->height;
     }
 
-    for (; dentry; dentry = dentry->next) {
-        uint8_t type = mode_to_dirent_type(dentry->inode->mode);
-        if (!callback(dentry->name, type, ctx))
-            break;
-        ++file->offset;
+    struct dentry_node* node = dir->root;
+    for (size_t level = dir->height - 1; level > 0; --level) {
+        size_t i = (cookie >> (level * SLOT_BITS)) & SLOT_MASK;
+        if (!node->slots[i]) {
+            struct dentry_node* child = alloc_node();
+            if (!child)
+                return -ENOMEM;
+            node->slots[i] = child;
+            ++node->count;
+        }
+        node = node->slots[i];
     }
+    size_t i = cookie & SLOT_MASK;
+    ASSERT(!node->slots[i]);
+    node->slots[i] = dentry;
+    ++node->count;
     return 0;
 }
 
-int dentry_append(struct dentry** head, const char* name, struct inode* child) {
-    struct dentry* prev = NULL;
-    struct dentry* it = *head;
-    while (it) {
-        if (!strcmp(it->name, name)) {
-            inode_unref(child);
-            return -EEXIST;
+// Removes the dentry with the cookie from the subtree of the node.
+// Returns whether the node has become empty.
+static bool remove_from_node(struct dentry_node* node, size_t level,
+                             size_t cookie) {
+    size_t i = (cookie >> (level * SLOT_BITS)) & SLOT_MASK;
+    ASSERT(node->slots[i]);
+    if (level > 0) {
+        struct dentry_node* child = node->slots[i];
+        if (!remove_from_node(child, level - 1, cookie))
+            return false;
+        kfree(child);
+    }
+    node->slots[i] = NULL;
+    return --node->count == 0;
+}
+
+static void tree_remove(struct dentry_dir* dir, size_t cookie) {
+    if (remove_from_node(dir->root, dir->height - 1, cookie)) {
+        kfree(dir->root);
+        dir->root = NULL;
+        dir->height = 0;
+    }
+}
+
+// Returns the dentry with the smallest cookie that is not less than the
+// given one in the subtree of the node.
+static struct dentry* find_next_in_node(const struct dentry_node* node,
+                                        size_t level, size_t cookie) {
+    for (size_t i = (cookie >> (level * SLOT_BITS)) & SLOT_MASK;
+         i < NUM_SLOTS; ++i) {
+        if (node->slots[i]) {
+            if (level == 0)
+                return node->slots[i];
+            struct dentry* dentry =
+                find_next_in_node(node->slots[i], level - 1, cookie);
+            if (dentry)
+                return dentry;
         }
-        prev = it;
-        it = it->next;
+        // The following subtrees are searched from their beginning.
+        cookie = 0;
     }
+    return NULL;
+}
 
-    struct dentry* new_dentry = kmalloc(sizeof(struct dentry));
-    if (!new_dentry) {
-        inode_unref(child);
-        return -ENOMEM;
+static void free_node(struct dentry_node* node, size_t level) {
+    if (level > 0) {
+        for (size_t i = 0; i < NUM_SLOTS; ++i) {
+            if (node->slots[i])
+                free_node(node->slots[i], level - 1);
+        }
     }
-    *new_dentry = (struct dentry){0};
+    kfree(node);
+}
 
-    new_dentry->name = kstrdup(name);
-    if (!new_dentry->name) {
-        inode_unref(child);
-        kfree(new_dentry);
-        return -ENOMEM;
+struct inode* dentry_find(const struct dentry_dir* dir, const char* name) {
+    struct dentry* dentry = find(dir, name, dentry_hash_name(name));
+    if (!dentry)
+        return ERR_PTR(-ENOENT);
+    inode_ref(dentry->inode);
+    return dentry->inode;
+}
+
+int dentry_getdents(struct file* file, const struct dentry_dir* dir,
+                    getdents_callback_fn callback, void* ctx) {
+    while (file->offset < dir->next_cookie) {
+        if (!dir->root || !fits(dir->height, file->offset))
+            break;
+        struct dentry* dentry =
+            find_next_in_node(dir->root, dir->height - 1, file->offset);
+        if (!dentry)
+            break;
+        uint8_t type = mode_to_dirent_type(dentry->inode->mode);
+        if (!callback(dentry->name, type, ctx))
+            break;
+        file->offset = (uint64_t)dentry->cookie + 1;
+    }
+    return 0;
+}
+
+int dentry_append(struct dentry_dir* dir, const char* name,
+                  struct inode* child) {
+    uint32_t hash = dentry_hash_name(name);
+    int rc = 0;
+    if (find(dir, name, hash)) {
+        rc = -EEXIST;
+        goto fail;
+    }
+    if (dir->next_cookie == SIZE_MAX) {
+        rc = -ENOSPC;
+        goto fail;
+    }
+    if (dir->num_dentries >= dir->num_buckets) {
+        // Keep the load factor at most 1 if possible
+        rc = grow_buckets(dir);
+        if (IS_ERR(rc) && !dir->num_buckets)
+            goto fail;
     }
-    new_dentry->inode = child;
 
-    if (prev)
-        prev->next = new_dentry;
-    else
-        *head = new_dentry;
+    struct dentry* dentry = kmalloc(sizeof(struct dentry));
+    if (!dentry) {
+        rc = -ENOMEM;
+        goto fail;
+    }
+    *dentry = (struct dentry){
+        .inode = child,
+        .hash = hash,
+        .cookie = dir->next_cookie,
+    };
+    dentry->name = kstrdup(name);
+    if (!dentry->name) {
+        kfree(dentry);
+        rc = -ENOMEM;
+        goto fail;
+    }
+    rc = tree_insert(dir, dentry);
+    if (IS_ERR(rc)) {
+        kfree(dentry->name);
+        kfree(dentry);
+        goto fail;
+    }
 
+    ++dir->next_cookie;
+    struct dentry** bucket = dir->buckets + (hash & (dir->num_buckets - 1));
+    dentry->next = *bucket;
+    *bucket = dentry;
+    ++dir->num_dentries;
     ++child->num_links;
-
     return 0;
+
+fail:
+    inode_unref(child);
+    return rc;
 }
 
-struct inode* dentry_remove(struct dentry** head, const char* name) {
-    struct dentry* prev = NULL;
-    struct dentry* it = *head;
-    while (it) {
-        if (!strcmp(it->name, name)) {
-            if (prev)
-                prev->next = it->next;
-            else
-                *head = it->next;
-            struct inode* inode = it->inode;
-            kfree(it->name);
-            kfree(it);
-            ASSERT(inode->num_links > 0);
-            --inode->num_links;
-            return inode;
+struct inode* dentry_remove(struct dentry_dir* dir, const char* name) {
+    if (!dir->num_buckets)
+        return ERR_PTR(-ENOENT);
+    uint32_t hash = dentry_hash_name(name);
+    struct dentry** link = dir->buckets + (hash & (dir->num_buckets - 1));
+    for (struct dentry* it = *link; it; it = *link) {
+        if (it->hash != hash || strcmp(it->name, name)) {
+            link = &it->next;
+            continue;
         }
-        prev = it;
-        it = it->next;
+        *link = it->next;
+        tree_remove(dir, it->cookie);
+        --dir->num_dentries;
+        struct inode* inode = it->inode;
+        kfree(it->name);
+        kfree(it);
+        ASSERT(inode->num_links > 0);
+        --inode->num_links;
+        return inode;
     }
     return ERR_PTR(-ENOENT);
 }
 
-void dentry_clear(struct dentry* head) {
-    for (struct dentry* dentry = head; dentry;) {
-        struct dentry* next = dentry->next;
-        ASSERT(dentry->inode->num_links > 0);
-        --dentry->inode->num_links;
-        inode_unref(dentry->inode);
-        kfree(dentry->name);
-        kfree(dentry);
-        dentry = next;
+void dentry_clear(struct dentry_dir* dir) {
+    for (size_t i = 0; i < dir->num_buckets; ++i) {
+        for (struct dentry* dentry = dir->buckets[i]; dentry;) {
+            struct dentry* next = dentry->next;
+            ASSERT(dentry->inode->num_links > 0);
+            --dentry->inode->num_links;
+            inode_unref(dentry->inode);
+            kfree(dentry->name);
+            kfree(dentry);
+            dentry = next;
+        }
     }
+    kfree(dir->buckets);
+    if (dir->root)
+        free_node(dir->root, dir->height - 1);
+    *dir = (struct dentry_dir){0};
 }
@@ -5,14 +5,37 @@
 struct dentry {
     char* name;
     struct inode* inode;
-    struct dentry* next;
+    uint32_t hash;
+    size_t cookie;       // Position of the dentry in the directory
+    struct dentry* next; // Next dentry in the same hash bucket
 };
 
-NODISCARD struct inode* dentry_find(const struct dentry* head,
+struct dentry_node;
+
+// Children of a directory. Lookups go through a hash table of the names.
+// Each child is also given a cookie, which increases with every append, and
+// is indexed by the cookie in a radix tree. getdents stores the cookie of the
+// next child in file->offset, so that it can resume from there even if
+// children are added or removed in the meantime.
+// A zero-initialized dentry_dir is an empty directory.
+struct dentry_dir {
+    struct dentry** buckets;
+    size_t num_buckets;
+    size_t num_dentries;
+
+    struct dentry_node* root;
+    size_t height; // Number of levels of the radix tree
+    size_t next_cookie;
+};
+
+// FNV-1a hash of the name
+uint32_t dentry_hash_name(const char* name);
+
+NODISCARD struct inode* dentry_find(const struct dentry_dir*,
                                     const char* name);
-NODISCARD int dentry_getdents(struct file*, const struct dentry* head,
+NODISCARD int dentry_getdents(struct file*, const struct dentry_dir*,
                               getdents_callback_fn callback, void* ctx);
-NODISCARD int dentry_append(struct dentry** head, const char* name,
+NODISCARD int dentry_append(struct dentry_dir*, const char* name,
                             struct inode* child);
-NODISCARD struct inode* dentry_remove(struct dentry** head, const char* name);
-void dentry_clear(struct dentry* head);
+NODISCARD struct inode* dentry_remove(struct dentry_dir*, const char* name);
+void dentry_clear(struct dentry_dir*);
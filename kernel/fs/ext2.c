@@ -0,0 +1,1515 @@
+#include "ext2.h"
+#include "buffer.h"
+#include "fs.h"
+#include <common/string.h>
+#include <kernel/api/dirent.h>
+#include <kernel/api/fcntl.h>
+#include <kernel/api/sys/sysmacros.h>
+#include <kernel/kmsg.h>
+#include <kernel/memory/memory.h>
+#include <kernel/panic.h>
+#include <kernel/time.h>
+
+#define NUM_INODE_BUCKETS 256
+
+// Maximum number of blocks read ahead when a file is read sequentially
+#define READAHEAD_BLOCKS 32
+
+// i_size of regular files can be extended with i_dir_acl, but files are
+// limited to what i_size alone can hold.
+#define MAX_FILE_SIZE UINT32_MAX
+
+struct ext2_fs {
+    struct file* device; // Keeps the device open while mounted
+    struct block_device* block_device;
+    dev_t dev;
+
+    // Serializes all operations on the file system
+    struct mutex lock;
+
+    size_t block_size;
+    size_t block_shift; // log2(block_size)
+    size_t inode_size;
+    uint32_t first_ino;
+    size_t num_groups;
+    bool has_filetype;
+
+    // The superblock and the group descriptors stay in the buffer cache
+    // while the file system is mounted.
+    struct buffer* sb_buffer;
+    struct ext2_superblock* sb;
+    struct buffer** gdt_buffers;
+    size_t num_gdt_blocks;
+
+    // Inodes in memory, hashed by the inode number
+    struct ext2_node* inodes[NUM_INODE_BUCKETS];
+
+    struct ext2_fs* next;
+};
+
+typedef struct ext2_node {
+    struct inode inode;
+    struct ext2_fs* fs;
+    uint32_t ino;
+    struct ext2_inode raw; // Copy of the on-disk inode
+
+    // Read-ahead state. Blocks before readahead_end have been read ahead.
+    uint32_t next_read_block;
+    uint32_t readahead_end;
+
+    struct ext2_node* hash_next;
+} ext2_node;
+
+static struct ext2_fs* mounted_fs;
+static struct mutex mount_lock;
+
+static ext2_node* node_from_inode(struct inode* inode) {
+    return CONTAINER_OF(inode, ext2_node, inode);
+}
+
+static uint32_t now(void) {
+    struct timespec ts;
+    if (IS_ERR(time_now(CLOCK_REALTIME, &ts)))
+        return 0;
+    return ts.tv_sec;
+}
+
+static struct buffer* read_block(struct ext2_fs* fs, uint32_t block) {
+    if (block >= fs->sb->s_blocks_count)
+        return ERR_PTR(-EIO);
+    return buffer_read(fs->block_device, block, fs->block_size);
+}
+
+static void dirty_superblock(struct ext2_fs* fs) {
+    buffer_mark_dirty(fs->sb_buffer);
+}
+
+#define GROUP_DESCS_PER_BLOCK(fs)                                              \
+    ((fs)->block_size / sizeof(struct ext2_group_desc))
+
+static struct ext2_group_desc* group_desc(struct ext2_fs* fs, size_t group) {
+    ASSERT(group < fs->num_groups);
+    struct buffer* buffer = fs->gdt_buffers[group / GROUP_DESCS_PER_BLOCK(fs)];
+    return (struct ext2_group_desc*)buffer->data +
+           group % GROUP_DESCS_PER_BLOCK(fs);
+}
+
+static void dirty_group(struct ext2_fs* fs, size_t group) {
+    buffer_mark_dirty(fs->gdt_buffers[group / GROUP_DESCS_PER_BLOCK(fs)]);
+}
+
+static size_t blocks_in_group(struct ext2_fs* fs, size_t group) {
+    const struct ext2_superblock* sb = fs->sb;
+    uint32_t first = sb->s_first_data_block + group * sb->s_blocks_per_group;
+    return MIN(sb->s_blocks_per_group, sb->s_blocks_count - first);
+}
+
+// Number of blocks needed to hold the size in bytes
+static uint64_t size_in_blocks(struct ext2_fs* fs, uint64_t size) {
+    return (size + fs->block_size - 1) >> fs->block_shift;
+}
+
+static size_t group_of_inode(struct ext2_fs* fs, uint32_t ino) {
+    return (ino - 1) / fs->sb->s_inodes_per_group;
+}
+
+static uint64_t file_size(const ext2_node* node) {
+    uint64_t size = node->raw.i_size;
+    if (S_ISREG(node->raw.i_mode))
+        size |= (uint64_t)node->raw.i_dir_acl << 32;
+    return size;
+}
+
+static void set_file_size(ext2_node* node, uint64_t size) {
+    ASSERT(size <= MAX_FILE_SIZE);
+    node->raw.i_size = size;
+    if (S_ISREG(node->raw.i_mode))
+        node->raw.i_dir_acl = 0;
+}
+
+// Symbolic links shorter than i_block are stored in i_block itself.
+static bool is_fast_symlink(const ext2_node* node) {
+    if (!S_ISLNK(node->raw.i_mode))
+        return false;
+    uint32_t acl_blocks =
+        node->raw.i_file_acl ? node->fs->block_size / 512 : 0;
+    return node->raw.i_blocks == acl_blocks;
+}
+
+// Allocates a clear bit in the bitmap and stores its index in `out_index`.
+static int alloc_bit(struct ext2_fs* fs, uint32_t bitmap_block,
+                     size_t num_bits, size_t* out_index) {
+    struct buffer* buffer = read_block(fs, bitmap_block);
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    uint8_t* bits = buffer->data;
+    for (size_t i = 0; i < num_bits; ++i) {
+        if (i % 8 == 0 && bits[i / 8] == 0xff) {
+            i += 7;
+            continue;
+        }
+        uint8_t mask = 1 << (i % 8);
+        if (bits[i / 8] & mask)
+            continue;
+        bits[i / 8] |= mask;
+        buffer_mark_dirty(buffer);
+        buffer_release(buffer);
+        *out_index = i;
+        return 0;
+    }
+    buffer_release(buffer);
+    return -ENOSPC;
+}
+
+static int free_bit(struct ext2_fs* fs, uint32_t bitmap_block, size_t index) {
+    struct buffer* buffer = read_block(fs, bitmap_block);
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    uint8_t* bits = buffer->data;
+    uint8_t mask = 1 << (index % 8);
+    int rc = 0;
+    if (bits[index / 8] & mask) {
+        bits[index / 8] &= ~mask;
+        buffer_mark_dirty(buffer);
+    } else {
+        rc = -EIO;
+    }
+    buffer_release(buffer);
+    return rc;
+}
+
+// Allocates a block filled with zeros, preferably in the given group.
+static int alloc_block(struct ext2_fs* fs, size_t goal_group,
+                       uint32_t* out_block) {
+    struct ext2_superblock* sb = fs->sb;
+    if (sb->s_free_blocks_count == 0)
+        return -ENOSPC;
+    for (size_t i = 0; i < fs->num_groups; ++i) {
+        size_t group = (goal_group + i) % fs->num_groups;
+        struct ext2_group_desc* desc = group_desc(fs, group);
+        if (desc->bg_free_blocks_count == 0)
+            continue;
+        size_t index;
+        int rc = alloc_bit(fs, desc->bg_block_bitmap,
+                           blocks_in_group(fs, group), &index);
+        if (rc == -ENOSPC)
+            continue;
+        if (IS_ERR(rc))
+            return rc;
+        --desc->bg_free_blocks_count;
+        dirty_group(fs, group);
+        --sb->s_free_blocks_count;
+        dirty_superblock(fs);
+
+        uint32_t block =
+            sb->s_first_data_block + group * sb->s_blocks_per_group + index;
+        struct buffer* buffer =
+            buffer_get(fs->block_device, block, fs->block_size);
+        if (IS_ERR(buffer))
+            return PTR_ERR(buffer);
+        memset(buffer->data, 0, fs->block_size);
+        buffer_mark_dirty(buffer);
+        buffer_release(buffer);
+        *out_block = block;
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+static void free_block(struct ext2_fs* fs, uint32_t block) {
+    struct ext2_superblock* sb = fs->sb;
+    if (block < sb->s_first_data_block || block >= sb->s_blocks_count) {
+        kprintf("ext2: freeing invalid block %u\n", block);
+        return;
+    }
+    uint32_t relative = block - sb->s_first_data_block;
+    size_t group = relative / sb->s_blocks_per_group;
+    struct ext2_group_desc* desc = group_desc(fs, group);
+    int rc = free_bit(fs, desc->bg_block_bitmap,
+                      relative % sb->s_blocks_per_group);
+    if (IS_ERR(rc)) {
+        kprintf("ext2: failed to free block %u (error %d)\n", block, rc);
+        return;
+    }
+    ++desc->bg_free_blocks_count;
+    dirty_group(fs, group);
+    ++sb->s_free_blocks_count;
+    dirty_superblock(fs);
+}
+
+static int alloc_inode_number(struct ext2_fs* fs, size_t goal_group,
+                              bool is_dir, uint32_t* out_ino) {
+    struct ext2_superblock* sb = fs->sb;
+    if (sb->s_free_inodes_count == 0)
+        return -ENOSPC;
+    for (size_t i = 0; i < fs->num_groups; ++i) {
+        size_t group = (goal_group + i) % fs->num_groups;
+        struct ext2_group_desc* desc = group_desc(fs, group);
+        if (desc->bg_free_inodes_count == 0)
+            continue;
+        size_t index;
+        int rc = alloc_bit(fs, desc->bg_inode_bitmap, sb->s_inodes_per_group,
+                           &index);
+        if (rc == -ENOSPC)
+            continue;
+        if (IS_ERR(rc))
+            return rc;
+        uint32_t ino = group * sb->s_inodes_per_group + index + 1;
+        if (ino < fs->first_ino) {
+            // Reserved inodes are always marked as used.
+            return -EIO;
+        }
+        --desc->bg_free_inodes_count;
+        if (is_dir)
+            ++desc->bg_used_dirs_count;
+        dirty_group(fs, group);
+        --sb->s_free_inodes_count;
+        dirty_superblock(fs);
+        *out_ino = ino;
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+static void free_inode_number(struct ext2_fs* fs, uint32_t ino, bool is_dir) {
+    struct ext2_superblock* sb = fs->sb;
+    size_t group = group_of_inode(fs, ino);
+    struct ext2_group_desc* desc = group_desc(fs, group);
+    int rc = free_bit(fs, desc->bg_inode_bitmap,
+                      (ino - 1) % sb->s_inodes_per_group);
+    if (IS_ERR(rc)) {
+        kprintf("ext2: failed to free inode %u (error %d)\n", ino, rc);
+        return;
+    }
+    ++desc->bg_free_inodes_count;
+    if (is_dir && desc->bg_used_dirs_count > 0)
+        --desc->bg_used_dirs_count;
+    dirty_group(fs, group);
+    ++sb->s_free_inodes_count;
+    dirty_superblock(fs);
+}
+
+// Returns the buffer holding the on-disk inode and its offset in the buffer.
+static struct buffer* inode_buffer(struct ext2_fs* fs, uint32_t ino,
+                                   size_t* out_offset) {
+    if (ino == 0 || ino > fs->sb->s_inodes_count)
+        return ERR_PTR(-EIO);
+    size_t index = (ino - 1) % fs->sb->s_inodes_per_group;
+    size_t offset = index * fs->inode_size;
+    struct ext2_group_desc* desc = group_desc(fs, group_of_inode(fs, ino));
+    *out_offset = offset & (fs->block_size - 1);
+    return read_block(fs, desc->bg_inode_table + (offset >> fs->block_shift));
+}
+
+static int write_inode(ext2_node* node) {
+    size_t offset;
+    struct buffer* buffer = inode_buffer(node->fs, node->ino, &offset);
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    memcpy(buffer->data + offset, &node->raw, sizeof(struct ext2_inode));
+    buffer_mark_dirty(buffer);
+    buffer_release(buffer);
+    return 0;
+}
+
+// Same as write_inode, but also clears the fields that follow
+// struct ext2_inode in larger inodes.
+static int write_new_inode(ext2_node* node) {
+    size_t offset;
+    struct buffer* buffer = inode_buffer(node->fs, node->ino, &offset);
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    memset(buffer->data + offset, 0, node->fs->inode_size);
+    memcpy(buffer->data + offset, &node->raw, sizeof(struct ext2_inode));
+    buffer_mark_dirty(buffer);
+    buffer_release(buffer);
+    return 0;
+}
+
+static void touch(ext2_node* node) {
+    node->raw.i_mtime = node->raw.i_ctime = now();
+}
+
+// Finds the physical block of the logical block of the file and stores it
+// in `out_block`, or 0 if the block is a hole. Missing blocks are allocated
+// if `create` is true.
+static int map_block(ext2_node* node, uint32_t index, bool create,
+                     uint32_t* out_block) {
+    struct ext2_fs* fs = node->fs;
+    size_t shift = fs->block_shift - 2; // log2 of block numbers per block
+    uint32_t mask = (1u << shift) - 1;
+
+    // Index of the slot at each level of the tree
+    size_t path[4];
+    size_t depth;
+    if (index < EXT2_NDIR_BLOCKS) {
+        path[0] = index;
+        depth = 1;
+    } else if ((index -= EXT2_NDIR_BLOCKS) >> shift == 0) {
+        path[0] = EXT2_IND_BLOCK;
+        path[1] = index;
+        depth = 2;
+    } else if ((index -= 1u << shift) >> (2 * shift) == 0) {
+        path[0] = EXT2_DIND_BLOCK;
+        path[1] = index >> shift;
+        path[2] = index & mask;
+        depth = 3;
+    } else {
+        index -= 1u << (2 * shift);
+        if (index >> (3 * shift))
+            return -EFBIG;
+        path[0] = EXT2_TIND_BLOCK;
+        path[1] = index >> (2 * shift);
+        path[2] = (index >> shift) & mask;
+        path[3] = index & mask;
+        depth = 4;
+    }
+
+    uint32_t* slot = &node->raw.i_block[path[0]];
+    struct buffer* holder = NULL; // Buffer containing slot, NULL if the inode
+    bool inode_dirty = false;
+    int rc = 0;
+    for (size_t level = 0;; ++level) {
+        if (!*slot) {
+            if (!create) {
+                *out_block = 0;
+                break;
+            }
+            uint32_t block;
+            rc = alloc_block(fs, group_of_inode(fs, node->ino), &block);
+            if (IS_ERR(rc))
+                break;
+            *slot = block;
+            if (holder)
+                buffer_mark_dirty(holder);
+            node->raw.i_blocks += fs->block_size / 512;
+            inode_dirty = true;
+        }
+        if (level + 1 == depth) {
+            *out_block = *slot;
+            break;
+        }
+        struct buffer* buffer = read_block(fs, *slot);
+        if (IS_ERR(buffer)) {
+            rc = PTR_ERR(buffer);
+            break;
+        }
+        buffer_release(holder);
+        holder = buffer;
+        slot = (uint32_t*)buffer->data + path[level + 1];
+    }
+    buffer_release(holder);
+    if (inode_dirty) {
+        int write_rc = write_inode(node);
+        if (IS_OK(rc))
+            rc = write_rc;
+    }
+    return rc;
+}
+
+// Frees the blocks of the subtree referenced by *slot that map logical
+// blocks at or after `from`, counted from the start of the subtree.
+// `level` is the number of levels of indirect blocks in the subtree.
+static int truncate_subtree(ext2_node* node, uint32_t* slot, size_t level,
+                            uint64_t from) {
+    if (!*slot)
+        return 0;
+    struct ext2_fs* fs = node->fs;
+    if (level > 0) {
+        struct buffer* buffer = read_block(fs, *slot);
+        if (IS_ERR(buffer))
+            return PTR_ERR(buffer);
+        uint32_t* entries = (uint32_t*)buffer->data;
+        size_t num_entries = fs->block_size / sizeof(uint32_t);
+        uint64_t span = (uint64_t)1 << ((level - 1) * (fs->block_shift - 2));
+        int rc = 0;
+        for (size_t i = num_entries; i-- > 0;) {
+            uint64_t start = i * span;
+            if (start + span <= from)
+                break;
+            if (!entries[i])
+                continue;
+            rc = truncate_subtree(node, &entries[i], level - 1,
+                                  from > start ? from - start : 0);
+            buffer_mark_dirty(buffer);
+            if (IS_ERR(rc))
+                break;
+        }
+        buffer_release(buffer);
+        if (IS_ERR(rc))
+            return rc;
+        if (from > 0) {
+            // The indirect block still maps blocks before `from`.
+            return 0;
+        }
+    }
+    free_block(fs, *slot);
+    *slot = 0;
+    node->raw.i_blocks -= fs->block_size / 512;
+    return 0;
+}
+
+// Frees the blocks of the file at or after the logical block `from`.
+static int truncate_blocks(ext2_node* node, uint64_t from) {
+    for (uint64_t i = from; i < EXT2_NDIR_BLOCKS; ++i) {
+        int rc = truncate_subtree(node, &node->raw.i_block[i], 0, 0);
+        if (IS_ERR(rc))
+            return rc;
+    }
+    size_t shift = node->fs->block_shift - 2;
+    uint64_t start = EXT2_NDIR_BLOCKS;
+    for (size_t level = 1; level <= 3; ++level) {
+        uint64_t span = (uint64_t)1 << (level * shift);
+        if (from < start + span) {
+            int rc = truncate_subtree(
+                node, &node->raw.i_block[EXT2_IND_BLOCK + level - 1], level,
+                from > start ? from - start : 0);
+            if (IS_ERR(rc))
+                return rc;
+        }
+        start += span;
+    }
+    return 0;
+}
+
+static const struct file_ops dir_fops;
+static const struct file_ops file_fops;
+static const struct file_ops special_fops;
+
+static dev_t decode_dev(const struct ext2_inode* raw) {
+    if (raw->i_block[0]) {
+        // Old encoding with 8-bit major and minor numbers
+        uint32_t dev = raw->i_block[0];
+        return makedev((dev >> 8) & 0xff, dev & 0xff);
+    }
+    return raw->i_block[1];
+}
+
+static void init_vfs_inode(ext2_node* node) {
+    struct inode* inode = &node->inode;
+    inode->dev = node->fs->dev;
+    inode->mode = node->raw.i_mode;
+    inode->num_links = node->raw.i_links_count;
+    inode->ref_count = 1;
+    switch (inode->mode & S_IFMT) {
+    case S_IFDIR:
+        inode->fops = &dir_fops;
+        break;
+    case S_IFREG:
+    case S_IFLNK:
+        inode->fops = &file_fops;
+        break;
+    case S_IFCHR:
+    case S_IFBLK:
+        inode->rdev = decode_dev(&node->raw);
+        inode->fops = &special_fops;
+        break;
+    default:
+        inode->fops = &special_fops;
+        break;
+    }
+}
+
+static void hash_insert(ext2_node* node) {
+    ext2_node** bucket = node->fs->inodes + node->ino % NUM_INODE_BUCKETS;
+    node->hash_next = *bucket;
+    *bucket = node;
+}
+
+// Returns the in-memory inode of the inode number, loading it if needed.
+static struct inode* get_inode(struct ext2_fs* fs, uint32_t ino) {
+    for (ext2_node* it = fs->inodes[ino % NUM_INODE_BUCKETS]; it;
+         it = it->hash_next) {
+        if (it->ino == ino) {
+            inode_ref(&it->inode);
+            return &it->inode;
+        }
+    }
+
+    size_t offset;
+    struct buffer* buffer = inode_buffer(fs, ino, &offset);
+    if (IS_ERR(buffer))
+        return ERR_CAST(buffer);
+    ext2_node* node = kmalloc(sizeof(ext2_node));
+    if (!node) {
+        buffer_release(buffer);
+        return ERR_PTR(-ENOMEM);
+    }
+    *node = (ext2_node){.fs = fs, .ino = ino};
+    memcpy(&node->raw, buffer->data + offset, sizeof(struct ext2_inode));
+    buffer_release(buffer);
+
+    if (node->raw.i_links_count == 0 || !(node->raw.i_mode & S_IFMT)) {
+        // A directory entry refers to a free inode.
+        kfree(node);
+        return ERR_PTR(-EIO);
+    }
+
+    init_vfs_inode(node);
+    hash_insert(node);
+    return &node->inode;
+}
+
+static size_t entry_name_len(struct ext2_fs* fs,
+                             const struct ext2_dir_entry* entry) {
+    if (fs->has_filetype)
+        return entry->name_len;
+    return entry->name_len | (entry->file_type << 8);
+}
+
+static size_t record_size(size_t name_len) {
+    return ROUND_UP(sizeof(struct ext2_dir_entry) + name_len, 4);
+}
+
+// Returns the directory entry at the position of the block, or NULL if the
+// entry is corrupted.
+static struct ext2_dir_entry* entry_at(struct ext2_fs* fs, unsigned char* data,
+                                       size_t pos) {
+    if (pos + sizeof(struct ext2_dir_entry) > fs->block_size)
+        return NULL;
+    struct ext2_dir_entry* entry = (struct ext2_dir_entry*)(data + pos);
+    if (entry->rec_len < sizeof(struct ext2_dir_entry) ||
+        entry->rec_len % 4 != 0 || pos + entry->rec_len > fs->block_size ||
+        record_size(entry_name_len(fs, entry)) > entry->rec_len)
+        return NULL;
+    return entry;
+}
+
+static bool entry_has_name(struct ext2_fs* fs,
+                           const struct ext2_dir_entry* entry, const char* name,
+                           size_t name_len) {
+    return entry->inode && entry_name_len(fs, entry) == name_len &&
+           !memcmp(entry->name, name, name_len);
+}
+
+static uint8_t mode_to_file_type(mode_t mode) {
+    switch (mode & S_IFMT) {
+    case S_IFREG:
+        return EXT2_FT_REG_FILE;
+    case S_IFDIR:
+        return EXT2_FT_DIR;
+    case S_IFCHR:
+        return EXT2_FT_CHRDEV;
+    case S_IFBLK:
+        return EXT2_FT_BLKDEV;
+    case S_IFIFO:
+        return EXT2_FT_FIFO;
+    case S_IFSOCK:
+        return EXT2_FT_SOCK;
+    case S_IFLNK:
+        return EXT2_FT_SYMLINK;
+    }
+    return EXT2_FT_UNKNOWN;
+}
+
+static uint8_t file_type_to_dirent_type(uint8_t file_type) {
+    switch (file_type) {
+    case EXT2_FT_REG_FILE:
+        return DT_REG;
+    case EXT2_FT_DIR:
+        return DT_DIR;
+    case EXT2_FT_CHRDEV:
+        return DT_CHR;
+    case EXT2_FT_BLKDEV:
+        return DT_BLK;
+    case EXT2_FT_FIFO:
+        return DT_FIFO;
+    case EXT2_FT_SOCK:
+        return DT_SOCK;
+    case EXT2_FT_SYMLINK:
+        return DT_LNK;
+    }
+    return DT_UNKNOWN;
+}
+
+static void fill_entry(struct ext2_fs* fs, struct ext2_dir_entry* entry,
+                       const char* name, size_t name_len, uint32_t ino,
+                       mode_t mode) {
+    entry->inode = ino;
+    entry->name_len = name_len;
+    entry->file_type = fs->has_filetype ? mode_to_file_type(mode) : 0;
+    memcpy(entry->name, name, name_len);
+}
+
+// Finds the entry of the name in the directory and stores its inode number
+// in `out_ino`. If `new_ino` is not 0, the entry is changed to refer to it.
+static int find_entry(ext2_node* dir, const char* name, uint32_t* out_ino,
+                      uint32_t new_ino) {
+    struct ext2_fs* fs = dir->fs;
+    size_t name_len = strlen(name);
+    uint32_t num_blocks = dir->raw.i_size >> fs->block_shift;
+    for (uint32_t i = 0; i < num_blocks; ++i) {
+        uint32_t block;
+        int rc = map_block(dir, i, false, &block);
+        if (IS_ERR(rc))
+            return rc;
+        if (!block)
+            continue;
+        struct buffer* buffer = read_block(fs, block);
+        if (IS_ERR(buffer))
+            return PTR_ERR(buffer);
+        for (size_t pos = 0; pos < fs->block_size;) {
+            struct ext2_dir_entry* entry = entry_at(fs, buffer->data, pos);
+            if (!entry) {
+                buffer_release(buffer);
+                return -EIO;
+            }
+            if (entry_has_name(fs, entry, name, name_len)) {
+                *out_ino = entry->inode;
+                if (new_ino) {
+                    entry->inode = new_ino;
+                    buffer_mark_dirty(buffer);
+                }
+                buffer_release(buffer);
+                return 0;
+            }
+            pos += entry->rec_len;
+        }
+        buffer_release(buffer);
+    }
+    return -ENOENT;
+}
+
+// Entries are added without updating the hash tree of indexed directories,
+// so the directory is turned back into a linear one.
+static int touch_dir(ext2_node* dir) {
+    dir->raw.i_flags &= ~EXT2_INDEX_FL;
+    touch(dir);
+    return write_inode(dir);
+}
+
+static int add_entry(ext2_node* dir, const char* name, uint32_t ino,
+                     mode_t mode) {
+    struct ext2_fs* fs = dir->fs;
+    size_t name_len = strlen(name);
+    if (name_len > EXT2_NAME_LEN)
+        return -ENAMETOOLONG;
+    size_t needed = record_size(name_len);
+
+    uint32_t num_blocks = dir->raw.i_size >> fs->block_shift;
+    for (uint32_t i = 0; i < num_blocks; ++i) {
+        uint32_t block;
+        int rc = map_block(dir, i, false, &block);
+        if (IS_ERR(rc))
+            return rc;
+        if (!block)
+            continue;
+        struct buffer* buffer = read_block(fs, block);
+        if (IS_ERR(buffer))
+            return PTR_ERR(buffer);
+        for (size_t pos = 0; pos < fs->block_size;) {
+            struct ext2_dir_entry* entry = entry_at(fs, buffer->data, pos);
+            if (!entry) {
+                buffer_release(buffer);
+                return -EIO;
+            }
+            size_t used =
+                entry->inode ? record_size(entry_name_len(fs, entry)) : 0;
+            if (entry->rec_len - used >= needed) {
+                // Split the unused space at the end of the entry off into
+                // the new entry.
+                struct ext2_dir_entry* new_entry = entry;
+                if (used) {
+                    new_entry = (struct ext2_dir_entry*)((unsigned char*)entry +
+                                                         used);
+                    new_entry->rec_len = entry->rec_len - used;
+                    entry->rec_len = used;
+                }
+                fill_entry(fs, new_entry, name, name_len, ino, mode);
+                buffer_mark_dirty(buffer);
+                buffer_release(buffer);
+                return touch_dir(dir);
+            }
+            pos += entry->rec_len;
+        }
+        buffer_release(buffer);
+    }
+
+    // No space in the existing blocks. Append a new block.
+    uint32_t block;
+    int rc = map_block(dir, num_blocks, true, &block);
+    if (IS_ERR(rc))
+        return rc;
+    struct buffer* buffer = read_block(fs, block);
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    struct ext2_dir_entry* entry = (struct ext2_dir_entry*)buffer->data;
+    entry->rec_len = fs->block_size;
+    fill_entry(fs, entry, name, name_len, ino, mode);
+    buffer_mark_dirty(buffer);
+    buffer_release(buffer);
+    dir->raw.i_size += fs->block_size;
+    return touch_dir(dir);
+}
+
+static int remove_entry(ext2_node* dir, const char* name) {
+    struct ext2_fs* fs = dir->fs;
+    size_t name_len = strlen(name);
+    uint32_t num_blocks = dir->raw.i_size >> fs->block_shift;
+    for (uint32_t i = 0; i < num_blocks; ++i) {
+        uint32_t block;
+        int rc = map_block(dir, i, false, &block);
+        if (IS_ERR(rc))
+            return rc;
+        if (!block)
+            continue;
+        struct buffer* buffer = read_block(fs, block);
+        if (IS_ERR(buffer))
+            return PTR_ERR(buffer);
+        struct ext2_dir_entry* prev = NULL;
+        for (size_t pos = 0; pos < fs->block_size;) {
+            struct ext2_dir_entry* entry = entry_at(fs, buffer->data, pos);
+            if (!entry) {
+                buffer_release(buffer);
+                return -EIO;
+            }
+            if (entry_has_name(fs, entry, name, name_len)) {
+                // Merge the entry into the previous one, or mark it unused
+                // if it is the first one in the block.
+                if (prev)
+                    prev->rec_len += entry->rec_len;
+                else
+                    entry->inode = 0;
+                buffer_mark_dirty(buffer);
+                buffer_release(buffer);
+                return touch_dir(dir);
+            }
+            prev = entry;
+            pos += entry->rec_len;
+        }
+        buffer_release(buffer);
+    }
+    return -ENOENT;
+}
+
+static void adjust_links(ext2_node* node, int delta) {
+    node->raw.i_links_count += delta;
+    node->inode.num_links = node->raw.i_links_count;
+    node->raw.i_ctime = now();
+}
+
+static void ext2_destroy_inode(struct inode* inode) {
+    ext2_node* node = node_from_inode(inode);
+    struct ext2_fs* fs = node->fs;
+    mutex_lock(&fs->lock);
+
+    ext2_node** link = fs->inodes + node->ino % NUM_INODE_BUCKETS;
+    while (*link != node)
+        link = &(*link)->hash_next;
+    *link = node->hash_next;
+
+    ASSERT(node->raw.i_links_count == 0);
+    int rc = 0;
+    if (!is_fast_symlink(node))
+        rc = truncate_blocks(node, 0);
+    if (IS_OK(rc)) {
+        set_file_size(node, 0);
+        node->raw.i_dtime = now();
+        rc = write_inode(node);
+    }
+    if (IS_OK(rc))
+        free_inode_number(fs, node->ino, S_ISDIR(node->raw.i_mode));
+    else
+        kprintf("ext2: failed to free inode %u (error %d)\n", node->ino, rc);
+
+    mutex_unlock(&fs->lock);
+    kfree(node);
+}
+
+static struct inode* ext2_lookup_child(struct inode* inode, const char* name) {
+    ext2_node* dir = node_from_inode(inode);
+    struct ext2_fs* fs = dir->fs;
+    mutex_lock(&fs->lock);
+    uint32_t ino;
+    int rc = find_entry(dir, name, &ino, 0);
+    struct inode* child = IS_OK(rc) ? get_inode(fs, ino) : ERR_PTR(rc);
+    mutex_unlock(&fs->lock);
+    inode_unref(inode);
+    return child;
+}
+
+// Writes the "." and ".." entries of a new directory.
+static int init_dir(ext2_node* node, uint32_t parent_ino) {
+    struct ext2_fs* fs = node->fs;
+    uint32_t block;
+    int rc = map_block(node, 0, true, &block);
+    if (IS_ERR(rc))
+        return rc;
+    struct buffer* buffer = read_block(fs, block);
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    struct ext2_dir_entry* dot = (struct ext2_dir_entry*)buffer->data;
+    dot->rec_len = record_size(1);
+    fill_entry(fs, dot, ".", 1, node->ino, S_IFDIR);
+    struct ext2_dir_entry* dot_dot =
+        (struct ext2_dir_entry*)(buffer->data + dot->rec_len);
+    dot_dot->rec_len = fs->block_size - dot->rec_len;
+    fill_entry(fs, dot_dot, "..", 2, parent_ino, S_IFDIR);
+    buffer_mark_dirty(buffer);
+    buffer_release(buffer);
+    node->raw.i_size = fs->block_size;
+    return 0;
+}
+
+static struct inode* ext2_create_child(struct inode* inode, const char* name,
+                                       mode_t mode) {
+    ext2_node* dir = node_from_inode(inode);
+    struct ext2_fs* fs = dir->fs;
+    bool is_dir = S_ISDIR(mode);
+    mutex_lock(&fs->lock);
+
+    uint32_t ino;
+    int rc = find_entry(dir, name, &ino, 0);
+    if (rc != -ENOENT) {
+        if (IS_OK(rc))
+            rc = -EEXIST;
+        goto fail;
+    }
+    if (strlen(name) > EXT2_NAME_LEN) {
+        rc = -ENAMETOOLONG;
+        goto fail;
+    }
+    if (is_dir && dir->raw.i_links_count >= UINT16_MAX) {
+        rc = -EMLINK;
+        goto fail;
+    }
+
+    rc = alloc_inode_number(fs, group_of_inode(fs, dir->ino), is_dir, &ino);
+    if (IS_ERR(rc))
+        goto fail;
+
+    ext2_node* node = kmalloc(sizeof(ext2_node));
+    if (!node) {
+        free_inode_number(fs, ino, is_dir);
+        rc = -ENOMEM;
+        goto fail;
+    }
+    uint32_t time = now();
+    *node = (ext2_node){
+        .fs = fs,
+        .ino = ino,
+        .raw =
+            {
+                .i_mode = mode,
+                .i_atime = time,
+                .i_ctime = time,
+                .i_mtime = time,
+                .i_links_count = is_dir ? 2 : 1,
+            },
+    };
+    if (is_dir)
+        rc = init_dir(node, dir->ino);
+    if (IS_OK(rc))
+        rc = write_new_inode(node);
+    if (IS_OK(rc))
+        rc = add_entry(dir, name, ino, mode);
+    if (IS_ERR(rc)) {
+        if (IS_ERR(truncate_blocks(node, 0)))
+            kprintf("ext2: leaked blocks of inode %u\n", ino);
+        free_inode_number(fs, ino, is_dir);
+        kfree(node);
+        goto fail;
+    }
+    if (is_dir) {
+        // The ".." entry of the new directory
+        adjust_links(dir, 1);
+        rc = write_inode(dir);
+        if (IS_ERR(rc))
+            kprintf("ext2: failed to update inode %u (error %d)\n", dir->ino,
+                    rc);
+    }
+
+    init_vfs_inode(node);
+    hash_insert(node);
+    mutex_unlock(&fs->lock);
+    inode_unref(inode);
+    return &node->inode;
+
+fail:
+    mutex_unlock(&fs->lock);
+    inode_unref(inode);
+    return ERR_PTR(rc);
+}
+
+static int ext2_link_child(struct inode* inode, const char* name,
+                           struct inode* child) {
+    ext2_node* dir = node_from_inode(inode);
+    ext2_node* child_node = node_from_inode(child);
+    struct ext2_fs* fs = dir->fs;
+    mutex_lock(&fs->lock);
+
+    uint32_t ino;
+    int rc = find_entry(dir, name, &ino, 0);
+    if (rc != -ENOENT) {
+        if (IS_OK(rc))
+            rc = -EEXIST;
+        goto done;
+    }
+    if (child_node->raw.i_links_count >= UINT16_MAX) {
+        rc = -EMLINK;
+        goto done;
+    }
+    rc = add_entry(dir, name, child_node->ino, child->mode);
+    if (IS_ERR(rc))
+        goto done;
+    adjust_links(child_node, 1);
+
+    if (S_ISDIR(child->mode)) {
+        // A directory is linked to another directory only when it is
+        // renamed. Its ".." entry moves to the new parent right away.
+        uint32_t old_parent_ino;
+        rc = find_entry(child_node, "..", &old_parent_ino, dir->ino);
+        if (IS_OK(rc) && old_parent_ino != dir->ino) {
+            adjust_links(dir, 1);
+            rc = write_inode(dir);
+            struct inode* old_parent = get_inode(fs, old_parent_ino);
+            if (IS_OK(old_parent)) {
+                ext2_node* old_parent_node = node_from_inode(old_parent);
+                adjust_links(old_parent_node, -1);
+                int write_rc = write_inode(old_parent_node);
+                if (IS_OK(rc))
+                    rc = write_rc;
+                inode_unref(old_parent);
+            } else if (IS_OK(rc)) {
+                rc = PTR_ERR(old_parent);
+            }
+        }
+    }
+
+    int write_rc = write_inode(child_node);
+    if (IS_OK(rc))
+        rc = write_rc;
+
+done:
+    mutex_unlock(&fs->lock);
+    inode_unref(child);
+    inode_unref(inode);
+    return rc;
+}
+
+static struct inode* ext2_unlink_child(struct inode* inode, const char* name) {
+    ext2_node* dir = node_from_inode(inode);
+    struct ext2_fs* fs = dir->fs;
+    mutex_lock(&fs->lock);
+
+    uint32_t ino;
+    int rc = find_entry(dir, name, &ino, 0);
+    struct inode* child = IS_OK(rc) ? get_inode(fs, ino) : ERR_PTR(rc);
+    if (IS_ERR(child))
+        goto done;
+    rc = remove_entry(dir, name);
+    if (IS_ERR(rc)) {
+        inode_unref(child);
+        child = ERR_PTR(rc);
+        goto done;
+    }
+
+    ext2_node* child_node = node_from_inode(child);
+    adjust_links(child_node, -1);
+    if (S_ISDIR(child->mode) && child_node->raw.i_links_count <= 1) {
+        // Only the "." entry is left, so the directory is removed.
+        // Its ".." entry no longer refers to the parent.
+        adjust_links(child_node, -child_node->raw.i_links_count);
+        adjust_links(dir, -1);
+        rc = write_inode(dir);
+        if (IS_ERR(rc))
+            kprintf("ext2: failed to update inode %u (error %d)\n", dir->ino,
+                    rc);
+    }
+    rc = write_inode(child_node);
+    if (IS_ERR(rc))
+        kprintf("ext2: failed to update inode %u (error %d)\n", ino, rc);
+
+done:
+    mutex_unlock(&fs->lock);
+    inode_unref(inode);
+    return child;
+}
+
+static int ext2_stat(struct inode* inode, struct kstat* buf) {
+    ext2_node* node = node_from_inode(inode);
+    struct ext2_fs* fs = node->fs;
+    mutex_lock(&fs->lock);
+    buf->st_ino = node->ino;
+    buf->st_size = file_size(node);
+    buf->st_blksize = fs->block_size;
+    buf->st_blocks = node->raw.i_blocks;
+    buf->st_atim = (struct timespec){.tv_sec = node->raw.i_atime};
+    buf->st_mtim = (struct timespec){.tv_sec = node->raw.i_mtime};
+    buf->st_ctim = (struct timespec){.tv_sec = node->raw.i_ctime};
+    mutex_unlock(&fs->lock);
+    inode_unref(inode);
+    return 0;
+}
+
+static void readahead(ext2_node* node, uint32_t index, uint32_t block) {
+    bool sequential = index == 0 || index == node->next_read_block;
+    node->next_read_block = index + 1;
+    if (!sequential) {
+        node->readahead_end = 0;
+        return;
+    }
+    if (index < node->readahead_end)
+        return;
+
+    struct ext2_fs* fs = node->fs;
+    uint64_t num_blocks = size_in_blocks(fs, file_size(node)) - index;
+    num_blocks = MIN(num_blocks, READAHEAD_BLOCKS);
+
+    // Read ahead the following blocks as long as they are contiguous on
+    // the device, so that they are read with a single request.
+    size_t n = 1;
+    for (; n < num_blocks; ++n) {
+        uint32_t next_block;
+        if (IS_ERR(map_block(node, index + n, false, &next_block)) ||
+            next_block != block + n)
+            break;
+    }
+    node->readahead_end = index + n;
+    buffer_readahead(fs->block_device, block, n, fs->block_size);
+}
+
+static ssize_t read_locked(ext2_node* node, unsigned char* dest, size_t count,
+                           uint64_t offset) {
+    uint64_t size = file_size(node);
+    if (offset >= size)
+        return 0;
+    count = MIN(count, size - offset);
+
+    if (is_fast_symlink(node)) {
+        memcpy(dest, (unsigned char*)node->raw.i_block + offset, count);
+        return count;
+    }
+
+    struct ext2_fs* fs = node->fs;
+    size_t nread = 0;
+    while (nread < count) {
+        uint32_t index = offset >> fs->block_shift;
+        size_t block_offset = offset & (fs->block_size - 1);
+        size_t n = MIN(count - nread, fs->block_size - block_offset);
+        uint32_t block;
+        int rc = map_block(node, index, false, &block);
+        if (IS_ERR(rc))
+            return rc;
+        if (block) {
+            readahead(node, index, block);
+            struct buffer* buffer = read_block(fs, block);
+            if (IS_ERR(buffer))
+                return PTR_ERR(buffer);
+            memcpy(dest + nread, buffer->data + block_offset, n);
+            buffer_release(buffer);
+        } else {
+            memset(dest + nread, 0, n);
+        }
+        nread += n;
+        offset += n;
+    }
+    return nread;
+}
+
+static ssize_t ext2_pread(struct file* file, void* buffer, size_t count,
+                          uint64_t offset) {
+    ext2_node* node = node_from_inode(file->inode);
+    struct ext2_fs* fs = node->fs;
+    mutex_lock(&fs->lock);
+    ssize_t rc = read_locked(node, buffer, count, offset);
+    mutex_unlock(&fs->lock);
+    return rc;
+}
+
+static ssize_t write_locked(ext2_node* node, const unsigned char* src,
+                            size_t count, uint64_t offset) {
+    if (offset >= MAX_FILE_SIZE)
+        return -EFBIG;
+    count = MIN(count, MAX_FILE_SIZE - offset);
+
+    uint64_t size = file_size(node);
+    if (is_fast_symlink(node)) {
+        if (offset + count < sizeof(node->raw.i_block)) {
+            memcpy((unsigned char*)node->raw.i_block + offset, src, count);
+            set_file_size(node, MAX(size, offset + count));
+            touch(node);
+            int rc = write_inode(node);
+            return IS_ERR(rc) ? rc : (ssize_t)count;
+        }
+        // Only empty symbolic links can turn into ones stored in blocks.
+        if (size > 0)
+            return -EFBIG;
+    }
+
+    struct ext2_fs* fs = node->fs;
+    size_t nwritten = 0;
+    int rc = 0;
+    while (nwritten < count) {
+        uint32_t index = offset >> fs->block_shift;
+        size_t block_offset = offset & (fs->block_size - 1);
+        size_t n = MIN(count - nwritten, fs->block_size - block_offset);
+        uint32_t block;
+        rc = map_block(node, index, true, &block);
+        if (IS_ERR(rc))
+            break;
+        // Blocks that are overwritten entirely don't have to be read.
+        struct buffer* buffer =
+            n == fs->block_size
+                ? buffer_get(fs->block_device, block, fs->block_size)
+                : read_block(fs, block);
+        if (IS_ERR(buffer)) {
+            rc = PTR_ERR(buffer);
+            break;
+        }
+        memcpy(buffer->data + block_offset, src + nwritten, n);
+        buffer_mark_dirty(buffer);
+        buffer_release(buffer);
+        nwritten += n;
+        offset += n;
+    }
+
+    if (offset > size)
+        set_file_size(node, offset);
+    touch(node);
+    int write_rc = write_inode(node);
+    if (IS_OK(rc))
+        rc = write_rc;
+    if (nwritten > 0)
+        return nwritten;
+    return rc;
+}
+
+static ssize_t ext2_pwrite(struct file* file, const void* buffer, size_t count,
+                           uint64_t offset) {
+    ext2_node* node = node_from_inode(file->inode);
+    struct ext2_fs* fs = node->fs;
+    mutex_lock(&fs->lock);
+    ssize_t rc = write_locked(node, buffer, count, offset);
+    mutex_unlock(&fs->lock);
+    return rc;
+}
+
+static int truncate_locked(ext2_node* node, uint64_t length) {
+    if (length > MAX_FILE_SIZE)
+        return -EFBIG;
+    uint64_t size = file_size(node);
+
+    if (is_fast_symlink(node)) {
+        if (length >= sizeof(node->raw.i_block))
+            return -EFBIG;
+        if (length < size)
+            memset((unsigned char*)node->raw.i_block + length, 0,
+                   size - length);
+    } else if (length < size) {
+        struct ext2_fs* fs = node->fs;
+        size_t tail = length & (fs->block_size - 1);
+        if (tail) {
+            // Clear the rest of the last block, so that extending the file
+            // later exposes zeros.
+            uint32_t block;
+            int rc = map_block(node, length >> fs->block_shift, false, &block);
+            if (IS_ERR(rc))
+                return rc;
+            if (block) {
+                struct buffer* buffer = read_block(fs, block);
+                if (IS_ERR(buffer))
+                    return PTR_ERR(buffer);
+                memset(buffer->data + tail, 0, fs->block_size - tail);
+                buffer_mark_dirty(buffer);
+                buffer_release(buffer);
+            }
+        }
+        int rc = truncate_blocks(node, size_in_blocks(fs, length));
+        if (IS_ERR(rc))
+            return rc;
+    }
+
+    set_file_size(node, length);
+    touch(node);
+    return write_inode(node);
+}
+
+static int ext2_truncate(struct file* file, uint64_t length) {
+    ext2_node* node = node_from_inode(file->inode);
+    struct ext2_fs* fs = node->fs;
+    mutex_lock(&fs->lock);
+    int rc = truncate_locked(node, length);
+    mutex_unlock(&fs->lock);
+    return rc;
+}
+
+static int getdents_locked(struct file* file, getdents_callback_fn callback,
+                           void* ctx) {
+    ext2_node* node = node_from_inode(file->inode);
+    struct ext2_fs* fs = node->fs;
+    char name[EXT2_NAME_LEN + 1];
+
+    // file->offset is the byte position of the next entry.
+    while (file->offset < node->raw.i_size) {
+        uint32_t index = file->offset >> fs->block_shift;
+        size_t start = file->offset & (fs->block_size - 1);
+        uint64_t next_block_offset = (uint64_t)(index + 1) << fs->block_shift;
+        uint32_t block;
+        int rc = map_block(node, index, false, &block);
+        if (IS_ERR(rc))
+            return rc;
+        if (!block) {
+            file->offset = next_block_offset;
+            continue;
+        }
+        struct buffer* buffer = read_block(fs, block);
+        if (IS_ERR(buffer))
+            return PTR_ERR(buffer);
+
+        // The entry at the offset may have been merged into the previous
+        // one since the last call. Resume from the first entry that starts
+        // at or after the offset.
+        for (size_t pos = 0; pos < fs->block_size;) {
+            struct ext2_dir_entry* entry = entry_at(fs, buffer->data, pos);
+            if (!entry) {
+                buffer_release(buffer);
+                return -EIO;
+            }
+            size_t next_pos = pos + entry->rec_len;
+            if (pos < start || !entry->inode) {
+                pos = next_pos;
+                continue;
+            }
+            size_t name_len = entry_name_len(fs, entry);
+            memcpy(name, entry->name, name_len);
+            name[name_len] = 0;
+            // "." and ".." are resolved by the VFS, and are not listed
+            // in the other file systems either.
+            if (strcmp(name, ".") && strcmp(name, "..")) {
+                uint8_t type = fs->has_filetype
+                                   ? file_type_to_dirent_type(entry->file_type)
+                                   : DT_UNKNOWN;
+                if (!callback(name, type, ctx)) {
+                    buffer_release(buffer);
+                    return 0;
+                }
+            }
+            file->offset = ((uint64_t)index << fs->block_shift) + next_pos;
+            pos = next_pos;
+        }
+        buffer_release(buffer);
+        file->offset = next_block_offset;
+    }
+    return 0;
+}
+
+static int ext2_getdents(struct file* file, getdents_callback_fn callback,
+                         void* ctx) {
+    ext2_node* node = node_from_inode(file->inode);
+    struct ext2_fs* fs = node->fs;
+    mutex_lock(&fs->lock);
+    mutex_lock(&file->offset_lock);
+    int rc = getdents_locked(file, callback, ctx);
+    mutex_unlock(&file->offset_lock);
+    mutex_unlock(&fs->lock);
+    return rc;
+}
+
+static const struct file_ops dir_fops = {
+    .destroy_inode = ext2_destroy_inode,
+    .lookup_child = ext2_lookup_child,
+    .create_child = ext2_create_child,
+    .link_child = ext2_link_child,
+    .unlink_child = ext2_unlink_child,
+    .cache_lookups = true,
+    .stat = ext2_stat,
+    .getdents = ext2_getdents,
+};
+static const struct file_ops file_fops = {
+    .destroy_inode = ext2_destroy_inode,
+    .stat = ext2_stat,
+    .pread = ext2_pread,
+    .pwrite = ext2_pwrite,
+    .truncate = ext2_truncate,
+};
+static const struct file_ops special_fops = {
+    .destroy_inode = ext2_destroy_inode,
+    .stat = ext2_stat,
+};
+
+static void release_fs(struct ext2_fs* fs) {
+    if (fs->gdt_buffers) {
+        for (size_t i = 0; i < fs->num_gdt_blocks; ++i)
+            buffer_release(fs->gdt_buffers[i]);
+        kfree(fs->gdt_buffers);
+    }
+    buffer_release(fs->sb_buffer);
+    file_close(fs->device);
+    kfree(fs);
+}
+
+// Validates the superblock and fills in the geometry of the file system.
+static int read_superblock(struct ext2_fs* fs) {
+    struct ext2_superblock* sb = kmalloc(sizeof(struct ext2_superblock));
+    if (!sb)
+        return -ENOMEM;
+    ssize_t nread = file_pread(fs->device, sb, sizeof(struct ext2_superblock),
+                               EXT2_SUPERBLOCK_OFFSET);
+    int rc = 0;
+    if (IS_ERR(nread)) {
+        rc = nread;
+        goto done;
+    }
+    if ((size_t)nread < sizeof(struct ext2_superblock) ||
+        sb->s_magic != EXT2_SUPER_MAGIC) {
+        rc = -EINVAL;
+        goto done;
+    }
+
+    if (sb->s_log_block_size > 2) {
+        kprintf("ext2: unsupported block size %u\n",
+                1024u << sb->s_log_block_size);
+        rc = -EINVAL;
+        goto done;
+    }
+    fs->block_shift = 10 + sb->s_log_block_size;
+    fs->block_size = (size_t)1 << fs->block_shift;
+
+    if (sb->s_rev_level == EXT2_GOOD_OLD_REV) {
+        fs->inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+        fs->first_ino = EXT2_GOOD_OLD_FIRST_INO;
+    } else {
+        fs->inode_size = sb->s_inode_size;
+        fs->first_ino = sb->s_first_ino;
+        // Compatible features can be ignored. Incompatible and read-only
+        // compatible ones have to be understood to write to the file system.
+        uint32_t incompat =
+            sb->s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_FILETYPE;
+        uint32_t ro_compat =
+            sb->s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER |
+                                        EXT2_FEATURE_RO_COMPAT_LARGE_FILE);
+        if (incompat || ro_compat) {
+            kprintf("ext2: unsupported features (incompat %#x, "
+                    "ro_compat %#x)\n",
+                    incompat, ro_compat);
+            rc = -EINVAL;
+            goto done;
+        }
+        fs->has_filetype =
+            sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE;
+    }
+
+    if (fs->inode_size < sizeof(struct ext2_inode) ||
+        fs->inode_size > fs->block_size ||
+        (fs->inode_size & (fs->inode_size - 1)) ||
+        sb->s_blocks_per_group == 0 ||
+        sb->s_blocks_per_group > fs->block_size * 8 ||
+        sb->s_inodes_per_group == 0 ||
+        sb->s_inodes_per_group > fs->block_size * 8 ||
+        sb->s_first_data_block >= sb->s_blocks_count) {
+        rc = -EINVAL;
+        goto done;
+    }
+    fs->num_groups = DIV_CEIL(sb->s_blocks_count - sb->s_first_data_block,
+                              sb->s_blocks_per_group);
+
+done:
+    kfree(sb);
+    return rc;
+}
+
+static int load_metadata(struct ext2_fs* fs) {
+    struct buffer* buffer =
+        buffer_read(fs->block_device,
+                    EXT2_SUPERBLOCK_OFFSET >> fs->block_shift, fs->block_size);
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+    fs->sb_buffer = buffer;
+    fs->sb = (struct ext2_superblock*)(buffer->data + (EXT2_SUPERBLOCK_OFFSET &
+                                                       (fs->block_size - 1)));
+
+    fs->num_gdt_blocks = DIV_CEIL(fs->num_groups, GROUP_DESCS_PER_BLOCK(fs));
+    fs->gdt_buffers = kmalloc(fs->num_gdt_blocks * sizeof(struct buffer*));
+    if (!fs->gdt_buffers)
+        return -ENOMEM;
+    for (size_t i = 0; i < fs->num_gdt_blocks; ++i)
+        fs->gdt_buffers[i] = NULL;
+    // The group descriptor table follows the block with the superblock.
+    for (size_t i = 0; i < fs->num_gdt_blocks; ++i) {
+        buffer = read_block(fs, fs->sb->s_first_data_block + 1 + i);
+        if (IS_ERR(buffer))
+            return PTR_ERR(buffer);
+        fs->gdt_buffers[i] = buffer;
+    }
+    return 0;
+}
+
+static struct inode* ext2_mount(const char* source) {
+    if (!source)
+        return ERR_PTR(-EINVAL);
+
+    struct ext2_fs* fs = kmalloc(sizeof(struct ext2_fs));
+    if (!fs)
+        return ERR_PTR(-ENOMEM);
+    *fs = (struct ext2_fs){0};
+
+    struct file* device = vfs_open(source, O_RDWR, 0);
+    if (IS_ERR(device)) {
+        kfree(fs);
+        return ERR_CAST(device);
+    }
+    fs->device = device;
+    fs->block_device = block_device_from_inode(device->inode);
+    fs->dev = device->inode->rdev;
+
+    int rc = 0;
+    if (!fs->block_device) {
+        rc = -ENOTBLK;
+        goto fail;
+    }
+
+    mutex_lock(&mount_lock);
+    for (struct ext2_fs* it = mounted_fs; it; it = it->next) {
+        if (it->device->inode == device->inode) {
+            // The in-memory inodes of the two mounts would go out of sync.
+            mutex_unlock(&mount_lock);
+            rc = -EBUSY;
+            goto fail;
+        }
+    }
+    rc = read_superblock(fs);
+    if (IS_OK(rc))
+        rc = load_metadata(fs);
+    if (IS_ERR(rc)) {
+        mutex_unlock(&mount_lock);
+        goto fail;
+    }
+
+    mutex_lock(&fs->lock);
+    struct inode* root = get_inode(fs, EXT2_ROOT_INO);
+    if (IS_OK(root) && !S_ISDIR(root->mode)) {
+        inode_unref(root);
+        root = ERR_PTR(-EIO);
+    }
+    if (IS_ERR(root)) {
+        mutex_unlock(&fs->lock);
+        mutex_unlock(&mount_lock);
+        rc = PTR_ERR(root);
+        goto fail;
+    }
+    ++fs->sb->s_mnt_count;
+    fs->sb->s_mtime = now();
+    dirty_superblock(fs);
+    mutex_unlock(&fs->lock);
+
+    fs->next = mounted_fs;
+    mounted_fs = fs;
+    mutex_unlock(&mount_lock);
+
+    kprintf("ext2: mounted %s (%u blocks of %u bytes, %u inodes)\n", source,
+            fs->sb->s_blocks_count, fs->block_size, fs->sb->s_inodes_count);
+    return root;
+
+fail:
+    release_fs(fs);
+    return ERR_PTR(rc);
+}
+
+void ext2_init(void) {
+    static struct file_system fs = {
+        .name = "ext2",
+        .mount = ext2_mount,
+    };
+    ASSERT_OK(vfs_register_file_system(&fs));
+}
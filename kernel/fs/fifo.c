@@ -1,20 +1,48 @@
 #include "fs.h"
 #include <kernel/api/fcntl.h>
 #include <kernel/api/signal.h>
-#include <kernel/api/sys/limits.h>
 #include <kernel/api/sys/poll.h>
-#include <kernel/containers/ring_buf.h>
 #include <kernel/panic.h>
 #include <kernel/task.h>
 
+// A range of bytes in a physical page
+struct pipe_buf {
+    uintptr_t page;
+    size_t offset;
+    size_t len;
+
+    // The page is shared with a page cache, user memory or another pipe, so
+    // the buffer must not be appended to.
+    bool loaned;
+};
+
+#define PIPE_NUM_BUFS 16
+
 struct fifo {
     struct inode inode;
-    struct ring_buf buf;
+
+    // Ring of buffers in the order of the data
+    struct pipe_buf bufs[PIPE_NUM_BUFS];
+    size_t head;
+    size_t num_bufs;
+
     struct mutex lock;
+
+    // Set while fifo_splice_to writes out the data at the head with the lock
+    // dropped. Other readers wait until it is cleared, so that the data is
+    // consumed only once and in order.
+    bool splicing;
+
     atomic_size_t num_readers;
     atomic_size_t num_writers;
 };
 
+static const struct file_ops fifo_fops;
+
+bool file_is_fifo(const struct file* file) {
+    return file->inode->fops == &fifo_fops;
+}
+
 static struct fifo* fifo_from_inode(struct inode* inode) {
     return CONTAINER_OF(inode, struct fifo, inode);
 }
@@ -23,9 +51,48 @@ static struct fifo* fifo_from_file(struct file* file) {
     return fifo_from_inode(file->inode);
 }
 
+static struct pipe_buf* nth_buf(struct fifo* fifo, size_t n) {
+    ASSERT(n < fifo->num_bufs);
+    return fifo->bufs + (fifo->head + n) % PIPE_NUM_BUFS;
+}
+
+static bool is_empty(const struct fifo* fifo) { return fifo->num_bufs == 0; }
+
+static bool has_free_buf(const struct fifo* fifo) {
+    return fifo->num_bufs < PIPE_NUM_BUFS;
+}
+
+static bool can_append(const struct pipe_buf* buf) {
+    return !buf->loaned && buf->offset + buf->len < PAGE_SIZE;
+}
+
+static bool is_full(struct fifo* fifo) {
+    if (has_free_buf(fifo))
+        return false;
+    return !can_append(nth_buf(fifo, fifo->num_bufs - 1));
+}
+
+static struct pipe_buf* push_buf(struct fifo* fifo) {
+    ASSERT(has_free_buf(fifo));
+    return nth_buf(fifo, fifo->num_bufs++);
+}
+
+// Removes the first buffer without dropping its reference to the page.
+static void remove_first_buf(struct fifo* fifo) {
+    ASSERT(!is_empty(fifo));
+    fifo->head = (fifo->head + 1) % PIPE_NUM_BUFS;
+    --fifo->num_bufs;
+}
+
+static void pop_buf(struct fifo* fifo) {
+    page_unref(nth_buf(fifo, 0)->page);
+    remove_first_buf(fifo);
+}
+
 static void fifo_destroy_inode(struct inode* inode) {
     struct fifo* fifo = fifo_from_inode(inode);
-    ring_buf_destroy(&fifo->buf);
+    while (!is_empty(fifo))
+        pop_buf(fifo);
     kfree(fifo);
 }
 
@@ -55,6 +122,7 @@ static int fifo_open(struct file* file, mode_t mode) {
     default:
         return -EINVAL;
     }
+    waitqueue_wake_all(&fifo->inode.waitqueue);
 
     if (file->inode->dev == 0) {
         // This is a fifo created by pipe syscall.
@@ -80,83 +148,184 @@ static int fifo_close(struct file* file) {
     default:
         UNREACHABLE();
     }
+    waitqueue_wake_all(&fifo->inode.waitqueue);
     return 0;
 }
 
+// Blocks until the condition is met. SPLICE_F_NONBLOCK in flags makes the
+// call non-blocking in addition to O_NONBLOCK of the file.
+static int wait_for(struct file* file, bool (*unblock)(struct file*),
+                    int flags) {
+    if ((flags & SPLICE_F_NONBLOCK) && !unblock(file))
+        return -EAGAIN;
+    return file_block(file, unblock, 0);
+}
+
+static int broken_pipe(void) {
+    int rc = task_send_signal(current->tid, SIGPIPE, 0);
+    if (IS_ERR(rc))
+        return rc;
+    return -EPIPE;
+}
+
 static bool unblock_read(struct file* file) {
-    const struct fifo* fifo = fifo_from_file(file);
-    return fifo->num_writers == 0 || !ring_buf_is_empty(&fifo->buf);
+    struct fifo* fifo = fifo_from_file(file);
+    return !fifo->splicing && (fifo->num_writers == 0 || !is_empty(fifo));
 }
 
-static ssize_t fifo_pread(struct file* file, void* buffer, size_t count,
-                          uint64_t offset) {
-    (void)offset;
+static bool unblock_write(struct file* file) {
+    struct fifo* fifo = fifo_from_file(file);
+    return fifo->num_readers == 0 || !is_full(fifo);
+}
 
+// Unlike unblock_write, requires a free buffer rather than free space in
+// the last buffer, as splicing never appends to existing buffers.
+static bool unblock_splice_write(struct file* file) {
     struct fifo* fifo = fifo_from_file(file);
-    struct ring_buf* buf = &fifo->buf;
+    return fifo->num_readers == 0 || has_free_buf(fifo);
+}
 
+// Waits until the fifo has data, and locks it.
+// Returns 1 if the fifo has data, or 0 if the fifo is empty and has no
+// writers.
+static int lock_for_read(struct file* file, int flags) {
+    struct fifo* fifo = fifo_from_file(file);
     for (;;) {
-        int rc = file_block(file, unblock_read, 0);
+        int rc = wait_for(file, unblock_read, flags);
         if (IS_ERR(rc))
             return rc;
 
         mutex_lock(&fifo->lock);
-        if (!ring_buf_is_empty(buf)) {
-            ssize_t nread = ring_buf_read(buf, buffer, count);
-            mutex_unlock(&fifo->lock);
-            return nread;
-        }
+        if (!fifo->splicing && !is_empty(fifo))
+            return 1;
 
-        bool no_writer = fifo->num_writers == 0;
+        bool no_writer = !fifo->splicing && fifo->num_writers == 0;
         mutex_unlock(&fifo->lock);
         if (no_writer)
             return 0;
     }
 }
 
-static bool unblock_write(struct file* file) {
-    const struct fifo* fifo = fifo_from_file(file);
-    return fifo->num_readers == 0 || !ring_buf_is_full(&fifo->buf);
-}
-
-static ssize_t fifo_pwrite(struct file* file, const void* buffer, size_t count,
-                           uint64_t offset) {
-    (void)offset;
-
+// Waits until the fifo can accept data, and locks it.
+static int lock_for_write(struct file* file, bool (*unblock)(struct file*),
+                          int flags) {
     struct fifo* fifo = fifo_from_file(file);
-    struct ring_buf* buf = &fifo->buf;
-
     for (;;) {
-        int rc = file_block(file, unblock_write, 0);
+        int rc = wait_for(file, unblock, flags);
         if (IS_ERR(rc))
             return rc;
 
         mutex_lock(&fifo->lock);
         if (fifo->num_readers == 0) {
             mutex_unlock(&fifo->lock);
-            int rc = task_send_signal(current->tid, SIGPIPE, 0);
-            if (IS_ERR(rc))
-                return rc;
-            return -EPIPE;
+            return broken_pipe();
         }
+        if (unblock(file))
+            return 0;
+        mutex_unlock(&fifo->lock);
+    }
+}
 
-        if (ring_buf_is_full(buf)) {
-            mutex_unlock(&fifo->lock);
-            continue;
+static void unlock_and_wake(struct fifo* fifo) {
+    mutex_unlock(&fifo->lock);
+    waitqueue_wake_all(&fifo->inode.waitqueue);
+}
+
+static ssize_t read_bufs(struct fifo* fifo, void* buffer, size_t count) {
+    unsigned char* dest = buffer;
+    size_t nread = 0;
+    int rc = 0;
+    while (nread < count && !is_empty(fifo)) {
+        struct pipe_buf* buf = nth_buf(fifo, 0);
+        size_t n = MIN(buf->len, count - nread);
+        rc = page_copy_to_buffer(buf->page, buf->offset, dest + nread, n);
+        if (IS_ERR(rc))
+            break;
+        buf->offset += n;
+        buf->len -= n;
+        nread += n;
+        if (buf->len == 0)
+            pop_buf(fifo);
+    }
+    if (nread == 0 && IS_ERR(rc))
+        return rc;
+    return nread;
+}
+
+static ssize_t write_bufs(struct fifo* fifo, const void* buffer,
+                          size_t count) {
+    const unsigned char* src = buffer;
+    size_t nwritten = 0;
+    int rc = 0;
+    while (nwritten < count) {
+        struct pipe_buf* buf =
+            is_empty(fifo) ? NULL : nth_buf(fifo, fifo->num_bufs - 1);
+        bool new_buf = !buf || !can_append(buf);
+        if (new_buf) {
+            if (!has_free_buf(fifo))
+                break;
+            uintptr_t page = page_alloc();
+            if (IS_ERR(page)) {
+                rc = page;
+                break;
+            }
+            buf = push_buf(fifo);
+            *buf = (struct pipe_buf){.page = page};
         }
 
-        ssize_t nwritten = ring_buf_write(buf, buffer, count);
-        mutex_unlock(&fifo->lock);
-        return nwritten;
+        size_t end = buf->offset + buf->len;
+        size_t n = MIN(PAGE_SIZE - end, count - nwritten);
+        rc = page_copy_from_buffer(buf->page, end, src + nwritten, n);
+        if (IS_ERR(rc)) {
+            if (new_buf) {
+                page_unref(buf->page);
+                --fifo->num_bufs;
+            }
+            break;
+        }
+        buf->len += n;
+        nwritten += n;
     }
+    if (nwritten == 0 && IS_ERR(rc))
+        return rc;
+    return nwritten;
+}
+
+static ssize_t pipe_read(struct file* file, void* buffer, size_t count,
+                         int flags) {
+    int rc = lock_for_read(file, flags);
+    if (rc <= 0)
+        return rc;
+    struct fifo* fifo = fifo_from_file(file);
+    ssize_t nread = read_bufs(fifo, buffer, count);
+    unlock_and_wake(fifo);
+    return nread;
+}
+
+static ssize_t fifo_pread(struct file* file, void* buffer, size_t count,
+                          uint64_t offset) {
+    (void)offset;
+    return pipe_read(file, buffer, count, 0);
+}
+
+static ssize_t fifo_pwrite(struct file* file, const void* buffer, size_t count,
+                           uint64_t offset) {
+    (void)offset;
+    int rc = lock_for_write(file, unblock_write, 0);
+    if (IS_ERR(rc))
+        return rc;
+    struct fifo* fifo = fifo_from_file(file);
+    ssize_t nwritten = write_bufs(fifo, buffer, count);
+    unlock_and_wake(fifo);
+    return nwritten;
 }
 
 static short fifo_poll(struct file* file, short events) {
     short revents = 0;
-    const struct fifo* fifo = fifo_from_file(file);
-    if ((events & POLLIN) && !ring_buf_is_empty(&fifo->buf))
+    struct fifo* fifo = fifo_from_file(file);
+    if ((events & POLLIN) && !is_empty(fifo))
         revents |= POLLIN;
-    if ((events & POLLOUT) && !ring_buf_is_full(&fifo->buf))
+    if ((events & POLLOUT) && !is_full(fifo))
         revents |= POLLOUT;
     switch (file->flags & O_ACCMODE) {
     case O_RDONLY:
@@ -173,28 +342,277 @@ static short fifo_poll(struct file* file, short events) {
     return revents;
 }
 
+// Reads the file into a new page. Used for files that have no page cache.
+static ssize_t splice_copy_page(struct fifo* fifo, struct file* in,
+                                uint64_t offset, size_t count) {
+    count = MIN(count, PAGE_SIZE);
+    unsigned char* bounce = kmalloc(count);
+    if (!bounce)
+        return -ENOMEM;
+
+    ssize_t nread = file_pread(in, bounce, count, offset);
+    if (IS_ERR(nread) || nread == 0)
+        goto done;
+
+    uintptr_t page = page_alloc();
+    if (IS_ERR(page)) {
+        nread = page;
+        goto done;
+    }
+    ASSERT_OK(page_copy_from_buffer(page, 0, bounce, nread));
+    *push_buf(fifo) = (struct pipe_buf){.page = page, .len = nread};
+
+done:
+    kfree(bounce);
+    return nread;
+}
+
+ssize_t fifo_splice_from(struct file* pipe, struct file* in, uint64_t offset,
+                         size_t count, int flags) {
+    if ((pipe->flags & O_ACCMODE) != O_WRONLY ||
+        (in->flags & O_ACCMODE) == O_WRONLY)
+        return -EBADF;
+    if (S_ISDIR(in->inode->mode))
+        return -EISDIR;
+
+    int rc = lock_for_write(pipe, unblock_splice_write, flags);
+    if (IS_ERR(rc))
+        return rc;
+
+    struct fifo* fifo = fifo_from_file(pipe);
+    struct page_cache* cache = in->inode->page_cache;
+    size_t nspliced = 0;
+    if (cache) {
+        // Loan the pages of the page cache to the pipe
+        while (nspliced < count && has_free_buf(fifo)) {
+            uint64_t pos = offset + nspliced;
+            size_t n = count - nspliced;
+            uintptr_t page = page_cache_loan_page(cache, pos, &n);
+            if (IS_ERR(page)) {
+                rc = page;
+                break;
+            }
+            if (n == 0)
+                break;
+            *push_buf(fifo) = (struct pipe_buf){
+                .page = page,
+                .offset = pos % PAGE_SIZE,
+                .len = n,
+                .loaned = true,
+            };
+            nspliced += n;
+        }
+    } else {
+        // Read only once, as another read may block even though some data
+        // has already been spliced.
+        ssize_t nread = splice_copy_page(fifo, in, offset, count);
+        if (IS_ERR(nread))
+            rc = nread;
+        else
+            nspliced = nread;
+    }
+    unlock_and_wake(fifo);
+
+    if (nspliced == 0 && IS_ERR(rc))
+        return rc;
+    return nspliced;
+}
+
+ssize_t fifo_splice_to(struct file* pipe, struct file* out, uint64_t offset,
+                       size_t count, int flags) {
+    if ((pipe->flags & O_ACCMODE) != O_RDONLY ||
+        (out->flags & O_ACCMODE) == O_RDONLY)
+        return -EBADF;
+
+    unsigned char* bounce = kmalloc(PAGE_SIZE);
+    if (!bounce)
+        return -ENOMEM;
+
+    int rc = lock_for_read(pipe, flags);
+    if (rc <= 0) {
+        kfree(bounce);
+        return rc;
+    }
+
+    // The write may block or fault, so the fifo is unlocked while writing.
+    // The head buffer stays in place in the meantime, as other readers wait
+    // while splicing is set, and writers only append.
+    struct fifo* fifo = fifo_from_file(pipe);
+    fifo->splicing = true;
+    size_t nspliced = 0;
+    while (nspliced < count && !is_empty(fifo)) {
+        struct pipe_buf buf = *nth_buf(fifo, 0);
+        size_t n = MIN(buf.len, count - nspliced);
+        mutex_unlock(&fifo->lock);
+
+        ASSERT_OK(page_copy_to_buffer(buf.page, buf.offset, bounce, n));
+        ssize_t nwritten = file_pwrite(out, bounce, n, offset + nspliced);
+
+        mutex_lock(&fifo->lock);
+        if (IS_ERR(nwritten)) {
+            rc = nwritten;
+            break;
+        }
+        struct pipe_buf* head = nth_buf(fifo, 0);
+        head->offset += nwritten;
+        head->len -= nwritten;
+        nspliced += nwritten;
+        if (head->len == 0)
+            pop_buf(fifo);
+        if ((size_t)nwritten < n)
+            break;
+    }
+    fifo->splicing = false;
+    unlock_and_wake(fifo);
+    kfree(bounce);
+
+    if (nspliced == 0 && IS_ERR(rc))
+        return rc;
+    return nspliced;
+}
+
+// Moves or copies buffers from one fifo to another. Only references to the
+// pages are passed, never the contents.
+static ssize_t transfer(struct file* in, struct file* out, size_t count,
+                        int flags, bool move) {
+    if ((in->flags & O_ACCMODE) != O_RDONLY ||
+        (out->flags & O_ACCMODE) != O_WRONLY)
+        return -EBADF;
+
+    struct fifo* src = fifo_from_file(in);
+    struct fifo* dest = fifo_from_file(out);
+    if (src == dest)
+        return -EINVAL;
+
+    // Lock the fifos in a consistent order to avoid deadlocks.
+    struct fifo* first = src < dest ? src : dest;
+    struct fifo* second = src < dest ? dest : src;
+
+    for (;;) {
+        int rc = wait_for(in, unblock_read, flags);
+        if (IS_ERR(rc))
+            return rc;
+        rc = wait_for(out, unblock_splice_write, flags);
+        if (IS_ERR(rc))
+            return rc;
+
+        mutex_lock(&first->lock);
+        mutex_lock(&second->lock);
+        if (dest->num_readers == 0) {
+            mutex_unlock(&second->lock);
+            mutex_unlock(&first->lock);
+            return broken_pipe();
+        }
+        if (src->splicing || is_empty(src) || !has_free_buf(dest)) {
+            bool no_writer =
+                !src->splicing && is_empty(src) && src->num_writers == 0;
+            mutex_unlock(&second->lock);
+            mutex_unlock(&first->lock);
+            if (no_writer)
+                return 0;
+            continue;
+        }
+
+        size_t ntransferred = 0;
+        size_t i = 0;
+        while (ntransferred < count && i < src->num_bufs &&
+               has_free_buf(dest)) {
+            struct pipe_buf* buf = nth_buf(src, i);
+            size_t n = MIN(buf->len, count - ntransferred);
+            if (move && n == buf->len) {
+                // Hand over the reference of the whole buffer
+                *push_buf(dest) = *buf;
+                remove_first_buf(src);
+            } else {
+                // Both fifos refer to the page from now on
+                page_ref(buf->page);
+                buf->loaned = true;
+                *push_buf(dest) = (struct pipe_buf){
+                    .page = buf->page,
+                    .offset = buf->offset,
+                    .len = n,
+                    .loaned = true,
+                };
+                if (move) {
+                    buf->offset += n;
+                    buf->len -= n;
+                } else {
+                    ++i;
+                }
+            }
+            ntransferred += n;
+        }
+
+        mutex_unlock(&second->lock);
+        mutex_unlock(&first->lock);
+        waitqueue_wake_all(&src->inode.waitqueue);
+        waitqueue_wake_all(&dest->inode.waitqueue);
+        return ntransferred;
+    }
+}
+
+ssize_t fifo_splice(struct file* in, struct file* out, size_t count,
+                    int flags) {
+    return transfer(in, out, count, flags, true);
+}
+
+ssize_t fifo_tee(struct file* in, struct file* out, size_t count, int flags) {
+    return transfer(in, out, count, flags, false);
+}
+
+ssize_t fifo_vmsplice(struct file* pipe, void* user_buf, size_t count,
+                      int flags) {
+    if ((pipe->flags & O_ACCMODE) == O_RDONLY)
+        return pipe_read(pipe, user_buf, count, flags);
+
+    int rc = lock_for_write(pipe, unblock_splice_write, flags);
+    if (IS_ERR(rc))
+        return rc;
+
+    // Loan the pages of the user memory to the pipe
+    struct fifo* fifo = fifo_from_file(pipe);
+    size_t nspliced = 0;
+    while (nspliced < count && has_free_buf(fifo)) {
+        uintptr_t addr = (uintptr_t)user_buf + nspliced;
+        size_t page_offset = addr % PAGE_SIZE;
+        size_t n = MIN(PAGE_SIZE - page_offset, count - nspliced);
+        uintptr_t page = vm_loan_user_page((void*)addr);
+        if (IS_ERR(page)) {
+            rc = page;
+            break;
+        }
+        *push_buf(fifo) = (struct pipe_buf){
+            .page = page,
+            .offset = page_offset,
+            .len = n,
+            .loaned = true,
+        };
+        nspliced += n;
+    }
+    unlock_and_wake(fifo);
+
+    if (nspliced == 0 && IS_ERR(rc))
+        return rc;
+    return nspliced;
+}
+
+static const struct file_ops fifo_fops = {
+    .destroy_inode = fifo_destroy_inode,
+    .open = fifo_open,
+    .close = fifo_close,
+    .pread = fifo_pread,
+    .pwrite = fifo_pwrite,
+    .poll = fifo_poll,
+};
+
 struct inode* fifo_create(void) {
     struct fifo* fifo = kmalloc(sizeof(struct fifo));
     if (!fifo)
         return ERR_PTR(-ENOMEM);
     *fifo = (struct fifo){0};
 
-    int rc = ring_buf_init(&fifo->buf, PIPE_BUF);
-    if (IS_ERR(rc)) {
-        kfree(fifo);
-        return ERR_PTR(rc);
-    }
-
     struct inode* inode = &fifo->inode;
-    static const struct file_ops fops = {
-        .destroy_inode = fifo_destroy_inode,
-        .open = fifo_open,
-        .close = fifo_close,
-        .pread = fifo_pread,
-        .pwrite = fifo_pwrite,
-        .poll = fifo_poll,
-    };
-    inode->fops = &fops;
+    inode->fops = &fifo_fops;
     inode->mode = S_IFIFO;
     inode->ref_count = 1;
 
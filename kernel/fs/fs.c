@@ -1,3 +1,4 @@
+#include "dcache.h"
 #include "fs.h"
 #include <kernel/api/dirent.h>
 #include <kernel/api/fcntl.h>
@@ -38,7 +39,24 @@ struct inode* inode_lookup_child(struct inode* inode, const char* name) {
         inode_unref(inode);
         return ERR_PTR(-ENOTDIR);
     }
-    return inode->fops->lookup_child(inode, name);
+    if (!inode->fops->cache_lookups)
+        return inode->fops->lookup_child(inode, name);
+
+    struct inode* child = dcache_lookup(inode, name);
+    if (child) {
+        inode_unref(inode);
+        return child;
+    }
+
+    unsigned token = dcache_begin_insert(inode, name);
+    inode_ref(inode);
+    child = inode->fops->lookup_child(inode, name);
+    if (IS_OK(child))
+        dcache_insert(inode, name, child, token);
+    else if (PTR_ERR(child) == -ENOENT)
+        dcache_insert(inode, name, NULL, token);
+    inode_unref(inode);
+    return child;
 }
 
 struct inode* inode_create_child(struct inode* inode, const char* name,
@@ -48,7 +66,11 @@ struct inode* inode_create_child(struct inode* inode, const char* name,
         return ERR_PTR(-ENOTDIR);
     }
     ASSERT(mode & S_IFMT);
-    return inode->fops->create_child(inode, name, mode);
+    inode_ref(inode);
+    struct inode* child = inode->fops->create_child(inode, name, mode);
+    dcache_invalidate(inode, name);
+    inode_unref(inode);
+    return child;
 }
 
 int inode_link_child(struct inode* inode, const char* name,
@@ -63,7 +85,11 @@ int inode_link_child(struct inode* inode, const char* name,
         inode_unref(child);
         return -EXDEV;
     }
-    return inode->fops->link_child(inode, name, child);
+    inode_ref(inode);
+    int rc = inode->fops->link_child(inode, name, child);
+    dcache_invalidate(inode, name);
+    inode_unref(inode);
+    return rc;
 }
 
 int inode_unlink_child(struct inode* inode, const char* name) {
@@ -71,9 +97,15 @@ int inode_unlink_child(struct inode* inode, const char* name) {
         inode_unref(inode);
         return -ENOTDIR;
     }
+    inode_ref(inode);
     struct inode* child = inode->fops->unlink_child(inode, name);
+    dcache_invalidate(inode, name);
+    inode_unref(inode);
     if (IS_ERR(child))
         return PTR_ERR(child);
+    // The entries of a removed directory would keep it alive.
+    if (S_ISDIR(child->mode))
+        dcache_invalidate_dir(child);
     inode_unref(child);
     return 0;
 }
@@ -142,7 +174,7 @@ int inode_stat(struct inode* inode, struct kstat* buf) {
     return 0;
 }
 
-static bool inode_is_seekable(const struct inode* inode) {
+bool inode_is_seekable(const struct inode* inode) {
     switch (inode->mode & S_IFMT) {
     case S_IFREG:
     case S_IFBLK:
@@ -336,8 +368,16 @@ short file_poll(struct file* file, short events) {
     return revents;
 }
 
+struct waitqueue* file_get_waitqueue(struct file* file) {
+    struct inode* inode = file->inode;
+    if (inode->fops->get_waitqueue)
+        return inode->fops->get_waitqueue(file);
+    return &inode->waitqueue;
+}
+
 int file_block(struct file* file, bool (*unblock)(struct file*), int flags) {
     if ((file->flags & O_NONBLOCK) && !unblock(file))
         return -EAGAIN;
-    return sched_block((unblock_fn)unblock, file, flags);
+    return sched_block(file_get_waitqueue(file), (unblock_fn)unblock, file,
+                       flags);
 }
@@ -5,6 +5,7 @@
 #include <kernel/api/sys/types.h>
 #include <kernel/api/time.h>
 #include <kernel/lock.h>
+#include <kernel/sched.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 
@@ -51,6 +52,12 @@ struct file_ops {
     struct inode* (*create_child)(struct inode*, const char* name, mode_t mode);
     int (*link_child)(struct inode*, const char* name, struct inode* child);
     struct inode* (*unlink_child)(struct inode*, const char* name);
+
+    // Whether the results of lookup_child may be kept in the dentry cache.
+    // Only possible if the directory changes solely through the operations
+    // above.
+    bool cache_lookups;
+
     int (*open)(struct file*, mode_t mode);
     int (*stat)(struct inode*, struct kstat* buf);
 
@@ -63,6 +70,10 @@ struct file_ops {
     int (*ioctl)(struct file*, int request, void* user_argp);
     int (*getdents)(struct file*, getdents_callback_fn callback, void* ctx);
     short (*poll)(struct file*, short events);
+
+    // Returns the wait queue that is woken up when the file may have become
+    // ready. Defaults to the wait queue of the inode.
+    struct waitqueue* (*get_waitqueue)(struct file*);
 };
 
 struct inode {
@@ -73,12 +84,22 @@ struct inode {
     _Atomic(struct unix_socket*) bound_socket;
     mode_t mode;
     _Atomic(nlink_t) num_links;
+
+    // Whether a file system is mounted on this inode
+    atomic_bool is_mount_point;
+
+    // Contents of the file if the file system keeps them in a page cache.
+    // Allows mapping the file without going through the file operations.
+    struct page_cache* page_cache;
+
+    struct waitqueue waitqueue;
     atomic_size_t ref_count;
 };
 
 void inode_ref(struct inode*);
 void inode_unref(struct inode*);
 
+bool inode_is_seekable(const struct inode*);
 void inode_destroy(struct inode*);
 NODISCARD struct inode* inode_lookup_child(struct inode*, const char* name);
 NODISCARD struct inode* inode_create_child(struct inode*, const char* name,
@@ -106,7 +127,10 @@ NODISCARD loff_t file_seek(struct file*, loff_t offset, int whence);
 NODISCARD int file_ioctl(struct file*, int request, void* user_argp);
 NODISCARD int file_getdents(struct file*, getdents_callback_fn, void* ctx);
 NODISCARD short file_poll(struct file*, short events);
+struct waitqueue* file_get_waitqueue(struct file*);
 
+// Blocks the current task on the wait queue of the file until the unblock
+// function returns true. Returns -EAGAIN if the file is non-blocking.
 NODISCARD int file_block(struct file*, bool (*unblock)(struct file*),
                          int flags);
 
@@ -156,3 +180,30 @@ struct path* vfs_resolve_path_at(const struct path* base, const char* pathname,
                                  int flags);
 
 struct inode* fifo_create(void);
+bool file_is_fifo(const struct file*);
+
+// Transfer data between fifos and other files by passing references to the
+// pages that hold the data, copying only when the other file has no page
+// cache. SPLICE_F_NONBLOCK in flags makes the calls non-blocking.
+
+// Splices from the file at the offset into the fifo.
+NODISCARD ssize_t fifo_splice_from(struct file* pipe, struct file* in,
+                                   uint64_t offset, size_t count, int flags);
+
+// Splices from the fifo into the file at the offset.
+NODISCARD ssize_t fifo_splice_to(struct file* pipe, struct file* out,
+                                 uint64_t offset, size_t count, int flags);
+
+// Moves data from one fifo to another.
+NODISCARD ssize_t fifo_splice(struct file* in, struct file* out, size_t count,
+                              int flags);
+
+// Duplicates data of one fifo into another without consuming it.
+NODISCARD ssize_t fifo_tee(struct file* in, struct file* out, size_t count,
+                           int flags);
+
+// Splices the user memory into the fifo. The pages are shared with the fifo,
+// and private pages are made copy-on-write.
+// If the fifo is the read end, reads from the fifo into the user memory.
+NODISCARD ssize_t fifo_vmsplice(struct file* pipe, void* user_buf,
+                                size_t count, int flags);
@@ -159,6 +159,32 @@ static int populate_maps(struct file* file, struct vec* vec) {
     return ret;
 }
 
+static int populate_status(struct file* file, struct vec* vec) {
+    proc_pid_item_inode* node = item_from_file(file);
+    struct task* task = task_find_by_tid(node->pid);
+    if (!task)
+        return -ENOENT;
+
+    mutex_lock(&task->lock);
+    char comm[sizeof(task->comm)];
+    strlcpy(comm, task->comm, sizeof(task->comm));
+    pid_t tgid = task->tgid;
+    pid_t ppid = task->ppid;
+    struct vm* vm = task->vm;
+    size_t num_resident_pages = vm == kernel_vm ? 0 : vm->num_resident_pages;
+    mutex_unlock(&task->lock);
+    task_unref(task);
+
+    return vec_printf(vec,
+                      "Name:\t%s\n"
+                      "Tgid:\t%d\n"
+                      "Pid:\t%d\n"
+                      "PPid:\t%d\n"
+                      "VmRSS:\t%8u kB\n",
+                      comm, tgid, node->pid, ppid,
+                      num_resident_pages * PAGE_SIZE / 1024);
+}
+
 static int add_item(proc_dir_inode* parent, const proc_item_def* item_def,
                     pid_t pid) {
     proc_pid_item_inode* node = kmalloc(sizeof(proc_pid_item_inode));
@@ -188,6 +214,7 @@ static proc_item_def pid_items[] = {
     {"cwd", S_IFLNK, populate_cwd},
     {"environ", S_IFREG, populate_environ},
     {"maps", S_IFREG, populate_maps},
+    {"status", S_IFREG, populate_status},
 };
 
 struct inode* proc_pid_dir_inode_create(proc_dir_inode* parent, pid_t pid) {
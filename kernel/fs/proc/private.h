@@ -1,6 +1,6 @@
 #pragma once
 
-#include <kernel/fs/fs.h>
+#include <kernel/fs/dentry.h>
 
 struct vec;
 
@@ -23,7 +23,7 @@ extern const struct file_ops proc_item_fops;
 
 typedef struct {
     struct inode inode;
-    struct dentry* children;
+    struct dentry_dir children;
 } proc_dir_inode;
 
 static inline proc_dir_inode* proc_dir_from_inode(struct inode* inode) {
@@ -46,13 +46,13 @@ const struct file_ops proc_item_fops = {
 
 void proc_dir_destroy_inode(struct inode* inode) {
     proc_dir_inode* node = proc_dir_from_inode(inode);
-    dentry_clear(node->children);
+    dentry_clear(&node->children);
     kfree(node);
 }
 
 struct inode* proc_dir_lookup_child(struct inode* inode, const char* name) {
     proc_dir_inode* node = proc_dir_from_inode(inode);
-    struct inode* child = dentry_find(node->children, name);
+    struct inode* child = dentry_find(&node->children, name);
     inode_unref(inode);
     return child;
 }
@@ -61,7 +61,7 @@ int proc_dir_getdents(struct file* file, getdents_callback_fn callback,
                       void* ctx) {
     proc_dir_inode* node = proc_dir_from_inode(file->inode);
     mutex_lock(&file->offset_lock);
-    int rc = dentry_getdents(file, node->children, callback, ctx);
+    int rc = dentry_getdents(file, &node->children, callback, ctx);
     mutex_unlock(&file->offset_lock);
     return rc;
 }
@@ -110,6 +110,83 @@ static int populate_meminfo(struct file* file, struct vec* vec) {
                       stats.total_kibibytes, stats.free_kibibytes);
 }
 
+NODISCARD static int sprintf_u64(struct vec* vec, uint64_t value) {
+    // UINT64_MAX has 20 digits, so the value is printed in groups of 9.
+    uint32_t low;
+    uint32_t mid;
+    uint64_t q = divmodu64(value, 1000000000, &low);
+    if (q == 0)
+        return vec_printf(vec, "%u", low);
+    uint32_t high = divmodu64(q, 1000000000, &mid);
+    if (high == 0)
+        return vec_printf(vec, "%u%09u", mid, low);
+    return vec_printf(vec, "%u%09u%09u", high, mid, low);
+}
+
+static int populate_lockstat(struct file* file, struct vec* vec) {
+    (void)file;
+    size_t n = lockstat_num_entries;
+    for (size_t i = 0; i < n; ++i) {
+        const struct lockstat_entry* entry = lockstat_entries + i;
+        int rc;
+        if (entry->spinlock) {
+            // The statistics are updated while holding the lock, so take it
+            // to read them consistently.
+            struct spinlock* s = entry->spinlock;
+            spinlock_lock(s);
+            uint64_t num_acquisitions = s->num_acquisitions;
+            uint64_t num_contended = s->num_contended;
+            uint64_t spin_cycles = s->spin_cycles;
+            spinlock_unlock(s);
+
+            rc = vec_printf(vec, "%s: acquisitions=", entry->name);
+            if (IS_ERR(rc))
+                return rc;
+            rc = sprintf_u64(vec, num_acquisitions);
+            if (IS_ERR(rc))
+                return rc;
+            rc = vec_printf(vec, " contended=");
+            if (IS_ERR(rc))
+                return rc;
+            rc = sprintf_u64(vec, num_contended);
+            if (IS_ERR(rc))
+                return rc;
+            rc = vec_printf(vec, " spin_cycles=");
+            if (IS_ERR(rc))
+                return rc;
+            rc = sprintf_u64(vec, spin_cycles);
+        } else {
+            const struct mutex* m = entry->mutex;
+            rc = vec_printf(vec, "%s: contended=%u spun=%u slept=%u",
+                            entry->name, m->num_contended, m->num_spun,
+                            m->num_slept);
+        }
+        if (IS_ERR(rc))
+            return rc;
+        rc = vec_append(vec, "\n", 1);
+        if (IS_ERR(rc))
+            return rc;
+    }
+    return 0;
+}
+
+static int print_slab_stats(const struct slab_stats* stats, void* ctx) {
+    return vec_printf(ctx,
+                      "%s: obj_size=%u objs_per_slab=%u slabs=%u objs=%u "
+                      "free=%u depot=%u allocs=%u slow_allocs=%u frees=%u "
+                      "slow_frees=%u\n",
+                      stats->name, stats->obj_size, stats->objs_per_slab,
+                      stats->num_slabs, stats->num_objs, stats->num_free_objs,
+                      stats->num_depot_objs, stats->num_allocs,
+                      stats->num_slow_allocs, stats->num_frees,
+                      stats->num_slow_frees);
+}
+
+static int populate_slabinfo(struct file* file, struct vec* vec) {
+    (void)file;
+    return slab_get_stats(print_slab_stats, vec);
+}
+
 static int populate_self(struct file* file, struct vec* vec) {
     (void)file;
     return vec_printf(vec, "%d", current->tgid);
@@ -158,8 +235,10 @@ static proc_item_def root_items[] = {
     {"cpuinfo", S_IFREG, populate_cpuinfo},
     {"filesystems", S_IFREG, populate_filesystems},
     {"kallsyms", S_IFREG, populate_kallsyms},
+    {"lockstat", S_IFREG, populate_lockstat},
     {"meminfo", S_IFREG, populate_meminfo},
     {"self", S_IFLNK, populate_self},
+    {"slabinfo", S_IFREG, populate_slabinfo},
     {"uptime", S_IFREG, populate_uptime},
     {"version", S_IFREG, populate_version},
 };
@@ -181,7 +260,7 @@ static int proc_root_getdents(struct file* file, getdents_callback_fn callback,
 
     mutex_lock(&file->offset_lock);
     if ((size_t)file->offset < NUM_ITEMS) {
-        int rc = dentry_getdents(file, node->children, callback, ctx);
+        int rc = dentry_getdents(file, &node->children, callback, ctx);
         if (IS_ERR(rc)) {
             mutex_unlock(&file->offset_lock);
             return rc;
@@ -192,26 +271,32 @@ static int proc_root_getdents(struct file* file, getdents_callback_fn callback,
         return 0;
     }
 
-    spinlock_lock(&all_tasks_lock);
-
-    pid_t offset_pid = (pid_t)(file->offset - NUM_ITEMS);
-    struct task* it = all_tasks;
-    while (it->tid <= offset_pid) {
-        it = it->all_tasks_next;
-        if (!it)
-            break;
-    }
-
-    while (it) {
-        char name[16];
-        (void)snprintf(name, sizeof(name), "%d", it->tid);
-        if (!callback(name, DT_DIR, ctx))
+    // The callback copies to userland, which may fault, so it is not called
+    // while all_tasks_lock is held. The tids are collected in batches first.
+    pid_t tids[64];
+    for (;;) {
+        size_t n = 0;
+        pid_t offset_pid = (pid_t)(file->offset - NUM_ITEMS);
+        spinlock_lock(&all_tasks_lock);
+        for (struct task* it = all_tasks; it && n < ARRAY_SIZE(tids);
+             it = it->all_tasks_next) {
+            if (it->tid > offset_pid)
+                tids[n++] = it->tid;
+        }
+        spinlock_unlock(&all_tasks_lock);
+
+        for (size_t i = 0; i < n; ++i) {
+            char name[16];
+            (void)snprintf(name, sizeof(name), "%d", tids[i]);
+            if (!callback(name, DT_DIR, ctx))
+                goto done;
+            file->offset = tids[i] + NUM_ITEMS;
+        }
+        if (n < ARRAY_SIZE(tids))
             break;
-        file->offset = it->tid + NUM_ITEMS;
-        it = it->all_tasks_next;
     }
 
-    spinlock_unlock(&all_tasks_lock);
+done:
     mutex_unlock(&file->offset_lock);
     return 0;
 }
@@ -1,28 +1,27 @@
 #include "dentry.h"
 #include "fs.h"
 #include <kernel/api/sys/sysmacros.h>
-#include <kernel/containers/vec.h>
 #include <kernel/memory/memory.h>
 #include <kernel/panic.h>
 
 typedef struct {
     struct inode inode;
     struct mutex lock;
-    struct vec content;
-    struct dentry* children;
+    struct page_cache content;
+    struct dentry_dir children;
 } tmpfs_inode;
 
 static void tmpfs_destroy_inode(struct inode* inode) {
     tmpfs_inode* node = CONTAINER_OF(inode, tmpfs_inode, inode);
-    vec_destroy(&node->content);
-    dentry_clear(node->children);
+    page_cache_destroy(&node->content);
+    dentry_clear(&node->children);
     kfree(node);
 }
 
 static struct inode* tmpfs_lookup_child(struct inode* inode, const char* name) {
     tmpfs_inode* node = CONTAINER_OF(inode, tmpfs_inode, inode);
     mutex_lock(&node->lock);
-    struct inode* child = dentry_find(node->children, name);
+    struct inode* child = dentry_find(&node->children, name);
     mutex_unlock(&node->lock);
     inode_unref(inode);
     return child;
@@ -38,36 +37,26 @@ static int tmpfs_stat(struct inode* inode, struct kstat* buf) {
 static ssize_t tmpfs_pread(struct file* file, void* buffer, size_t count,
                            uint64_t offset) {
     tmpfs_inode* node = CONTAINER_OF(file->inode, tmpfs_inode, inode);
-    mutex_lock(&node->lock);
-    ssize_t nread = vec_pread(&node->content, buffer, count, offset);
-    mutex_unlock(&node->lock);
-    return nread;
+    return page_cache_read(&node->content, buffer, count, offset);
 }
 
 static ssize_t tmpfs_pwrite(struct file* file, const void* buffer, size_t count,
                             uint64_t offset) {
     tmpfs_inode* node = CONTAINER_OF(file->inode, tmpfs_inode, inode);
-    mutex_lock(&node->lock);
-    ssize_t nwritten = vec_pwrite(&node->content, buffer, count, offset);
-    mutex_unlock(&node->lock);
-    return nwritten;
+    return page_cache_write(&node->content, buffer, count, offset);
 }
 
 static void* tmpfs_mmap(struct file* file, size_t length, uint64_t offset,
                         int flags) {
-    tmpfs_inode* node = (tmpfs_inode*)file->inode;
-    mutex_lock(&node->lock);
-    void* ret = vec_mmap(&node->content, length, offset, flags);
-    mutex_unlock(&node->lock);
-    return ret;
+    if (!(flags & VM_SHARED))
+        return vm_map_file(NULL, file->inode, length, offset, flags);
+    tmpfs_inode* node = CONTAINER_OF(file->inode, tmpfs_inode, inode);
+    return page_cache_mmap(&node->content, NULL, length, offset, flags);
 }
 
 static int tmpfs_truncate(struct file* file, uint64_t length) {
     tmpfs_inode* node = CONTAINER_OF(file->inode, tmpfs_inode, inode);
-    mutex_lock(&node->lock);
-    int rc = vec_resize(&node->content, length);
-    mutex_unlock(&node->lock);
-    return rc;
+    return page_cache_truncate(&node->content, length);
 }
 
 static int tmpfs_getdents(struct file* file, getdents_callback_fn callback,
@@ -75,7 +64,7 @@ static int tmpfs_getdents(struct file* file, getdents_callback_fn callback,
     tmpfs_inode* node = CONTAINER_OF(file->inode, tmpfs_inode, inode);
     mutex_lock(&node->lock);
     mutex_lock(&file->offset_lock);
-    int rc = dentry_getdents(file, node->children, callback, ctx);
+    int rc = dentry_getdents(file, &node->children, callback, ctx);
     mutex_unlock(&file->offset_lock);
     mutex_unlock(&node->lock);
     return rc;
@@ -109,6 +98,7 @@ static const struct file_ops dir_fops = {
     .create_child = tmpfs_create_child,
     .link_child = tmpfs_link_child,
     .unlink_child = tmpfs_unlink_child,
+    .cache_lookups = true,
     .stat = tmpfs_stat,
     .getdents = tmpfs_getdents,
 };
@@ -133,6 +123,8 @@ static struct inode* tmpfs_create_child(struct inode* inode, const char* name,
     child_inode->fops = S_ISDIR(mode) ? &dir_fops : &non_dir_fops;
     child_inode->mode = mode;
     child_inode->ref_count = 1;
+    if (!S_ISDIR(mode))
+        child_inode->page_cache = &child->content;
 
     inode_ref(child_inode);
     int rc = tmpfs_link_child(inode, name, child_inode);
@@ -1,3 +1,5 @@
+#include "buffer.h"
+#include "dcache.h"
 #include "fs.h"
 #include "path.h"
 #include <common/string.h>
@@ -42,14 +44,22 @@ int vfs_register_file_system(struct file_system* fs) {
     return 0;
 }
 
+#define NUM_MOUNT_BUCKETS 64
+
 struct mount_point {
     struct inode* host;
     struct inode* guest;
-    struct mount_point* next;
+    _Atomic(struct mount_point*) next;
 };
 
-static struct mount_point* mount_points;
-static struct mutex mount_lock;
+// Mount points hashed by the host inode. Mount points are never removed, so
+// path resolution walks the chains without taking any lock.
+static _Atomic(struct mount_point*) mount_buckets[NUM_MOUNT_BUCKETS];
+static struct mutex mount_lock; // Serializes mounts
+
+static _Atomic(struct mount_point*)* mount_bucket_for(struct inode* host) {
+    return mount_buckets + ((uintptr_t)host >> 4) % NUM_MOUNT_BUCKETS;
+}
 
 static int mount_at(struct inode* host, struct inode* guest) {
     if (!S_ISDIR(host->mode)) {
@@ -66,30 +76,31 @@ static int mount_at(struct inode* host, struct inode* guest) {
     mp->host = host;
     mp->guest = guest;
     mutex_lock(&mount_lock);
-    mp->next = mount_points;
-    mount_points = mp;
+    _Atomic(struct mount_point*)* bucket = mount_bucket_for(host);
+    mp->next = *bucket;
+    *bucket = mp;
+    // Set after the mount point is published, so that readers that see the
+    // flag also find the mount point.
+    host->is_mount_point = true;
     mutex_unlock(&mount_lock);
     return 0;
 }
 
 static struct inode* resolve_mounts(struct inode* host) {
-    struct inode* needle = host;
-    mutex_lock(&mount_lock);
-    for (;;) {
-        struct mount_point* it = mount_points;
-        while (it) {
-            if (it->host == needle)
-                break;
+    struct inode* inode = host;
+    while (inode->is_mount_point) {
+        // The most recent mount on the inode comes first in the chain.
+        struct mount_point* it = *mount_bucket_for(inode);
+        while (it->host != inode)
             it = it->next;
-        }
-        if (!it)
-            break;
-        needle = it->guest;
+        inode = it->guest;
     }
-    mutex_unlock(&mount_lock);
-    if (needle != host)
-        inode_ref(needle);
-    return needle;
+    if (inode != host) {
+        // The mount point keeps the host alive.
+        inode_ref(inode);
+        inode_unref(host);
+    }
+    return inode;
 }
 
 int vfs_mount(const char* source, const char* target, const char* type) {
@@ -480,11 +491,15 @@ struct inode* vfs_create_at(const struct path* base, const char* pathname,
 
 void tmpfs_init(void);
 void proc_init(void);
+void ext2_init(void);
 void initrd_populate_root_fs(uintptr_t phys_addr, size_t size);
 
 void vfs_init(const multiboot_module_t* initrd_mod) {
+    dcache_init();
+    buffer_init();
     tmpfs_init();
     proc_init();
+    ext2_init();
 
     kprint("vfs: mounting root filesystem\n");
     struct file_system* fs = find_file_system("tmpfs");
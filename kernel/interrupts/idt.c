@@ -6,6 +6,7 @@
 #include <kernel/asm_wrapper.h>
 #include <kernel/cpu.h>
 #include <kernel/kmsg.h>
+#include <kernel/memory/memory.h>
 #include <kernel/panic.h>
 #include <kernel/safe_string.h>
 #include <kernel/system.h>
@@ -43,6 +44,30 @@ void idt_set_interrupt_handler(uint8_t num, interrupt_handler_fn handler) {
     interrupt_handlers[num] = handler;
 }
 
+#define MAX_SHARED_HANDLERS 4
+
+static interrupt_handler_fn shared_irq_handlers[NUM_IRQS][MAX_SHARED_HANDLERS];
+
+static void handle_shared_irq(struct registers* regs) {
+    interrupt_handler_fn* handlers =
+        shared_irq_handlers[regs->interrupt_num - IRQ(0)];
+    for (size_t i = 0; i < MAX_SHARED_HANDLERS && handlers[i]; ++i)
+        handlers[i](regs);
+}
+
+void idt_add_shared_irq_handler(uint8_t irq, interrupt_handler_fn handler) {
+    ASSERT(irq < NUM_IRQS);
+    interrupt_handler_fn* handlers = shared_irq_handlers[irq];
+    size_t i = 0;
+    for (; handlers[i]; ++i) {
+        if (handlers[i] == handler)
+            return;
+        ASSERT(i + 1 < MAX_SHARED_HANDLERS);
+    }
+    handlers[i] = handler;
+    interrupt_handlers[IRQ(irq)] = handle_shared_irq;
+}
+
 void isr_handler(struct registers* regs) {
     ASSERT(regs->interrupt_num < NUM_IDT_ENTRIES);
     if (regs->interrupt_num != SPURIOUS_VECTOR) {
@@ -154,17 +179,29 @@ static void handle_exception13(struct registers* regs) {
 
 DEFINE_ISR_WITH_ERROR_CODE(14)
 static void handle_exception14(struct registers* regs) {
+    void* virt_addr = (void*)read_cr2();
+
+    // Resolving the fault may sleep, so it is only possible if the faulting
+    // context had interrupts enabled.
+    if (regs->eflags & X86_EFLAGS_IF) {
+        sti();
+        int rc = vm_handle_page_fault(virt_addr, regs->error_code);
+        cli();
+        if (IS_OK(rc))
+            return;
+    }
+
     if (safe_string_handle_page_fault(regs))
         return;
 
-    bool present = regs->error_code & 0x1;
-    bool write = regs->error_code & 0x2;
-    bool user = regs->error_code & 0x4;
+    bool present = regs->error_code & PF_PRESENT;
+    bool write = regs->error_code & PF_WRITE;
+    bool user = regs->error_code & PF_USER;
 
     kprintf("Page fault (%s%s%s) at %p\n",
             present ? "page-protection " : "non-present ",
             write ? "write " : "read ", user ? "user-mode" : "kernel-mode",
-            (void*)read_cr2());
+            virt_addr);
     crash(regs, SIGSEGV);
 }
 
@@ -24,6 +24,11 @@ void i8259_eoi(uint8_t irq);
 typedef void (*interrupt_handler_fn)(struct registers*);
 void idt_set_interrupt_handler(uint8_t num, interrupt_handler_fn handler);
 
+// Adds a handler for an IRQ line that several devices may share, e.g. a PCI
+// interrupt line. Every handler of the line is called on each interrupt, and
+// has to check whether its device raised the interrupt.
+void idt_add_shared_irq_handler(uint8_t irq, interrupt_handler_fn handler);
+
 void lapic_init(void);
 void lapic_init_cpu(void);
 
@@ -31,6 +31,8 @@ static size_t read_index = 0;
 static size_t write_index = 0;
 static struct spinlock lock;
 
+void kmsg_init(void) { lockstat_register_spinlock(&lock, "kmsg_lock"); }
+
 size_t kmsg_read(char* buf, size_t count) {
     size_t dest_index = 0;
 
@@ -4,81 +4,184 @@
 #include "panic.h"
 #include "sched.h"
 #include "task.h"
+#include <common/string.h>
+
+struct mutex_waiter {
+    struct task* task;
+    struct mutex_waiter* next;
+    atomic_bool granted;
+};
+
+// Number of times a contending task checks the mutex before going to sleep,
+// as long as the holder is running on another CPU.
+#define MUTEX_SPIN_LIMIT 100
+
+static bool try_acquire(struct mutex* m, struct task* task) {
+    if (m->level == 0 || m->holder == task) {
+        m->holder = task;
+        ++m->level;
+        return true;
+    }
+    return false;
+}
+
+static bool is_granted(struct mutex_waiter* waiter) { return waiter->granted; }
 
 void mutex_lock(struct mutex* m) {
     ASSERT(interrupts_enabled());
+    struct task* task = current;
 
-    for (;;) {
-        bool expected = false;
-        if (atomic_compare_exchange_strong_explicit(&m->lock, &expected, true,
-                                                    memory_order_acq_rel,
-                                                    memory_order_acquire)) {
-            if (!m->holder || m->holder == current) {
-                m->holder = current;
-                ++m->level;
-                atomic_store_explicit(&m->lock, false, memory_order_release);
-                return;
-            }
-            atomic_store_explicit(&m->lock, false, memory_order_release);
+    spinlock_lock(&m->wait_lock);
+    if (try_acquire(m, task)) {
+        spinlock_unlock(&m->wait_lock);
+        return;
+    }
+    ++m->num_contended;
+
+    // The holder is likely to release the mutex soon if it is running.
+    // Don't spin if there are waiters, as the mutex will be handed off to
+    // them.
+    for (size_t i = 0; i < MUTEX_SPIN_LIMIT; ++i) {
+        if (m->waiters_head || !m->holder || !m->holder->on_cpu)
+            break;
+        spinlock_unlock(&m->wait_lock);
+        cpu_pause();
+        spinlock_lock(&m->wait_lock);
+        if (try_acquire(m, task)) {
+            ++m->num_spun;
+            spinlock_unlock(&m->wait_lock);
+            return;
         }
-        sched_yield(true);
     }
+
+    struct mutex_waiter waiter = {.task = task};
+    if (m->waiters_tail)
+        m->waiters_tail->next = &waiter;
+    else
+        m->waiters_head = &waiter;
+    m->waiters_tail = &waiter;
+    ++m->num_slept;
+    spinlock_unlock(&m->wait_lock);
+
+    // mutex_unlock hands off the mutex to us before waking us up.
+    ASSERT_OK(sched_block_until(0, (unblock_fn)is_granted, &waiter,
+                                BLOCK_UNINTERRUPTIBLE));
+    ASSERT(m->holder == task);
+}
+
+bool mutex_try_lock_exclusive(struct mutex* m) {
+    ASSERT(interrupts_enabled());
+    spinlock_lock(&m->wait_lock);
+    bool acquired = m->level == 0 && try_acquire(m, current);
+    spinlock_unlock(&m->wait_lock);
+    return acquired;
 }
 
 void mutex_unlock(struct mutex* m) {
     ASSERT(interrupts_enabled());
 
-    for (;;) {
-        bool expected = false;
-        if (atomic_compare_exchange_strong_explicit(&m->lock, &expected, true,
-                                                    memory_order_acq_rel,
-                                                    memory_order_acquire)) {
-            ASSERT(m->holder == current);
-            ASSERT(m->level > 0);
-            if (--m->level == 0)
-                m->holder = NULL;
-            atomic_store_explicit(&m->lock, false, memory_order_release);
-            return;
-        }
-        sched_yield(true);
+    spinlock_lock(&m->wait_lock);
+    ASSERT(m->holder == current);
+    ASSERT(m->level > 0);
+    if (--m->level > 0) {
+        spinlock_unlock(&m->wait_lock);
+        return;
     }
-}
 
-#define SPINLOCK_LOCKED 0x1
-#define SPINLOCK_PUSHED_INTERRUPT 0x2
-#define SPINLOCK_CPU_ID_SHIFT 2
+    struct mutex_waiter* waiter = m->waiters_head;
+    if (!waiter) {
+        m->holder = NULL;
+        spinlock_unlock(&m->wait_lock);
+        return;
+    }
+
+    m->waiters_head = waiter->next;
+    if (!m->waiters_head)
+        m->waiters_tail = NULL;
+
+    struct task* task = waiter->task;
+    m->holder = task;
+    m->level = 1;
+    // The waiter may return as soon as it sees `granted`, so don't touch
+    // the waiter after this.
+    waiter->granted = true;
+    sched_wake(task);
+
+    spinlock_unlock(&m->wait_lock);
+}
 
 void spinlock_lock(struct spinlock* s) {
-    unsigned desired = SPINLOCK_LOCKED;
-    if (interrupts_enabled())
-        desired |= SPINLOCK_PUSHED_INTERRUPT;
+    bool int_flag = interrupts_enabled();
     cli();
-    uint8_t cpu_id = cpu_get_id();
-    desired |= (unsigned)cpu_id << SPINLOCK_CPU_ID_SHIFT;
-    for (;;) {
-        unsigned expected = 0;
-        if (atomic_compare_exchange_strong(&s->lock, &expected, desired)) {
-            ASSERT(s->level == 0);
-            break;
-        }
-        if ((expected >> SPINLOCK_CPU_ID_SHIFT) == cpu_id) {
-            ASSERT(expected & SPINLOCK_LOCKED);
-            break;
-        }
-        cpu_pause();
+
+    unsigned owner = cpu_get_id() + 1;
+    if (atomic_load_explicit(&s->owner, memory_order_relaxed) == owner) {
+        ASSERT(s->level > 0);
+        ++s->level;
+        return;
+    }
+
+    unsigned ticket =
+        atomic_fetch_add_explicit(&s->next_ticket, 1, memory_order_relaxed);
+    uint64_t spin_cycles = 0;
+    if (atomic_load_explicit(&s->now_serving, memory_order_acquire) != ticket) {
+        uint64_t start = rdtsc();
+        while (atomic_load_explicit(&s->now_serving, memory_order_acquire) !=
+               ticket)
+            cpu_pause();
+        spin_cycles = rdtsc() - start;
+    }
+
+    ASSERT(s->level == 0);
+    atomic_store_explicit(&s->owner, owner, memory_order_relaxed);
+    s->level = 1;
+    s->pushed_interrupt = int_flag;
+
+    ++s->num_acquisitions;
+    if (spin_cycles) {
+        ++s->num_contended;
+        s->spin_cycles += spin_cycles;
     }
-    ++s->level;
 }
 
 void spinlock_unlock(struct spinlock* s) {
     ASSERT(!interrupts_enabled());
-    unsigned v = atomic_load(&s->lock);
-    ASSERT(v & SPINLOCK_LOCKED);
-    ASSERT((v >> SPINLOCK_CPU_ID_SHIFT) == cpu_get_id());
+    ASSERT(s->owner == (unsigned)cpu_get_id() + 1);
     ASSERT(s->level > 0);
-    if (--s->level == 0) {
-        atomic_store_explicit(&s->lock, 0, memory_order_release);
-        if (v & SPINLOCK_PUSHED_INTERRUPT)
-            sti();
+    if (--s->level > 0)
+        return;
+
+    bool int_flag = s->pushed_interrupt;
+    atomic_store_explicit(&s->owner, 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->now_serving, 1, memory_order_release);
+    if (int_flag)
+        sti();
+}
+
+struct lockstat_entry lockstat_entries[LOCKSTAT_MAX_ENTRIES];
+atomic_size_t lockstat_num_entries;
+static struct spinlock lockstat_lock;
+
+static void lockstat_register(struct spinlock* spinlock, struct mutex* mutex,
+                              const char* name) {
+    spinlock_lock(&lockstat_lock);
+    size_t n = lockstat_num_entries;
+    if (n < LOCKSTAT_MAX_ENTRIES) {
+        struct lockstat_entry* entry = lockstat_entries + n;
+        strlcpy(entry->name, name, sizeof(entry->name));
+        entry->spinlock = spinlock;
+        entry->mutex = mutex;
+        // Publish the entry after filling it in.
+        atomic_store_explicit(&lockstat_num_entries, n + 1,
+                              memory_order_release);
     }
+    spinlock_unlock(&lockstat_lock);
+}
+
+void lockstat_register_spinlock(struct spinlock* s, const char* name) {
+    lockstat_register(s, NULL, name);
+}
+
+void lockstat_register_mutex(struct mutex* m, const char* name) {
+    lockstat_register(NULL, m, name);
 }
@@ -1,21 +1,67 @@
 #pragma once
 
+#include <common/extra.h>
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+// A recursive ticket lock that disables interrupts while held.
+struct spinlock {
+    atomic_uint next_ticket;
+    atomic_uint now_serving;
+    atomic_uint owner; // ID + 1 of the CPU holding the lock, 0 if not held
+    uint32_t level;
+    bool pushed_interrupt;
+
+    // Statistics, updated while holding the lock
+    uint64_t num_acquisitions;
+    uint64_t num_contended;
+    uint64_t spin_cycles;
+};
+
+struct mutex_waiter;
+
+// A recursive mutex. Contending tasks spin briefly while the holder is
+// running on another CPU, and then sleep in FIFO order. The mutex is handed
+// off directly to the first waiter on unlock.
 struct mutex {
-    volatile struct task* holder;
-    volatile uint32_t level;
-    volatile atomic_bool lock;
+    struct task* holder;
+    uint32_t level;
+    struct mutex_waiter* waiters_head;
+    struct mutex_waiter* waiters_tail;
+    struct spinlock wait_lock; // Protects all the fields above
+
+    atomic_size_t num_contended; // Acquisitions that found the mutex held
+    atomic_size_t num_spun;      // Contended acquisitions done by spinning
+    atomic_size_t num_slept;     // Contended acquisitions that had to sleep
 };
 
 void mutex_lock(struct mutex*);
 void mutex_unlock(struct mutex*);
 
-struct spinlock {
-    uint32_t level;
-    volatile atomic_uint lock;
-};
+// Acquires the mutex only if it can be done without waiting. Fails if the
+// current task already holds the mutex. Used by code that may run in the
+// middle of the holder's critical section and must not observe its
+// intermediate state.
+NODISCARD bool mutex_try_lock_exclusive(struct mutex*);
 
 void spinlock_lock(struct spinlock*);
 void spinlock_unlock(struct spinlock*);
+
+#define LOCKSTAT_MAX_ENTRIES 64
+
+struct lockstat_entry {
+    char name[32];
+    // Exactly one of these is set
+    struct spinlock* spinlock;
+    struct mutex* mutex;
+};
+
+extern struct lockstat_entry lockstat_entries[LOCKSTAT_MAX_ENTRIES];
+extern atomic_size_t lockstat_num_entries;
+
+// Lists the statistics of the lock in /proc/lockstat.
+// Locks registered after LOCKSTAT_MAX_ENTRIES are ignored.
+void lockstat_register_spinlock(struct spinlock*, const char* name);
+void lockstat_register_mutex(struct mutex*, const char* name);
@@ -3,6 +3,8 @@
 #include "cpu.h"
 #include "drivers/drivers.h"
 #include "drivers/serial.h"
+#include "fs/buffer.h"
+#include "fs/dcache.h"
 #include "interrupts/interrupts.h"
 #include "kmsg.h"
 #include "memory/memory.h"
@@ -73,6 +75,7 @@ noreturn void start(uint32_t mb_magic, uintptr_t mb_info_phys_addr) {
         *(const multiboot_module_t*)(mb_info->mods_addr + KERNEL_VIRT_ADDR);
 
     cmdline_init(mb_info);
+    kmsg_init();
     memory_init(mb_info);
     ksyms_init();
     task_init();
@@ -89,6 +92,9 @@ noreturn void start(uint32_t mb_magic, uintptr_t mb_info_phys_addr) {
     kprint("\x1b[32mkernel initialization done\x1b[m\n");
 
     ASSERT_OK(task_spawn("userland_init", userland_init));
+    reclaim_start();
+    writeback_start();
+    dcache_start();
 
     sched_start();
 }
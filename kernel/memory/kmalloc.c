@@ -1,26 +1,110 @@
 #include "memory.h"
+#include "private.h"
 #include <common/string.h>
 #include <kernel/panic.h>
 
+// Allocations up to the largest size class are served from slab caches of
+// power-of-two sizes. Larger allocations get their own page-aligned region.
+// Slab objects are never page-aligned because each slab page starts with a
+// header, so the address tells which allocator an object came from.
+
+#define MIN_SIZE_CLASS_SHIFT 4  // 16 bytes
+#define MAX_SIZE_CLASS_SHIFT 10 // 1024 bytes
+#define NUM_SIZE_CLASSES (MAX_SIZE_CLASS_SHIFT - MIN_SIZE_CLASS_SHIFT + 1)
+
+static struct slab_cache size_classes[NUM_SIZE_CLASSES];
+static const char* size_class_names[NUM_SIZE_CLASSES] = {
+    "kmalloc-16",  "kmalloc-32",  "kmalloc-64",   "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+void kmalloc_init(void) {
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i)
+        slab_cache_init(size_classes + i, size_class_names[i],
+                        1 << (MIN_SIZE_CLASS_SHIFT + i));
+}
+
+static struct slab_cache* size_class_for(size_t size) {
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; ++i) {
+        if (size <= size_classes[i].obj_size)
+            return size_classes + i;
+    }
+    return NULL;
+}
+
+static bool is_slab_obj(void* ptr) { return (uintptr_t)ptr % PAGE_SIZE; }
+
 void* kmalloc(size_t size) {
+    if (size == 0)
+        return NULL;
+
+    struct slab_cache* cache = size_class_for(size);
+    if (cache) {
+        void* obj = slab_cache_alloc(cache);
+        return IS_OK(obj) ? obj : NULL;
+    }
+
     void* addr = vm_alloc(size, VM_READ | VM_WRITE);
     return IS_OK(addr) ? addr : NULL;
 }
 
 void* kaligned_alloc(size_t alignment, size_t size) {
     ASSERT(alignment <= PAGE_SIZE);
-    return kmalloc(size); // kmalloc already returns page-aligned addresses
+    // Slab objects are aligned to their size class, and larger allocations
+    // are page-aligned.
+    return kmalloc(MAX(size, alignment));
+}
+
+void* kmalloc_contiguous(size_t size) {
+    if (size == 0)
+        return NULL;
+
+    size_t num_pages = DIV_CEIL(size, PAGE_SIZE);
+    size_t order = 0;
+    while ((1U << order) < num_pages)
+        ++order;
+    if (order > MAX_PAGE_ORDER)
+        return NULL;
+
+    uintptr_t phys_addr = page_alloc_contiguous(order);
+    if (IS_ERR(phys_addr))
+        return NULL;
+    void* addr = vm_phys_map(phys_addr, num_pages * PAGE_SIZE, VM_RW);
+
+    // The mapping holds its own references to the pages. Dropping ours
+    // returns the pages beyond the requested size to the page allocator.
+    for (size_t i = 0; i < (1U << order); ++i)
+        page_unref(phys_addr + i * PAGE_SIZE);
+
+    return IS_OK(addr) ? addr : NULL;
 }
 
 void* krealloc(void* ptr, size_t new_size) {
     if (!ptr)
         return kmalloc(new_size);
+
+    if (is_slab_obj(ptr)) {
+        size_t old_size = slab_cache_of(ptr)->obj_size;
+        if (new_size <= old_size)
+            return ptr;
+        void* new_ptr = kmalloc(new_size);
+        if (!new_ptr)
+            return NULL;
+        memcpy(new_ptr, ptr, old_size);
+        kfree(ptr);
+        return new_ptr;
+    }
+
     void* addr = vm_resize(ptr, new_size);
     return IS_OK(addr) ? addr : NULL;
 }
 
 void kfree(void* ptr) {
-    if (ptr)
+    if (!ptr)
+        return;
+    if (is_slab_obj(ptr))
+        slab_cache_free(slab_cache_of(ptr), ptr);
+    else
         ASSERT_OK(vm_free(ptr));
 }
 
@@ -0,0 +1,95 @@
+#include "private.h"
+#include <kernel/api/err.h>
+#include <kernel/panic.h>
+#include <kernel/system.h>
+
+#define GUARD_SIZE PAGE_SIZE
+
+// Each CPU caches the stacks of reaped tasks so that creating a task doesn't
+// need to allocate and map a new stack.
+#define KSTACK_CACHE_SIZE 8
+
+struct kstack_cache {
+    // Mostly taken by the owning CPU. The shrinker takes it to free the
+    // cached stacks.
+    struct spinlock lock;
+    size_t count;
+    void* stacks[KSTACK_CACHE_SIZE];
+};
+
+static struct kstack_cache kstack_caches[MAX_NUM_CPUS];
+
+static void* create_stack(void) {
+    unsigned char* guard = vm_alloc(GUARD_SIZE + STACK_SIZE, VM_RW);
+    if (IS_ERR(guard))
+        return guard;
+    int rc = vm_set_flags(guard, GUARD_SIZE, 0);
+    if (IS_ERR(rc)) {
+        ASSERT_OK(vm_free(guard));
+        return ERR_PTR(rc);
+    }
+    return guard + GUARD_SIZE;
+}
+
+static void destroy_stack(void* stack) {
+    // vm_set_flags has split the guard page into its own region.
+    ASSERT_OK(vm_free((unsigned char*)stack - GUARD_SIZE));
+    ASSERT_OK(vm_free(stack));
+}
+
+// The task may migrate to another CPU after picking the cache, which is
+// harmless because the cache is protected by its own lock.
+static struct kstack_cache* current_cache(void) {
+    return kstack_caches + cpu_get_id();
+}
+
+void* kstack_alloc(void) {
+    struct kstack_cache* cache = current_cache();
+    spinlock_lock(&cache->lock);
+    void* stack = cache->count > 0 ? cache->stacks[--cache->count] : NULL;
+    spinlock_unlock(&cache->lock);
+    return stack ? stack : create_stack();
+}
+
+void kstack_free(void* stack) {
+    if (!stack)
+        return;
+    struct kstack_cache* cache = current_cache();
+    spinlock_lock(&cache->lock);
+    bool cached = cache->count < KSTACK_CACHE_SIZE;
+    if (cached)
+        cache->stacks[cache->count++] = stack;
+    spinlock_unlock(&cache->lock);
+    if (!cached)
+        destroy_stack(stack);
+}
+
+static size_t shrink_kstacks(size_t target) {
+    // The caller may be in the middle of updating kernel_vm, which
+    // destroy_stack modifies.
+    if (!mutex_try_lock_exclusive(&kernel_vm->lock))
+        return 0;
+    size_t num_freed = 0;
+    for (size_t i = 0; i < num_cpus && num_freed < target; ++i) {
+        struct kstack_cache* cache = kstack_caches + i;
+        for (;;) {
+            spinlock_lock(&cache->lock);
+            void* stack =
+                cache->count > 0 ? cache->stacks[--cache->count] : NULL;
+            spinlock_unlock(&cache->lock);
+            if (!stack)
+                break;
+            destroy_stack(stack);
+            num_freed += STACK_SIZE / PAGE_SIZE;
+        }
+    }
+    mutex_unlock(&kernel_vm->lock);
+    return num_freed;
+}
+
+static struct shrinker kstack_shrinker = {
+    .name = "kstack",
+    .shrink = shrink_kstacks,
+};
+
+void kstack_init(void) { shrinker_register(&kstack_shrinker); }
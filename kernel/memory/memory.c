@@ -5,4 +5,6 @@ void memory_init(const multiboot_info_t* mb_info) {
     page_init(mb_info);
     page_table_init();
     vm_init();
+    kmalloc_init();
+    kstack_init();
 }
@@ -25,9 +25,15 @@
 // The bit is unused by the hardware, so we can use it for our purposes.
 #define PTE_SHARED 0x200
 
+// Flag to indicate that the page is shared copy-on-write.
+// The page is mapped read-only and is copied on the first write.
+#define PTE_COW 0x400
+
 #ifndef ASM_FILE
 
 #include <common/extra.h>
+#include <kernel/api/sys/types.h>
+#include <kernel/cpu.h>
 #include <kernel/lock.h>
 
 extern struct page_directory* kernel_page_directory;
@@ -62,16 +68,80 @@ struct memory_stats {
 
 void memory_get_stats(struct memory_stats* out_stats);
 
+// A subsystem that caches memory which can be given back when physical
+// pages run low.
+struct shrinker {
+    const char* name;
+
+    // Frees up to `target` pages and returns the number of pages freed.
+    // Called when the page allocator runs low, possibly while the caller
+    // holds locks, so locks have to be taken with mutex_try_lock_exclusive.
+    size_t (*shrink)(size_t target);
+
+    struct shrinker* next;
+};
+
+// Registers a shrinker. Shrinkers are never unregistered.
+void shrinker_register(struct shrinker*);
+
+// Starts the task that reclaims memory in the background when free pages
+// drop below the low watermark.
+void reclaim_start(void);
+
+struct slab_stats {
+    const char* name;
+    size_t obj_size;
+    size_t objs_per_slab;
+    size_t num_slabs;
+    size_t num_objs;       // Objects in all slabs
+    size_t num_free_objs;  // Free objects in slabs
+    size_t num_depot_objs; // Free objects cached in the depot
+    size_t num_allocs;
+    size_t num_slow_allocs; // Allocations that missed the per-CPU magazine
+    size_t num_frees;
+    size_t num_slow_frees; // Frees that missed the per-CPU magazine
+};
+
+typedef int (*slab_stats_fn)(const struct slab_stats*, void* ctx);
+
+// Calls the callback with the statistics of each slab cache.
+// Stops and returns the error if the callback fails.
+NODISCARD int slab_get_stats(slab_stats_fn, void* ctx);
+
 void* kmalloc(size_t);
 void* kaligned_alloc(size_t alignment, size_t);
 void* krealloc(void*, size_t new_size);
 void kfree(void*);
 
+// Allocates page-aligned, physically contiguous memory, e.g. for DMA buffers.
+// The memory must be freed with kfree and must not be resized.
+void* kmalloc_contiguous(size_t);
+
+// Allocates a kernel stack of STACK_SIZE bytes with an unmapped guard page
+// below it, so that a stack overflow faults instead of corrupting the memory
+// next to the stack. Returns the lowest address of the stack.
+// Freed stacks are cached per CPU and reused by later allocations.
+NODISCARD void* kstack_alloc(void);
+void kstack_free(void*);
+
 char* kstrdup(const char*);
 char* kstrndup(const char*, size_t n);
 
 uintptr_t virt_to_phys(void*);
 
+// Physical pages are reference-counted and freed when the last reference is
+// dropped.
+uintptr_t page_alloc(void);
+void page_ref(uintptr_t phys_addr);
+void page_unref(uintptr_t phys_addr);
+
+// Copies n bytes between the page at the offset and a buffer, which may be
+// in user space. Returns -EFAULT if the buffer is not accessible.
+NODISCARD int page_copy_to_buffer(uintptr_t phys_addr, size_t offset,
+                                  void* dest, size_t n);
+NODISCARD int page_copy_from_buffer(uintptr_t phys_addr, size_t offset,
+                                    const void* src, size_t n);
+
 // Region may be read
 #define VM_READ 0x1
 
@@ -87,21 +157,55 @@ uintptr_t virt_to_phys(void*);
 // Write-combining is enabled for the region
 #define VM_WC 0x10
 
+// Region is populated up front with 4MiB pages. Only affects the allocation;
+// the region behaves like any other afterwards.
+#define VM_HUGE 0x20
+
 struct vm {
     uintptr_t start;
     uintptr_t end;
     struct page_directory* page_directory;
     struct mutex lock;
-    struct vm_region* regions;
+    struct vm_region* regions;     // Sorted list of the regions
+    struct vm_region* region_tree; // Root of the tree of the regions
     atomic_size_t ref_count;
+
+    // Bitmap of CPUs that have the page directory of the vm loaded.
+    // Only these CPUs need to flush TLB entries of userland addresses.
+    atomic_uint active_cpus[MAX_NUM_CPUS / 32];
+
+    // Number of pages mapped to the userland part of the vm
+    atomic_size_t num_resident_pages;
 };
 
+struct inode;
+
 struct vm_region {
     uintptr_t start;
     uintptr_t end;
     int flags;
+
+    // Private regions may be backed by the page cache of a file, in which
+    // case the pages are populated from it on first access. The region holds
+    // a reference to the inode.
+    struct inode* inode;
+    uint64_t offset; // Offset in the file that is mapped at `start`
+
     struct vm_region* prev;
     struct vm_region* next;
+
+    // AVL tree keyed by the start address
+    struct vm_region* parent;
+    struct vm_region* left;
+    struct vm_region* right;
+    int height;
+
+    // Free space between the previous region (or the start of the vm) and
+    // this region
+    size_t gap;
+
+    // Largest gap in the subtree rooted at this region
+    size_t max_gap;
 };
 
 extern struct vm* kernel_vm;
@@ -114,9 +218,26 @@ void vm_unref(struct vm*);
 void vm_enter(struct vm*);
 
 // Clones the current virtual memory space.
+// Private pages are shared copy-on-write between the two vm instances.
 struct vm* vm_clone(void);
 
+// Page fault error code bits
+#define PF_PRESENT 0x1
+#define PF_WRITE 0x2
+#define PF_USER 0x4
+
+// Tries to resolve a page fault at the address in the current vm.
+// Returns 0 if the fault was resolved, -EFAULT if the access was invalid.
+NODISCARD int vm_handle_page_fault(void* virt_addr, uint32_t error_code);
+
+// Returns the physical page that backs the user address in the current vm,
+// with a reference taken for the caller. Private pages are made
+// copy-on-write, so the page keeps its contents even if the task writes to
+// the address later.
+uintptr_t vm_loan_user_page(void* virt_addr);
+
 // Allocates a virtual memory region mapped to free physical pages.
+// Pages of private user regions are allocated on first access.
 void* vm_alloc(size_t, int flags);
 
 // Allocates a virtual memory region at a specific virtual address range.
@@ -130,6 +251,20 @@ void* vm_phys_map(uintptr_t phys_addr, size_t, int flags);
 // virtual memory range.
 void* vm_virt_map(void*, size_t, int flags);
 
+// Allocates a virtual memory region mapped to the physical pages.
+// If virt_addr is not NULL, the region is placed at the address.
+// Private regions map the pages copy-on-write. Pages that are 0 are left
+// unmapped, which is only allowed for regions populated on demand.
+void* vm_map_pages(void* virt_addr, const uintptr_t* pages, size_t num_pages,
+                   int flags);
+
+// Allocates a private virtual memory region that maps the page cache of the
+// inode from the offset. If virt_addr is not NULL, the region is placed at
+// the address. Nothing is mapped up front: pages are mapped copy-on-write on
+// first access.
+NODISCARD void* vm_map_file(void* virt_addr, struct inode*, size_t length,
+                            uint64_t offset, int flags);
+
 // Resizes a virtual memory region.
 NODISCARD void* vm_resize(void*, size_t new_size);
 
@@ -145,6 +280,47 @@ NODISCARD int vm_unmap(void*, size_t);
 // Fails if the address is not the start of a region.
 NODISCARD int vm_free(void*);
 
+struct page_cache_node;
+
+// Contents of a file kept in reference-counted physical pages indexed by
+// a radix tree. Pages are allocated as they are written, so growing the
+// contents never copies them, and holes read as zeros.
+struct page_cache {
+    struct mutex lock;
+    struct page_cache_node* root;
+    size_t height; // Number of levels of the tree
+    uint64_t size; // Size of the contents in bytes
+};
+
+void page_cache_destroy(struct page_cache*);
+NODISCARD ssize_t page_cache_read(struct page_cache*, void* buffer,
+                                  size_t count, uint64_t offset);
+NODISCARD ssize_t page_cache_write(struct page_cache*, const void* buffer,
+                                   size_t count, uint64_t offset);
+
+// Returns the page that holds the byte at the offset with a reference taken
+// for the caller, without copying the contents. count is clamped to the
+// bytes available in the page. Returns 0 and sets count to 0 at the end of
+// the contents.
+uintptr_t page_cache_loan_page(struct page_cache*, uint64_t offset,
+                               size_t* count);
+
+// Returns the page that holds the byte at the offset with a reference taken
+// for the caller, or 0 if the page is a hole. Returns -EFAULT if the offset
+// is past the last page of the contents.
+uintptr_t page_cache_get_page(struct page_cache*, uint64_t offset);
+
+// Resizes the contents. If the contents grow, the new bytes read as zeros.
+NODISCARD int page_cache_truncate(struct page_cache*, uint64_t length);
+
+// Maps the pages of the contents to a new shared virtual memory region.
+// If addr is not NULL, the region is placed at the address.
+// The region maps the same pages as the cache, so that writes through either
+// of them are visible to the other. Private mappings are made with
+// vm_map_file.
+NODISCARD void* page_cache_mmap(struct page_cache*, void* addr, size_t length,
+                                uint64_t offset, int flags);
+
 // Allocates free pages and maps them to the virtual address range.
 NODISCARD int page_table_map_anon(uintptr_t virt_addr, uintptr_t size,
                                   uint16_t flags);
@@ -162,6 +338,22 @@ NODISCARD int page_table_shallow_copy(uintptr_t to_virt_addr,
 void page_table_unmap(uintptr_t virt_addr, uintptr_t size);
 
 // Changes the page table flags for the virtual address range.
+// Copy-on-write pages stay read-only until they are written to.
 void page_table_set_flags(uintptr_t virt_addr, uintptr_t size, uint16_t flags);
 
+// Resolves a page fault at the virtual address.
+// A page that is not present is mapped copy-on-write to `page`, or populated
+// with zeros if `page` is 0. A write to a copy-on-write page gives the page a
+// private writable copy.
+NODISCARD int page_table_handle_fault(uintptr_t virt_addr, uint16_t flags,
+                                      bool write, uintptr_t page);
+
+// Returns the page mapped at the virtual address with a reference taken,
+// or -ENOENT if the page is not present. A private writable page is made
+// copy-on-write.
+uintptr_t page_table_loan_page(uintptr_t virt_addr);
+
+// Flushes the TLB entries of the virtual address range on the current CPU.
+void flush_tlb_range_local(uintptr_t virt_addr, size_t size);
+
 #endif
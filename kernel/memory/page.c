@@ -1,5 +1,7 @@
 #include "memory.h"
+#include "private.h"
 #include <common/extra.h>
+#include <common/string.h>
 #include <kernel/api/sys/types.h>
 #include <kernel/kmsg.h>
 #include <kernel/lock.h>
@@ -8,35 +10,152 @@
 #include <kernel/system.h>
 #include <stdbool.h>
 
+// Physical pages are managed by a buddy allocator. A free block of order k
+// consists of 2^k pages and is aligned to 2^k pages. Each order has a bitmap
+// with a bit per block, which is set when the block is free.
+//
+// To find a free block without scanning the whole bitmap, the bitmaps are
+// hierarchical: each bit of an upper level tells whether the corresponding
+// word of the level below has any bit set.
+
 #define MAX_NUM_PAGES (1024 * 1024)
 #define BITMAP_INDEX(i) ((i) / 32)
 #define BITMAP_MAX_LEN BITMAP_INDEX(MAX_NUM_PAGES)
 
-static size_t bitmap_len;
-static uint32_t bitmap[BITMAP_MAX_LEN];
-static uint8_t ref_counts[MAX_NUM_PAGES];
-static struct mutex lock;
+// With MAX_NUM_PAGES pages, the top level of order 0 has 32 words.
+#define NUM_LEVELS 3
+
+struct free_map {
+    uint32_t* levels[NUM_LEVELS];
+    size_t lens[NUM_LEVELS];
+};
+
+// Upper bound of the number of words needed by the bitmaps of all orders
+#define FREE_MAP_POOL_LEN                                                      \
+    (2 * (BITMAP_MAX_LEN + BITMAP_MAX_LEN / 32 + BITMAP_MAX_LEN / 1024) +      \
+     NUM_LEVELS * (MAX_PAGE_ORDER + 1))
+
+static uint32_t free_map_pool[FREE_MAP_POOL_LEN];
+static struct free_map free_maps[MAX_PAGE_ORDER + 1];
+static size_t num_pages;
+static atomic_uchar ref_counts[MAX_NUM_PAGES];
+static struct mutex lock; // Protects free_maps
+
+// Number of free pages in free_maps, excluding the per-CPU caches
+static atomic_size_t num_free_pages;
+
+// Each CPU caches free pages so that allocating and freeing single pages
+// doesn't need to take the global lock. The caches are refilled from and
+// drained to the buddy allocator in batches.
+#define PAGE_CACHE_SIZE 32
+#define PAGE_CACHE_BATCH 16
+
+struct cpu_page_cache {
+    // Mostly taken by the owning CPU. Other CPUs take it to drain the cache
+    // when the buddy allocator runs out of pages.
+    struct spinlock lock;
+    size_t count;
+    uint32_t pages[PAGE_CACHE_SIZE]; // Indices of the pages
+};
+
+static struct cpu_page_cache page_caches[MAX_NUM_CPUS];
+
+// The reclaim task is woken up when the free pages drop below the low
+// watermark, and frees cached memory until they reach the high watermark.
+static size_t low_watermark;
+static size_t high_watermark;
+
+static bool free_map_get(const struct free_map* map, size_t i) {
+    if (BITMAP_INDEX(i) >= map->lens[0])
+        return false;
+    return map->levels[0][BITMAP_INDEX(i)] & (1U << (i & 31));
+}
+
+static void free_map_set(struct free_map* map, size_t i) {
+    for (size_t level = 0; level < NUM_LEVELS; ++level) {
+        ASSERT(BITMAP_INDEX(i) < map->lens[level]);
+        uint32_t* word = map->levels[level] + BITMAP_INDEX(i);
+        bool was_empty = *word == 0;
+        *word |= 1U << (i & 31);
+        if (!was_empty)
+            break;
+        i = BITMAP_INDEX(i);
+    }
+}
 
-static bool bitmap_get(size_t i) {
-    ASSERT(BITMAP_INDEX(i) < bitmap_len);
-    return bitmap[BITMAP_INDEX(i)] & (1U << (i & 31));
+static void free_map_clear(struct free_map* map, size_t i) {
+    for (size_t level = 0; level < NUM_LEVELS; ++level) {
+        ASSERT(BITMAP_INDEX(i) < map->lens[level]);
+        uint32_t* word = map->levels[level] + BITMAP_INDEX(i);
+        *word &= ~(1U << (i & 31));
+        if (*word)
+            break;
+        i = BITMAP_INDEX(i);
+    }
+}
+
+static ssize_t free_map_find_first_set(const struct free_map* map) {
+    const size_t top = NUM_LEVELS - 1;
+    size_t i = 0;
+    for (; i < map->lens[top]; ++i) {
+        if (map->levels[top][i])
+            break;
+    }
+    if (i == map->lens[top])
+        return -ENOMEM;
+    for (size_t level = top + 1; level-- > 0;) {
+        int b = __builtin_ffs(map->levels[level][i]);
+        ASSERT(b > 0);
+        i = (i << 5) | (b - 1);
+    }
+    return i;
 }
 
-static void bitmap_set(size_t i) {
-    ASSERT(BITMAP_INDEX(i) < bitmap_len);
-    bitmap[BITMAP_INDEX(i)] |= 1U << (i & 31);
+static void free_maps_init(void) {
+    size_t pool_len = 0;
+    for (size_t order = 0; order <= MAX_PAGE_ORDER; ++order) {
+        struct free_map* map = free_maps + order;
+        size_t num_bits = DIV_CEIL(num_pages, 1U << order);
+        for (size_t level = 0; level < NUM_LEVELS; ++level) {
+            size_t len = MAX(DIV_CEIL(num_bits, 32), 1);
+            map->levels[level] = free_map_pool + pool_len;
+            map->lens[level] = len;
+            pool_len += len;
+            num_bits = len;
+        }
+    }
+    ASSERT(pool_len <= FREE_MAP_POOL_LEN);
 }
 
-static void bitmap_clear(size_t i) {
-    ASSERT(BITMAP_INDEX(i) < bitmap_len);
-    bitmap[BITMAP_INDEX(i)] &= ~(1U << (i & 31));
+// Marks the page free, merging it with its free buddies.
+static void free_page(size_t index) {
+    size_t order = 0;
+    for (; order < MAX_PAGE_ORDER; ++order) {
+        struct free_map* map = free_maps + order;
+        size_t buddy = index ^ 1;
+        if (!free_map_get(map, buddy))
+            break;
+        free_map_clear(map, buddy);
+        index >>= 1;
+    }
+    free_map_set(free_maps + order, index);
 }
 
-static ssize_t bitmap_find_first_set(void) {
-    for (size_t i = 0; i < bitmap_len; ++i) {
-        int b = __builtin_ffs(bitmap[i]);
-        if (b > 0) // b == 0 if bitmap[i] == 0
-            return (i << 5) | (b - 1);
+// Takes a free block of the given order, splitting a larger block if needed.
+// Returns the index of the first page of the block.
+static ssize_t alloc_block(size_t order) {
+    for (size_t k = order; k <= MAX_PAGE_ORDER; ++k) {
+        ssize_t index = free_map_find_first_set(free_maps + k);
+        if (IS_ERR(index))
+            continue;
+        free_map_clear(free_maps + k, index);
+        // Return the upper halves to the lower orders.
+        while (k > order) {
+            --k;
+            index <<= 1;
+            free_map_set(free_maps + k, index | 1);
+        }
+        return index << order;
     }
     return -ENOMEM;
 }
@@ -67,12 +186,19 @@ static void get_available_physical_addr_bounds(const multiboot_info_t* mb_info,
     }
 }
 
-static struct memory_stats stats;
+static size_t total_kibibytes;
+
+static void free_maps_init_pages(const multiboot_info_t* mb_info,
+                                 uintptr_t lower_bound,
+                                 uintptr_t upper_bound) {
+    num_pages = upper_bound / PAGE_SIZE;
+    ASSERT(num_pages <= MAX_NUM_PAGES);
+    free_maps_init();
 
-static void bitmap_init(const multiboot_info_t* mb_info, uintptr_t lower_bound,
-                        uintptr_t upper_bound) {
-    bitmap_len = DIV_CEIL(upper_bound, PAGE_SIZE * 32);
-    ASSERT(bitmap_len <= BITMAP_MAX_LEN);
+    // By setting initial reference counts to be non-zero values,
+    // the reference counts of unavailable pages will never reach zero,
+    // avoiding accidentally marking the pages available for allocation.
+    memset((void*)ref_counts, UINT8_MAX, sizeof(ref_counts));
 
     if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP) {
         uint32_t num_entries =
@@ -100,12 +226,12 @@ static void bitmap_init(const multiboot_info_t* mb_info, uintptr_t lower_bound,
 
             for (size_t i = DIV_CEIL(entry_start, PAGE_SIZE);
                  i < entry_end / PAGE_SIZE; ++i)
-                bitmap_set(i);
+                ref_counts[i] = 0;
         }
     } else {
         for (size_t i = DIV_CEIL(lower_bound, PAGE_SIZE);
              i < upper_bound / PAGE_SIZE; ++i)
-            bitmap_set(i);
+            ref_counts[i] = 0;
     }
 
     if (mb_info->flags & MULTIBOOT_INFO_MODS) {
@@ -116,31 +242,26 @@ static void bitmap_init(const multiboot_info_t* mb_info, uintptr_t lower_bound,
                     mod->mod_end, (mod->mod_end - mod->mod_start) / 0x100000);
             for (size_t i = mod->mod_start / PAGE_SIZE;
                  i < DIV_CEIL(mod->mod_end, PAGE_SIZE); ++i)
-                bitmap_clear(i);
+                ref_counts[i] = UINT8_MAX;
             ++mod;
         }
     }
 
-    size_t num_pages = 0;
-    for (size_t i = 0; i < bitmap_len * 32; ++i) {
-        if (bitmap_get(i)) {
-            ++num_pages;
-        } else {
-            // By setting initial reference counts to be non-zero values,
-            // the reference counts of these pages will never reach zero,
-            // avoiding accidentally marking the pages available for allocation.
-            ref_counts[i] = UINT8_MAX;
+    for (size_t i = 0; i < num_pages; ++i) {
+        if (ref_counts[i] == 0) {
+            free_page(i);
+            ++num_free_pages;
         }
     }
-    stats.total_kibibytes = stats.free_kibibytes = num_pages * PAGE_SIZE / 1024;
-    kprintf("page: #physical pages = %u (%u KiB)\n", num_pages,
-            stats.total_kibibytes);
+    total_kibibytes = num_free_pages * PAGE_SIZE / 1024;
+    kprintf("page: #physical pages = %u (%u KiB)\n", num_free_pages,
+            total_kibibytes);
 }
 
 void page_init(const multiboot_info_t* mb_info) {
     // In the current setup, kernel image (including 1MiB offset) has to fit in
-    // single page table (< 4MiB), and last two pages are reserved for quickmap
-    ASSERT((uintptr_t)kernel_end <= KERNEL_VIRT_ADDR + 1022 * PAGE_SIZE);
+    // single page table (< 4MiB)
+    ASSERT((uintptr_t)kernel_end <= KERNEL_VIRT_ADDR + 1024 * PAGE_SIZE);
 
     uintptr_t lower_bound;
     uintptr_t upper_bound;
@@ -148,74 +269,241 @@ void page_init(const multiboot_info_t* mb_info) {
     kprintf("page: available physical memory address space P%#x - P%#x\n",
             lower_bound, upper_bound);
 
-    bitmap_init(mb_info, lower_bound, upper_bound);
+    free_maps_init_pages(mb_info, lower_bound, upper_bound);
+
+    low_watermark = MAX(num_free_pages / 64, 64);
+    high_watermark = 2 * low_watermark;
+
+    lockstat_register_mutex(&lock, "page_lock");
 }
 
-uintptr_t page_alloc(void) {
+// Returns pages to the buddy allocator.
+static void free_pages(const uint32_t* pages, size_t n) {
     mutex_lock(&lock);
+    for (size_t i = 0; i < n; ++i)
+        free_page(pages[i]);
+    num_free_pages += n;
+    mutex_unlock(&lock);
+}
 
-    ssize_t first_set = bitmap_find_first_set();
-    if (IS_ERR(first_set)) {
-        mutex_unlock(&lock);
-        kprint("page: out of physical pages\n");
-        return first_set;
+static ssize_t alloc_from_buddy(size_t order) {
+    mutex_lock(&lock);
+    ssize_t index = alloc_block(order);
+    if (IS_OK(index))
+        num_free_pages -= 1U << order;
+    mutex_unlock(&lock);
+    return index;
+}
+
+// Takes a batch of pages from the buddy allocator, keeps the first one for
+// the caller, and puts the rest into the cache.
+static ssize_t refill_cache(struct cpu_page_cache* cache) {
+    uint32_t pages[PAGE_CACHE_BATCH];
+    size_t n = 0;
+    mutex_lock(&lock);
+    for (; n < PAGE_CACHE_BATCH; ++n) {
+        ssize_t index = alloc_block(0);
+        if (IS_ERR(index))
+            break;
+        pages[n] = index;
     }
+    num_free_pages -= n;
+    mutex_unlock(&lock);
+    if (n == 0)
+        return -ENOMEM;
 
-    ASSERT(ref_counts[first_set] == 0);
-    ASSERT(bitmap_get(first_set));
+    size_t i = 1;
+    spinlock_lock(&cache->lock);
+    for (; i < n && cache->count < PAGE_CACHE_SIZE; ++i)
+        cache->pages[cache->count++] = pages[i];
+    spinlock_unlock(&cache->lock);
 
-    ref_counts[first_set] = 1;
-    bitmap_clear(first_set);
-    stats.free_kibibytes -= PAGE_SIZE / 1024;
+    // The cache was refilled by someone else in the meantime.
+    if (i < n)
+        free_pages(pages + i, n - i);
 
-    mutex_unlock(&lock);
-    return first_set * PAGE_SIZE;
+    return pages[0];
 }
 
-void page_ref(uintptr_t phys_addr) {
-    ASSERT(phys_addr % PAGE_SIZE == 0);
-    size_t index = phys_addr / PAGE_SIZE;
-    if (BITMAP_INDEX(index) >= bitmap_len)
+// The task may migrate to another CPU after picking the cache, which is
+// harmless because the cache is protected by its own lock.
+static struct cpu_page_cache* current_cache(void) {
+    return page_caches + cpu_get_id();
+}
+
+static ssize_t alloc_from_cache(void) {
+    struct cpu_page_cache* cache = current_cache();
+    spinlock_lock(&cache->lock);
+    if (cache->count > 0) {
+        ssize_t index = cache->pages[--cache->count];
+        spinlock_unlock(&cache->lock);
+        return index;
+    }
+    spinlock_unlock(&cache->lock);
+    return refill_cache(cache);
+}
+
+static void free_to_cache(size_t index) {
+    struct cpu_page_cache* cache = current_cache();
+    spinlock_lock(&cache->lock);
+    if (cache->count < PAGE_CACHE_SIZE) {
+        cache->pages[cache->count++] = index;
+        spinlock_unlock(&cache->lock);
         return;
+    }
 
-    mutex_lock(&lock);
+    // Drain the least recently freed pages, which are the least likely
+    // to be in the CPU cache.
+    uint32_t pages[PAGE_CACHE_BATCH];
+    memcpy(pages, cache->pages, sizeof(pages));
+    cache->count -= PAGE_CACHE_BATCH;
+    memmove(cache->pages, cache->pages + PAGE_CACHE_BATCH,
+            cache->count * sizeof(uint32_t));
+    cache->pages[cache->count++] = index;
+    spinlock_unlock(&cache->lock);
+
+    free_pages(pages, PAGE_CACHE_BATCH);
+}
 
-    ASSERT(ref_counts[index] > 0);
-    ASSERT(!bitmap_get(index));
+// Returns the pages in all the per-CPU caches to the buddy allocator.
+static void drain_caches(void) {
+    for (size_t i = 0; i < num_cpus; ++i) {
+        struct cpu_page_cache* cache = page_caches + i;
+        uint32_t pages[PAGE_CACHE_SIZE];
+        spinlock_lock(&cache->lock);
+        size_t n = cache->count;
+        memcpy(pages, cache->pages, n * sizeof(uint32_t));
+        cache->count = 0;
+        spinlock_unlock(&cache->lock);
+        if (n > 0)
+            free_pages(pages, n);
+    }
+}
 
-    if (ref_counts[index] < UINT8_MAX)
-        ++ref_counts[index];
+static ssize_t alloc_pages(size_t order) {
+    return order == 0 ? alloc_from_cache() : alloc_from_buddy(order);
+}
 
-    mutex_unlock(&lock);
+static uintptr_t finish_alloc(size_t index, size_t order) {
+    if (num_free_pages < low_watermark)
+        reclaim_wake();
+
+    for (size_t i = 0; i < (1U << order); ++i) {
+        ASSERT(ref_counts[index + i] == 0);
+        atomic_store_explicit(ref_counts + index + i, 1, memory_order_relaxed);
+    }
+    return index * PAGE_SIZE;
+}
+
+uintptr_t page_alloc_contiguous(size_t order) {
+    ASSERT(order <= MAX_PAGE_ORDER);
+
+    ssize_t index = alloc_pages(order);
+    if (IS_ERR(index)) {
+        // Reclaim memory cached by shrinkers and per-CPU caches, and try
+        // again. Pages freed by the shrinkers go to the per-CPU caches,
+        // so drain them after shrinking.
+        shrink_memory(1U << order);
+        drain_caches();
+        index = alloc_pages(order);
+    }
+    if (IS_ERR(index)) {
+        kprintf("page: out of physical pages (order %u)\n", order);
+        // A failed larger allocation may only be due to fragmentation, so
+        // killing a task would not necessarily help.
+        if (order == 0)
+            oom_kill();
+        return index;
+    }
+    return finish_alloc(index, order);
+}
+
+uintptr_t page_try_alloc_contiguous(size_t order) {
+    ASSERT(order <= MAX_PAGE_ORDER);
+
+    ssize_t index = alloc_pages(order);
+    if (IS_ERR(index)) {
+        drain_caches();
+        index = alloc_pages(order);
+    }
+    if (IS_ERR(index))
+        return index;
+    return finish_alloc(index, order);
+}
+
+uintptr_t page_alloc(void) { return page_alloc_contiguous(0); }
+
+// When the reference count is UINT8_MAX, we can't tell whether it actually
+// has exactly UINT8_MAX references or the count was saturated.
+// To be safe, we never change the reference count if count == UINT8_MAX
+// assuming the count was saturated.
+
+void page_ref(uintptr_t phys_addr) {
+    ASSERT(phys_addr % PAGE_SIZE == 0);
+    size_t index = phys_addr / PAGE_SIZE;
+    if (index >= num_pages)
+        return;
+
+    atomic_uchar* ref_count = ref_counts + index;
+    unsigned char count =
+        atomic_load_explicit(ref_count, memory_order_relaxed);
+    do {
+        ASSERT(count > 0);
+        if (count == UINT8_MAX)
+            return;
+    } while (!atomic_compare_exchange_weak_explicit(
+        ref_count, &count, count + 1, memory_order_relaxed,
+        memory_order_relaxed));
 }
 
 void page_unref(uintptr_t phys_addr) {
     ASSERT(phys_addr % PAGE_SIZE == 0);
     size_t index = phys_addr / PAGE_SIZE;
-    if (BITMAP_INDEX(index) >= bitmap_len)
+    if (index >= num_pages)
         return;
 
-    mutex_lock(&lock);
+    atomic_uchar* ref_count = ref_counts + index;
+    unsigned char count =
+        atomic_load_explicit(ref_count, memory_order_relaxed);
+    do {
+        ASSERT(count > 0);
+        if (count == UINT8_MAX)
+            return;
+    } while (!atomic_compare_exchange_weak_explicit(
+        ref_count, &count, count - 1, memory_order_acq_rel,
+        memory_order_relaxed));
+
+    if (count == 1)
+        free_to_cache(index);
+}
 
-    ASSERT(ref_counts[index] > 0);
-    ASSERT(!bitmap_get(index));
-
-    // When the reference count is UINT8_MAX, we can't tell whether it actually
-    // has exactly UINT8_MAX references or the count was saturated.
-    // To be safe, we never decrement the reference count if count == UINT8_MAX
-    // assuming the count was saturated.
-    if (ref_counts[index] < UINT8_MAX) {
-        if (--ref_counts[index] == 0) {
-            bitmap_set(index);
-            stats.free_kibibytes += PAGE_SIZE / 1024;
-        }
+void page_reclaim(void) {
+    while (num_free_pages < high_watermark) {
+        size_t num_freed = shrink_memory(high_watermark - num_free_pages);
+        drain_caches();
+        if (num_freed == 0)
+            break;
     }
+}
 
-    mutex_unlock(&lock);
+size_t page_ref_count(uintptr_t phys_addr) {
+    ASSERT(phys_addr % PAGE_SIZE == 0);
+    size_t index = phys_addr / PAGE_SIZE;
+    if (index >= num_pages)
+        return UINT8_MAX;
+
+    size_t ref_count = atomic_load_explicit(ref_counts + index,
+                                            memory_order_acquire);
+    ASSERT(ref_count > 0);
+    return ref_count;
 }
 
 void memory_get_stats(struct memory_stats* out_stats) {
-    mutex_lock(&lock);
-    *out_stats = stats;
-    mutex_unlock(&lock);
+    // The counts are read without locking, so the result may be slightly
+    // out of date.
+    size_t num_free = num_free_pages;
+    for (size_t i = 0; i < num_cpus; ++i)
+        num_free += page_caches[i].count;
+    out_stats->total_kibibytes = total_kibibytes;
+    out_stats->free_kibibytes = num_free * PAGE_SIZE / 1024;
 }
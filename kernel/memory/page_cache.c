@@ -0,0 +1,327 @@
+#include "private.h"
+#include <common/string.h>
+#include <kernel/api/err.h>
+#include <kernel/panic.h>
+#include <kernel/safe_string.h>
+
+// Each node of the radix tree covers 2^SLOT_BITS times the range of its
+// children. The bottom level holds physical addresses of the pages.
+#define SLOT_BITS 6
+#define NUM_SLOTS (1 << SLOT_BITS)
+#define SLOT_MASK (NUM_SLOTS - 1)
+
+// Page indices are size_t, which limits the size of the contents.
+#define INDEX_BITS (sizeof(size_t) * 8)
+#define MAX_SIZE (((uint64_t)SIZE_MAX + 1) * PAGE_SIZE)
+
+struct page_cache_node {
+    uintptr_t slots[NUM_SLOTS]; // Child nodes, or pages at the bottom level
+};
+
+static bool fits(size_t height, size_t index) {
+    size_t bits = height * SLOT_BITS;
+    return bits >= INDEX_BITS || (index >> bits) == 0;
+}
+
+static void free_node(struct page_cache_node* node, size_t level) {
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        if (!node->slots[i])
+            continue;
+        if (level > 0)
+            free_node((struct page_cache_node*)node->slots[i], level - 1);
+        else
+            page_unref(node->slots[i]);
+    }
+    kfree(node);
+}
+
+static void free_all(struct page_cache* cache) {
+    if (cache->root)
+        free_node(cache->root, cache->height - 1);
+    cache->root = NULL;
+    cache->height = 0;
+}
+
+void page_cache_destroy(struct page_cache* cache) {
+    free_all(cache);
+    cache->size = 0;
+}
+
+static struct page_cache_node* alloc_node(void) {
+    struct page_cache_node* node = kmalloc(sizeof(struct page_cache_node));
+    if (node)
+        *node = (struct page_cache_node){0};
+    return node;
+}
+
+// Returns the slot that holds the page at the index.
+// If create is false, returns NULL if the slot does not exist.
+static uintptr_t* find_slot(struct page_cache* cache, size_t index,
+                            bool create) {
+    while (!cache->root || !fits(cache->height, index)) {
+        if (!create)
+            return NULL;
+        // Grow the tree by adding a new root above the current one
+        struct page_cache_node* root = alloc_node();
+        if (!root)
+            return ERR_PTR(-ENOMEM);
+        root->slots[0] = (uintptr_t)cache->root;
+        cache->root = root;
+        ++cache->height;
+    }
+
+    struct page_cache_node* node = cache->root;
+    for (size_t level = cache->height - 1; level > 0; --level) {
+        size_t i = (index >> (level * SLOT_BITS)) & SLOT_MASK;
+        uintptr_t* slot = node->slots + i;
+        if (!*slot) {
+            if (!create)
+                return NULL;
+            struct page_cache_node* child = alloc_node();
+            if (!child)
+                return ERR_PTR(-ENOMEM);
+            *slot = (uintptr_t)child;
+        }
+        node = (struct page_cache_node*)*slot;
+    }
+    return node->slots + (index & SLOT_MASK);
+}
+
+// Returns the page at the index, or 0 if the page is a hole.
+static uintptr_t lookup_page(struct page_cache* cache, size_t index) {
+    uintptr_t* slot = find_slot(cache, index, false);
+    return slot ? *slot : 0;
+}
+
+// Returns the page at the index, filling the hole with zeros if needed.
+static uintptr_t get_or_create_page(struct page_cache* cache, size_t index) {
+    uintptr_t* slot = find_slot(cache, index, true);
+    if (IS_ERR(slot))
+        return PTR_ERR(slot);
+    if (!*slot) {
+        uintptr_t phys_addr = page_alloc_zeroed();
+        if (IS_ERR(phys_addr))
+            return phys_addr;
+        *slot = phys_addr;
+    }
+    return *slot;
+}
+
+#define PAGES_PER_LARGE_PAGE (LARGE_PAGE_SIZE / PAGE_SIZE)
+
+// Fills the pages starting at the index with a physically contiguous block
+// if they are all holes, so that the pages can be mapped with a large page.
+// This is only an optimization, so failures are ignored.
+static void fill_with_large_page(struct page_cache* cache, size_t index) {
+    ASSERT(index % PAGES_PER_LARGE_PAGE == 0);
+    for (size_t i = 0; i < PAGES_PER_LARGE_PAGE; ++i) {
+        if (lookup_page(cache, index + i))
+            return;
+    }
+
+    uintptr_t phys_addr = page_try_alloc_contiguous(MAX_PAGE_ORDER);
+    if (IS_ERR(phys_addr))
+        return;
+    size_t i = 0;
+    for (; i < PAGES_PER_LARGE_PAGE; ++i) {
+        uintptr_t* slot = find_slot(cache, index + i, true);
+        if (IS_ERR(slot))
+            break;
+        uintptr_t page = phys_addr + i * PAGE_SIZE;
+        page_clear(page, 0, PAGE_SIZE);
+        *slot = page;
+    }
+    // The pages that didn't make it into the cache are freed.
+    for (; i < PAGES_PER_LARGE_PAGE; ++i)
+        page_unref(phys_addr + i * PAGE_SIZE);
+}
+
+ssize_t page_cache_read(struct page_cache* cache, void* buffer, size_t count,
+                        uint64_t offset) {
+    mutex_lock(&cache->lock);
+    if (offset >= cache->size) {
+        mutex_unlock(&cache->lock);
+        return 0;
+    }
+    count = MIN(count, cache->size - offset);
+
+    unsigned char* dest = buffer;
+    size_t nread = 0;
+    int rc = 0;
+    while (nread < count) {
+        uint64_t pos = offset + nread;
+        size_t page_offset = pos % PAGE_SIZE;
+        size_t n = MIN(PAGE_SIZE - page_offset, count - nread);
+        uintptr_t phys_addr = lookup_page(cache, pos / PAGE_SIZE);
+        rc = phys_addr ? page_copy_to_buffer(phys_addr, page_offset,
+                                             dest + nread, n)
+                       : safe_memset(dest + nread, 0, n);
+        if (IS_ERR(rc))
+            break;
+        nread += n;
+    }
+    mutex_unlock(&cache->lock);
+
+    if (nread == 0 && IS_ERR(rc))
+        return rc;
+    return nread;
+}
+
+ssize_t page_cache_write(struct page_cache* cache, const void* buffer,
+                         size_t count, uint64_t offset) {
+    uint64_t end = offset + count;
+    if (end < offset || end > MAX_SIZE)
+        return -EFBIG;
+
+    mutex_lock(&cache->lock);
+
+    const unsigned char* src = buffer;
+    size_t nwritten = 0;
+    int rc = 0;
+    while (nwritten < count) {
+        uint64_t pos = offset + nwritten;
+        size_t page_offset = pos % PAGE_SIZE;
+        size_t n = MIN(PAGE_SIZE - page_offset, count - nwritten);
+        uintptr_t phys_addr = get_or_create_page(cache, pos / PAGE_SIZE);
+        if (IS_ERR(phys_addr)) {
+            rc = phys_addr;
+            break;
+        }
+        rc = page_copy_from_buffer(phys_addr, page_offset, src + nwritten, n);
+        if (IS_ERR(rc))
+            break;
+        nwritten += n;
+    }
+
+    if (cache->size < offset + nwritten)
+        cache->size = offset + nwritten;
+    mutex_unlock(&cache->lock);
+
+    if (nwritten == 0 && IS_ERR(rc))
+        return rc;
+    return nwritten;
+}
+
+uintptr_t page_cache_loan_page(struct page_cache* cache, uint64_t offset,
+                               size_t* count) {
+    mutex_lock(&cache->lock);
+    if (offset >= cache->size) {
+        mutex_unlock(&cache->lock);
+        *count = 0;
+        return 0;
+    }
+
+    size_t page_offset = offset % PAGE_SIZE;
+    *count = MIN(*count, PAGE_SIZE - page_offset);
+    *count = MIN(*count, cache->size - offset);
+    uintptr_t phys_addr = get_or_create_page(cache, offset / PAGE_SIZE);
+    if (IS_OK(phys_addr))
+        page_ref(phys_addr);
+    mutex_unlock(&cache->lock);
+    return phys_addr;
+}
+
+uintptr_t page_cache_get_page(struct page_cache* cache, uint64_t offset) {
+    mutex_lock(&cache->lock);
+    uintptr_t phys_addr = -EFAULT;
+    if (offset < ROUND_UP(cache->size, PAGE_SIZE)) {
+        phys_addr = lookup_page(cache, offset / PAGE_SIZE);
+        if (phys_addr)
+            page_ref(phys_addr);
+    }
+    mutex_unlock(&cache->lock);
+    return phys_addr;
+}
+
+// Drops the pages at `first` and after in the subtree of the node.
+static void truncate_node(struct page_cache_node* node, size_t level,
+                          size_t first) {
+    uint64_t span = (uint64_t)1 << (level * SLOT_BITS);
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        if (!node->slots[i])
+            continue;
+        uint64_t start = i * span;
+        if (start >= first) {
+            if (level > 0)
+                free_node((struct page_cache_node*)node->slots[i], level - 1);
+            else
+                page_unref(node->slots[i]);
+            node->slots[i] = 0;
+        } else if (level > 0 && start + span > first) {
+            truncate_node((struct page_cache_node*)node->slots[i], level - 1,
+                          first - start);
+        }
+    }
+}
+
+int page_cache_truncate(struct page_cache* cache, uint64_t length) {
+    if (length > MAX_SIZE)
+        return -EFBIG;
+
+    mutex_lock(&cache->lock);
+    if (length < cache->size) {
+        uint64_t first = DIV_CEIL(length, PAGE_SIZE);
+        if (first == 0)
+            free_all(cache);
+        else if (cache->root && first <= SIZE_MAX &&
+                 fits(cache->height, first))
+            truncate_node(cache->root, cache->height - 1, first);
+
+        // Bytes past the end of the contents have to read as zeros when the
+        // contents grow again.
+        size_t page_offset = length % PAGE_SIZE;
+        if (page_offset) {
+            uintptr_t phys_addr = lookup_page(cache, length / PAGE_SIZE);
+            if (phys_addr)
+                page_clear(phys_addr, page_offset, PAGE_SIZE - page_offset);
+        }
+    }
+
+    cache->size = length;
+    mutex_unlock(&cache->lock);
+    return 0;
+}
+
+void* page_cache_mmap(struct page_cache* cache, void* addr, size_t length,
+                      uint64_t offset, int flags) {
+    if (offset % PAGE_SIZE || !(flags & VM_SHARED))
+        return ERR_PTR(-EINVAL);
+
+    size_t num_pages = DIV_CEIL(length, PAGE_SIZE);
+    uintptr_t* pages = kmalloc(num_pages * sizeof(uintptr_t));
+    if (!pages)
+        return ERR_PTR(-ENOMEM);
+
+    mutex_lock(&cache->lock);
+    if (offset + length > ROUND_UP(cache->size, PAGE_SIZE)) {
+        addr = ERR_PTR(-EINVAL);
+        goto done;
+    }
+
+    size_t first = offset / PAGE_SIZE;
+    if (page_table_supports_large_pages()) {
+        size_t index = ROUND_UP(first, PAGES_PER_LARGE_PAGE);
+        for (; index + PAGES_PER_LARGE_PAGE <= first + num_pages;
+             index += PAGES_PER_LARGE_PAGE)
+            fill_with_large_page(cache, index);
+    }
+
+    for (size_t i = 0; i < num_pages; ++i) {
+        // The mapping has to see later writes to the holes.
+        uintptr_t phys_addr = get_or_create_page(cache, first + i);
+        if (IS_ERR(phys_addr)) {
+            addr = ERR_PTR(phys_addr);
+            goto done;
+        }
+        pages[i] = phys_addr;
+    }
+
+    // The pages stay mapped even if the cache drops them later, as the
+    // mapping holds its own references.
+    addr = vm_map_pages(addr, pages, num_pages, flags);
+
+done:
+    mutex_unlock(&cache->lock);
+    kfree(pages);
+    return addr;
+}
@@ -6,6 +6,7 @@
 #include <kernel/kmsg.h>
 #include <kernel/memory/memory.h>
 #include <kernel/panic.h>
+#include <kernel/safe_string.h>
 #include <kernel/task.h>
 
 #define PTE_FLAGS_MASK 0xfff
@@ -31,6 +32,35 @@ typedef struct {
     alignas(PAGE_SIZE) page_table_entry entries[1024];
 } page_table;
 
+// A page directory entry with PDE_LARGE set maps a 4MiB page directly
+// instead of pointing to a page table. The PAT bit of a large page is bit 12
+// because bit 7 is taken by PDE_LARGE.
+#define PDE_LARGE 0x80
+#define PDE_LARGE_PAT 0x1000
+#define LARGE_PAGE_ADDR_MASK (~(LARGE_PAGE_SIZE - 1))
+
+static bool is_large(const page_directory_entry* pde) {
+    return pde->raw & PDE_LARGE;
+}
+
+static uint32_t to_large_flags(uint16_t pte_flags) {
+    uint32_t flags = (pte_flags & ~PTE_PAT) | PDE_LARGE;
+    if (pte_flags & PTE_PAT)
+        flags |= PDE_LARGE_PAT;
+    return flags;
+}
+
+static uint16_t from_large_flags(uint32_t pde_raw) {
+    uint16_t flags = pde_raw & PTE_FLAGS_MASK & ~PDE_LARGE;
+    if (pde_raw & PDE_LARGE_PAT)
+        flags |= PTE_PAT;
+    return flags;
+}
+
+bool page_table_supports_large_pages(void) {
+    return cpu_has_feature(cpu_get_bsp(), X86_FEATURE_PSE);
+}
+
 struct page_directory* current_page_directory(void) {
     if (!current)
         return kernel_page_directory;
@@ -46,10 +76,15 @@ static volatile page_table* get_page_table_from_index(size_t index) {
     return (volatile page_table*)(0xffc00000 + PAGE_SIZE * index);
 }
 
+static page_directory_entry* get_pde(uintptr_t virt_addr) {
+    return current_page_directory()->entries + (virt_addr >> 22);
+}
+
 static volatile page_table* get_or_create_page_table(uintptr_t virt_addr) {
     size_t pd_idx = virt_addr >> 22;
 
-    page_directory_entry* pde = current_page_directory()->entries + pd_idx;
+    page_directory_entry* pde = get_pde(virt_addr);
+    ASSERT(!is_large(pde));
     bool created = false;
     if (!pde->present) {
         pde->raw = page_alloc();
@@ -69,9 +104,10 @@ static volatile page_table* get_or_create_page_table(uintptr_t virt_addr) {
 
 static volatile page_table_entry* get_pte(uintptr_t virt_addr) {
     size_t pd_idx = virt_addr >> 22;
-    page_directory_entry* pde = current_page_directory()->entries + pd_idx;
+    page_directory_entry* pde = get_pde(virt_addr);
     if (!pde->present)
         return NULL;
+    ASSERT(!is_large(pde));
 
     volatile page_table* pt = get_page_table_from_index(pd_idx);
     return pt->entries + ((virt_addr >> 12) & 0x3ff);
@@ -84,26 +120,80 @@ static volatile page_table_entry* get_or_create_pte(uintptr_t virt_addr) {
     return pt->entries + ((virt_addr >> 12) & 0x3ff);
 }
 
+// Returns the page table entry that maps the page, with large pages
+// presented as if they were mapped by page tables.
+// Returns 0 if the page is not mapped.
+static uint32_t lookup_pte(uintptr_t virt_addr) {
+    const page_directory_entry* pde = get_pde(virt_addr);
+    if (!pde->present)
+        return 0;
+    if (is_large(pde)) {
+        uintptr_t offset = ROUND_DOWN(virt_addr, PAGE_SIZE) % LARGE_PAGE_SIZE;
+        return ((pde->raw & LARGE_PAGE_ADDR_MASK) + offset) |
+               from_large_flags(pde->raw);
+    }
+    const volatile page_table_entry* pte = get_pte(virt_addr);
+    return pte->present ? pte->raw : 0;
+}
+
 uintptr_t virt_to_phys(void* virt_addr) {
     uintptr_t addr = (uintptr_t)virt_addr;
-    const volatile page_table_entry* pte = get_pte(addr);
+    uint32_t pte = lookup_pte(addr);
     ASSERT(pte);
-    ASSERT(pte->present);
-    return (pte->raw & ~PTE_FLAGS_MASK) | (addr & PTE_FLAGS_MASK);
+    return (pte & ~PTE_FLAGS_MASK) | (addr & PTE_FLAGS_MASK);
+}
+
+// Page directory entries of the kernel space are copied to every page
+// directory. When one of them changes, the change is propagated to all
+// page directories.
+struct page_directory_node {
+    struct page_directory* pd;
+    struct page_directory_node* next;
+};
+
+static struct page_directory_node* page_directories;
+static struct spinlock page_directories_lock;
+
+// Page directory entries of the page tables created by page_table_init.
+// They are restored when large pages in the kernel space are unmapped.
+static uint32_t kernel_page_tables[1024 - KERNEL_PDE_IDX];
+
+static void set_pde(uintptr_t virt_addr, uint32_t raw) {
+    size_t pd_idx = virt_addr >> 22;
+    if (pd_idx < KERNEL_PDE_IDX) {
+        current_page_directory()->entries[pd_idx].raw = raw;
+        return;
+    }
+    spinlock_lock(&page_directories_lock);
+    kernel_page_directory->entries[pd_idx].raw = raw;
+    for (struct page_directory_node* it = page_directories; it; it = it->next)
+        it->pd->entries[pd_idx].raw = raw;
+    spinlock_unlock(&page_directories_lock);
 }
 
 struct page_directory* page_directory_create(void) {
     struct page_directory* dst = kmalloc(sizeof(struct page_directory));
     if (!dst)
         return ERR_PTR(-ENOMEM);
+    struct page_directory_node* node =
+        kmalloc(sizeof(struct page_directory_node));
+    if (!node) {
+        kfree(dst);
+        return ERR_PTR(-ENOMEM);
+    }
+    node->pd = dst;
 
     // userland
     memset(dst->entries, 0, KERNEL_PDE_IDX * sizeof(page_directory_entry));
 
     // kernel
+    spinlock_lock(&page_directories_lock);
     memcpy(dst->entries + KERNEL_PDE_IDX,
            (void*)(kernel_page_directory->entries + KERNEL_PDE_IDX),
            (1023 - KERNEL_PDE_IDX) * sizeof(page_directory_entry));
+    node->next = page_directories;
+    page_directories = node;
+    spinlock_unlock(&page_directories_lock);
 
     // recursive
     page_directory_entry* last_entry = dst->entries + 1023;
@@ -113,7 +203,42 @@ struct page_directory* page_directory_create(void) {
     return dst;
 }
 
-static void flush_tlb_range(uintptr_t virt_addr, size_t size) {
+// Above this size, flushing the whole TLB is cheaper than invalidating
+// the pages one by one.
+#define FLUSH_TLB_ALL_THRESHOLD (32 * PAGE_SIZE)
+
+// Flushes all the TLB entries including global ones.
+static void flush_tlb_global(void) {
+    uint32_t cr4 = read_cr4();
+    if (!(cr4 & X86_CR4_PGE)) {
+        flush_tlb();
+        return;
+    }
+    // Toggling CR4.PGE flushes the entire TLB.
+    write_cr4(cr4 & ~X86_CR4_PGE);
+    write_cr4(cr4);
+}
+
+void flush_tlb_range_local(uintptr_t virt_addr, size_t size) {
+    if (size > FLUSH_TLB_ALL_THRESHOLD) {
+        // Reloading CR3 does not flush global pages, which are only used
+        // for kernel space.
+        if (virt_addr + size <= KERNEL_VIRT_ADDR)
+            flush_tlb();
+        else
+            flush_tlb_global();
+        return;
+    }
+    for (uintptr_t addr = virt_addr; addr < virt_addr + size; addr += PAGE_SIZE)
+        flush_tlb_single(addr);
+}
+
+static bool is_active_on(const struct vm* vm, size_t cpu_id) {
+    return vm->active_cpus[cpu_id / 32] & (1U << (cpu_id % 32));
+}
+
+// Flushes the TLB entries of the range on all CPUs that may have them cached.
+static void shootdown(uintptr_t virt_addr, size_t size) {
     ASSERT((virt_addr % PAGE_SIZE) == 0);
     ASSERT((size % PAGE_SIZE) == 0);
 
@@ -130,19 +255,13 @@ static void flush_tlb_range(uintptr_t virt_addr, size_t size) {
             };
             cpu_broadcast_message(msg);
         } else {
-            ASSERT(is_user_range((void*)virt_addr, size));
+            ASSERT(virt_addr + size <= KERNEL_VIRT_ADDR);
             uint8_t cpu_id = cpu_get_id();
 
             // If the address is userland, we only need to flush TLBs of CPUs
-            // that is in the same vm as the current task
+            // that have the current vm loaded
             for (size_t i = 0; i < num_cpus; ++i) {
-                if (i == cpu_id)
-                    continue;
-                struct cpu* cpu = cpus[i];
-                struct task* task = cpu->current_task;
-                if (!task)
-                    continue;
-                if (task->vm != current->vm)
+                if (i == cpu_id || !is_active_on(current->vm, i))
                     continue;
                 if (!msg) {
                     msg = cpu_alloc_message();
@@ -152,14 +271,13 @@ static void flush_tlb_range(uintptr_t virt_addr, size_t size) {
                     };
                 }
                 ++msg->ref_count;
-                cpu_unicast_message(cpu, msg);
+                cpu_unicast_message(cpus[i], msg);
             }
         }
     }
 
     // While other CPUs are flushing TLBs, we can flush this CPU's TLB
-    for (uintptr_t addr = virt_addr; addr < virt_addr + size; addr += PAGE_SIZE)
-        flush_tlb_single(addr);
+    flush_tlb_range_local(virt_addr, size);
 
     // Wait for other CPUs to finish flushing TLBs
     if (msg) {
@@ -171,73 +289,206 @@ static void flush_tlb_range(uintptr_t virt_addr, size_t size) {
     pop_cli(int_flag);
 }
 
-// quickmap temporarily maps a physical page to the fixed virtual addresses,
-// which are at the last two pages of the kernel page directory
+// Returns the batch that defers the flushes of the address, or NULL if the
+// address has to be flushed right away.
+static struct tlb_batch* batch_for(uintptr_t virt_addr) {
+    if (!current || !current->tlb_batch)
+        return NULL;
+    struct tlb_batch* batch = current->tlb_batch;
+    bool is_kernel = is_kernel_address((void*)virt_addr);
+    return is_kernel == (batch->vm == kernel_vm) ? batch : NULL;
+}
+
+// Accounts pages mapped to or unmapped from the userland of the current vm.
+static void add_resident_pages(uintptr_t virt_addr, ssize_t n) {
+    if (virt_addr >= KERNEL_VIRT_ADDR || !current)
+        return;
+    struct vm* vm = current->vm;
+    if (vm != kernel_vm)
+        vm->num_resident_pages += n;
+}
 
-#define QUICKMAP_PAGE 1022
-#define QUICKMAP_PAGE_TABLE 1023
+static void extend_range(uintptr_t* start, uintptr_t* end, uintptr_t virt_addr,
+                         size_t size) {
+    if (*start == *end) {
+        *start = virt_addr;
+        *end = virt_addr + size;
+    } else {
+        *start = MIN(*start, virt_addr);
+        *end = MAX(*end, virt_addr + size);
+    }
+}
 
-// this is locked in page_directory_clone_current
-static struct mutex quickmap_lock;
+static void flush_tlb_range(uintptr_t virt_addr, size_t size) {
+    struct tlb_batch* batch = batch_for(virt_addr);
+    if (batch)
+        extend_range(&batch->flush_start, &batch->flush_end, virt_addr, size);
+    else
+        shootdown(virt_addr, size);
+}
+
+// Releases the pages that were unmapped from the range. This has to be done
+// after flushing the TLB entries of the range, as other CPUs may keep
+// accessing the pages until then.
+static void release_unmapped_pages(uintptr_t virt_addr, size_t size) {
+    uintptr_t virt_end = virt_addr + size;
+    for (uintptr_t virt_cursor = virt_addr; virt_cursor < virt_end;
+         virt_cursor += PAGE_SIZE) {
+        page_directory_entry* pde = get_pde(virt_cursor);
+        if (!pde->present && is_large(pde)) {
+            uintptr_t phys_addr = pde->raw & LARGE_PAGE_ADDR_MASK;
+            for (size_t i = 0; i < 1024; ++i)
+                page_unref(phys_addr + i * PAGE_SIZE);
+            size_t pd_idx = virt_cursor >> 22;
+            set_pde(virt_cursor,
+                    pd_idx < KERNEL_PDE_IDX
+                        ? 0
+                        : kernel_page_tables[pd_idx - KERNEL_PDE_IDX]);
+            virt_cursor = ROUND_DOWN(virt_cursor, LARGE_PAGE_SIZE) +
+                          LARGE_PAGE_SIZE - PAGE_SIZE;
+            continue;
+        }
+        volatile page_table_entry* pte = get_pte(virt_cursor);
+        // page_table_unmap clears the present bit but leaves the address.
+        if (!pte || pte->present || !pte->raw)
+            continue;
+        page_unref(pte->raw & ~PTE_FLAGS_MASK);
+        pte->raw = 0;
+    }
+}
+
+void tlb_batch_begin(struct tlb_batch* batch, struct vm* vm) {
+    *batch = (struct tlb_batch){.vm = vm};
+    if (!current)
+        return;
+    // Operations on kernel_vm may happen in the middle of an operation on
+    // a user vm, e.g. when allocating kernel memory.
+    batch->outer = current->tlb_batch;
+    current->tlb_batch = batch;
+}
+
+void tlb_batch_end(struct tlb_batch* batch) {
+    if (!current)
+        return;
+    ASSERT(current->tlb_batch == batch);
+    current->tlb_batch = batch->outer;
+
+    if (batch->flush_start != batch->flush_end)
+        shootdown(batch->flush_start, batch->flush_end - batch->flush_start);
+    if (batch->release_start != batch->release_end)
+        release_unmapped_pages(batch->release_start,
+                               batch->release_end - batch->release_start);
+}
+
+// quickmap temporarily maps a physical page to a virtual address reserved for
+// the current CPU. The caller has to keep interrupts disabled until
+// unquickmap so that the task stays on the CPU. As no other CPU uses the
+// address, only the TLB of the current CPU has to be flushed.
+
+#define QUICKMAP_START KERNEL_HEAP_END
+#define QUICKMAP_END (QUICKMAP_START + 1024 * PAGE_SIZE)
+
+#define QUICKMAP_PAGE 0
+#define QUICKMAP_PAGE_TABLE 1
+#define NUM_QUICKMAP_SLOTS 2
+
+STATIC_ASSERT(MAX_NUM_CPUS * NUM_QUICKMAP_SLOTS * PAGE_SIZE <=
+              QUICKMAP_END - QUICKMAP_START);
+
+static volatile page_table_entry* quickmap_pte(size_t which,
+                                               uintptr_t* virt_addr) {
+    ASSERT(!interrupts_enabled());
+    ASSERT(which < NUM_QUICKMAP_SLOTS);
+    size_t index = cpu_get_id() * NUM_QUICKMAP_SLOTS + which;
+    *virt_addr = QUICKMAP_START + PAGE_SIZE * index;
+    volatile page_table* pt = get_page_table_from_index(QUICKMAP_START >> 22);
+    return pt->entries + index;
+}
 
 static uintptr_t quickmap(size_t which, uintptr_t phys_addr, uint32_t flags) {
-    volatile page_table* pt = get_page_table_from_index(KERNEL_PDE_IDX);
-    volatile page_table_entry* pte = pt->entries + which;
+    uintptr_t virt_addr;
+    volatile page_table_entry* pte = quickmap_pte(which, &virt_addr);
     ASSERT(pte->raw == 0);
     pte->raw = phys_addr | flags;
     pte->present = true;
-    uintptr_t virt_addr = KERNEL_VIRT_ADDR + PAGE_SIZE * which;
-    flush_tlb_range(virt_addr, PAGE_SIZE);
     return virt_addr;
 }
 
 static void unquickmap(size_t which) {
-    volatile page_table* pt = get_page_table_from_index(KERNEL_PDE_IDX);
-    volatile page_table_entry* pte = pt->entries + which;
+    uintptr_t virt_addr;
+    volatile page_table_entry* pte = quickmap_pte(which, &virt_addr);
     ASSERT(pte->present);
     pte->raw = 0;
-    flush_tlb_range(KERNEL_VIRT_ADDR + PAGE_SIZE * which, PAGE_SIZE);
+    flush_tlb_single(virt_addr);
 }
 
-static uintptr_t clone_page_table(const volatile page_table* src,
-                                  uintptr_t src_virt_addr) {
+// Replaces the large page containing the address with a page table mapping
+// the same pages.
+static int split_large_page(uintptr_t virt_addr) {
+    uintptr_t start = ROUND_DOWN(virt_addr, LARGE_PAGE_SIZE);
+    size_t pd_idx = start >> 22;
+    uint32_t raw = get_pde(start)->raw;
+    uintptr_t phys_addr = raw & LARGE_PAGE_ADDR_MASK;
+    uint16_t flags = from_large_flags(raw);
+
+    uint32_t pt_pde;
+    if (pd_idx < KERNEL_PDE_IDX) {
+        uintptr_t pt_phys_addr = page_alloc();
+        if (IS_ERR(pt_phys_addr))
+            return pt_phys_addr;
+        pt_pde = pt_phys_addr | PTE_PRESENT | PTE_WRITE | PTE_USER;
+    } else {
+        pt_pde = kernel_page_tables[pd_idx - KERNEL_PDE_IDX];
+    }
+
+    bool int_flag = push_cli();
+    volatile page_table* pt = (volatile page_table*)quickmap(
+        QUICKMAP_PAGE_TABLE, pt_pde & ~PTE_FLAGS_MASK, PTE_WRITE);
+    for (size_t i = 0; i < 1024; ++i)
+        pt->entries[i].raw = (phys_addr + i * PAGE_SIZE) | flags;
+    unquickmap(QUICKMAP_PAGE_TABLE);
+    pop_cli(int_flag);
+
+    set_pde(start, pt_pde);
+    flush_tlb_range(start, LARGE_PAGE_SIZE);
+    return 0;
+}
+
+static bool is_mapped_by_large_page(uintptr_t virt_addr) {
+    const page_directory_entry* pde = get_pde(virt_addr);
+    return pde->present && is_large(pde);
+}
+
+static uintptr_t clone_page_table(volatile page_table* src) {
     uintptr_t dest_pt_phys_addr = page_alloc();
     if (IS_ERR(dest_pt_phys_addr))
         return dest_pt_phys_addr;
 
+    bool int_flag = push_cli();
     uintptr_t dest_pt_virt_addr =
         quickmap(QUICKMAP_PAGE_TABLE, dest_pt_phys_addr, PTE_WRITE);
     volatile page_table* dest_pt = (volatile page_table*)dest_pt_virt_addr;
 
     for (size_t i = 0; i < 1024; ++i) {
-        if (!src->entries[i].present) {
+        volatile page_table_entry* src_pte = src->entries + i;
+        if (!src_pte->present) {
             dest_pt->entries[i].raw = 0;
             continue;
         }
 
-        if (src->entries[i].raw & PTE_SHARED) {
-            dest_pt->entries[i].raw = src->entries[i].raw;
-            page_ref(src->entries[i].raw & ~PTE_FLAGS_MASK);
-            continue;
-        }
-
-        uintptr_t dest_page_phys_addr = page_alloc();
-        if (IS_ERR(dest_page_phys_addr)) {
-            unquickmap(QUICKMAP_PAGE_TABLE);
-            return dest_page_phys_addr;
+        // Private pages are shared read-only by both vm instances until
+        // either of them writes to the page.
+        if (!(src_pte->raw & PTE_SHARED)) {
+            src_pte->raw |= PTE_COW;
+            src_pte->write = false;
         }
 
-        dest_pt->entries[i].raw =
-            dest_page_phys_addr | (src->entries[i].raw & PTE_FLAGS_MASK);
-
-        uintptr_t dest_page_virt_addr =
-            quickmap(QUICKMAP_PAGE, dest_page_phys_addr, PTE_WRITE);
-        memcpy((void*)dest_page_virt_addr,
-               (void*)(src_virt_addr + PAGE_SIZE * i), PAGE_SIZE);
-        unquickmap(QUICKMAP_PAGE);
+        dest_pt->entries[i].raw = src_pte->raw;
+        page_ref(src_pte->raw & ~PTE_FLAGS_MASK);
     }
 
     unquickmap(QUICKMAP_PAGE_TABLE);
+    pop_cli(int_flag);
     return dest_pt_phys_addr;
 }
 
@@ -248,8 +499,6 @@ struct page_directory* page_directory_clone_current(void) {
 
     // copy userland region
 
-    mutex_lock(&quickmap_lock);
-
     struct page_directory* src = current_page_directory();
     for (size_t i = 0; i < KERNEL_PDE_IDX; ++i) {
         if (!src->entries[i].present) {
@@ -257,18 +506,37 @@ struct page_directory* page_directory_clone_current(void) {
             continue;
         }
 
+        if (is_large(src->entries + i) &&
+            !(src->entries[i].raw & PTE_SHARED)) {
+            // Private pages are copied on write one by one.
+            int rc = split_large_page(i << 22);
+            if (IS_ERR(rc)) {
+                dst = ERR_PTR(rc);
+                break;
+            }
+        }
+
+        if (is_large(src->entries + i)) {
+            uintptr_t phys_addr = src->entries[i].raw & LARGE_PAGE_ADDR_MASK;
+            for (size_t j = 0; j < 1024; ++j)
+                page_ref(phys_addr + j * PAGE_SIZE);
+            dst->entries[i].raw = src->entries[i].raw;
+            continue;
+        }
+
         volatile page_table* pt = get_page_table_from_index(i);
-        uintptr_t cloned_pt_phys_addr = clone_page_table(pt, i * 0x400000);
+        uintptr_t cloned_pt_phys_addr = clone_page_table(pt);
         if (IS_ERR(cloned_pt_phys_addr)) {
-            mutex_unlock(&quickmap_lock);
-            return ERR_PTR(cloned_pt_phys_addr);
+            dst = ERR_PTR(cloned_pt_phys_addr);
+            break;
         }
 
         dst->entries[i].raw =
             cloned_pt_phys_addr | (src->entries[i].raw & PTE_FLAGS_MASK);
     }
 
-    mutex_unlock(&quickmap_lock);
+    // Writable pages of the current vm may have become copy-on-write.
+    flush_tlb_range(0, KERNEL_VIRT_ADDR);
 
     return dst;
 }
@@ -287,10 +555,17 @@ void page_directory_destroy_current(void) {
         if (!pd->entries[i].present)
             continue;
 
+        if (is_large(pd->entries + i)) {
+            uintptr_t phys_addr = pd->entries[i].raw & LARGE_PAGE_ADDR_MASK;
+            for (size_t j = 0; j < 1024; ++j)
+                page_unref(phys_addr + j * PAGE_SIZE);
+            continue;
+        }
+
         volatile page_table* pt = get_page_table_from_index(i);
         for (size_t j = 0; j < 1024; ++j) {
             if (pt->entries[j].present)
-                page_unref(pt->entries[i].raw & ~PTE_FLAGS_MASK);
+                page_unref(pt->entries[j].raw & ~PTE_FLAGS_MASK);
         }
     }
 
@@ -303,10 +578,24 @@ void page_directory_destroy_current(void) {
     page_directory_switch(kernel_page_directory);
 
     for (size_t i = 0; i < KERNEL_PDE_IDX; ++i) {
-        if (pd->entries[i].present)
+        if (pd->entries[i].present && !is_large(pd->entries + i))
             page_unref(pd->entries[i].raw & ~PTE_FLAGS_MASK);
     }
 
+    spinlock_lock(&page_directories_lock);
+    struct page_directory_node* node = NULL;
+    for (struct page_directory_node** it = &page_directories; *it;
+         it = &(*it)->next) {
+        if ((*it)->pd == pd) {
+            node = *it;
+            *it = node->next;
+            break;
+        }
+    }
+    spinlock_unlock(&page_directories_lock);
+    ASSERT(node);
+
+    kfree(node);
     kfree(pd);
 }
 
@@ -322,9 +611,56 @@ void page_table_init(void) {
 
     // Populate page directory entries for kernel space so that all vm instances
     // share the same kernel space
-    for (size_t virt_addr = KERNEL_HEAP_START; virt_addr < KERNEL_HEAP_END;
-         virt_addr += 1024 * PAGE_SIZE)
+    for (size_t virt_addr = KERNEL_HEAP_START; virt_addr < QUICKMAP_END;
+         virt_addr += LARGE_PAGE_SIZE) {
         ASSERT_OK(get_or_create_page_table(virt_addr));
+        size_t pd_idx = virt_addr >> 22;
+        kernel_page_tables[pd_idx - KERNEL_PDE_IDX] =
+            kernel_page_directory->entries[pd_idx].raw;
+    }
+}
+
+// Returns whether the range starting at virt_addr can be mapped with a large
+// page.
+static bool can_map_large(uintptr_t virt_addr, uintptr_t phys_addr,
+                          uintptr_t virt_end, uint16_t flags) {
+    if (!page_table_supports_large_pages())
+        return false;
+    if (virt_addr % LARGE_PAGE_SIZE || phys_addr % LARGE_PAGE_SIZE ||
+        virt_end - virt_addr < LARGE_PAGE_SIZE)
+        return false;
+
+    size_t pd_idx = virt_addr >> 22;
+    const page_directory_entry* pde = get_pde(virt_addr);
+    if (pd_idx < KERNEL_PDE_IDX) {
+        // Private pages are copied on write one by one, so a private large
+        // page is split before it is shared copy-on-write.
+        return !(flags & PTE_COW) && !pde->raw;
+    }
+
+    // The page table of the kernel space is replaced by the large page, so
+    // none of its entries may be in use.
+    if (pde->raw != kernel_page_tables[pd_idx - KERNEL_PDE_IDX])
+        return false;
+    volatile page_table* pt = get_page_table_from_index(pd_idx);
+    for (size_t i = 0; i < 1024; ++i) {
+        if (pt->entries[i].raw)
+            return false;
+    }
+    return true;
+}
+
+int page_table_split_large_pages(uintptr_t virt_addr, uintptr_t size) {
+    // Large pages that are entirely inside the range can stay as they are.
+    uintptr_t virt_end = virt_addr + size;
+    if (virt_addr % LARGE_PAGE_SIZE && is_mapped_by_large_page(virt_addr)) {
+        int rc = split_large_page(virt_addr);
+        if (IS_ERR(rc))
+            return rc;
+    }
+    if (virt_end % LARGE_PAGE_SIZE && is_mapped_by_large_page(virt_end))
+        return split_large_page(virt_end);
+    return 0;
 }
 
 int page_table_map_anon(uintptr_t virt_addr, uintptr_t size, uint16_t flags) {
@@ -351,6 +687,7 @@ int page_table_map_anon(uintptr_t virt_addr, uintptr_t size, uint16_t flags) {
 
         pte->raw = phys_addr | flags;
         pte->present = true;
+        add_resident_pages(virt_cursor, 1);
     }
 
     flush_tlb_range(virt_addr, size);
@@ -373,8 +710,18 @@ int page_table_map_phys(uintptr_t virt_addr, uintptr_t phys_addr,
     uintptr_t virt_end = virt_addr + size;
     uintptr_t phys_cursor = phys_addr;
 
-    for (; virt_cursor < virt_end;
-         virt_cursor += PAGE_SIZE, phys_cursor += PAGE_SIZE) {
+    while (virt_cursor < virt_end) {
+        if (can_map_large(virt_cursor, phys_cursor, virt_end, flags)) {
+            for (size_t i = 0; i < 1024; ++i)
+                page_ref(phys_cursor + i * PAGE_SIZE);
+            set_pde(virt_cursor,
+                    phys_cursor | to_large_flags(flags) | PTE_PRESENT);
+            add_resident_pages(virt_cursor, LARGE_PAGE_SIZE / PAGE_SIZE);
+            virt_cursor += LARGE_PAGE_SIZE;
+            phys_cursor += LARGE_PAGE_SIZE;
+            continue;
+        }
+
         volatile page_table_entry* pte = get_or_create_pte(virt_cursor);
         if (IS_ERR(pte)) {
             ret = PTR_ERR(pte);
@@ -386,6 +733,10 @@ int page_table_map_phys(uintptr_t virt_addr, uintptr_t phys_addr,
 
         pte->raw = phys_cursor | flags;
         pte->present = true;
+        add_resident_pages(virt_cursor, 1);
+
+        virt_cursor += PAGE_SIZE;
+        phys_cursor += PAGE_SIZE;
     }
 
     flush_tlb_range(virt_addr, size);
@@ -409,8 +760,9 @@ int page_table_shallow_copy(uintptr_t to_virt_addr, uintptr_t from_virt_addr,
 
     for (; from_virt_cursor < from_virt_end;
          from_virt_cursor += PAGE_SIZE, to_virt_cursor += PAGE_SIZE) {
-        volatile page_table_entry* from_pte = get_pte(from_virt_cursor);
-        ASSERT(from_pte && from_pte->present);
+        uint32_t from_pte = lookup_pte(from_virt_cursor);
+        if (!from_pte) // Not populated yet
+            continue;
 
         volatile page_table_entry* to_pte = get_or_create_pte(to_virt_cursor);
         if (IS_ERR(to_pte)) {
@@ -419,11 +771,16 @@ int page_table_shallow_copy(uintptr_t to_virt_addr, uintptr_t from_virt_addr,
         }
         ASSERT(!to_pte->present);
 
-        uintptr_t phys_addr = from_pte->raw & ~PTE_FLAGS_MASK;
+        uintptr_t phys_addr = from_pte & ~PTE_FLAGS_MASK;
         page_ref(phys_addr);
 
         to_pte->raw = phys_addr | new_flags;
         to_pte->present = true;
+        add_resident_pages(to_virt_cursor, 1);
+        if (from_pte & PTE_COW) {
+            to_pte->raw |= PTE_COW;
+            to_pte->write = false;
+        }
     }
 
     flush_tlb_range(to_virt_addr, size);
@@ -438,15 +795,37 @@ void page_table_unmap(uintptr_t virt_addr, uintptr_t size) {
     ASSERT((virt_addr % PAGE_SIZE) == 0);
     ASSERT((size % PAGE_SIZE) == 0);
 
+    // The pages are released after the TLB entries are flushed.
     uintptr_t virt_end = virt_addr + ROUND_UP(size, PAGE_SIZE);
-    for (uintptr_t virt_cursor = virt_addr; virt_cursor < virt_end;
-         virt_cursor += PAGE_SIZE) {
+    uintptr_t virt_cursor = virt_addr;
+    while (virt_cursor < virt_end) {
+        page_directory_entry* pde = get_pde(virt_cursor);
+        if (pde->present && is_large(pde)) {
+            // Partially covered large pages have been split beforehand.
+            ASSERT(virt_cursor % LARGE_PAGE_SIZE == 0);
+            ASSERT(virt_end - virt_cursor >= LARGE_PAGE_SIZE);
+            set_pde(virt_cursor, pde->raw & ~PTE_PRESENT);
+            add_resident_pages(virt_cursor, -(LARGE_PAGE_SIZE / PAGE_SIZE));
+            virt_cursor += LARGE_PAGE_SIZE;
+            continue;
+        }
         volatile page_table_entry* pte = get_pte(virt_cursor);
-        ASSERT(pte && pte->present);
-        page_unref(pte->raw & ~PTE_FLAGS_MASK);
-        pte->raw = 0;
+        if (pte && pte->present) {
+            pte->present = false;
+            add_resident_pages(virt_cursor, -1);
+        }
+        virt_cursor += PAGE_SIZE;
     }
-    flush_tlb_range(virt_addr, size);
+
+    struct tlb_batch* batch = batch_for(virt_addr);
+    if (batch) {
+        extend_range(&batch->flush_start, &batch->flush_end, virt_addr, size);
+        extend_range(&batch->release_start, &batch->release_end, virt_addr,
+                     size);
+        return;
+    }
+    shootdown(virt_addr, size);
+    release_unmapped_pages(virt_addr, size);
 }
 
 void page_table_set_flags(uintptr_t virt_addr, uintptr_t size, uint16_t flags) {
@@ -456,10 +835,225 @@ void page_table_set_flags(uintptr_t virt_addr, uintptr_t size, uint16_t flags) {
     uintptr_t virt_end = virt_addr + ROUND_UP(size, PAGE_SIZE);
     for (uintptr_t virt_cursor = virt_addr; virt_cursor < virt_end;
          virt_cursor += PAGE_SIZE) {
+        page_directory_entry* pde = get_pde(virt_cursor);
+        if (pde->present && is_large(pde)) {
+            ASSERT(virt_cursor % LARGE_PAGE_SIZE == 0);
+            ASSERT(virt_end - virt_cursor >= LARGE_PAGE_SIZE);
+            set_pde(virt_cursor, (pde->raw & LARGE_PAGE_ADDR_MASK) |
+                                     to_large_flags(flags) | PTE_PRESENT);
+            virt_cursor += LARGE_PAGE_SIZE - PAGE_SIZE;
+            continue;
+        }
         volatile page_table_entry* pte = get_pte(virt_cursor);
-        ASSERT(pte && pte->present);
-        pte->raw = (pte->raw & ~PTE_FLAGS_MASK) | flags;
+        if (!pte || !pte->present) // Not populated yet
+            continue;
+        uint16_t cow = pte->raw & PTE_COW;
+        pte->raw = (pte->raw & ~PTE_FLAGS_MASK) | flags | cow;
         pte->present = true;
+        if (cow)
+            pte->write = false;
     }
     flush_tlb_range(virt_addr, size);
 }
+
+// Physical page filled with zeros, shared copy-on-write by pages that have
+// only been read.
+static _Atomic(uintptr_t) zero_page_phys_addr;
+
+// Allocates a page and fills it with a copy of src, or with zeros if src is 0.
+static uintptr_t alloc_page_copy(uintptr_t src) {
+    uintptr_t phys_addr = page_alloc();
+    if (IS_ERR(phys_addr))
+        return phys_addr;
+
+    bool int_flag = push_cli();
+    uintptr_t virt_addr = quickmap(QUICKMAP_PAGE, phys_addr, PTE_WRITE);
+    if (src)
+        memcpy((void*)virt_addr, (void*)src, PAGE_SIZE);
+    else
+        memset((void*)virt_addr, 0, PAGE_SIZE);
+    unquickmap(QUICKMAP_PAGE);
+    pop_cli(int_flag);
+
+    return phys_addr;
+}
+
+uintptr_t page_alloc_zeroed(void) { return alloc_page_copy(0); }
+
+void page_clear(uintptr_t phys_addr, size_t offset, size_t n) {
+    ASSERT(offset + n <= PAGE_SIZE);
+    bool int_flag = push_cli();
+    uintptr_t virt_addr = quickmap(QUICKMAP_PAGE, phys_addr, PTE_WRITE);
+    memset((void*)(virt_addr + offset), 0, n);
+    unquickmap(QUICKMAP_PAGE);
+    pop_cli(int_flag);
+}
+
+// The buffers of page_copy_to_buffer and page_copy_from_buffer may be in
+// user space. The copy is first attempted while the page is quickmapped. If
+// the buffer is not populated yet, the page fault cannot be resolved with
+// interrupts disabled, so the copy goes through a bounce buffer instead.
+#define BOUNCE_BUFFER_SIZE 256
+
+int page_copy_to_buffer(uintptr_t phys_addr, size_t offset, void* dest,
+                        size_t n) {
+    ASSERT(offset + n <= PAGE_SIZE);
+    bool int_flag = push_cli();
+    uintptr_t virt_addr = quickmap(QUICKMAP_PAGE, phys_addr, 0);
+    int rc = safe_memcpy(dest, (void*)(virt_addr + offset), n);
+    unquickmap(QUICKMAP_PAGE);
+    pop_cli(int_flag);
+    if (IS_OK(rc))
+        return 0;
+
+    unsigned char bounce[BOUNCE_BUFFER_SIZE];
+    for (size_t i = 0; i < n; i += BOUNCE_BUFFER_SIZE) {
+        size_t len = MIN(BOUNCE_BUFFER_SIZE, n - i);
+        int_flag = push_cli();
+        virt_addr = quickmap(QUICKMAP_PAGE, phys_addr, 0);
+        memcpy(bounce, (void*)(virt_addr + offset + i), len);
+        unquickmap(QUICKMAP_PAGE);
+        pop_cli(int_flag);
+        rc = safe_memcpy((unsigned char*)dest + i, bounce, len);
+        if (IS_ERR(rc))
+            return rc;
+    }
+    return 0;
+}
+
+int page_copy_from_buffer(uintptr_t phys_addr, size_t offset, const void* src,
+                          size_t n) {
+    ASSERT(offset + n <= PAGE_SIZE);
+    bool int_flag = push_cli();
+    uintptr_t virt_addr = quickmap(QUICKMAP_PAGE, phys_addr, PTE_WRITE);
+    int rc = safe_memcpy((void*)(virt_addr + offset), src, n);
+    unquickmap(QUICKMAP_PAGE);
+    pop_cli(int_flag);
+    if (IS_OK(rc))
+        return 0;
+
+    unsigned char bounce[BOUNCE_BUFFER_SIZE];
+    for (size_t i = 0; i < n; i += BOUNCE_BUFFER_SIZE) {
+        size_t len = MIN(BOUNCE_BUFFER_SIZE, n - i);
+        rc = safe_memcpy(bounce, (const unsigned char*)src + i, len);
+        if (IS_ERR(rc))
+            return rc;
+        int_flag = push_cli();
+        virt_addr = quickmap(QUICKMAP_PAGE, phys_addr, PTE_WRITE);
+        memcpy((void*)(virt_addr + offset + i), bounce, len);
+        unquickmap(QUICKMAP_PAGE);
+        pop_cli(int_flag);
+    }
+    return 0;
+}
+
+static uintptr_t get_zero_page(void) {
+    uintptr_t phys_addr = zero_page_phys_addr;
+    if (phys_addr)
+        return phys_addr;
+
+    phys_addr = alloc_page_copy(0);
+    if (IS_ERR(phys_addr))
+        return phys_addr;
+
+    // Someone else may have allocated the zero page in the meantime.
+    uintptr_t expected = 0;
+    if (atomic_compare_exchange_strong(&zero_page_phys_addr, &expected,
+                                       phys_addr))
+        return phys_addr;
+    page_unref(phys_addr);
+    return expected;
+}
+
+static int copy_on_write(uintptr_t virt_addr, volatile page_table_entry* pte) {
+    uintptr_t phys_addr = pte->raw & ~PTE_FLAGS_MASK;
+    uint16_t flags = (pte->raw & PTE_FLAGS_MASK & ~PTE_COW) | PTE_WRITE;
+
+    // If no one else refers to the page, we can take it over without copying.
+    if (page_ref_count(phys_addr) > 1) {
+        bool is_zero_page = phys_addr == zero_page_phys_addr;
+        uintptr_t new_phys_addr = alloc_page_copy(is_zero_page ? 0 : virt_addr);
+        if (IS_ERR(new_phys_addr))
+            return new_phys_addr;
+        page_unref(phys_addr);
+        phys_addr = new_phys_addr;
+    }
+
+    pte->raw = phys_addr | flags;
+    flush_tlb_range(virt_addr, PAGE_SIZE);
+    return 0;
+}
+
+int page_table_handle_fault(uintptr_t virt_addr, uint16_t flags, bool write,
+                            uintptr_t page) {
+    ASSERT((virt_addr % PAGE_SIZE) == 0);
+
+    const page_directory_entry* pde = get_pde(virt_addr);
+    if (pde->present && is_large(pde)) {
+        // Large pages are split before they become copy-on-write.
+        return (!write || pde->write) ? 0 : -EFAULT;
+    }
+
+    volatile page_table_entry* pte = get_or_create_pte(virt_addr);
+    if (IS_ERR(pte))
+        return PTR_ERR(pte);
+
+    if (!pte->present) {
+        uintptr_t phys_addr;
+        if (write && !page) {
+            phys_addr = alloc_page_copy(0);
+        } else {
+            // Reads are served by the backing page, or by the zero page,
+            // until the first write.
+            phys_addr = page ? page : get_zero_page();
+            if (IS_OK(phys_addr)) {
+                page_ref(phys_addr);
+                flags = (flags & ~PTE_WRITE) | PTE_COW;
+            }
+        }
+        if (IS_ERR(phys_addr))
+            return phys_addr;
+
+        // The page was not present, so there is no TLB entry to flush.
+        pte->raw = phys_addr | flags;
+        pte->present = true;
+        add_resident_pages(virt_addr, 1);
+        if (!write || !page)
+            return 0;
+        return copy_on_write(virt_addr, pte);
+    }
+
+    if (!write || pte->write) {
+        // Another task sharing the vm has already resolved the fault.
+        return 0;
+    }
+    if (pte->raw & PTE_COW)
+        return copy_on_write(virt_addr, pte);
+    return -EFAULT;
+}
+
+uintptr_t page_table_loan_page(uintptr_t virt_addr) {
+    ASSERT((virt_addr % PAGE_SIZE) == 0);
+
+    uint32_t entry = lookup_pte(virt_addr);
+    if (!entry)
+        return -ENOENT;
+
+    // The borrower expects the contents of private pages to stay as they
+    // were when they were loaned, so the owner has to get a copy on its
+    // next write.
+    if ((entry & PTE_WRITE) && !(entry & PTE_SHARED)) {
+        if (is_mapped_by_large_page(virt_addr)) {
+            int rc = split_large_page(virt_addr);
+            if (IS_ERR(rc))
+                return rc;
+        }
+        volatile page_table_entry* pte = get_pte(virt_addr);
+        pte->raw = (pte->raw & ~PTE_WRITE) | PTE_COW;
+        flush_tlb_range(virt_addr, PAGE_SIZE);
+    }
+
+    uintptr_t phys_addr = entry & ~PTE_FLAGS_MASK;
+    page_ref(phys_addr);
+    return phys_addr;
+}
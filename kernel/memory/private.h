@@ -2,6 +2,7 @@
 
 #include "memory.h"
 #include <common/extra.h>
+#include <kernel/cpu.h>
 #include <kernel/lock.h>
 #include <stdalign.h>
 
@@ -28,34 +29,146 @@ struct page_directory {
     alignas(PAGE_SIZE) page_directory_entry entries[1024];
 };
 
+// The largest block of the page allocator is 2^MAX_PAGE_ORDER pages (4 MiB).
+#define MAX_PAGE_ORDER 10
+
 void page_init(const multiboot_info_t*);
-uintptr_t page_alloc(void);
-void page_ref(uintptr_t phys_addr);
-void page_unref(uintptr_t phys_addr);
 
-// kernel heap starts right after the quickmap page
+// Allocates 2^order physically contiguous pages aligned to 2^order pages.
+// Each of the pages has its own reference count and is freed individually.
+// If no memory can be reclaimed, a single page allocation kills the process
+// with the largest resident set, and larger allocations fail with -ENOMEM.
+uintptr_t page_alloc_contiguous(size_t order);
+
+// Same as page_alloc_contiguous, but fails instead of reclaiming memory or
+// killing a process. For callers that can fall back to smaller pages.
+uintptr_t page_try_alloc_contiguous(size_t order);
+
+// Allocates a page filled with zeros.
+uintptr_t page_alloc_zeroed(void);
+
+// Fills n bytes of the page at the offset with zeros.
+void page_clear(uintptr_t phys_addr, size_t offset, size_t n);
+
+// Returns the number of references to the page.
+// Pages that are not managed by the page allocator are reported as UINT8_MAX.
+size_t page_ref_count(uintptr_t phys_addr);
+
+// Frees memory cached by shrinkers and per-CPU caches until the number of
+// free pages reaches the high watermark.
+void page_reclaim(void);
+
+// Calls the shrinkers until `target` pages are freed.
+// Returns the number of pages freed.
+size_t shrink_memory(size_t target);
+
+// Wakes up the reclaim task.
+void reclaim_wake(void);
+
+// Kills the user process with the largest resident set, unless a process
+// killed earlier is still exiting.
+void oom_kill(void);
+
+// kernel heap starts right after the page table of the kernel image
 #define KERNEL_HEAP_START (KERNEL_VIRT_ADDR + 1024 * PAGE_SIZE)
 
-// last 4MiB is for recursive mapping
-#define KERNEL_HEAP_END 0xffc00000
+// 4MiB after the kernel heap is for quickmap, and the last 4MiB is for
+// recursive mapping
+#define KERNEL_HEAP_END 0xff800000
 
 void page_table_init(void);
 
+// Physically contiguous ranges mapped with matching 4MiB alignment are
+// mapped with large pages when the CPU supports them.
+#define LARGE_PAGE_SIZE (1024 * PAGE_SIZE)
+
+bool page_table_supports_large_pages(void);
+
+// Splits large pages that are partially covered by the range into page
+// tables, so that the range can be unmapped or have its flags changed.
+NODISCARD int page_table_split_large_pages(uintptr_t virt_addr, uintptr_t size);
+
 struct page_directory* page_directory_create(void);
 struct page_directory* page_directory_clone_current(void);
 void page_directory_destroy_current(void);
 void page_directory_switch(struct page_directory* to);
 
+// Defers TLB flushes of the vm issued by the current task until the batch
+// ends, so that a vm operation that updates page tables several times
+// flushes only once. Pages unmapped during the batch are released after
+// the flush.
+struct tlb_batch {
+    struct vm* vm;
+    uintptr_t flush_start, flush_end;     // Range to flush
+    uintptr_t release_start, release_end; // Range with pages to release
+    struct tlb_batch* outer; // Batch that was active when this one began
+};
+
+void tlb_batch_begin(struct tlb_batch*, struct vm*);
+void tlb_batch_end(struct tlb_batch*);
+
+#define SLAB_MAGAZINE_SIZE 15
+
+// A stack of free objects cached by a CPU. Allocations and frees are served
+// from the magazine of the current CPU without taking any lock.
+struct slab_magazine {
+    size_t count;
+    void* objs[SLAB_MAGAZINE_SIZE];
+    struct slab_magazine* next; // Used when the magazine is in the depot
+};
+
+// Per-CPU state of a slab cache, accessed with interrupts disabled
+struct slab_cpu {
+    struct slab_magazine* magazine;
+    size_t num_allocs;
+    size_t num_frees;
+};
+
 struct slab_cache {
-    struct mutex lock;
+    const char* name;
     size_t obj_size;
-    struct slab_obj* free_list;
+    size_t objs_per_slab;
+    bool uses_magazines;
+
+    struct slab_cpu cpus[MAX_NUM_CPUS];
+
+    struct mutex lock; // Protects the fields below
+
+    // Depot of magazines that are not loaded on any CPU.
+    // Full magazines are exactly full, empty ones are exactly empty.
+    struct slab_magazine* full_magazines;
+    struct slab_magazine* empty_magazines;
+    size_t num_full_magazines;
+
+    struct slab* partial_slabs; // Slabs with both free and allocated objects
+    struct slab* empty_slabs;   // Slabs with only free objects
+    size_t num_slabs;
+    size_t num_free_objs; // Free objects in slabs, excluding magazines
+
+    // Allocations and frees that missed the magazine of the CPU
+    atomic_size_t num_slow_allocs;
+    atomic_size_t num_slow_frees;
+
+    struct slab_cache* next; // Linked list of all caches
 };
 
-void slab_cache_init(struct slab_cache*, size_t obj_size);
+// The list of all slab caches. Caches are never removed from the list.
+extern struct slab_cache* slab_caches;
+
+void slab_cache_init(struct slab_cache*, const char* name, size_t obj_size);
 void* slab_cache_alloc(struct slab_cache*);
 void slab_cache_free(struct slab_cache*, void*);
 
+// Returns objects cached in the depots and empty slabs to the page allocator.
+// Caches that are busy are skipped. Returns the number of pages freed.
+size_t slab_shrink(void);
+
+// Returns the cache the object was allocated from.
+struct slab_cache* slab_cache_of(void* obj);
+
+void kmalloc_init(void);
+void kstack_init(void);
+
 #define VM_RW (VM_READ | VM_WRITE)
 
 struct vm;
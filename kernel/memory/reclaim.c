@@ -0,0 +1,92 @@
+#include "private.h"
+#include <kernel/api/signal.h>
+#include <kernel/kmsg.h>
+#include <kernel/panic.h>
+#include <kernel/sched.h>
+#include <kernel/task.h>
+
+static _Atomic(struct shrinker*) shrinkers;
+
+void shrinker_register(struct shrinker* shrinker) {
+    struct shrinker* head = shrinkers;
+    do {
+        shrinker->next = head;
+    } while (!atomic_compare_exchange_weak(&shrinkers, &head, shrinker));
+}
+
+size_t shrink_memory(size_t target) {
+    size_t num_freed = 0;
+    for (struct shrinker* it = shrinkers; it && num_freed < target;
+         it = it->next)
+        num_freed += it->shrink(target - num_freed);
+    return num_freed;
+}
+
+static struct waitqueue reclaim_waitqueue;
+static atomic_bool reclaim_requested;
+
+void reclaim_wake(void) {
+    if (!atomic_exchange(&reclaim_requested, true))
+        waitqueue_wake_all(&reclaim_waitqueue);
+}
+
+static bool unblock_reclaim(void* data) {
+    (void)data;
+    return reclaim_requested;
+}
+
+static void reclaim_task(void) {
+    for (;;) {
+        ASSERT_OK(sched_block(&reclaim_waitqueue, unblock_reclaim, NULL,
+                              BLOCK_UNINTERRUPTIBLE));
+        page_reclaim();
+
+        // Allocations made while reclaiming may have requested another
+        // round, which is not needed as we have just reclaimed.
+        reclaim_requested = false;
+    }
+}
+
+void reclaim_start(void) { ASSERT_OK(task_spawn("reclaim", reclaim_task)); }
+
+// The process that was killed last. Another process is not killed until
+// this one exits and gives back its memory.
+static atomic_int oom_victim;
+
+void oom_kill(void) {
+    // Pick the process with the largest resident set. Ties are broken by
+    // the larger pid, so that the choice is deterministic.
+    // Kernel tasks and init are never killed.
+    pid_t victim = 0;
+    size_t victim_num_pages = 0;
+    bool victim_alive = false;
+    spinlock_lock(&all_tasks_lock);
+    for (struct task* it = all_tasks; it; it = it->all_tasks_next) {
+        if (it->state == TASK_DEAD)
+            continue;
+        if (it->tgid == oom_victim) {
+            victim_alive = true;
+            break;
+        }
+        struct vm* vm = it->vm;
+        if (vm == kernel_vm || it->tgid <= 1)
+            continue;
+        size_t num_pages = vm->num_resident_pages;
+        if (num_pages > victim_num_pages ||
+            (num_pages == victim_num_pages && it->tgid > victim)) {
+            victim = it->tgid;
+            victim_num_pages = num_pages;
+        }
+    }
+    spinlock_unlock(&all_tasks_lock);
+
+    if (victim_alive || !victim)
+        return;
+
+    // The process may have exited in the meantime.
+    if (IS_ERR(task_send_signal(victim, SIGKILL, SIGNAL_DEST_THREAD_GROUP)))
+        return;
+    oom_victim = victim;
+    kprintf("oom: killed process %d (%u KiB resident)\n", victim,
+            victim_num_pages * PAGE_SIZE / 1024);
+}
@@ -1,23 +1,116 @@
 #include "memory.h"
 #include "private.h"
+#include <kernel/interrupts/interrupts.h>
 #include <kernel/panic.h>
 
-void slab_cache_init(struct slab_cache* cache, size_t obj_size) {
+// Each slab is a single page starting with this header.
+// Objects follow the header, aligned to the largest power of two that
+// divides the object size.
+struct slab {
+    struct vm_region region;
+    struct slab_cache* cache;
+    struct slab_obj* free_list;
+    size_t num_free_objs;
+    struct slab* prev;
+    struct slab* next;
+};
+
+struct slab_obj {
+    struct slab_obj* next;
+};
+
+struct slab_cache* slab_caches;
+static struct spinlock slab_caches_lock;
+
+// Magazines are allocated from this cache, which doesn't use magazines itself.
+static struct slab_cache magazine_cache;
+
+static size_t first_obj_offset(size_t obj_size) {
+    size_t alignment = obj_size & -obj_size;
+    return ROUND_UP(sizeof(struct slab), alignment);
+}
+
+static void init_cache(struct slab_cache* cache, const char* name,
+                       size_t obj_size, bool uses_magazines) {
+    ASSERT(obj_size >= sizeof(struct slab_obj));
+
     // Ensure that the slab fits in a single page
-    ASSERT(sizeof(struct vm_region) + obj_size <= PAGE_SIZE);
+    size_t offset = first_obj_offset(obj_size);
+    ASSERT(offset + obj_size <= PAGE_SIZE);
 
     *cache = (struct slab_cache){
+        .name = name,
         .obj_size = obj_size,
+        .objs_per_slab = (PAGE_SIZE - offset) / obj_size,
+        .uses_magazines = uses_magazines,
     };
+
+    spinlock_lock(&slab_caches_lock);
+    cache->next = slab_caches;
+    slab_caches = cache;
+    spinlock_unlock(&slab_caches_lock);
 }
 
-struct slab_obj {
-    struct slab_obj* next;
+static size_t shrink_slabs(size_t target) {
+    (void)target;
+    return slab_shrink();
+}
+
+static struct shrinker slab_shrinker = {
+    .name = "slab",
+    .shrink = shrink_slabs,
 };
 
-static int ensure_cache(struct slab_cache* cache) {
-    if (cache->free_list)
-        return 0;
+void slab_cache_init(struct slab_cache* cache, const char* name,
+                     size_t obj_size) {
+    if (!magazine_cache.obj_size) {
+        init_cache(&magazine_cache, "slab_magazine",
+                   sizeof(struct slab_magazine), false);
+        shrinker_register(&slab_shrinker);
+    }
+    init_cache(cache, name, obj_size, true);
+}
+
+static struct slab* slab_of(void* obj) {
+    struct slab* slab = (struct slab*)ROUND_DOWN((uintptr_t)obj, PAGE_SIZE);
+    ASSERT((void*)slab != obj);
+    return slab;
+}
+
+struct slab_cache* slab_cache_of(void* obj) { return slab_of(obj)->cache; }
+
+static void list_insert(struct slab** head, struct slab* slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head)
+        (*head)->prev = slab;
+    *head = slab;
+}
+
+static void list_remove(struct slab** head, struct slab* slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *head = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->prev = slab->next = NULL;
+}
+
+// Returns the list the slab belongs to, or NULL if it has no free objects.
+static struct slab** list_for(struct slab_cache* cache, struct slab* slab) {
+    if (slab->num_free_objs == cache->objs_per_slab)
+        return &cache->empty_slabs;
+    if (slab->num_free_objs > 0)
+        return &cache->partial_slabs;
+    return NULL;
+}
+
+// Allocates a new slab and adds it to the empty slab list.
+// Called with cache->lock held. The lock is released while allocating the
+// page, as kernel_vm->lock may be held by a task waiting for cache->lock.
+static int grow(struct slab_cache* cache) {
+    mutex_unlock(&cache->lock);
 
     int ret = 0;
     mutex_lock(&kernel_vm->lock);
@@ -33,47 +126,311 @@ static int ensure_cache(struct slab_cache* cache) {
     if (IS_ERR(ret))
         goto fail;
 
-    struct vm_region* region = (struct vm_region*)virt_addr;
-    *region = (struct vm_region){
-        .start = virt_addr,
-        .end = virt_addr + PAGE_SIZE,
-        .flags = VM_RW,
+    struct slab* slab = (struct slab*)virt_addr;
+    *slab = (struct slab){
+        .region =
+            {
+                .start = virt_addr,
+                .end = virt_addr + PAGE_SIZE,
+                .flags = VM_RW,
+            },
+        .cache = cache,
+        .num_free_objs = cache->objs_per_slab,
     };
-    vm_insert_region_after(kernel_vm, cursor, region);
+    vm_insert_region_after(kernel_vm, cursor, &slab->region);
 
     mutex_unlock(&kernel_vm->lock);
 
-    struct slab_obj* obj =
-        (struct slab_obj*)(virt_addr + sizeof(struct vm_region));
-    for (size_t i = 0; i < PAGE_SIZE / cache->obj_size - 1; ++i) {
-        obj->next = cache->free_list;
-        cache->free_list = obj;
-        obj = (struct slab_obj*)((uintptr_t)obj + cache->obj_size);
+    uintptr_t addr = virt_addr + first_obj_offset(cache->obj_size);
+    for (size_t i = 0; i < cache->objs_per_slab; ++i) {
+        struct slab_obj* obj = (struct slab_obj*)addr;
+        obj->next = slab->free_list;
+        slab->free_list = obj;
+        addr += cache->obj_size;
     }
 
+    mutex_lock(&cache->lock);
+    list_insert(&cache->empty_slabs, slab);
+    ++cache->num_slabs;
+    cache->num_free_objs += cache->objs_per_slab;
     return 0;
 
 fail:
     mutex_unlock(&kernel_vm->lock);
+    mutex_lock(&cache->lock);
     return ret;
 }
 
-void* slab_cache_alloc(struct slab_cache* cache) {
+// Called with cache->lock held.
+static void* alloc_from_slabs(struct slab_cache* cache) {
+    struct slab* slab;
+    for (;;) {
+        slab = cache->partial_slabs;
+        if (!slab)
+            slab = cache->empty_slabs;
+        if (slab)
+            break;
+        // Other tasks may take objects from the new slab while grow()
+        // releases the lock, so check the lists again.
+        int rc = grow(cache);
+        if (IS_ERR(rc))
+            return ERR_PTR(rc);
+    }
+
+    list_remove(list_for(cache, slab), slab);
+    struct slab_obj* obj = slab->free_list;
+    ASSERT(obj);
+    slab->free_list = obj->next;
+    --slab->num_free_objs;
+    --cache->num_free_objs;
+    struct slab** list = list_for(cache, slab);
+    if (list)
+        list_insert(list, slab);
+    return obj;
+}
+
+// Called with cache->lock held.
+static void free_to_slabs(struct slab_cache* cache, void* ptr) {
+    struct slab* slab = slab_of(ptr);
+    ASSERT(slab->cache == cache);
+
+    struct slab** list = list_for(cache, slab);
+    if (list)
+        list_remove(list, slab);
+    struct slab_obj* obj = ptr;
+    obj->next = slab->free_list;
+    slab->free_list = obj;
+    ++slab->num_free_objs;
+    ++cache->num_free_objs;
+    list_insert(list_for(cache, slab), slab);
+}
+
+// Puts a magazine that was unloaded from a CPU back into the depot.
+// Called with cache->lock held.
+static void put_magazine(struct slab_cache* cache, struct slab_magazine* mag) {
+    if (mag->count == SLAB_MAGAZINE_SIZE) {
+        mag->next = cache->full_magazines;
+        cache->full_magazines = mag;
+        ++cache->num_full_magazines;
+        return;
+    }
+    while (mag->count > 0)
+        free_to_slabs(cache, mag->objs[--mag->count]);
+    mag->next = cache->empty_magazines;
+    cache->empty_magazines = mag;
+}
+
+// Loads the magazine on the current CPU and returns the previously loaded
+// one, which may be NULL.
+static struct slab_magazine* swap_magazine(struct slab_cache* cache,
+                                           struct slab_magazine* mag) {
+    bool int_flag = push_cli();
+    struct slab_magazine** slot = &cache->cpus[cpu_get_id()].magazine;
+    struct slab_magazine* prev = *slot;
+    *slot = mag;
+    pop_cli(int_flag);
+    return prev;
+}
+
+// Returns an empty magazine from the depot, or allocates a new one.
+// Called with cache->lock held. As in grow(), the lock is released while
+// allocating, as magazine_cache may need to take kernel_vm->lock.
+static struct slab_magazine* get_empty_magazine(struct slab_cache* cache) {
+    struct slab_magazine* mag = cache->empty_magazines;
+    if (mag) {
+        cache->empty_magazines = mag->next;
+        return mag;
+    }
+    mutex_unlock(&cache->lock);
+    mag = slab_cache_alloc(&magazine_cache);
+    mutex_lock(&cache->lock);
+    return mag;
+}
+
+static void* alloc_slow(struct slab_cache* cache) {
     mutex_lock(&cache->lock);
-    int rc = ensure_cache(cache);
-    if (IS_ERR(rc)) {
+
+    struct slab_magazine* mag = cache->full_magazines;
+    if (mag) {
+        cache->full_magazines = mag->next;
+        --cache->num_full_magazines;
+    } else {
+        // Refill an empty magazine with half of its capacity so that the
+        // next frees on this CPU don't immediately overflow it.
+        mag = get_empty_magazine(cache);
+        if (IS_OK(mag)) {
+            mag->count = 0;
+            while (mag->count < SLAB_MAGAZINE_SIZE / 2 + 1) {
+                void* obj = alloc_from_slabs(cache);
+                if (IS_ERR(obj))
+                    break;
+                mag->objs[mag->count++] = obj;
+            }
+            if (mag->count == 0) {
+                mag->next = cache->empty_magazines;
+                cache->empty_magazines = mag;
+                mag = NULL;
+            }
+        } else {
+            mag = NULL;
+        }
+    }
+
+    if (!mag) {
+        // Fall back to allocating directly from the slabs
+        void* obj = alloc_from_slabs(cache);
+        mutex_unlock(&cache->lock);
+        return obj;
+    }
+
+    void* obj = mag->objs[--mag->count];
+    mutex_unlock(&cache->lock);
+
+    struct slab_magazine* prev = swap_magazine(cache, mag);
+    if (prev) {
+        mutex_lock(&cache->lock);
+        put_magazine(cache, prev);
         mutex_unlock(&cache->lock);
-        return ERR_PTR(rc);
     }
-    struct slab_obj* obj = cache->free_list;
-    cache->free_list = obj->next;
+    return obj;
+}
+
+void* slab_cache_alloc(struct slab_cache* cache) {
+    if (cache->uses_magazines) {
+        bool int_flag = push_cli();
+        struct slab_cpu* cpu = cache->cpus + cpu_get_id();
+        ++cpu->num_allocs;
+        struct slab_magazine* mag = cpu->magazine;
+        if (mag && mag->count > 0) {
+            void* obj = mag->objs[--mag->count];
+            pop_cli(int_flag);
+            return obj;
+        }
+        pop_cli(int_flag);
+        ++cache->num_slow_allocs;
+        return alloc_slow(cache);
+    }
+
+    mutex_lock(&cache->lock);
+    ++cache->cpus[0].num_allocs;
+    ++cache->num_slow_allocs;
+    void* obj = alloc_from_slabs(cache);
     mutex_unlock(&cache->lock);
     return obj;
 }
 
+static void free_slow(struct slab_cache* cache, void* obj) {
+    mutex_lock(&cache->lock);
+
+    struct slab_magazine* mag = get_empty_magazine(cache);
+    if (IS_ERR(mag)) {
+        free_to_slabs(cache, obj);
+        mutex_unlock(&cache->lock);
+        return;
+    }
+    mag->count = 0;
+    mag->objs[mag->count++] = obj;
+
+    mutex_unlock(&cache->lock);
+
+    struct slab_magazine* prev = swap_magazine(cache, mag);
+    if (prev) {
+        mutex_lock(&cache->lock);
+        put_magazine(cache, prev);
+        mutex_unlock(&cache->lock);
+    }
+}
+
 void slab_cache_free(struct slab_cache* cache, void* obj) {
+    if (cache->uses_magazines) {
+        bool int_flag = push_cli();
+        struct slab_cpu* cpu = cache->cpus + cpu_get_id();
+        ++cpu->num_frees;
+        struct slab_magazine* mag = cpu->magazine;
+        if (mag && mag->count < SLAB_MAGAZINE_SIZE) {
+            mag->objs[mag->count++] = obj;
+            pop_cli(int_flag);
+            return;
+        }
+        pop_cli(int_flag);
+        ++cache->num_slow_frees;
+        free_slow(cache, obj);
+        return;
+    }
+
     mutex_lock(&cache->lock);
-    ((struct slab_obj*)obj)->next = cache->free_list;
-    cache->free_list = obj;
+    ++cache->cpus[0].num_frees;
+    ++cache->num_slow_frees;
+    free_to_slabs(cache, obj);
     mutex_unlock(&cache->lock);
 }
+
+// Called with cache->lock and kernel_vm->lock held.
+// Returns the number of slabs freed.
+static size_t shrink_cache(struct slab_cache* cache) {
+    while (cache->full_magazines) {
+        struct slab_magazine* mag = cache->full_magazines;
+        cache->full_magazines = mag->next;
+        --cache->num_full_magazines;
+        while (mag->count > 0)
+            free_to_slabs(cache, mag->objs[--mag->count]);
+        mag->next = cache->empty_magazines;
+        cache->empty_magazines = mag;
+    }
+    size_t num_freed = 0;
+    while (cache->empty_slabs) {
+        struct slab* slab = cache->empty_slabs;
+        list_remove(&cache->empty_slabs, slab);
+        --cache->num_slabs;
+        cache->num_free_objs -= cache->objs_per_slab;
+        uintptr_t virt_addr = slab->region.start;
+        vm_remove_region(kernel_vm, &slab->region);
+        page_table_unmap(virt_addr, PAGE_SIZE);
+        ++num_freed;
+    }
+    return num_freed;
+}
+
+size_t slab_shrink(void) {
+    // This is called when running out of memory, possibly while holding
+    // locks of the caches or kernel_vm. Skip whatever is busy instead of
+    // waiting for it to avoid deadlocks, and whatever we are in the middle
+    // of updating.
+    if (!mutex_try_lock_exclusive(&kernel_vm->lock))
+        return 0;
+    size_t num_freed = 0;
+    for (struct slab_cache* cache = slab_caches; cache; cache = cache->next) {
+        if (!mutex_try_lock_exclusive(&cache->lock))
+            continue;
+        num_freed += shrink_cache(cache);
+        mutex_unlock(&cache->lock);
+    }
+    mutex_unlock(&kernel_vm->lock);
+    return num_freed;
+}
+
+int slab_get_stats(slab_stats_fn callback, void* ctx) {
+    for (struct slab_cache* cache = slab_caches; cache; cache = cache->next) {
+        mutex_lock(&cache->lock);
+        struct slab_stats stats = {
+            .name = cache->name,
+            .obj_size = cache->obj_size,
+            .objs_per_slab = cache->objs_per_slab,
+            .num_slabs = cache->num_slabs,
+            .num_objs = cache->num_slabs * cache->objs_per_slab,
+            .num_free_objs = cache->num_free_objs,
+            .num_depot_objs = cache->num_full_magazines * SLAB_MAGAZINE_SIZE,
+            .num_slow_allocs = cache->num_slow_allocs,
+            .num_slow_frees = cache->num_slow_frees,
+        };
+        mutex_unlock(&cache->lock);
+        for (size_t i = 0; i < num_cpus; ++i) {
+            stats.num_allocs += cache->cpus[i].num_allocs;
+            stats.num_frees += cache->cpus[i].num_frees;
+        }
+        int rc = callback(&stats, ctx);
+        if (IS_ERR(rc))
+            return rc;
+    }
+    return 0;
+}
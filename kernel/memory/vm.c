@@ -1,6 +1,8 @@
 #include "memory.h"
 #include "private.h"
 #include <common/string.h>
+#include <kernel/fs/fs.h>
+#include <kernel/interrupts/interrupts.h>
 #include <kernel/kmsg.h>
 #include <kernel/panic.h>
 #include <kernel/task.h>
@@ -19,7 +21,30 @@ void vm_init(void) {
         .ref_count = 1,
     };
 
-    slab_cache_init(&vm_region_cache, sizeof(struct vm_region));
+    slab_cache_init(&vm_region_cache, "vm_region", sizeof(struct vm_region));
+}
+
+static struct vm_region* alloc_region(void) {
+    struct vm_region* region = slab_cache_alloc(&vm_region_cache);
+    if (IS_OK(region))
+        *region = (struct vm_region){0};
+    return region;
+}
+
+static void free_region(struct vm_region* region) {
+    if (region->inode)
+        inode_unref(region->inode);
+    slab_cache_free(&vm_region_cache, region);
+}
+
+// Makes the region map the same file as `src`, at the offset that
+// corresponds to the start of the region.
+static void inherit_file(struct vm_region* region,
+                         const struct vm_region* src) {
+    region->inode = src->inode;
+    region->offset = src->offset + (region->start - src->start);
+    if (region->inode)
+        inode_ref(region->inode);
 }
 
 struct vm* vm_create(void* start, void* end) {
@@ -64,7 +89,7 @@ void vm_unref(struct vm* vm) {
     struct vm_region* region = vm->regions;
     while (region) {
         struct vm_region* next = region->next;
-        slab_cache_free(&vm_region_cache, region);
+        free_region(region);
         region = next;
     }
 
@@ -78,14 +103,92 @@ void vm_unref(struct vm* vm) {
     kfree(vm);
 }
 
+// The vm whose page directory is loaded on each CPU
+static struct vm* active_vms[MAX_NUM_CPUS];
+
 void vm_enter(struct vm* vm) {
     ASSERT(current);
-    // current->vm needs to be updated BEFORE switching page directory.
-    // Otherwise, when we are preempted between the two operations,
-    // current->vm's page directory will be out of sync with the actual
-    // active page directory.
+    bool int_flag = push_cli();
+
     current->vm = vm;
+
+    uint8_t cpu_id = cpu_get_id();
+    struct vm* prev_vm = active_vms[cpu_id];
+    unsigned bit = 1U << (cpu_id % 32);
+
+    // Tasks of the same vm can share the TLB entries, so the page directory
+    // is reloaded only when the vm changes.
+    if (prev_vm == vm) {
+        pop_cli(int_flag);
+        return;
+    }
+
+    // Join the vm before loading its page directory so that flushes from
+    // other CPUs are not missed. Reloading the page directory flushes the
+    // TLB entries of the previous vm, so this CPU no longer needs flushes
+    // of the previous vm.
+    atomic_fetch_or(vm->active_cpus + cpu_id / 32, bit);
     page_directory_switch(vm->page_directory);
+    if (prev_vm && prev_vm != vm)
+        atomic_fetch_and(prev_vm->active_cpus + cpu_id / 32, ~bit);
+    active_vms[cpu_id] = vm;
+
+    pop_cli(int_flag);
+}
+
+// vm operations defer their TLB flushes and flush them at once when the vm is
+// unlocked.
+static void lock_vm(struct vm* vm, struct tlb_batch* batch) {
+    mutex_lock(&vm->lock);
+    tlb_batch_begin(batch, vm);
+}
+
+static void unlock_vm(struct vm* vm, struct tlb_batch* batch) {
+    tlb_batch_end(batch);
+    mutex_unlock(&vm->lock);
+}
+
+// Copies the subtree keeping its shape, and appends the copied regions to
+// the region list of the vm in order.
+static struct vm_region* clone_subtree(struct vm* vm,
+                                       const struct vm_region* src,
+                                       struct vm_region** tail) {
+    if (!src)
+        return NULL;
+
+    struct vm_region* left = clone_subtree(vm, src->left, tail);
+    if (IS_ERR(left))
+        return left;
+
+    struct vm_region* cloned = slab_cache_alloc(&vm_region_cache);
+    if (IS_ERR(cloned))
+        return cloned;
+    *cloned = *src;
+    if (cloned->inode)
+        inode_ref(cloned->inode);
+
+    // Link the region right away so that it is freed on failure.
+    cloned->prev = *tail;
+    cloned->next = NULL;
+    if (*tail)
+        (*tail)->next = cloned;
+    else
+        vm->regions = cloned;
+    *tail = cloned;
+
+    cloned->parent = NULL;
+    cloned->left = left;
+    if (left)
+        left->parent = cloned;
+
+    struct vm_region* right = clone_subtree(vm, src->right, tail);
+    if (IS_ERR(right))
+        return right;
+    cloned->right = right;
+    if (right)
+        right->parent = cloned;
+
+    return cloned;
 }
 
 struct vm* vm_clone(void) {
@@ -111,110 +214,260 @@ struct vm* vm_clone(void) {
         .end = vm->end,
         .page_directory = page_directory,
         .ref_count = 1,
+        .num_resident_pages = vm->num_resident_pages,
     };
 
-    struct vm_region* it = vm->regions;
-    struct vm_region* prev_cloned = NULL;
-    while (it) {
-        struct vm_region* cloned = slab_cache_alloc(&vm_region_cache);
-        if (IS_ERR(cloned)) {
-            mutex_unlock(&vm->lock);
-            vm_unref(new_vm);
-            return ERR_CAST(cloned);
-        }
-        *cloned = *it;
-
-        cloned->prev = prev_cloned;
-        cloned->next = NULL;
-        if (prev_cloned)
-            prev_cloned->next = cloned;
-        else
-            new_vm->regions = cloned;
-        prev_cloned = cloned;
-
-        it = it->next;
+    struct vm_region* tail = NULL;
+    struct vm_region* root = clone_subtree(new_vm, vm->region_tree, &tail);
+    if (IS_ERR(root)) {
+        mutex_unlock(&vm->lock);
+        vm_unref(new_vm);
+        return ERR_CAST(root);
     }
+    new_vm->region_tree = root;
 
     mutex_unlock(&vm->lock);
     return new_vm;
 }
 
-struct vm_region* vm_find_region(struct vm* vm, void* virt_addr) {
-    uintptr_t addr = (uintptr_t)virt_addr;
-    struct vm_region* it = vm->regions;
+// Regions are kept both in a sorted doubly linked list and in an AVL tree
+// augmented with the largest gap in each subtree, so that lookups and
+// first-fit gap searches take O(log n).
+
+static int height(const struct vm_region* region) {
+    return region ? region->height : 0;
+}
+
+static size_t max_gap(const struct vm_region* region) {
+    return region ? region->max_gap : 0;
+}
+
+// Recomputes the augmented fields from the children.
+static void update_node(struct vm_region* region) {
+    region->height = MAX(height(region->left), height(region->right)) + 1;
+    region->max_gap =
+        MAX(region->gap, MAX(max_gap(region->left), max_gap(region->right)));
+}
+
+// Recomputes the gap before the region and propagates it to the root.
+static void update_gap(struct vm* vm, struct vm_region* region) {
+    if (!region)
+        return;
+    uintptr_t prev_end = region->prev ? region->prev->end : vm->start;
+    ASSERT(prev_end <= region->start);
+    region->gap = region->start - prev_end;
+    for (struct vm_region* it = region; it; it = it->parent)
+        update_node(it);
+}
+
+static void replace_child(struct vm* vm, struct vm_region* parent,
+                          struct vm_region* old_child,
+                          struct vm_region* new_child) {
+    if (!parent)
+        vm->region_tree = new_child;
+    else if (parent->left == old_child)
+        parent->left = new_child;
+    else
+        parent->right = new_child;
+    if (new_child)
+        new_child->parent = parent;
+}
+
+static void rotate_left(struct vm* vm, struct vm_region* x) {
+    struct vm_region* y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    replace_child(vm, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+    update_node(x);
+    update_node(y);
+}
+
+static void rotate_right(struct vm* vm, struct vm_region* x) {
+    struct vm_region* y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    replace_child(vm, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+    update_node(x);
+    update_node(y);
+}
+
+// Restores the balance and the augmented fields from the region to the root.
+static void rebalance(struct vm* vm, struct vm_region* region) {
+    for (struct vm_region* it = region; it; it = it->parent) {
+        update_node(it);
+        int balance = height(it->left) - height(it->right);
+        if (balance > 1) {
+            if (height(it->left->left) < height(it->left->right))
+                rotate_left(vm, it->left);
+            rotate_right(vm, it);
+            it = it->parent;
+        } else if (balance < -1) {
+            if (height(it->right->right) < height(it->right->left))
+                rotate_right(vm, it->right);
+            rotate_left(vm, it);
+            it = it->parent;
+        }
+    }
+}
+
+// Returns the last region that starts at or before the address.
+static struct vm_region* find_floor(struct vm* vm, uintptr_t addr) {
+    struct vm_region* found = NULL;
+    struct vm_region* it = vm->region_tree;
     while (it) {
-        if (it->next)
-            ASSERT(it->end <= it->next->start);
-        if (it->start <= addr && addr < it->end)
-            return it;
-        it = it->next;
+        if (it->start <= addr) {
+            found = it;
+            it = it->right;
+        } else {
+            it = it->left;
+        }
     }
+    return found;
+}
+
+struct vm_region* vm_find_region(struct vm* vm, void* virt_addr) {
+    uintptr_t addr = (uintptr_t)virt_addr;
+    struct vm_region* region = find_floor(vm, addr);
+    if (region && addr < region->end)
+        return region;
     return NULL;
 }
 
-struct vm_region* vm_find_gap(struct vm* vm, size_t size,
-                              uintptr_t* virt_addr) {
-    if (vm->start + size > vm->end)
+// Finds a gap that can fit a region of the given size starting at an address
+// congruent to `offset` modulo `align`.
+static struct vm_region* find_aligned_gap(struct vm* vm, size_t size,
+                                          size_t align, size_t offset,
+                                          uintptr_t* virt_addr) {
+    ASSERT(align >= PAGE_SIZE && (align & (align - 1)) == 0);
+    ASSERT(offset < align);
+
+    // Any gap of this size contains a suitably aligned address.
+    size_t padded_size = size + (align - PAGE_SIZE);
+    if (padded_size < size || vm->start + padded_size > vm->end)
         return ERR_PTR(-ENOMEM);
-    if (!vm->regions) {
-        if (virt_addr)
-            *virt_addr = vm->start;
-        return NULL;
-    }
 
-    struct vm_region* prev = NULL;
-    struct vm_region* it = vm->regions;
-    while (it) {
-        if (it->next)
-            ASSERT(it->end <= it->next->start);
-        if (prev && prev->end + size <= it->start) {
-            if (virt_addr)
-                *virt_addr = prev->end;
-            return prev;
+    struct vm_region* it = vm->region_tree;
+    if (it && it->max_gap >= padded_size) {
+        // Find the lowest gap that fits
+        for (;;) {
+            if (max_gap(it->left) >= padded_size) {
+                it = it->left;
+            } else if (it->gap >= padded_size) {
+                if (virt_addr)
+                    *virt_addr =
+                        ROUND_UP(it->start - it->gap - offset, align) + offset;
+                return it->prev;
+            } else {
+                it = it->right;
+                ASSERT(it && it->max_gap >= padded_size);
+            }
         }
-        prev = it;
-        it = it->next;
     }
-    if (prev && prev->end + size <= vm->end) {
+
+    // Try the space after the last region
+    struct vm_region* last = vm->region_tree;
+    while (last && last->right)
+        last = last->right;
+    uintptr_t start = last ? last->end : vm->start;
+    if (start + padded_size <= vm->end) {
         if (virt_addr)
-            *virt_addr = prev->end;
-        return prev;
+            *virt_addr = ROUND_UP(start - offset, align) + offset;
+        return last;
     }
 
-    kprint("vm: out of virtual memory\n");
     return ERR_PTR(-ENOMEM);
 }
 
+struct vm_region* vm_find_gap(struct vm* vm, size_t size,
+                              uintptr_t* virt_addr) {
+    struct vm_region* cursor =
+        find_aligned_gap(vm, size, PAGE_SIZE, 0, virt_addr);
+    if (IS_ERR(cursor))
+        kprint("vm: out of virtual memory\n");
+    return cursor;
+}
+
 void vm_insert_region_after(struct vm* vm, struct vm_region* cursor,
                             struct vm_region* inserted) {
-    if (cursor) {
+    struct vm_region* next = cursor ? cursor->next : vm->regions;
+    if (cursor)
         ASSERT(cursor->end <= inserted->start);
-        inserted->prev = cursor;
-        inserted->next = cursor->next;
-        if (cursor->next) {
-            ASSERT(inserted->end <= cursor->next->start);
-            cursor->next->prev = inserted;
-        }
+    if (next)
+        ASSERT(inserted->end <= next->start);
+
+    inserted->prev = cursor;
+    inserted->next = next;
+    if (cursor)
         cursor->next = inserted;
-    } else {
-        inserted->prev = NULL;
-        inserted->next = vm->regions;
-        if (vm->regions) {
-            ASSERT(inserted->end <= vm->regions->start);
-            vm->regions->prev = inserted;
-        }
+    else
         vm->regions = inserted;
+    if (next)
+        next->prev = inserted;
+
+    // The in-order successor of the cursor is either the right child of
+    // the cursor or the left child of the next region.
+    inserted->left = inserted->right = NULL;
+    if (cursor && !cursor->right) {
+        cursor->right = inserted;
+        inserted->parent = cursor;
+    } else if (next) {
+        ASSERT(!next->left);
+        next->left = inserted;
+        inserted->parent = next;
+    } else {
+        ASSERT(!vm->region_tree);
+        vm->region_tree = inserted;
+        inserted->parent = NULL;
     }
+
+    inserted->gap = 0;
+    rebalance(vm, inserted);
+    update_gap(vm, inserted);
+    update_gap(vm, next);
 }
 
 void vm_remove_region(struct vm* vm, struct vm_region* region) {
+    struct vm_region* next = region->next;
     if (region->prev)
-        region->prev->next = region->next;
+        region->prev->next = next;
     else
-        vm->regions = region->next;
-    if (region->next)
-        region->next->prev = region->prev;
+        vm->regions = next;
+    if (next)
+        next->prev = region->prev;
+
+    struct vm_region* rebalance_from;
+    if (region->left && region->right) {
+        // Replace the region with its in-order successor, which is the
+        // leftmost region of the right subtree.
+        struct vm_region* successor = next;
+        ASSERT(successor && !successor->left);
+        if (successor->parent == region) {
+            rebalance_from = successor;
+        } else {
+            rebalance_from = successor->parent;
+            replace_child(vm, successor->parent, successor, successor->right);
+            successor->right = region->right;
+            successor->right->parent = successor;
+        }
+        replace_child(vm, region->parent, region, successor);
+        successor->left = region->left;
+        successor->left->parent = successor;
+    } else {
+        rebalance_from = region->parent;
+        replace_child(vm, region->parent, region,
+                      region->left ? region->left : region->right);
+    }
+    rebalance(vm, rebalance_from);
+    update_gap(vm, next);
+
     region->prev = region->next = NULL;
+    region->parent = region->left = region->right = NULL;
 }
 
 static struct vm* vm_for_flags(int vm_flags) {
@@ -257,6 +510,10 @@ static bool validate_vm_flags(int vm_flags) {
         // Regions without actual mapping cannot be shared
         return false;
     }
+    if ((vm_flags & VM_HUGE) && !(vm_flags & VM_RW)) {
+        // Regions without actual mapping cannot be populated
+        return false;
+    }
     return true;
 }
 
@@ -274,25 +531,77 @@ static uint16_t to_pte_flags(int vm_flags) {
     return pte_flags;
 }
 
+// Private user regions are populated on first access.
+// Other regions are populated up front: kernel memory may be accessed in
+// contexts where page faults cannot be handled, and shared regions have to be
+// backed by the same pages in all vm instances sharing them.
+static bool is_demand_paged(int vm_flags) {
+    return (vm_flags & VM_USER) && !(vm_flags & VM_SHARED);
+}
+
+static int populate(uintptr_t virt_addr, size_t size, int vm_flags) {
+    if (!(vm_flags & VM_RW) || is_demand_paged(vm_flags))
+        return 0;
+    return page_table_map_anon(virt_addr, size, to_pte_flags(vm_flags));
+}
+
+// Populates the range with 4MiB pages. Private regions are populated as well,
+// as their large pages would be lost if they were populated on demand.
+static int populate_huge(uintptr_t virt_addr, size_t size, int vm_flags) {
+    ASSERT(virt_addr % LARGE_PAGE_SIZE == 0);
+    ASSERT(size % LARGE_PAGE_SIZE == 0);
+    uint16_t pte_flags = to_pte_flags(vm_flags);
+    for (size_t offset = 0; offset < size; offset += LARGE_PAGE_SIZE) {
+        uintptr_t phys_addr = page_try_alloc_contiguous(MAX_PAGE_ORDER);
+        int rc = IS_ERR(phys_addr) ? -ENOMEM : 0;
+        if (IS_OK(rc)) {
+            for (size_t i = 0; i < LARGE_PAGE_SIZE; i += PAGE_SIZE)
+                page_clear(phys_addr + i, 0, PAGE_SIZE);
+            rc = page_table_map_phys(virt_addr + offset, phys_addr,
+                                     LARGE_PAGE_SIZE, pte_flags);
+            // The mapping holds its own references to the pages.
+            for (size_t i = 0; i < LARGE_PAGE_SIZE; i += PAGE_SIZE)
+                page_unref(phys_addr + i);
+        }
+        if (IS_ERR(rc)) {
+            page_table_unmap(virt_addr, offset);
+            return rc;
+        }
+    }
+    return 0;
+}
+
 static void* alloc(struct vm* vm, size_t size, int vm_flags) {
-    struct vm_region* region = slab_cache_alloc(&vm_region_cache);
+    struct vm_region* region = alloc_region();
     if (IS_ERR(region))
         return ERR_PTR(region);
 
     int ret = 0;
 
     uintptr_t virt_addr;
-    struct vm_region* cursor = vm_find_gap(vm, size, &virt_addr);
+    struct vm_region* cursor;
+    if (vm_flags & VM_HUGE) {
+        if (!page_table_supports_large_pages()) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+        cursor = find_aligned_gap(vm, size, LARGE_PAGE_SIZE, 0, &virt_addr);
+    } else {
+        cursor = vm_find_gap(vm, size, &virt_addr);
+    }
     if (IS_ERR(cursor)) {
         ret = PTR_ERR(cursor);
         goto fail;
     }
 
-    if (vm_flags & VM_RW) {
-        ret = page_table_map_anon(virt_addr, size, to_pte_flags(vm_flags));
-        if (IS_ERR(ret))
-            goto fail;
+    if (vm_flags & VM_HUGE) {
+        ret = populate_huge(virt_addr, size, vm_flags);
+        vm_flags &= ~VM_HUGE;
+    } else {
+        ret = populate(virt_addr, size, vm_flags);
     }
+    if (IS_ERR(ret))
+        goto fail;
 
     region->start = virt_addr;
     region->end = virt_addr + size;
@@ -302,39 +611,39 @@ static void* alloc(struct vm* vm, size_t size, int vm_flags) {
     return (void*)virt_addr;
 
 fail:
-    slab_cache_free(&vm_region_cache, region);
+    free_region(region);
     return ERR_PTR(ret);
 }
 
+// Returns the region before the range, or -EEXIST if the range is already
+// occupied.
+static struct vm_region* check_free_range(struct vm* vm, uintptr_t virt_addr,
+                                          size_t size) {
+    struct vm_region* prev = find_floor(vm, virt_addr);
+    struct vm_region* next = prev ? prev->next : vm->regions;
+    if ((prev && prev->end > virt_addr) ||
+        (next && next->start < virt_addr + size))
+        return ERR_PTR(-EEXIST);
+    return prev;
+}
+
 static void* alloc_at(struct vm* vm, uintptr_t virt_addr, size_t size,
                       int vm_flags) {
-    struct vm_region* region = slab_cache_alloc(&vm_region_cache);
+    struct vm_region* region = alloc_region();
     if (IS_ERR(region))
         return ERR_PTR(region);
 
     int ret = 0;
 
-    // Check if the range is already occupied
-    struct vm_region* prev = NULL;
-    struct vm_region* it = vm->regions;
-    while (it && it->start < virt_addr) {
-        if (it->end > virt_addr) {
-            ret = -EEXIST;
-            goto fail;
-        }
-        prev = it;
-        it = it->next;
-    }
-    if (prev && prev->end > virt_addr && prev->start < virt_addr + size) {
-        ret = -EEXIST;
+    struct vm_region* prev = check_free_range(vm, virt_addr, size);
+    if (IS_ERR(prev)) {
+        ret = PTR_ERR(prev);
         goto fail;
     }
 
-    if (vm_flags & VM_RW) {
-        ret = page_table_map_anon(virt_addr, size, to_pte_flags(vm_flags));
-        if (IS_ERR(ret))
-            goto fail;
-    }
+    ret = populate(virt_addr, size, vm_flags);
+    if (IS_ERR(ret))
+        goto fail;
 
     region->start = virt_addr;
     region->end = virt_addr + size;
@@ -344,7 +653,7 @@ static void* alloc_at(struct vm* vm, uintptr_t virt_addr, size_t size,
     return (void*)virt_addr;
 
 fail:
-    slab_cache_free(&vm_region_cache, region);
+    free_region(region);
     return ERR_PTR(ret);
 }
 
@@ -356,9 +665,14 @@ static int set_flags(struct vm* vm, void* addr, size_t size, int vm_flags) {
         return -EINVAL;
     if (region->flags == vm_flags)
         return 0;
-    if (!(region->flags & VM_RW) && (vm_flags & VM_RW))
+    if (!(region->flags & VM_RW) && (vm_flags & VM_RW) &&
+        !is_demand_paged(vm_flags))
         return -EINVAL;
 
+    int rc = page_table_split_large_pages((uintptr_t)addr, size);
+    if (IS_ERR(rc))
+        return rc;
+
     int old_flags = region->flags;
     if (region->start == (uintptr_t)addr &&
         region->start + size == region->end) {
@@ -368,12 +682,13 @@ static int set_flags(struct vm* vm, void* addr, size_t size, int vm_flags) {
         // Split the region into two.
         // Left (`region`): [start, start + size) with new flags
         // Right (`right_region`): [start + size, end) with old flags
-        struct vm_region* right_region = slab_cache_alloc(&vm_region_cache);
+        struct vm_region* right_region = alloc_region();
         if (IS_ERR(right_region))
             return PTR_ERR(right_region);
         right_region->start = region->start + size;
         right_region->end = region->end;
         right_region->flags = region->flags;
+        inherit_file(right_region, region);
         region->end = region->start + size;
         region->flags = vm_flags;
         vm_insert_region_after(vm, region, right_region);
@@ -381,12 +696,13 @@ static int set_flags(struct vm* vm, void* addr, size_t size, int vm_flags) {
         // Split the region into two.
         // Left (`region`): [start, addr) with old flags
         // Right (`right_region`): [addr, end) with new flags
-        struct vm_region* right_region = slab_cache_alloc(&vm_region_cache);
+        struct vm_region* right_region = alloc_region();
         if (IS_ERR(right_region))
             return PTR_ERR(right_region);
         right_region->start = (uintptr_t)addr;
         right_region->end = region->end;
         right_region->flags = vm_flags;
+        inherit_file(right_region, region);
         region->end = (uintptr_t)addr;
         vm_insert_region_after(vm, region, right_region);
     } else {
@@ -394,20 +710,22 @@ static int set_flags(struct vm* vm, void* addr, size_t size, int vm_flags) {
         // Left (`region`): [start, addr) with old flags
         // Middle (`middle_region`): [addr, addr + size) with new flags
         // Right (`right_region`): [addr + size, end) with old flags
-        struct vm_region* middle_region = slab_cache_alloc(&vm_region_cache);
+        struct vm_region* middle_region = alloc_region();
         if (IS_ERR(middle_region))
             return PTR_ERR(middle_region);
-        struct vm_region* right_region = slab_cache_alloc(&vm_region_cache);
+        struct vm_region* right_region = alloc_region();
         if (IS_ERR(right_region)) {
-            slab_cache_free(&vm_region_cache, middle_region);
+            free_region(middle_region);
             return PTR_ERR(right_region);
         }
         middle_region->start = (uintptr_t)addr;
         middle_region->end = middle_region->start + size;
         middle_region->flags = vm_flags;
+        inherit_file(middle_region, region);
         right_region->start = middle_region->end;
         right_region->end = region->end;
         right_region->flags = region->flags;
+        inherit_file(right_region, region);
         region->end = middle_region->start;
         vm_insert_region_after(vm, region, middle_region);
         vm_insert_region_after(vm, middle_region, right_region);
@@ -423,14 +741,24 @@ static int set_flags(struct vm* vm, void* addr, size_t size, int vm_flags) {
 
 static void* phys_map(struct vm* vm, uintptr_t phys_addr, size_t size,
                       int vm_flags) {
-    struct vm_region* region = slab_cache_alloc(&vm_region_cache);
+    struct vm_region* region = alloc_region();
     if (IS_ERR(region))
         return ERR_PTR(region);
 
     int ret = 0;
 
+    // Place the range at the same offset from a 4MiB boundary as the
+    // physical address so that it can be mapped with large pages.
     uintptr_t virt_addr;
-    struct vm_region* cursor = vm_find_gap(vm, size, &virt_addr);
+    struct vm_region* cursor = ERR_PTR(-ENOMEM);
+    uint64_t phys_end = (uint64_t)phys_addr + size;
+    if (page_table_supports_large_pages() &&
+        ROUND_UP((uint64_t)phys_addr, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE <=
+            phys_end)
+        cursor = find_aligned_gap(vm, size, LARGE_PAGE_SIZE,
+                                  phys_addr % LARGE_PAGE_SIZE, &virt_addr);
+    if (IS_ERR(cursor))
+        cursor = vm_find_gap(vm, size, &virt_addr);
     if (IS_ERR(cursor)) {
         ret = PTR_ERR(cursor);
         goto fail;
@@ -451,7 +779,7 @@ static void* phys_map(struct vm* vm, uintptr_t phys_addr, size_t size,
     return (void*)virt_addr;
 
 fail:
-    slab_cache_free(&vm_region_cache, region);
+    free_region(region);
     return ERR_PTR(ret);
 }
 
@@ -469,7 +797,7 @@ static void* virt_map(struct vm* vm, void* src_virt_addr, size_t size,
 
     ASSERT(vm_flags & VM_RW);
 
-    struct vm_region* region = slab_cache_alloc(&vm_region_cache);
+    struct vm_region* region = alloc_region();
     if (IS_ERR(region))
         return ERR_PTR(region);
 
@@ -495,10 +823,128 @@ static void* virt_map(struct vm* vm, void* src_virt_addr, size_t size,
     return (void*)dest_virt_addr;
 
 fail:
-    slab_cache_free(&vm_region_cache, region);
+    free_region(region);
     return ERR_PTR(-ENOMEM);
 }
 
+// Returns the number of pages starting at pages[i] that are physically
+// contiguous.
+static size_t contiguous_run(const uintptr_t* pages, size_t num_pages,
+                             size_t i) {
+    size_t n = 1;
+    while (i + n < num_pages && pages[i + n] &&
+           pages[i + n] == pages[i] + n * PAGE_SIZE)
+        ++n;
+    return n;
+}
+
+// Finds a gap for the pages. If some of the pages form a physically
+// contiguous 4MiB block, the gap is aligned so that the block can be mapped
+// with a large page.
+static struct vm_region* find_gap_for_pages(struct vm* vm,
+                                            const uintptr_t* pages,
+                                            size_t num_pages, int vm_flags,
+                                            uintptr_t* virt_addr) {
+    size_t size = num_pages * PAGE_SIZE;
+    if (!(vm_flags & VM_SHARED) || !page_table_supports_large_pages())
+        return vm_find_gap(vm, size, virt_addr);
+    for (size_t i = 0; i < num_pages; ++i) {
+        if (!pages[i] || pages[i] % LARGE_PAGE_SIZE)
+            continue;
+        if (contiguous_run(pages, num_pages, i) < LARGE_PAGE_SIZE / PAGE_SIZE)
+            continue;
+        size_t offset = -(i * PAGE_SIZE) % LARGE_PAGE_SIZE;
+        struct vm_region* cursor =
+            find_aligned_gap(vm, size, LARGE_PAGE_SIZE, offset, virt_addr);
+        if (IS_OK(cursor))
+            return cursor;
+        break;
+    }
+    return vm_find_gap(vm, size, virt_addr);
+}
+
+static void* map_pages(struct vm* vm, uintptr_t virt_addr,
+                       const uintptr_t* pages, size_t num_pages,
+                       int vm_flags) {
+    struct vm_region* region = alloc_region();
+    if (IS_ERR(region))
+        return ERR_PTR(region);
+
+    int ret = 0;
+
+    size_t size = num_pages * PAGE_SIZE;
+    struct vm_region* cursor =
+        virt_addr
+            ? check_free_range(vm, virt_addr, size)
+            : find_gap_for_pages(vm, pages, num_pages, vm_flags, &virt_addr);
+    if (IS_ERR(cursor)) {
+        ret = PTR_ERR(cursor);
+        goto fail;
+    }
+
+    if (vm_flags & VM_RW) {
+        uint16_t pte_flags = to_pte_flags(vm_flags);
+        // The pages belong to someone else, so private regions must not
+        // write to them.
+        if (!(vm_flags & VM_SHARED))
+            pte_flags = (pte_flags & ~PTE_WRITE) | PTE_COW;
+
+        // Contiguous pages are mapped together, so that page_table_map_phys
+        // can use large pages for them.
+        for (size_t i = 0; i < num_pages;) {
+            if (!pages[i]) {
+                ASSERT(is_demand_paged(vm_flags));
+                ++i;
+                continue;
+            }
+            size_t n = contiguous_run(pages, num_pages, i);
+            ret = page_table_map_phys(virt_addr + i * PAGE_SIZE, pages[i],
+                                      n * PAGE_SIZE, pte_flags);
+            if (IS_ERR(ret)) {
+                page_table_unmap(virt_addr, i * PAGE_SIZE);
+                goto fail;
+            }
+            i += n;
+        }
+    }
+
+    region->start = virt_addr;
+    region->end = virt_addr + size;
+    region->flags = vm_flags;
+    vm_insert_region_after(vm, cursor, region);
+
+    return (void*)virt_addr;
+
+fail:
+    free_region(region);
+    return ERR_PTR(ret);
+}
+
+static void* map_file(struct vm* vm, uintptr_t virt_addr, struct inode* inode,
+                      size_t size, uint64_t offset, int vm_flags) {
+    struct vm_region* region = alloc_region();
+    if (IS_ERR(region))
+        return ERR_CAST(region);
+
+    struct vm_region* cursor = virt_addr
+                                   ? check_free_range(vm, virt_addr, size)
+                                   : vm_find_gap(vm, size, &virt_addr);
+    if (IS_ERR(cursor)) {
+        free_region(region);
+        return ERR_CAST(cursor);
+    }
+
+    region->start = virt_addr;
+    region->end = virt_addr + size;
+    region->flags = vm_flags;
+    region->inode = inode;
+    region->offset = offset;
+    inode_ref(inode);
+    vm_insert_region_after(vm, cursor, region);
+
+    return (void*)virt_addr;
+}
+
 static void* resize(struct vm* vm, void* virt_addr, size_t new_size) {
     struct vm_region* region = vm_find_region(vm, virt_addr);
     if (!region)
@@ -512,8 +958,13 @@ static void* resize(struct vm* vm, void* virt_addr, size_t new_size) {
 
     // Shrink the region
     if (new_size < old_size) {
+        int rc = page_table_split_large_pages(region->start + new_size,
+                                              old_size - new_size);
+        if (IS_ERR(rc))
+            return ERR_PTR(rc);
         page_table_unmap(region->start + new_size, old_size - new_size);
         region->end = region->start + new_size;
+        update_gap(vm, region->next);
         return virt_addr;
     }
 
@@ -521,14 +972,13 @@ static void* resize(struct vm* vm, void* virt_addr, size_t new_size) {
 
     // If the region is the last one or there is enough space after the
     // region, we can simply extend the region
-    if (!region->next || region->start + new_size < region->next->start) {
-        if (region->flags & VM_RW) {
-            int rc = page_table_map_anon(region->start + old_size,
-                                         new_size - old_size, pte_flags);
-            if (IS_ERR(rc))
-                return ERR_PTR(rc);
-        }
+    if (!region->next || region->start + new_size <= region->next->start) {
+        int rc = populate(region->start + old_size, new_size - old_size,
+                          region->flags);
+        if (IS_ERR(rc))
+            return ERR_PTR(rc);
         region->end = region->start + new_size;
+        update_gap(vm, region->next);
         return virt_addr;
     }
 
@@ -546,22 +996,20 @@ static void* resize(struct vm* vm, void* virt_addr, size_t new_size) {
         return ERR_PTR(rc);
 
     // Extend
-    if (region->flags & VM_RW) {
-        rc = page_table_map_anon(new_virt_addr + old_size, new_size - old_size,
-                                 pte_flags);
-        if (IS_ERR(rc)) {
-            page_table_unmap(new_virt_addr, old_size);
-            return ERR_PTR(rc);
-        }
+    rc = populate(new_virt_addr + old_size, new_size - old_size,
+                  region->flags);
+    if (IS_ERR(rc)) {
+        page_table_unmap(new_virt_addr, old_size);
+        return ERR_PTR(rc);
     }
 
     // Unmap the old range
     page_table_unmap(region->start, old_size);
 
+    vm_remove_region(vm, region);
+
     region->start = new_virt_addr;
     region->end = new_virt_addr + new_size;
-
-    vm_remove_region(vm, region);
     vm_insert_region_after(vm, cursor, region);
 
     return (void*)new_virt_addr;
@@ -576,32 +1024,40 @@ static int unmap(struct vm* vm, void* virt_addr, size_t size) {
     if (region->end < addr + size)
         return -EINVAL;
 
+    int rc = page_table_split_large_pages(addr, size);
+    if (IS_ERR(rc))
+        return rc;
+
     if (region->start == addr && region->start + size == region->end) {
         // Unmap the whole region
         page_table_unmap(addr, size);
         vm_remove_region(vm, region);
-        slab_cache_free(&vm_region_cache, region);
+        free_region(region);
     } else if (region->start == addr) {
         // Unmap the beginning of the region.
         // The region is shrunk to [start + size, end)
         page_table_unmap(addr, size);
         region->start += size;
+        region->offset += size;
+        update_gap(vm, region);
     } else if (region->end == addr + size) {
         // Unmap the end of the region.
         // The region is shrunk to [start, end - size)
         page_table_unmap(addr, size);
         region->end -= size;
+        update_gap(vm, region->next);
     } else {
         // Split the region into two, unmapping the middle part.
         // Left (`region`): [start, addr)
         // Right (`right_region`): [addr + size, end)
-        struct vm_region* right_region = slab_cache_alloc(&vm_region_cache);
+        struct vm_region* right_region = alloc_region();
         if (IS_ERR(right_region))
             return PTR_ERR(right_region);
         page_table_unmap(addr, size);
         right_region->start = addr + size;
         right_region->end = region->end;
         right_region->flags = region->flags;
+        inherit_file(right_region, region);
         region->end = addr;
         vm_insert_region_after(vm, region, right_region);
     }
@@ -624,12 +1080,15 @@ void* vm_alloc(size_t size, int vm_flags) {
         return ERR_PTR(-EINVAL);
     if (!validate_vm_flags(vm_flags))
         return ERR_PTR(-EINVAL);
-    size = ROUND_UP(size, PAGE_SIZE);
+    size = ROUND_UP(size, (vm_flags & VM_HUGE) ? LARGE_PAGE_SIZE : PAGE_SIZE);
+    if (size == 0)
+        return ERR_PTR(-ENOMEM);
 
     struct vm* vm = vm_for_flags(vm_flags);
-    mutex_lock(&vm->lock);
+    struct tlb_batch batch;
+    lock_vm(vm, &batch);
     void* addr = alloc(vm, size, vm_flags);
-    mutex_unlock(&vm->lock);
+    unlock_vm(vm, &batch);
     return addr;
 }
 
@@ -647,9 +1106,10 @@ void* vm_alloc_at(void* virt_addr, size_t size, int vm_flags) {
     if (aligned_addr < vm->start || vm->end < aligned_addr + size)
         return ERR_PTR(-ERANGE);
 
-    mutex_lock(&vm->lock);
+    struct tlb_batch batch;
+    lock_vm(vm, &batch);
     unsigned char* addr = alloc_at(vm, aligned_addr, size, vm_flags);
-    mutex_unlock(&vm->lock);
+    unlock_vm(vm, &batch);
     if (IS_ERR(addr))
         return addr;
     return addr + ((uintptr_t)virt_addr - aligned_addr);
@@ -664,9 +1124,10 @@ void* vm_phys_map(uintptr_t phys_addr, size_t size, int vm_flags) {
 
     uintptr_t aligned_addr = page_align_range(phys_addr, &size);
     struct vm* vm = vm_for_flags(vm_flags);
-    mutex_lock(&vm->lock);
+    struct tlb_batch batch;
+    lock_vm(vm, &batch);
     unsigned char* addr = phys_map(vm, aligned_addr, size, vm_flags);
-    mutex_unlock(&vm->lock);
+    unlock_vm(vm, &batch);
     if (IS_ERR(addr))
         return addr;
     return addr + (phys_addr - aligned_addr);
@@ -683,14 +1144,86 @@ void* vm_virt_map(void* virt_addr, size_t size, int vm_flags) {
 
     uintptr_t aligned_addr = page_align_range((uintptr_t)virt_addr, &size);
     struct vm* vm = vm_for_flags(vm_flags);
-    mutex_lock(&vm->lock);
+    struct tlb_batch batch;
+    lock_vm(vm, &batch);
     unsigned char* addr = virt_map(vm, (void*)aligned_addr, size, vm_flags);
-    mutex_unlock(&vm->lock);
+    unlock_vm(vm, &batch);
     if (IS_ERR(addr))
         return addr;
     return addr + ((uintptr_t)virt_addr - aligned_addr);
 }
 
+void* vm_map_pages(void* virt_addr, const uintptr_t* pages, size_t num_pages,
+                   int vm_flags) {
+    if (num_pages == 0 || num_pages > SIZE_MAX / PAGE_SIZE)
+        return ERR_PTR(-EINVAL);
+    if (!validate_vm_flags(vm_flags))
+        return ERR_PTR(-EINVAL);
+
+    size_t size = num_pages * PAGE_SIZE;
+    struct vm* vm = vm_for_flags(vm_flags);
+    if (virt_addr) {
+        int rc = validate_range((uintptr_t)virt_addr, size);
+        if (IS_ERR(rc))
+            return ERR_PTR(rc);
+        if ((uintptr_t)virt_addr % PAGE_SIZE)
+            return ERR_PTR(-EINVAL);
+        if (is_user_address(virt_addr) && !(vm_flags & VM_USER))
+            return ERR_PTR(-EINVAL);
+        if ((uintptr_t)virt_addr < vm->start ||
+            vm->end < (uintptr_t)virt_addr + size)
+            return ERR_PTR(-ERANGE);
+    }
+
+    struct tlb_batch batch;
+    lock_vm(vm, &batch);
+    void* addr =
+        map_pages(vm, (uintptr_t)virt_addr, pages, num_pages, vm_flags);
+    unlock_vm(vm, &batch);
+    return addr;
+}
+
+void* vm_map_file(void* virt_addr, struct inode* inode, size_t length,
+                  uint64_t offset, int vm_flags) {
+    if (length == 0 || offset % PAGE_SIZE)
+        return ERR_PTR(-EINVAL);
+    if (!inode->page_cache)
+        return ERR_PTR(-ENODEV);
+    if (!validate_vm_flags(vm_flags) || !is_demand_paged(vm_flags) ||
+        (vm_flags & VM_HUGE))
+        return ERR_PTR(-EINVAL);
+
+    size_t size = ROUND_UP(length, PAGE_SIZE);
+    if (size == 0)
+        return ERR_PTR(-ENOMEM);
+
+    struct page_cache* cache = inode->page_cache;
+    mutex_lock(&cache->lock);
+    bool in_range = offset + size <= ROUND_UP(cache->size, PAGE_SIZE);
+    mutex_unlock(&cache->lock);
+    if (!in_range)
+        return ERR_PTR(-EINVAL);
+
+    struct vm* vm = vm_for_flags(vm_flags);
+    if (virt_addr) {
+        int rc = validate_range((uintptr_t)virt_addr, size);
+        if (IS_ERR(rc))
+            return ERR_PTR(rc);
+        if ((uintptr_t)virt_addr % PAGE_SIZE)
+            return ERR_PTR(-EINVAL);
+        if ((uintptr_t)virt_addr < vm->start ||
+            vm->end < (uintptr_t)virt_addr + size)
+            return ERR_PTR(-ERANGE);
+    }
+
+    struct tlb_batch batch;
+    lock_vm(vm, &batch);
+    void* addr =
+        map_file(vm, (uintptr_t)virt_addr, inode, size, offset, vm_flags);
+    unlock_vm(vm, &batch);
+    return addr;
+}
+
 void* vm_resize(void* virt_addr, size_t new_size) {
     int rc = validate_range((uintptr_t)virt_addr, new_size);
     if (IS_ERR(rc))
@@ -698,9 +1231,10 @@ void* vm_resize(void* virt_addr, size_t new_size) {
 
     uintptr_t aligned_addr = page_align_range((uintptr_t)virt_addr, &new_size);
     struct vm* vm = vm_for_addr(virt_addr);
-    mutex_lock(&vm->lock);
+    struct tlb_batch batch;
+    lock_vm(vm, &batch);
     unsigned char* new_addr = resize(vm, (void*)aligned_addr, new_size);
-    mutex_unlock(&vm->lock);
+    unlock_vm(vm, &batch);
     if (IS_ERR(new_addr))
         return new_addr;
     return new_addr + ((uintptr_t)virt_addr - aligned_addr);
@@ -715,9 +1249,10 @@ int vm_set_flags(void* addr, size_t size, int vm_flags) {
 
     uintptr_t aligned_addr = page_align_range((uintptr_t)addr, &size);
     struct vm* vm = vm_for_addr(addr);
-    mutex_lock(&vm->lock);
+    struct tlb_batch batch;
+    lock_vm(vm, &batch);
     rc = set_flags(vm, (void*)aligned_addr, size, vm_flags);
-    mutex_unlock(&vm->lock);
+    unlock_vm(vm, &batch);
     return rc;
 }
 
@@ -728,9 +1263,10 @@ int vm_unmap(void* addr, size_t size) {
 
     uintptr_t aligned_addr = page_align_range((uintptr_t)addr, &size);
     struct vm* vm = vm_for_addr(addr);
-    mutex_lock(&vm->lock);
+    struct tlb_batch batch;
+    lock_vm(vm, &batch);
     rc = unmap(vm, (void*)aligned_addr, size);
-    mutex_unlock(&vm->lock);
+    unlock_vm(vm, &batch);
     return rc;
 }
 
@@ -739,19 +1275,109 @@ int vm_free(void* addr) {
         return -EFAULT;
 
     struct vm* vm = vm_for_addr(addr);
-    mutex_lock(&vm->lock);
+    struct tlb_batch batch;
+    lock_vm(vm, &batch);
     struct vm_region* region = vm_find_region(vm, addr);
     if (!region) {
-        mutex_unlock(&vm->lock);
+        unlock_vm(vm, &batch);
         return -ENOENT;
     }
     if (region->start != ROUND_DOWN((uintptr_t)addr, PAGE_SIZE)) {
-        mutex_unlock(&vm->lock);
+        unlock_vm(vm, &batch);
         return -EINVAL;
     }
     page_table_unmap(region->start, region->end - region->start);
     vm_remove_region(vm, region);
-    mutex_unlock(&vm->lock);
-    slab_cache_free(&vm_region_cache, region);
+    unlock_vm(vm, &batch);
+    free_region(region);
     return 0;
 }
+
+// Returns the page of the file that backs the page address in the region,
+// with a reference taken, or 0 if the page is a hole in the file.
+// page_cache_read locks the page cache while copying to user memory, which
+// may fault and lock the vm, so the page cache is locked only after
+// dropping the lock of the vm. Returns -EAGAIN if the region has changed
+// in the meantime.
+static uintptr_t get_file_page(struct vm* vm, struct vm_region* region,
+                               uintptr_t page_addr) {
+    struct inode* inode = region->inode;
+    uint64_t offset = region->offset + (page_addr - region->start);
+    inode_ref(inode);
+    mutex_unlock(&vm->lock);
+
+    uintptr_t page = page_cache_get_page(inode->page_cache, offset);
+
+    mutex_lock(&vm->lock);
+    region = vm_find_region(vm, (void*)page_addr);
+    if (!region || region->inode != inode ||
+        region->offset + (page_addr - region->start) != offset) {
+        if (IS_OK(page) && page)
+            page_unref(page);
+        page = -EAGAIN;
+    }
+    inode_unref(inode);
+    return page;
+}
+
+int vm_handle_page_fault(void* virt_addr, uint32_t error_code) {
+    if (!current || !is_user_address(virt_addr))
+        return -EFAULT;
+
+    struct vm* vm = current->vm;
+    if (vm == kernel_vm)
+        return -EFAULT;
+
+    bool write = error_code & PF_WRITE;
+    int required_flags = write ? VM_WRITE : VM_READ;
+    uintptr_t page_addr = ROUND_DOWN((uintptr_t)virt_addr, PAGE_SIZE);
+
+    mutex_lock(&vm->lock);
+    uintptr_t page = 0;
+    struct vm_region* region = vm_find_region(vm, virt_addr);
+    if (region && region->inode && !(error_code & PF_PRESENT)) {
+        page = get_file_page(vm, region, page_addr);
+        if (page == (uintptr_t)-EAGAIN) {
+            // The access is retried and faults again if it still has to.
+            mutex_unlock(&vm->lock);
+            return 0;
+        }
+        region = vm_find_region(vm, virt_addr);
+    }
+    int rc = IS_ERR(page) ? (int)page : -EFAULT;
+    if (IS_OK(page) && region && (region->flags & required_flags) &&
+        ((error_code & PF_PRESENT) || is_demand_paged(region->flags)))
+        rc = page_table_handle_fault(page_addr, to_pte_flags(region->flags),
+                                     write, page);
+    if (IS_OK(page) && page)
+        page_unref(page);
+    mutex_unlock(&vm->lock);
+    return rc;
+}
+
+uintptr_t vm_loan_user_page(void* virt_addr) {
+    if (!is_user_address(virt_addr))
+        return -EFAULT;
+
+    struct vm* vm = current->vm;
+    if (vm == kernel_vm)
+        return -EFAULT;
+
+    uintptr_t page_addr = ROUND_DOWN((uintptr_t)virt_addr, PAGE_SIZE);
+    for (;;) {
+        struct tlb_batch batch;
+        lock_vm(vm, &batch);
+        uintptr_t rc = -EFAULT;
+        struct vm_region* region = vm_find_region(vm, virt_addr);
+        if (region && (region->flags & VM_READ))
+            rc = page_table_loan_page(page_addr);
+        unlock_vm(vm, &batch);
+        if (rc != (uintptr_t)-ENOENT)
+            return rc;
+
+        // Populate the page as if it was read by the task.
+        int fault_rc = vm_handle_page_fault(virt_addr, PF_USER);
+        if (IS_ERR(fault_rc))
+            return fault_rc;
+    }
+}
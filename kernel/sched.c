@@ -5,16 +5,25 @@
 #include "panic.h"
 #include "system.h"
 #include "task.h"
+#include "time.h"
 #include <common/stdio.h>
 #include <common/string.h>
 
-static struct task* ready_queue;
-static struct spinlock ready_queue_lock;
+// Blocked tasks with a timer, sorted by wakeup_tick
+static struct task* sleep_queue;
+static struct spinlock sleep_queue_lock;
 
 static noreturn void do_idle(void) {
     for (;;) {
-        ASSERT(interrupts_enabled());
-        hlt();
+        cli();
+        if (cpu_get_current()->num_ready_tasks > 0) {
+            sched_yield(false);
+            continue;
+        }
+        // sti takes effect after the next instruction, so a wakeup IPI sent
+        // after the check above still brings us out of hlt.
+        __asm__ volatile("sti\n"
+                         "hlt");
     }
 }
 
@@ -26,43 +35,110 @@ void sched_init(void) {
         struct task* idle = task_create(comm, do_idle);
         ASSERT_OK(idle);
         cpu->idle_task = idle;
+
+        char name[SIZEOF_FIELD(struct lockstat_entry, name)];
+        (void)snprintf(name, sizeof(name), "ready_queue_lock/%u", i);
+        lockstat_register_spinlock(&cpu->ready_queue_lock, name);
     }
+    lockstat_register_spinlock(&sleep_queue_lock, "sleep_queue_lock");
+}
+
+static void push_ready(struct cpu* cpu, struct task* task) {
+    task->ready_queue_next = NULL;
+
+    spinlock_lock(&cpu->ready_queue_lock);
+    if (cpu->ready_queue_tail) {
+        ASSERT(cpu->ready_queue_tail != task);
+        cpu->ready_queue_tail->ready_queue_next = task;
+    } else {
+        cpu->ready_queue_head = task;
+    }
+    cpu->ready_queue_tail = task;
+    ++cpu->num_ready_tasks;
+    spinlock_unlock(&cpu->ready_queue_lock);
+}
+
+static struct task* pop_ready(struct cpu* cpu) {
+    spinlock_lock(&cpu->ready_queue_lock);
+    struct task* task = cpu->ready_queue_head;
+    if (task) {
+        ASSERT(task->state != TASK_DEAD);
+        cpu->ready_queue_head = task->ready_queue_next;
+        if (!cpu->ready_queue_head)
+            cpu->ready_queue_tail = NULL;
+        task->ready_queue_next = NULL;
+        ASSERT(cpu->num_ready_tasks > 0);
+        --cpu->num_ready_tasks;
+    }
+    spinlock_unlock(&cpu->ready_queue_lock);
+    return task;
 }
 
-void enqueue_ready(struct task* task) {
+// Enqueues the task to the run queue of the current CPU.
+static void enqueue_ready(struct task* task) {
     ASSERT(task);
     ASSERT(task->state == TASK_RUNNING);
 
-    task->ready_queue_next = NULL;
+    bool int_flag = push_cli();
+    push_ready(cpu_get_current(), task);
+    pop_cli(int_flag);
+}
 
-    spinlock_lock(&ready_queue_lock);
-    if (ready_queue) {
-        struct task* it = ready_queue;
-        for (;;) {
-            ASSERT(it != task);
-            if (!it->ready_queue_next)
-                break;
-            it = it->ready_queue_next;
+// Returns the CPU with the most ready tasks other than `self`,
+// or NULL if no other CPU has more than `threshold` ready tasks.
+static struct cpu* find_busiest_cpu(const struct cpu* self, size_t threshold) {
+    struct cpu* busiest = NULL;
+    size_t max_num_ready = threshold;
+    for (size_t i = 0; i < num_cpus; ++i) {
+        struct cpu* cpu = cpus[i];
+        if (cpu == self)
+            continue;
+        size_t num_ready = cpu->num_ready_tasks;
+        if (num_ready > max_num_ready) {
+            busiest = cpu;
+            max_num_ready = num_ready;
         }
-        it->ready_queue_next = task;
-    } else {
-        ready_queue = task;
     }
-    spinlock_unlock(&ready_queue_lock);
+    return busiest;
 }
 
 static struct task* dequeue_ready(void) {
-    spinlock_lock(&ready_queue_lock);
-    if (!ready_queue) {
-        spinlock_unlock(&ready_queue_lock);
-        return cpu_get_current()->idle_task;
-    }
-    struct task* task = ready_queue;
-    ASSERT(task->state != TASK_DEAD);
-    ready_queue = task->ready_queue_next;
-    task->ready_queue_next = NULL;
-    spinlock_unlock(&ready_queue_lock);
-    return task;
+    struct cpu* cpu = cpu_get_current();
+
+    // Pull a task from another CPU if the load is imbalanced by more than one
+    // task. Otherwise, run a task from the local run queue, and steal from
+    // other CPUs only if the local run queue is empty.
+    struct cpu* busiest = find_busiest_cpu(cpu, cpu->num_ready_tasks + 1);
+    if (busiest) {
+        struct task* task = pop_ready(busiest);
+        if (task)
+            return task;
+    }
+
+    struct task* task = pop_ready(cpu);
+    if (task)
+        return task;
+
+    // The lock of the victim is taken without holding our own lock,
+    // so two CPUs stealing from each other never deadlock.
+    busiest = find_busiest_cpu(cpu, 0);
+    if (busiest) {
+        task = pop_ready(busiest);
+        if (task)
+            return task;
+    }
+
+    return NULL;
+}
+
+// Returns the CPU with the fewest ready tasks.
+static struct cpu* find_least_loaded_cpu(void) {
+    struct cpu* least = cpus[0];
+    for (size_t i = 1; i < num_cpus; ++i) {
+        if (cpus[i]->num_ready_tasks < least->num_ready_tasks)
+            least = cpus[i];
+    }
+    return least;
 }
 
 void sched_register(struct task* task) {
@@ -86,50 +162,58 @@ void sched_register(struct task* task) {
     }
     spinlock_unlock(&all_tasks_lock);
 
-    enqueue_ready(task);
+    // Spread newly created tasks across CPUs.
+    bool int_flag = push_cli();
+    struct cpu* cpu = find_least_loaded_cpu();
+    push_ready(cpu, task);
+
+    // An idle CPU sits in hlt until its next timer tick, so kick it to pick
+    // up the task right away.
+    if (smp_active && cpu != cpu_get_current() &&
+        cpu->current_task == cpu->idle_task)
+        lapic_unicast_ipi(cpu->apic_id);
+    pop_cli(int_flag);
 }
 
-static void unblock_tasks(void) {
-    spinlock_lock(&all_tasks_lock);
-
-    if (!all_tasks) {
-        spinlock_unlock(&all_tasks_lock);
+// Called on the stack of the next task after switching away from prev_task.
+void finish_switch(struct task* prev_task, bool requeue_prev) {
+    if (!prev_task)
         return;
-    }
 
-    for (struct task* it = all_tasks; it; it = it->all_tasks_next) {
-        if (it->state != TASK_UNINTERRUPTIBLE &&
-            it->state != TASK_INTERRUPTIBLE)
-            continue;
+    bool is_dead = prev_task->state == TASK_DEAD;
 
-        ASSERT(it->unblock);
-        bool interrupted = it->state == TASK_INTERRUPTIBLE &&
-                           (it->pending_signals & ~it->blocked_signals);
-        if (interrupted || it->unblock(it->block_data)) {
-            it->unblock = NULL;
-            it->block_data = NULL;
-            it->interrupted = interrupted;
-            it->state = TASK_RUNNING;
-            task_ref(it);
-            enqueue_ready(it);
-        }
+    // Once on_cpu is cleared, other CPUs may run (or reap) prev_task.
+    unsigned on_cpu = atomic_exchange(&prev_task->on_cpu, 0);
+    if (requeue_prev || on_cpu == 2) {
+        // prev_task was either preempted or woken up while switching out.
+        enqueue_ready(prev_task);
+        return;
     }
 
-    spinlock_unlock(&all_tasks_lock);
+    if (is_dead)
+        waitqueue_wake_all(&task_exit_waitqueue);
 }
 
-noreturn void switch_context(void) {
+noreturn void switch_context(struct task* prev_task, bool requeue_prev) {
     cli();
 
     struct cpu* cpu = cpu_get_current();
-    struct task* prev_task = cpu->current_task;
     if (prev_task == cpu->idle_task)
-        prev_task = NULL;
-
-    unblock_tasks();
+        requeue_prev = false;
 
     struct task* task = dequeue_ready();
-    ASSERT(task);
+    if (!task) {
+        // Keep running the previous task if nothing else is runnable,
+        // instead of bouncing through the idle task.
+        task = requeue_prev ? prev_task : cpu->idle_task;
+    }
+    if (task == prev_task) {
+        prev_task = NULL;
+        requeue_prev = false;
+    } else {
+        ASSERT(task->on_cpu == 0);
+        task->on_cpu = 1;
+    }
     ASSERT(task->state == TASK_RUNNING);
     cpu->current_task = task;
 
@@ -143,17 +227,15 @@ noreturn void switch_context(void) {
     else
         __asm__ volatile("frstor %0" ::"m"(task->fpu_state));
 
-    // Call enqueue_ready(prev_task) after switching to the stack of the next
-    // task to prevent other CPUs from using the stack of prev_task while
-    // we are still using it.
+    // Call finish_switch(prev_task, requeue_prev) after switching to the stack
+    // of the next task to prevent other CPUs from using the stack of
+    // prev_task while we are still using it.
     __asm__ volatile("movl 0x04(%%ebx), %%esp\n" // esp = task->esp
                      "movl 0x08(%%ebx), %%ebp\n" // ebp = task->ebp
-                     "test %%eax, %%eax\n"
-                     "jz 1f\n"
+                     "pushl %%ecx\n"
                      "pushl %%eax\n"
-                     "call enqueue_ready\n"
-                     "add $4, %%esp\n"
-                     "1:\n"
+                     "call finish_switch\n"
+                     "add $8, %%esp\n"
                      "movl %%ebx, %%eax\n"
                      "movl 0x0c(%%eax), %%ebx\n" // ebx = task->ebx
                      "movl 0x10(%%eax), %%esi\n" // esi = task->esi
@@ -161,11 +243,11 @@ noreturn void switch_context(void) {
                      "movl (%%eax), %%eax\n"     // eax = task->eip
                      "jmp *%%eax"
                      :
-                     : "b"(task), "a"(prev_task));
+                     : "b"(task), "a"(prev_task), "c"((int)requeue_prev));
     UNREACHABLE();
 }
 
-void sched_start(void) { switch_context(); }
+void sched_start(void) { switch_context(NULL, false); }
 
 void sched_yield(bool requeue_current) {
     bool int_flag = push_cli();
@@ -183,23 +265,150 @@ void sched_yield(bool requeue_current) {
         cpu->current_task = NULL;
     }
 
+    // Jump to switch_context(task, requeue_current) with a dummy return
+    // address.
+    int requeue = requeue_current;
     __asm__ volatile("movl $1f, (%%eax)\n"       // task->eip
                      "movl %%esp, 0x04(%%eax)\n" // task->esp
                      "movl %%ebp, 0x08(%%eax)\n" // task->ebp
                      "movl %%ebx, 0x0c(%%eax)\n" // task->ebx
                      "movl %%esi, 0x10(%%eax)\n" // task->esi
                      "movl %%edi, 0x14(%%eax)\n" // task->edi
+                     "pushl %%edx\n"
+                     "pushl %%eax\n"
+                     "pushl $0\n"
                      "jmp switch_context\n"
                      "1:" // switch_context() will jump back here
+                     : "+a"(task), "+d"(requeue)
                      :
-                     : "a"(task)
-                     : "edx", "ecx", "memory");
+                     : "ecx", "memory");
 
     pop_cli(int_flag);
 }
 
+// Makes the blocked task runnable.
+static void wake(struct task* task, bool interruptible_only) {
+    unsigned state = task->state;
+    for (;;) {
+        bool is_blocked =
+            state == TASK_INTERRUPTIBLE ||
+            (!interruptible_only && state == TASK_UNINTERRUPTIBLE);
+        if (!is_blocked)
+            return;
+        if (atomic_compare_exchange_weak(&task->state, &state, TASK_RUNNING))
+            break;
+    }
+
+    task_ref(task);
+
+    // If the task has not switched out yet, finish_switch will enqueue it.
+    unsigned on_cpu = 1;
+    if (atomic_compare_exchange_strong(&task->on_cpu, &on_cpu, 2))
+        return;
+    ASSERT(on_cpu == 0);
+    enqueue_ready(task);
+}
+
+void sched_wake(struct task* task) { wake(task, false); }
+
+void sched_interrupt(struct task* task) { wake(task, true); }
+
+void waitqueue_add(struct waitqueue* wq, struct waiter* waiter) {
+    *waiter = (struct waiter){.task = current};
+    spinlock_lock(&wq->lock);
+    waiter->next = wq->head;
+    if (wq->head)
+        wq->head->prev = waiter;
+    wq->head = waiter;
+    spinlock_unlock(&wq->lock);
+}
+
+void waitqueue_remove(struct waitqueue* wq, struct waiter* waiter) {
+    spinlock_lock(&wq->lock);
+    if (waiter->prev)
+        waiter->prev->next = waiter->next;
+    else
+        wq->head = waiter->next;
+    if (waiter->next)
+        waiter->next->prev = waiter->prev;
+    spinlock_unlock(&wq->lock);
+    waiter->prev = waiter->next = NULL;
+}
+
+void waitqueue_wake_all(struct waitqueue* wq) {
+    // Pairs with setting the state in sched_block_until, so that either we
+    // see the waiter or the waiter sees the event that caused this wakeup.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!wq->head)
+        return;
+    spinlock_lock(&wq->lock);
+    for (struct waiter* it = wq->head; it; it = it->next)
+        wake(it->task, false);
+    spinlock_unlock(&wq->lock);
+}
+
+static bool tick_has_passed(unsigned tick) {
+    return (int)(uptime - tick) >= 0;
+}
+
+static void sleep_queue_insert(struct task* task, unsigned wakeup_tick) {
+    spinlock_lock(&sleep_queue_lock);
+    ASSERT(!task->in_sleep_queue);
+    task->wakeup_tick = wakeup_tick;
+    struct task* prev = NULL;
+    struct task* it = sleep_queue;
+    while (it && (int)(it->wakeup_tick - wakeup_tick) <= 0) {
+        prev = it;
+        it = it->sleep_queue_next;
+    }
+    task->sleep_queue_prev = prev;
+    task->sleep_queue_next = it;
+    if (prev)
+        prev->sleep_queue_next = task;
+    else
+        sleep_queue = task;
+    if (it)
+        it->sleep_queue_prev = task;
+    task->in_sleep_queue = true;
+    spinlock_unlock(&sleep_queue_lock);
+}
+
+static void sleep_queue_remove(struct task* task) {
+    spinlock_lock(&sleep_queue_lock);
+    if (task->in_sleep_queue) {
+        if (task->sleep_queue_prev)
+            task->sleep_queue_prev->sleep_queue_next = task->sleep_queue_next;
+        else
+            sleep_queue = task->sleep_queue_next;
+        if (task->sleep_queue_next)
+            task->sleep_queue_next->sleep_queue_prev = task->sleep_queue_prev;
+        task->sleep_queue_prev = task->sleep_queue_next = NULL;
+        task->in_sleep_queue = false;
+    }
+    spinlock_unlock(&sleep_queue_lock);
+}
+
+static void wake_expired_sleepers(void) {
+    if (!sleep_queue)
+        return;
+    spinlock_lock(&sleep_queue_lock);
+    while (sleep_queue && tick_has_passed(sleep_queue->wakeup_tick)) {
+        struct task* task = sleep_queue;
+        sleep_queue = task->sleep_queue_next;
+        if (sleep_queue)
+            sleep_queue->sleep_queue_prev = NULL;
+        task->sleep_queue_next = NULL;
+        task->in_sleep_queue = false;
+        wake(task, false);
+    }
+    spinlock_unlock(&sleep_queue_lock);
+}
+
 void sched_tick(struct registers* regs) {
     ASSERT(!interrupts_enabled());
+
+    wake_expired_sleepers();
+
     if (!current)
         return;
 
@@ -217,28 +426,70 @@ void sched_tick(struct registers* regs) {
     struct sigaction act;
     int signum = task_pop_signal(&act);
     ASSERT_OK(signum);
-    if (signum > 0)
+    if (signum > 0) {
+        // Pushing the signal frame may fault on a copy-on-write page of the
+        // user stack, and resolving it requires interrupts to be enabled.
+        sti();
         task_handle_signal(regs, signum, &act);
+    }
 }
 
-int sched_block(unblock_fn unblock, void* data, int flags) {
-    ASSERT(!current->unblock);
-    ASSERT(!current->block_data);
-    current->interrupted = false;
-
-    if (unblock(data))
-        return 0;
+int sched_block_until(unsigned wakeup_tick, unblock_fn unblock, void* data,
+                      int flags) {
+    unsigned blocked_state = (flags & BLOCK_UNINTERRUPTIBLE)
+                                 ? TASK_UNINTERRUPTIBLE
+                                 : TASK_INTERRUPTIBLE;
 
     bool int_flag = push_cli();
+    struct task* task = current;
+    int ret = 0;
+    for (;;) {
+        // The state is set before evaluating the unblock function so that
+        // a wakeup that happens after the evaluation is not lost.
+        task->state = blocked_state;
+
+        bool done = unblock(data);
+        if (!done && blocked_state == TASK_INTERRUPTIBLE &&
+            (task->pending_signals & ~task->blocked_signals)) {
+            ret = -EINTR;
+            done = true;
+        }
+        if (done) {
+            unsigned state = blocked_state;
+            if (atomic_compare_exchange_strong(&task->state, &state,
+                                               TASK_RUNNING))
+                break;
 
-    current->unblock = unblock;
-    current->block_data = data;
-    current->state = (flags & BLOCK_UNINTERRUPTIBLE) ? TASK_UNINTERRUPTIBLE
-                                                     : TASK_INTERRUPTIBLE;
+            // Someone has already woken us up and expects us to switch out
+            // so that we can be requeued.
+            sched_yield(false);
+            break;
+        }
+
+        if (wakeup_tick) {
+            if (tick_has_passed(wakeup_tick))
+                wakeup_tick = uptime + 1;
+            sleep_queue_insert(task, wakeup_tick);
+        }
 
-    sched_yield(false);
+        sched_yield(false);
 
+        if (wakeup_tick)
+            sleep_queue_remove(task);
+    }
     pop_cli(int_flag);
 
-    return current->interrupted ? -EINTR : 0;
+    return ret;
+}
+
+int sched_block(struct waitqueue* wq, unblock_fn unblock, void* data,
+                int flags) {
+    if (unblock(data))
+        return 0;
+
+    struct waiter waiter;
+    waitqueue_add(wq, &waiter);
+    int rc = sched_block_until(0, unblock, data, flags);
+    waitqueue_remove(wq, &waiter);
+    return rc;
 }
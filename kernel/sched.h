@@ -1,5 +1,6 @@
 #pragma once
 
+#include "lock.h"
 #include <common/extra.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -22,11 +23,49 @@ void sched_yield(bool requeue_current);
 // Should be called on every timer tick.
 void sched_tick(struct registers*);
 
+// A list of tasks waiting for an event.
+struct waitqueue {
+    struct waiter* head;
+    struct spinlock lock;
+};
+
+struct waiter {
+    struct task* task;
+    struct waiter* prev;
+    struct waiter* next;
+};
+
+// Adds the current task to the wait queue.
+void waitqueue_add(struct waitqueue*, struct waiter*);
+
+// Removes the waiter added with waitqueue_add.
+void waitqueue_remove(struct waitqueue*, struct waiter*);
+
+// Wakes up all the tasks waiting on the wait queue.
+void waitqueue_wake_all(struct waitqueue*);
+
+// Wakes up the task if it is blocked.
+void sched_wake(struct task*);
+
+// Wakes up the task if it is blocked interruptibly, e.g. to deliver a signal.
+void sched_interrupt(struct task*);
+
 #define BLOCK_UNINTERRUPTIBLE 1
 
 // Returns true if the task should be unblocked.
 typedef bool (*unblock_fn)(void*);
 
 // Blocks the current task until the unblock function returns true.
+// The unblock function is evaluated when the task is woken up by one of the
+// wait queues it has been added to, by a signal, or by the timer once
+// `uptime` reaches `wakeup_tick` (0 means no timer). Once the timer has
+// expired, the unblock function is evaluated on every tick.
+// Returns -EINTR if the task was interrupted.
+NODISCARD int sched_block_until(unsigned wakeup_tick, unblock_fn, void* data,
+                                int flags);
+
+// Blocks the current task on the wait queue until the unblock function
+// returns true.
 // Returns -EINTR if the task was interrupted.
-NODISCARD int sched_block(unblock_fn, void* data, int flags);
+NODISCARD int sched_block(struct waitqueue*, unblock_fn, void* data,
+                          int flags);
@@ -46,7 +46,7 @@ extern unsigned char ap_trampoline_start[];
 extern unsigned char ap_trampoline_end[];
 static bool smp_enabled;
 static atomic_uint num_ready_cpus = 1;
-void* ap_stack_top;
+void** ap_stack_tops;
 atomic_bool smp_active;
 
 void smp_init(void) {
@@ -77,10 +77,13 @@ void smp_start(void) {
     const struct acpi* acpi = acpi_get();
     ASSERT(acpi);
 
-    size_t ap_stack_size = STACK_SIZE * (num_cpus - 1);
-    unsigned char* ap_stack = kmalloc(ap_stack_size);
-    ASSERT(ap_stack);
-    ap_stack_top = ap_stack + ap_stack_size;
+    ap_stack_tops = kmalloc((num_cpus - 1) * sizeof(void*));
+    ASSERT(ap_stack_tops);
+    for (size_t i = 0; i < num_cpus - 1; ++i) {
+        unsigned char* stack = kstack_alloc();
+        ASSERT_OK(stack);
+        ap_stack_tops[i] = stack + STACK_SIZE;
+    }
 
     STATIC_ASSERT(AP_TRAMPOLINE_ADDR < 0x100000);
     STATIC_ASSERT(AP_TRAMPOLINE_ADDR % 0x1000 == 0);
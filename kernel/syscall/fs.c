@@ -5,6 +5,7 @@
 #include <kernel/api/sys/limits.h>
 #include <kernel/api/sys/uio.h>
 #include <kernel/api/unistd.h>
+#include <kernel/fs/buffer.h>
 #include <kernel/fs/fs.h>
 #include <kernel/fs/path.h>
 #include <kernel/memory/memory.h>
@@ -565,6 +566,8 @@ int sys_mount(const char* user_source, const char* user_target,
     return vfs_mount(source, target, fs_type);
 }
 
+int sys_sync(void) { return buffer_sync(NULL); }
+
 int sys_link(const char* user_oldpath, const char* user_newpath) {
     char old_pathname[PATH_MAX];
     int rc = copy_pathname_from_user(old_pathname, user_oldpath);
@@ -993,3 +996,130 @@ fail:
     file_close(writer_file);
     return rc;
 }
+
+typedef ssize_t (*splice_fn)(struct file* pipe, struct file*, uint64_t offset,
+                             size_t count, int flags);
+
+// Splices between a pipe and a file, at the offset given by user_offset or
+// at the file offset if user_offset is NULL.
+static ssize_t splice_file(splice_fn fn, struct file* pipe, struct file* file,
+                           loff_t* user_offset, size_t count, int flags) {
+    bool seekable = inode_is_seekable(file->inode);
+    if (user_offset) {
+        if (!seekable)
+            return -ESPIPE;
+        loff_t offset;
+        if (copy_from_user(&offset, user_offset, sizeof(loff_t)))
+            return -EFAULT;
+        if (offset < 0)
+            return -EINVAL;
+        ssize_t n = fn(pipe, file, offset, count, flags);
+        if (IS_ERR(n))
+            return n;
+        offset += n;
+        if (copy_to_user(user_offset, &offset, sizeof(loff_t)))
+            return -EFAULT;
+        return n;
+    }
+
+    if (!seekable)
+        return fn(pipe, file, 0, count, flags);
+
+    mutex_lock(&file->offset_lock);
+    ssize_t n = fn(pipe, file, file->offset, count, flags);
+    if (IS_OK(n))
+        file->offset += n;
+    mutex_unlock(&file->offset_lock);
+    return n;
+}
+
+ssize_t sys_splice(int fd_in, loff_t* user_off_in, int fd_out,
+                   loff_t* user_off_out, size_t len, unsigned int flags) {
+    struct file* in = task_get_file(fd_in);
+    if (IS_ERR(in))
+        return PTR_ERR(in);
+    struct file* out = task_get_file(fd_out);
+    if (IS_ERR(out))
+        return PTR_ERR(out);
+    if (len == 0)
+        return 0;
+
+    bool in_is_fifo = file_is_fifo(in);
+    bool out_is_fifo = file_is_fifo(out);
+    if ((in_is_fifo && user_off_in) || (out_is_fifo && user_off_out))
+        return -ESPIPE;
+
+    ssize_t rc;
+    if (in_is_fifo && out_is_fifo)
+        rc = fifo_splice(in, out, len, flags);
+    else if (in_is_fifo)
+        rc = splice_file(fifo_splice_to, in, out, user_off_out, len, flags);
+    else if (out_is_fifo)
+        rc = splice_file(fifo_splice_from, out, in, user_off_in, len, flags);
+    else
+        return -EINVAL;
+    if (rc == -EINTR)
+        return -ERESTARTSYS;
+    return rc;
+}
+
+ssize_t sys_tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+    struct file* in = task_get_file(fd_in);
+    if (IS_ERR(in))
+        return PTR_ERR(in);
+    struct file* out = task_get_file(fd_out);
+    if (IS_ERR(out))
+        return PTR_ERR(out);
+    if (!file_is_fifo(in) || !file_is_fifo(out))
+        return -EINVAL;
+    if (len == 0)
+        return 0;
+    ssize_t rc = fifo_tee(in, out, len, flags);
+    if (rc == -EINTR)
+        return -ERESTARTSYS;
+    return rc;
+}
+
+ssize_t sys_vmsplice(int fd, const struct iovec* user_iov, size_t nr_segs,
+                     unsigned int flags) {
+    if (nr_segs > SIZE_MAX / sizeof(struct iovec))
+        return -EINVAL;
+    if (!user_iov || !is_user_range(user_iov, nr_segs * sizeof(struct iovec)))
+        return -EFAULT;
+    struct file* file = task_get_file(fd);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+    if (!file_is_fifo(file))
+        return -EBADF;
+
+    ssize_t ret = 0;
+    for (size_t i = 0; i < nr_segs; ++i) {
+        struct iovec iov;
+        if (copy_from_user(&iov, user_iov + i, sizeof(struct iovec))) {
+            ret = -EFAULT;
+            break;
+        }
+        if (iov.iov_len == 0)
+            continue;
+        if (!is_user_range(iov.iov_base, iov.iov_len)) {
+            ret = -EFAULT;
+            break;
+        }
+        ssize_t n = fifo_vmsplice(file, iov.iov_base, iov.iov_len, flags);
+        if (n == -EINTR && ret == 0) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        if (IS_ERR(n)) {
+            if (ret == 0)
+                ret = n;
+            break;
+        }
+        ret += n;
+        if ((size_t)n < iov.iov_len)
+            break;
+        // Don't wait for more room once some data has been transferred.
+        flags |= SPLICE_F_NONBLOCK;
+    }
+    return ret;
+}
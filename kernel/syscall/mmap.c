@@ -20,6 +20,8 @@ void* sys_mmap_pgoff(void* addr, size_t length, int prot, int flags, int fd,
         return ERR_PTR(-ENOTSUP);
     if ((flags & MAP_ANONYMOUS) && pgoff)
         return ERR_PTR(-ENOTSUP);
+    if ((flags & MAP_HUGETLB) && !(flags & MAP_ANONYMOUS))
+        return ERR_PTR(-EINVAL);
 
     int vm_flags = VM_USER;
     if (prot & PROT_READ)
@@ -28,12 +30,17 @@ void* sys_mmap_pgoff(void* addr, size_t length, int prot, int flags, int fd,
         vm_flags |= VM_WRITE;
     if (flags & MAP_SHARED)
         vm_flags |= VM_SHARED;
+    if (flags & MAP_HUGETLB)
+        vm_flags |= VM_HUGE;
 
     if (flags & MAP_ANONYMOUS) {
         void* mapped_addr = vm_alloc(length, vm_flags);
         if (IS_ERR(mapped_addr))
             return mapped_addr;
-        memset(mapped_addr, 0, length);
+        // Private mappings are populated with zero-filled pages on demand.
+        // Huge pages are zeroed when they are allocated.
+        if ((flags & MAP_SHARED) && !(flags & MAP_HUGETLB))
+            memset(mapped_addr, 0, length);
         return mapped_addr;
     }
 
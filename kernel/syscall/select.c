@@ -54,6 +54,7 @@ NODISCARD static int poll(nfds_t nfds, struct pollfd pollfds[nfds],
         .nfds = nfds,
         .pollfds = pollfds,
     };
+    struct waiter* waiters = NULL;
 
     if (nfds > 0) {
         blocker.files = kmalloc(sizeof(struct file*) * nfds);
@@ -61,6 +62,11 @@ NODISCARD static int poll(nfds_t nfds, struct pollfd pollfds[nfds],
             ret = -ENOMEM;
             goto fail;
         }
+        waiters = kmalloc(sizeof(struct waiter) * nfds);
+        if (!waiters) {
+            ret = -ENOMEM;
+            goto fail;
+        }
 
         for (nfds_t i = 0; i < nfds; ++i) {
             struct pollfd* pollfd = pollfds + i;
@@ -88,7 +94,18 @@ NODISCARD static int poll(nfds_t nfds, struct pollfd pollfds[nfds],
         blocker.deadline = deadline;
     }
 
-    ret = sched_block((unblock_fn)unblock_poll, &blocker, 0);
+    // Wait on all the files at once. Any of them becoming ready (or the
+    // timeout expiring) wakes us up to re-poll.
+    for (nfds_t i = 0; i < nfds; ++i) {
+        if (blocker.files[i])
+            waitqueue_add(file_get_waitqueue(blocker.files[i]), waiters + i);
+    }
+    unsigned wakeup_tick = timeout ? uptime + timespec_to_ticks(timeout) : 0;
+    ret = sched_block_until(wakeup_tick, (unblock_fn)unblock_poll, &blocker, 0);
+    for (nfds_t i = 0; i < nfds; ++i) {
+        if (blocker.files[i])
+            waitqueue_remove(file_get_waitqueue(blocker.files[i]), waiters + i);
+    }
     if (IS_ERR(ret))
         goto fail;
 
@@ -104,6 +121,7 @@ NODISCARD static int poll(nfds_t nfds, struct pollfd pollfds[nfds],
     ret = blocker.num_events;
 
 fail:
+    kfree(waiters);
     kfree(blocker.files);
     return ret;
 }
@@ -34,21 +34,22 @@ int sys_sigaction(int signum, const struct sigaction* user_act,
             return -EFAULT;
     }
 
-    int ret = 0;
+    // Writing to user_oldact may fault, so it is done after releasing the
+    // lock.
+    struct sigaction oldact;
     struct sighand* sighand = current->sighand;
     spinlock_lock(&sighand->lock);
     struct sigaction* slot = &sighand->actions[signum - 1];
-    if (user_oldact) {
-        if (copy_to_user(user_oldact, slot, sizeof(struct sigaction))) {
-            ret = -EFAULT;
-            goto done;
-        }
-    }
+    oldact = *slot;
     if (user_act)
         *slot = act;
-done:
     spinlock_unlock(&sighand->lock);
-    return ret;
+
+    if (user_oldact) {
+        if (copy_to_user(user_oldact, &oldact, sizeof(struct sigaction)))
+            return -EFAULT;
+    }
+    return 0;
 }
 
 int sys_sigprocmask(int how, const sigset_t* user_set, sigset_t* user_oldset) {
@@ -84,7 +85,9 @@ static bool unblock_pause(void* data) {
     return false; // Do not unblock until a signal is received
 }
 
-int sys_pause(void) { return sched_block(unblock_pause, NULL, 0); }
+int sys_pause(void) {
+    return sched_block_until(0, unblock_pause, NULL, 0);
+}
 
 int sys_sigsuspend(const sigset_t* user_mask) {
     sigset_t mask;
@@ -41,6 +41,7 @@
     F(oldfstat, sys_fstat, 0)                                                  \
     F(pause, sys_pause, 0)                                                     \
     F(access, sys_access, 0)                                                   \
+    F(sync, sys_sync, 0)                                                       \
     F(kill, sys_kill, 0)                                                       \
     F(rename, sys_rename, 0)                                                   \
     F(mkdir, sys_mkdir, 0)                                                     \
@@ -118,6 +119,9 @@
     F(clock_gettime, sys_clock_gettime32, 0)                                   \
     F(clock_getres, sys_clock_getres_time32, 0)                                \
     F(clock_nanosleep, sys_clock_nanosleep_time32, 0)                          \
+    F(splice, sys_splice, 0)                                                   \
+    F(tee, sys_tee, 0)                                                         \
+    F(vmsplice, sys_vmsplice, 0)                                               \
     F(getcpu, sys_getcpu, 0)                                                   \
     F(dup3, sys_dup3, 0)                                                       \
     F(pipe2, sys_pipe2, 0)                                                     \
@@ -179,6 +183,7 @@ int sys_stime32(const time32_t* t);
 int sys_fstat(int fd, struct linux_old_stat* buf);
 int sys_pause(void);
 int sys_access(const char* pathname, int mode);
+int sys_sync(void);
 int sys_kill(pid_t pid, int sig);
 int sys_rename(const char* oldpath, const char* newpath);
 int sys_mkdir(const char* pathname, mode_t mode);
@@ -269,6 +274,11 @@ int sys_clock_getres_time32(clockid_t clockid, struct timespec32* res);
 int sys_clock_nanosleep_time32(clockid_t clockid, int flags,
                                const struct timespec32* request,
                                struct timespec32* remain);
+ssize_t sys_splice(int fd_in, loff_t* off_in, int fd_out, loff_t* off_out,
+                   size_t len, unsigned int flags);
+ssize_t sys_tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+ssize_t sys_vmsplice(int fd, const struct iovec* iov, size_t nr_segs,
+                     unsigned int flags);
 int sys_getcpu(unsigned int* cpu, unsigned int* node,
                struct getcpu_cache* tcache);
 int sys_dup3(int oldfd, int newfd, int flags);
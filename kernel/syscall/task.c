@@ -190,9 +190,10 @@ int sys_clone(struct registers* regs, unsigned long flags, void* user_stack,
     strlcpy(task->comm, current->comm, sizeof(task->comm));
 
     int rc = 0;
-    void* stack = kmalloc(STACK_SIZE);
-    if (!stack) {
-        rc = -ENOMEM;
+    void* stack = kstack_alloc();
+    if (IS_ERR(stack)) {
+        rc = PTR_ERR(stack);
+        stack = NULL;
         goto fail;
     }
     task->kernel_stack_base = (uintptr_t)stack;
@@ -305,7 +306,7 @@ fail:
     files_unref(task->files);
     fs_unref(task->fs);
     vm_unref(task->vm);
-    kfree(stack);
+    kstack_free(stack);
     kfree(task);
     return rc;
 }
@@ -401,7 +402,9 @@ static bool unblock_waitpid(struct waitpid_blocker* blocker) {
                 is_target = true;
         }
         any_target_exists |= is_target;
-        if (is_target && it->state == TASK_DEAD)
+        // Wait for the dead task to switch out before reaping it, as its
+        // kernel stack may still be in use.
+        if (is_target && it->state == TASK_DEAD && !it->on_cpu)
             break;
 
         prev = it;
@@ -446,7 +449,8 @@ pid_t sys_wait4(pid_t pid, int* user_wstatus, int options,
             return -ECHILD;
         }
     } else {
-        int rc = sched_block((unblock_fn)unblock_waitpid, &blocker, 0);
+        int rc = sched_block(&task_exit_waitqueue,
+                             (unblock_fn)unblock_waitpid, &blocker, 0);
         if (rc == -EINTR)
             return -ERESTARTSYS;
         if (IS_ERR(rc))
@@ -158,12 +158,18 @@ static int clock_nanosleep(clockid_t clockid, int flags,
         .clock_id = clockid,
         .deadline = deadline,
     };
-    rc = sched_block((unblock_fn)unblock_sleep, &blocker, 0);
+    struct timespec now;
+    rc = time_now(clockid, &now);
+    if (IS_ERR(rc))
+        return rc;
+    struct timespec duration = deadline;
+    timespec_saturating_sub(&duration, &now);
+    rc = sched_block_until(uptime + timespec_to_ticks(&duration),
+                           (unblock_fn)unblock_sleep, &blocker, 0);
     if (IS_ERR(rc))
         return rc;
     if (remain && flags != TIMER_ABSTIME) {
         *remain = deadline;
-        struct timespec now;
         rc = time_now(clockid, &now);
         if (IS_ERR(rc))
             return rc;
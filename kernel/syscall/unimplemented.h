@@ -15,7 +15,6 @@
     F(alarm)                                                                   \
     F(utime)                                                                   \
     F(nice)                                                                    \
-    F(sync)                                                                    \
     F(brk)                                                                     \
     F(setgid)                                                                  \
     F(signal)                                                                  \
@@ -188,10 +187,7 @@
     F(unshare)                                                                 \
     F(set_robust_list)                                                         \
     F(get_robust_list)                                                         \
-    F(splice)                                                                  \
     F(sync_file_range)                                                         \
-    F(tee)                                                                     \
-    F(vmsplice)                                                                \
     F(epoll_pwait)                                                             \
     F(utimensat)                                                               \
     F(signalfd)                                                                \
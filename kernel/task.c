@@ -16,6 +16,7 @@ static atomic_int next_tid = 1;
 
 struct task* all_tasks;
 struct spinlock all_tasks_lock;
+struct waitqueue task_exit_waitqueue;
 
 static struct fs* fs_create(void) {
     struct fs* fs = kmalloc(sizeof(struct fs));
@@ -159,6 +160,8 @@ void thread_group_unref(struct thread_group* tg) {
 }
 
 void task_init(void) {
+    lockstat_register_spinlock(&all_tasks_lock, "all_tasks_lock");
+
     __asm__ volatile("fninit");
     if (cpu_has_feature(cpu_get_bsp(), X86_FEATURE_FXSR))
         __asm__ volatile("fxsave %0" : "=m"(initial_fpu_state));
@@ -218,9 +221,10 @@ struct task* task_create(const char* comm, void (*entry_point)(void)) {
 
     task->vm = kernel_vm;
 
-    stack = kmalloc(STACK_SIZE);
-    if (!stack) {
-        ret = -ENOMEM;
+    stack = kstack_alloc();
+    if (IS_ERR(stack)) {
+        ret = PTR_ERR(stack);
+        stack = NULL;
         goto fail;
     }
     task->kernel_stack_base = (uintptr_t)stack;
@@ -247,7 +251,7 @@ struct task* task_create(const char* comm, void (*entry_point)(void)) {
     return task;
 
 fail:
-    kfree(stack);
+    kstack_free(stack);
     thread_group_unref(task->thread_group);
     sighand_unref(task->sighand);
     files_unref(task->files);
@@ -292,7 +296,7 @@ void task_unref(struct task* task) {
     if (task->vm != kernel_vm)
         vm_unref(task->vm);
 
-    kfree((void*)task->kernel_stack_base);
+    kstack_free((void*)task->kernel_stack_base);
     kfree(task);
 }
 
@@ -480,8 +484,10 @@ static void do_send_signal(struct task* task, int signum) {
 
     bool ignored = (handler == SIG_IGN) ||
                    (handler == SIG_DFL && default_disposition == DISP_IGN);
-    if (!ignored)
+    if (!ignored) {
         task->pending_signals |= sigmask(signum);
+        sched_interrupt(task);
+    }
 }
 
 int task_send_signal(pid_t pid, int signum, int flags) {
@@ -29,6 +29,7 @@ struct task {
     char comm[16];
 
     _Atomic(struct vm*) vm;
+    struct tlb_batch* tlb_batch; // TLB flushes deferred by a vm operation
     uintptr_t kernel_stack_base, kernel_stack_top;
     uintptr_t arg_start, arg_end, env_start, env_end;
 
@@ -42,10 +43,6 @@ struct task {
     _Atomic(sigset_t) pending_signals;
     _Atomic(sigset_t) blocked_signals;
 
-    unblock_fn unblock;
-    void* block_data;
-    bool interrupted;
-
     struct thread_group* thread_group;
 
     atomic_size_t user_ticks;
@@ -54,6 +51,16 @@ struct task {
     struct task* all_tasks_next;
     struct task* ready_queue_next;
 
+    // 1 while the task is running on a CPU, 2 if it was woken up while still
+    // running on a CPU, and 0 after it has been switched out.
+    atomic_uint on_cpu;
+
+    // The tick at which the blocked task is woken up by the timer
+    unsigned wakeup_tick;
+    struct task* sleep_queue_prev;
+    struct task* sleep_queue_next;
+    bool in_sleep_queue;
+
     struct mutex lock;
     atomic_size_t ref_count;
 };
@@ -104,6 +111,9 @@ void thread_group_unref(struct thread_group*);
 
 extern struct task* all_tasks;
 extern struct spinlock all_tasks_lock;
+
+// Woken up whenever a task has exited and switched out for the last time.
+extern struct waitqueue task_exit_waitqueue;
 extern struct fpu_state initial_fpu_state;
 
 void task_init(void);
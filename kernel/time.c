@@ -3,6 +3,7 @@
 #include "drivers/rtc.h"
 #include "lock.h"
 #include "time.h"
+#include <common/extra.h>
 
 #define NANOS 1000000000
 
@@ -39,11 +40,26 @@ int timespec_compare(const struct timespec* a, const struct timespec* b) {
     return 0;
 }
 
+unsigned timespec_to_ticks(const struct timespec* ts) {
+    // Limit the result to half the range of uptime so that deadlines can be
+    // compared across wraparound.
+    static const time_t max_sec = INT32_MAX / CLK_TCK - 1;
+    if (ts->tv_sec < 0)
+        return 0;
+    if (ts->tv_sec >= max_sec)
+        return max_sec * CLK_TCK;
+    uint32_t nsec = ts->tv_nsec;
+    return ts->tv_sec * CLK_TCK + DIV_CEIL(nsec, NANOS / CLK_TCK);
+}
+
 volatile atomic_uint uptime;
 static struct timespec now;
 static struct spinlock now_lock;
 
-void time_init(void) { now.tv_sec = rtc_now(); }
+void time_init(void) {
+    now.tv_sec = rtc_now();
+    lockstat_register_spinlock(&now_lock, "now_lock");
+}
 
 void time_tick(void) {
     ++uptime;
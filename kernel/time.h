@@ -14,6 +14,9 @@ void timespec_add(struct timespec*, const struct timespec*);
 void timespec_saturating_sub(struct timespec*, const struct timespec*);
 int timespec_compare(const struct timespec*, const struct timespec*);
 
+// Converts the duration to ticks, rounding up and saturating.
+unsigned timespec_to_ticks(const struct timespec*);
+
 void time_init(void);
 void time_tick(void);
 NODISCARD int time_now(clockid_t, struct timespec*);
@@ -17,6 +17,7 @@ static int unix_socket_close(struct file* file) {
     struct unix_socket* socket = unix_socket_from_file(file);
     socket->is_open_for_writing_to_connector = false;
     socket->is_open_for_writing_to_acceptor = false;
+    waitqueue_wake_all(&socket->inode.waitqueue);
     return 0;
 }
 
@@ -67,6 +68,7 @@ static ssize_t unix_socket_pread(struct file* file, void* buffer, size_t count,
         if (!ring_buf_is_empty(buf)) {
             ssize_t nread = ring_buf_read(buf, buffer, count);
             mutex_unlock(&socket->lock);
+            waitqueue_wake_all(&socket->inode.waitqueue);
             return nread;
         }
         mutex_unlock(&socket->lock);
@@ -113,6 +115,7 @@ static ssize_t unix_socket_pwrite(struct file* file, const void* buffer,
         if (!ring_buf_is_full(buf)) {
             ssize_t nwritten = ring_buf_write(buf, buffer, count);
             mutex_unlock(&socket->lock);
+            waitqueue_wake_all(&socket->inode.waitqueue);
             return nwritten;
         }
         mutex_unlock(&socket->lock);
@@ -248,6 +251,7 @@ struct unix_socket* unix_socket_accept(struct file* file) {
         connector->state = SOCKET_STATE_CONNECTED;
         connector->is_connected = true;
         mutex_unlock(&connector->lock);
+        waitqueue_wake_all(&connector->inode.waitqueue);
         return connector;
     }
 }
@@ -307,6 +311,7 @@ int unix_socket_connect(struct file* file, struct inode* addr_inode) {
 
     mutex_unlock(&listener->lock);
     mutex_unlock(&connector->lock);
+    waitqueue_wake_all(&listener->inode.waitqueue);
 
     return file_block(file, is_connectable, 0);
 }
@@ -332,6 +337,7 @@ int unix_socket_shutdown(struct file* file, int how) {
         socket->is_open_for_writing_to_connector = false;
     if ((conn && shut_write) || (!conn && shut_read))
         socket->is_open_for_writing_to_acceptor = false;
+    waitqueue_wake_all(&socket->inode.waitqueue);
 
     return 0;
 }
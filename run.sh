@@ -4,6 +4,8 @@ set -eo pipefail
 
 KERNEL='kernel/kernel'
 INITRD='initrd'
+EXT2_IMAGE='ext2.img'
+SCRATCH_IMAGE='scratch.img'
 CMDLINE=()
 NUM_CPUS=1
 
@@ -39,6 +41,8 @@ if command -v wslpath >/dev/null; then
     QEMU_VIRT_TECH_ARGS=(-accel "whpx,kernel-irqchip=off" -accel tcg)
     KERNEL=$(wslpath -w "${KERNEL}")
     INITRD=$(wslpath -w "${INITRD}")
+    EXT2_IMAGE=$(wslpath -w "${EXT2_IMAGE}")
+    SCRATCH_IMAGE=$(wslpath -w "${SCRATCH_IMAGE}")
 fi
 
 QEMU_BIN="${QEMU_BINARY_PREFIX}qemu-system-i386${QEMU_BINARY_SUFFIX}"
@@ -49,6 +53,8 @@ QEMU_BIN="${QEMU_BINARY_PREFIX}qemu-system-i386${QEMU_BINARY_SUFFIX}"
     -d guest_errors \
     "${QEMU_DISPLAY_ARGS[@]}" \
     -device ac97 \
+    -drive "file=${EXT2_IMAGE},if=virtio,format=raw" \
+    -drive "file=${SCRATCH_IMAGE},if=virtio,format=raw" \
     -chardev stdio,mux=on,id=char0 \
     -serial chardev:char0 \
     -mon char0,mode=readline \
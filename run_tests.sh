@@ -2,14 +2,24 @@
 
 set -e
 
-! qemu-system-i386 \
-    -kernel kernel/kernel \
-    -initrd initrd \
-    -append 'panic=poweroff init=/bin/init-test console=ttyS0' \
-    -d guest_errors \
-    -no-reboot \
-    -cpu max \
-    -serial stdio \
-    -vga none -display none \
-    -m 512M \
-    2>&1 | tee >(cat 1>&2) | grep -q PANIC
+run() {
+    ! qemu-system-i386 \
+        -kernel kernel/kernel \
+        -initrd initrd \
+        -append "panic=poweroff init=/bin/init-test console=ttyS0 $1" \
+        -d guest_errors \
+        -no-reboot \
+        -cpu max \
+        -serial stdio \
+        -vga none -display none \
+        -m 512M \
+        -drive file=ext2.img,if=virtio,format=raw \
+        -drive file=scratch.img,if=virtio,format=raw \
+        2>&1 | tee >(cat 1>&2) | grep -q PANIC
+}
+
+run
+
+# Boot again with the same disk to check that the files synced by the first
+# boot made it to the disk.
+run usertests.ext2_persisted
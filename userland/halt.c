@@ -4,6 +4,7 @@
 #include <unistd.h>
 
 int main(void) {
+    sync();
     if (reboot(RB_HALT_SYSTEM) < 0)
         perror("reboot");
     return EXIT_FAILURE;
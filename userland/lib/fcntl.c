@@ -32,3 +32,18 @@ int fcntl64(int fd, int cmd, ...) {
     va_end(args);
     RETURN_WITH_ERRNO(int, SYSCALL3(fcntl64, fd, cmd, arg));
 }
+
+ssize_t splice(int fd_in, loff_t* off_in, int fd_out, loff_t* off_out,
+               size_t len, unsigned int flags) {
+    RETURN_WITH_ERRNO(ssize_t, SYSCALL6(splice, fd_in, off_in, fd_out,
+                                        off_out, len, flags));
+}
+
+ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+    RETURN_WITH_ERRNO(ssize_t, SYSCALL4(tee, fd_in, fd_out, len, flags));
+}
+
+ssize_t vmsplice(int fd, const struct iovec* iov, size_t nr_segs,
+                 unsigned int flags) {
+    RETURN_WITH_ERRNO(ssize_t, SYSCALL4(vmsplice, fd, iov, nr_segs, flags));
+}
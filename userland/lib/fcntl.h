@@ -1,9 +1,18 @@
 #pragma once
 
 #include <kernel/api/fcntl.h>
+#include <stddef.h>
 #include <sys/types.h>
 
+struct iovec;
+
 int open(const char* pathname, int flags, ...);
 int creat(const char* pathname, mode_t mode);
 int fcntl(int fd, int cmd, ...);
 int fcntl64(int fd, int cmd, ...);
+
+ssize_t splice(int fd_in, loff_t* off_in, int fd_out, loff_t* off_out,
+               size_t len, unsigned int flags);
+ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+ssize_t vmsplice(int fd, const struct iovec* iov, size_t nr_segs,
+                 unsigned int flags);
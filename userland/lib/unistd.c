@@ -211,6 +211,8 @@ int setdomainname(const char* name, size_t len) {
     RETURN_WITH_ERRNO(int, SYSCALL2(setdomainname, name, len));
 }
 
+void sync(void) { SYSCALL0(sync); }
+
 int reboot(int howto) {
     RETURN_WITH_ERRNO(int, SYSCALL4(reboot, LINUX_REBOOT_MAGIC1,
                                     LINUX_REBOOT_MAGIC2, howto, NULL));
@@ -61,6 +61,7 @@ int sethostname(const char* name, size_t len);
 int getdomainname(char* name, size_t len);
 int setdomainname(const char* name, size_t len);
 
+void sync(void);
 int reboot(int howto);
 
 enum {
@@ -4,6 +4,7 @@
 #include <unistd.h>
 
 int main(void) {
+    sync();
     if (reboot(RB_POWER_OFF) < 0)
         perror("reboot");
     return EXIT_FAILURE;
@@ -1,16 +1,21 @@
+#include <dirent.h>
 #include <errno.h>
 #include <extra.h>
 #include <fcntl.h>
 #include <linux/fb.h>
 #include <panic.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/mount.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -158,6 +163,86 @@ static void test_fs(void) {
     }
 }
 
+static void test_dentry_cache(void) {
+    puts("Dentry cache");
+    struct stat st;
+
+    unlink("/tmp/test-dcache/b");
+    rmdir("/tmp/test-dcache/d");
+    unlink("/tmp/test-dcache/d");
+    rmdir("/tmp/test-dcache");
+    ASSERT_OK(mkdir("/tmp/test-dcache", 0));
+
+    // Cached nonexistent names are invalidated by rename
+    ASSERT_ERR(stat("/tmp/test-dcache/b", &st));
+    ASSERT(errno == ENOENT);
+    ASSERT_OK(close(open("/tmp/test-dcache/a", O_CREAT | O_EXCL, 0)));
+    ASSERT_OK(stat("/tmp/test-dcache/a", &st));
+    ASSERT_OK(rename("/tmp/test-dcache/a", "/tmp/test-dcache/b"));
+    ASSERT_OK(stat("/tmp/test-dcache/b", &st));
+    ASSERT_ERR(stat("/tmp/test-dcache/a", &st));
+    ASSERT(errno == ENOENT);
+
+    // A directory recreated with the same name starts out empty
+    ASSERT_OK(mkdir("/tmp/test-dcache/d", 0));
+    ASSERT_OK(close(open("/tmp/test-dcache/d/x", O_CREAT | O_EXCL, 0)));
+    ASSERT_OK(stat("/tmp/test-dcache/d/x", &st));
+    ASSERT_OK(unlink("/tmp/test-dcache/d/x"));
+    ASSERT_OK(rmdir("/tmp/test-dcache/d"));
+    ASSERT_OK(close(open("/tmp/test-dcache/d", O_CREAT | O_EXCL, 0)));
+    ASSERT_OK(stat("/tmp/test-dcache/d", &st));
+    ASSERT(S_ISREG(st.st_mode));
+    ASSERT_OK(unlink("/tmp/test-dcache/d"));
+    ASSERT_OK(mkdir("/tmp/test-dcache/d", 0));
+    ASSERT_ERR(stat("/tmp/test-dcache/d/x", &st));
+    ASSERT(errno == ENOENT);
+
+    ASSERT_OK(rmdir("/tmp/test-dcache/d"));
+    ASSERT_OK(unlink("/tmp/test-dcache/b"));
+    ASSERT_OK(rmdir("/tmp/test-dcache"));
+}
+
+static void test_large_dir(void) {
+    puts("Large directory");
+    enum { NUM_FILES = 500 };
+    char path[64];
+
+    for (int i = 0; i < NUM_FILES; ++i) {
+        (void)snprintf(path, sizeof(path), "/tmp/test-large-dir/%d", i);
+        unlink(path);
+    }
+    rmdir("/tmp/test-large-dir");
+    ASSERT_OK(mkdir("/tmp/test-large-dir", 0));
+    for (int i = 0; i < NUM_FILES; ++i) {
+        (void)snprintf(path, sizeof(path), "/tmp/test-large-dir/%d", i);
+        ASSERT_OK(close(open(path, O_CREAT | O_EXCL, 0)));
+    }
+
+    // Removing visited entries during the iteration doesn't make it skip or
+    // repeat the remaining ones.
+    static bool seen[NUM_FILES];
+    memset(seen, 0, sizeof(seen));
+    DIR* dirp = opendir("/tmp/test-large-dir");
+    ASSERT(dirp);
+    int count = 0;
+    struct dirent* dent;
+    while ((dent = readdir(dirp))) {
+        if (dent->d_name[0] == '.')
+            continue;
+        int i = atoi(dent->d_name);
+        ASSERT(0 <= i && i < NUM_FILES);
+        ASSERT(!seen[i]);
+        seen[i] = true;
+        ++count;
+        (void)snprintf(path, sizeof(path), "/tmp/test-large-dir/%d", i);
+        ASSERT_OK(unlink(path));
+    }
+    ASSERT_OK(closedir(dirp));
+    ASSERT(count == NUM_FILES);
+
+    ASSERT_OK(rmdir("/tmp/test-large-dir"));
+}
+
 static size_t read_all(int fd, unsigned char* buf, size_t count) {
     size_t total = 0;
     while (total < count) {
@@ -314,6 +399,74 @@ static noreturn void socket_receiver(bool shut_rd) {
     exit(0);
 }
 
+static void test_splice(void) {
+    puts("splice");
+    int fd = open("/tmp/test-splice", O_CREAT | O_RDWR | O_TRUNC);
+    ASSERT_OK(fd);
+    char buf[8192];
+    for (size_t i = 0; i < sizeof(buf); ++i)
+        buf[i] = i % 251;
+    ASSERT(write(fd, buf, sizeof(buf)) == sizeof(buf));
+
+    int fds1[2];
+    int fds2[2];
+    ASSERT_OK(pipe(fds1));
+    ASSERT_OK(pipe(fds2));
+
+    // File -> pipe, starting in the middle of a page
+    loff_t offset = 100;
+    ASSERT(splice(fd, &offset, fds1[1], NULL, 5000, 0) == 5000);
+    ASSERT(offset == 5100);
+
+    // Pipe -> pipe, duplicated with tee
+    ASSERT(tee(fds1[0], fds2[1], 3000, 0) == 3000);
+    ASSERT(splice(fds1[0], NULL, fds2[1], NULL, 1000, 0) == 1000);
+
+    char out[5000];
+    ASSERT(read(fds2[0], out, 4000) == 4000);
+    ASSERT(!memcmp(out, buf + 100, 3000));
+    ASSERT(!memcmp(out + 3000, buf + 100, 1000));
+    ASSERT(read(fds1[0], out, 4000) == 4000);
+    ASSERT(!memcmp(out, buf + 1100, 4000));
+
+    // User memory -> pipe keeps the contents at the time of the call
+    char* page = malloc(4096);
+    ASSERT(page);
+    memcpy(page, "hello", 5);
+    struct iovec iov = {.iov_base = page, .iov_len = 5};
+    ASSERT(vmsplice(fds1[1], &iov, 1, 0) == 5);
+    memcpy(page, "world", 5);
+    ASSERT(read(fds1[0], out, 5) == 5);
+    ASSERT(!memcmp(out, "hello", 5));
+    free(page);
+
+    // Pipe -> file
+    ASSERT(write(fds1[1], "abc", 3) == 3);
+    offset = 8192;
+    ASSERT(splice(fds1[0], NULL, fd, &offset, 3, 0) == 3);
+    ASSERT(pread(fd, out, 3, 8192) == 3);
+    ASSERT(!memcmp(out, "abc", 3));
+
+    // Pipe -> file, spanning multiple buffers of the pipe
+    ASSERT(write(fds1[1], buf, sizeof(buf)) == sizeof(buf));
+    offset = 0;
+    ASSERT(splice(fds1[0], NULL, fd, &offset, sizeof(buf), 0) ==
+           sizeof(buf));
+    char spliced[sizeof(buf)];
+    ASSERT(pread(fd, spliced, sizeof(spliced), 0) == sizeof(spliced));
+    ASSERT(!memcmp(spliced, buf, sizeof(buf)));
+
+    ASSERT(splice(fds1[0], NULL, fd, NULL, 3, SPLICE_F_NONBLOCK) == -1);
+    ASSERT(errno == EAGAIN);
+
+    for (size_t i = 0; i < 2; ++i) {
+        ASSERT_OK(close(fds1[i]));
+        ASSERT_OK(close(fds2[i]));
+    }
+    ASSERT_OK(close(fd));
+    ASSERT_OK(unlink("/tmp/test-splice"));
+}
+
 static void test_socket(void) {
     puts("Socket");
 
@@ -453,6 +606,37 @@ static void test_mmap_private(void) {
     ASSERT_OK(close(fd));
 }
 
+static void test_sparse_file(void) {
+    puts("Sparse file");
+    int fd = open("/tmp/test-sparse", O_CREAT | O_RDWR | O_TRUNC);
+    ASSERT_OK(fd);
+
+    size_t offset = 1024 * 1024;
+    ASSERT(pwrite(fd, "foo", 3, offset) == 3);
+    struct stat st;
+    ASSERT_OK(fstat(fd, &st));
+    ASSERT(st.st_size == (off_t)offset + 3);
+
+    char buf[16];
+    memset(buf, 0xff, sizeof(buf));
+    ASSERT(pread(fd, buf, sizeof(buf), 4096) == sizeof(buf));
+    for (size_t i = 0; i < sizeof(buf); ++i)
+        ASSERT(buf[i] == 0);
+
+    // Writes through a shared mapping are visible to read()
+    char* map =
+        mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    ASSERT(map != MAP_FAILED);
+    ASSERT(!memcmp(map, "foo", 3));
+    memcpy(map, "bar", 3);
+    ASSERT(pread(fd, buf, 3, offset) == 3);
+    ASSERT(!memcmp(buf, "bar", 3));
+    ASSERT_OK(munmap(map, 4096));
+
+    ASSERT_OK(close(fd));
+    ASSERT_OK(unlink("/tmp/test-sparse"));
+}
+
 static void* shared_mmap_addr;
 
 static void mmap_reader(void) {
@@ -479,6 +663,183 @@ static void test_mmap_shared(void) {
     ASSERT_OK(munmap(shared_mmap_addr, size));
 }
 
+static void test_mmap_anonymous(void) {
+    puts("mmap(MAP_ANONYMOUS)");
+    size_t size = 64 * 1024 * 1024;
+    unsigned char* buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+    ASSERT(buf != MAP_FAILED);
+    for (size_t i = 0; i < size; i += 1024 * 1024) {
+        ASSERT(buf[i] == 0);
+        ASSERT(buf[i + 1] == 0);
+        buf[i + 1] = 42;
+        ASSERT(buf[i] == 0);
+        ASSERT(buf[i + 1] == 42);
+    }
+    ASSERT_OK(munmap(buf, size));
+}
+
+static size_t read_rss_kib(void) {
+    int fd = open("/proc/self/status", O_RDONLY);
+    ASSERT_OK(fd);
+    char buf[256];
+    ssize_t nread = read(fd, buf, sizeof(buf) - 1);
+    ASSERT(nread > 0);
+    buf[nread] = 0;
+    ASSERT_OK(close(fd));
+    char* rss = strstr(buf, "VmRSS:");
+    ASSERT(rss);
+    return atoi(rss + strlen("VmRSS:"));
+}
+
+static void test_rss(void) {
+    puts("RSS accounting");
+    size_t size = 4 * 1024 * 1024;
+    unsigned char* buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+    ASSERT(buf != MAP_FAILED);
+    size_t before = read_rss_kib();
+    for (size_t i = 0; i < size; i += 4096)
+        buf[i] = 1;
+    size_t touched = read_rss_kib();
+    ASSERT(touched >= before + size / 1024);
+    ASSERT_OK(munmap(buf, size));
+    ASSERT(read_rss_kib() + size / 1024 <= touched);
+}
+
+static void test_proc_getdents(void) {
+    puts("getdents on /proc");
+    pid_t child = fork();
+    ASSERT_OK(child);
+    if (child == 0) {
+        pause();
+        exit(0);
+    }
+
+    // readdir passes a freshly allocated buffer to getdents, so copying the
+    // entries may page-fault.
+    bool seen_self = false;
+    bool seen_child = false;
+    DIR* dirp = opendir("/proc");
+    ASSERT(dirp);
+    struct dirent* dent;
+    while ((dent = readdir(dirp))) {
+        pid_t pid = atoi(dent->d_name);
+        seen_self |= pid == getpid();
+        seen_child |= pid == child;
+    }
+    ASSERT_OK(closedir(dirp));
+    ASSERT(seen_self);
+    ASSERT(seen_child);
+
+    ASSERT_OK(kill(child, SIGKILL));
+    ASSERT_OK(waitpid(child, NULL, 0));
+}
+
+// Writes the contents of the file from a mapping whose pages have not been
+// accessed yet, so the kernel faults them in while reading the buffer.
+static void write_from_unpopulated_mapping(int out_fd, int fd, size_t size) {
+    char* buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ASSERT(buf != MAP_FAILED);
+    ASSERT(write(out_fd, buf, size) == (ssize_t)size);
+    ASSERT_OK(munmap(buf, size));
+}
+
+static void test_write_unpopulated(void) {
+    puts("write from unpopulated pages");
+    static const char msg[] = "written from an unpopulated page\n";
+    unlink("/tmp/test-write-unpopulated");
+    int fd = open("/tmp/test-write-unpopulated", O_CREAT | O_EXCL | O_RDWR);
+    ASSERT_OK(fd);
+    ASSERT(write(fd, msg, strlen(msg)) == (ssize_t)strlen(msg));
+
+    write_from_unpopulated_mapping(STDOUT_FILENO, fd, strlen(msg));
+
+    if (mknod("/dev/kmsg", S_IFCHR, makedev(1, 11)) < 0)
+        ASSERT(errno == EEXIST);
+    int kmsg_fd = open("/dev/kmsg", O_WRONLY);
+    ASSERT_OK(kmsg_fd);
+    write_from_unpopulated_mapping(kmsg_fd, fd, strlen(msg));
+    ASSERT_OK(close(kmsg_fd));
+
+    ASSERT_OK(close(fd));
+    ASSERT_OK(unlink("/tmp/test-write-unpopulated"));
+}
+
+static void test_fork_cow(void) {
+    puts("fork (copy-on-write)");
+    size_t size = 5000;
+    uint32_t* buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+    ASSERT(buf != MAP_FAILED);
+    for (size_t i = 0; i < 100; ++i)
+        buf[i] = i;
+
+    int pipefd[2];
+    ASSERT_OK(pipe(pipefd));
+    pid_t pid = fork();
+    ASSERT_OK(pid);
+    if (pid == 0) {
+        ASSERT_OK(close(pipefd[1]));
+        for (size_t i = 0; i < 100; ++i) {
+            ASSERT(buf[i] == i);
+            buf[i] = i + 100;
+        }
+        // The kernel writes into a page that is shared with the parent
+        ASSERT(read(pipefd[0], buf + 1000, sizeof(uint32_t)) ==
+               sizeof(uint32_t));
+        ASSERT(buf[1000] == 42);
+        exit(0);
+    }
+    ASSERT_OK(close(pipefd[0]));
+    uint32_t value = 42;
+    ASSERT(write(pipefd[1], &value, sizeof(value)) == sizeof(value));
+    ASSERT_OK(close(pipefd[1]));
+    ASSERT_OK(waitpid(pid, NULL, 0));
+
+    for (size_t i = 0; i < 100; ++i)
+        ASSERT(buf[i] == i);
+    ASSERT(buf[1000] == 0);
+    ASSERT_OK(munmap(buf, size));
+}
+
+static void test_mmap_hugetlb(void) {
+    puts("mmap(MAP_HUGETLB)");
+    size_t size = 8 * 1024 * 1024;
+    uint32_t* buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, 0, 0);
+    if (buf == MAP_FAILED) {
+        // Large pages are not supported or memory is too fragmented
+        ASSERT(errno == ENOMEM);
+        return;
+    }
+    size_t n = size / sizeof(uint32_t);
+    for (size_t i = 0; i < n; i += 1024) {
+        ASSERT(buf[i] == 0);
+        buf[i] = i;
+    }
+
+    // Private huge pages are copied on write after fork
+    pid_t pid = fork();
+    ASSERT_OK(pid);
+    if (pid == 0) {
+        for (size_t i = 0; i < n; i += 1024) {
+            ASSERT(buf[i] == i);
+            buf[i] = 0;
+        }
+        exit(0);
+    }
+    ASSERT_OK(waitpid(pid, NULL, 0));
+    for (size_t i = 0; i < n; i += 1024)
+        ASSERT(buf[i] == i);
+
+    // Unmapping a part of a huge page keeps the rest of it
+    ASSERT_OK(munmap(buf + 1024, 4096));
+    ASSERT(buf[0] == 0);
+    ASSERT(buf[2048] == 2048);
+    ASSERT_OK(munmap(buf, size));
+}
+
 static void test_framebuffer(void) {
     puts("Framebuffer");
 
@@ -505,6 +866,285 @@ static void test_framebuffer(void) {
     ASSERT_OK(munmap(fb, fix.smem_len));
 }
 
+static bool cmdline_contains(const char* key) {
+    int fd = open("/proc/cmdline", O_RDONLY);
+    ASSERT_OK(fd);
+    char buf[1024];
+    ssize_t nread = read(fd, buf, sizeof(buf) - 1);
+    ASSERT_OK(nread);
+    buf[nread] = 0;
+    ASSERT_OK(close(fd));
+
+    char* saved_ptr;
+    static const char* sep = " \n";
+    for (char* token = strtok_r(buf, sep, &saved_ptr); token;
+         token = strtok_r(NULL, sep, &saved_ptr)) {
+        if (!strcmp(token, key))
+            return true;
+    }
+    return false;
+}
+
+// Spans the direct, indirect and doubly indirect blocks of a file on a file
+// system with 1 KiB blocks.
+#define EXT2_TEST_FILE_SIZE (300 * 1024)
+
+// Differs between the blocks of the file
+static unsigned char ext2_pattern_at(size_t offset) {
+    return offset * 7 + offset / 1024;
+}
+
+static void fill_ext2_pattern(unsigned char* buf, size_t offset, size_t size) {
+    for (size_t i = 0; i < size; ++i)
+        buf[i] = ext2_pattern_at(offset + i);
+}
+
+static void check_ext2_pattern(const unsigned char* buf, size_t offset,
+                               size_t size) {
+    for (size_t i = 0; i < size; ++i)
+        ASSERT(buf[i] == ext2_pattern_at(offset + i));
+}
+
+static void check_ext2_persisted(void) {
+    int fd = open("/tmp/ext2/persisted/file", O_RDONLY);
+    ASSERT_OK(fd);
+    unsigned char* buf = malloc(EXT2_TEST_FILE_SIZE);
+    ASSERT(buf);
+    ASSERT(read_all(fd, buf, EXT2_TEST_FILE_SIZE) == EXT2_TEST_FILE_SIZE);
+    check_ext2_pattern(buf, 0, EXT2_TEST_FILE_SIZE);
+    ASSERT(read(fd, buf, 1) == 0);
+    ASSERT_OK(close(fd));
+    free(buf);
+
+    ASSERT_OK(unlink("/tmp/ext2/persisted/file"));
+    ASSERT_OK(rmdir("/tmp/ext2/persisted"));
+}
+
+static void test_ext2(void) {
+    puts("ext2");
+
+    // run_tests.sh attaches a freshly formatted ext2 image as /dev/vda.
+    if (mknod("/dev/vda", S_IFBLK, makedev(254, 0)) < 0)
+        ASSERT(errno == EEXIST);
+    if (mkdir("/tmp/ext2", 0) < 0)
+        ASSERT(errno == EEXIST);
+    if (mount("/dev/vda", "/tmp/ext2", "ext2", 0, NULL) < 0) {
+        // Mounted by an earlier run
+        ASSERT(errno == EBUSY);
+    }
+
+    // run_tests.sh boots a second time with the same disk to check that
+    // what the first boot synced made it to the disk.
+    if (cmdline_contains("usertests.ext2_persisted"))
+        check_ext2_persisted();
+
+    unlink("/tmp/ext2/test/a");
+    unlink("/tmp/ext2/test/b");
+    unlink("/tmp/ext2/test/sub/c");
+    rmdir("/tmp/ext2/test/sub");
+    rmdir("/tmp/ext2/test");
+
+    ASSERT_OK(mkdir("/tmp/ext2/test", 0755));
+    ASSERT_OK(mkdir("/tmp/ext2/test/sub", 0755));
+
+    unsigned char* buf = malloc(EXT2_TEST_FILE_SIZE);
+    ASSERT(buf);
+    {
+        int fd = open("/tmp/ext2/test/a", O_WRONLY | O_CREAT | O_EXCL, 0644);
+        ASSERT_OK(fd);
+        fill_ext2_pattern(buf, 0, EXT2_TEST_FILE_SIZE);
+        ASSERT(write_all(fd, buf, EXT2_TEST_FILE_SIZE) == EXT2_TEST_FILE_SIZE);
+        ASSERT_OK(close(fd));
+    }
+    {
+        int fd = open("/tmp/ext2/test/a", O_RDWR);
+        ASSERT_OK(fd);
+        memset(buf, 0, EXT2_TEST_FILE_SIZE);
+        ASSERT(read_all(fd, buf, EXT2_TEST_FILE_SIZE) == EXT2_TEST_FILE_SIZE);
+        check_ext2_pattern(buf, 0, EXT2_TEST_FILE_SIZE);
+        ASSERT(read(fd, buf, 1) == 0);
+
+        // Unaligned accesses across block boundaries
+        ASSERT(pread(fd, buf, 3000, 1000) == 3000);
+        check_ext2_pattern(buf, 1000, 3000);
+        memset(buf, 0xab, 5000);
+        ASSERT(pwrite(fd, buf, 5000, 270000) == 5000);
+        ASSERT(pread(fd, buf, 7000, 269000) == 7000);
+        check_ext2_pattern(buf, 269000, 1000);
+        for (size_t i = 1000; i < 6000; ++i)
+            ASSERT(buf[i] == 0xab);
+        check_ext2_pattern(buf + 6000, 275000, 1000);
+
+        struct stat st;
+        ASSERT_OK(fstat(fd, &st));
+        ASSERT(st.st_size == EXT2_TEST_FILE_SIZE);
+        blkcnt_t blocks = st.st_blocks;
+
+        // Truncation frees the blocks past the end, and extension reads
+        // back zeros.
+        ASSERT_OK(ftruncate(fd, 5000));
+        ASSERT_OK(fstat(fd, &st));
+        ASSERT(st.st_size == 5000);
+        ASSERT(st.st_blocks < blocks);
+        ASSERT_OK(ftruncate(fd, 20000));
+        ASSERT(pread(fd, buf, 20000, 0) == 20000);
+        check_ext2_pattern(buf, 0, 5000);
+        for (size_t i = 5000; i < 20000; ++i)
+            ASSERT(buf[i] == 0);
+        ASSERT_OK(close(fd));
+    }
+
+    struct stat st;
+    ASSERT_OK(rename("/tmp/ext2/test/a", "/tmp/ext2/test/b"));
+    ASSERT_ERR(stat("/tmp/ext2/test/a", &st));
+    ASSERT(errno == ENOENT);
+    ASSERT_OK(stat("/tmp/ext2/test/b", &st));
+    ASSERT(st.st_size == 20000);
+
+    // Renaming over an existing file replaces it.
+    ASSERT_OK(close(open("/tmp/ext2/test/sub/c", O_CREAT | O_EXCL, 0644)));
+    ASSERT_OK(rename("/tmp/ext2/test/b", "/tmp/ext2/test/sub/c"));
+    ASSERT_ERR(stat("/tmp/ext2/test/b", &st));
+    ASSERT(errno == ENOENT);
+    ASSERT_OK(stat("/tmp/ext2/test/sub/c", &st));
+    ASSERT(st.st_size == 20000);
+
+    // Enough entries to span several directory blocks
+    enum { NUM_FILES = 200 };
+    char path[64];
+    for (int i = 0; i < NUM_FILES; ++i) {
+        (void)snprintf(path, sizeof(path), "/tmp/ext2/test/file%d", i);
+        ASSERT_OK(close(open(path, O_CREAT | O_EXCL, 0644)));
+    }
+    static bool seen[NUM_FILES];
+    memset(seen, 0, sizeof(seen));
+    bool seen_sub = false;
+    int count = 0;
+    DIR* dirp = opendir("/tmp/ext2/test");
+    ASSERT(dirp);
+    struct dirent* dent;
+    while ((dent = readdir(dirp))) {
+        if (dent->d_name[0] == '.')
+            continue;
+        if (!strcmp(dent->d_name, "sub")) {
+            ASSERT(!seen_sub);
+            seen_sub = true;
+            continue;
+        }
+        ASSERT(!strncmp(dent->d_name, "file", 4));
+        int i = atoi(dent->d_name + 4);
+        ASSERT(0 <= i && i < NUM_FILES);
+        ASSERT(!seen[i]);
+        seen[i] = true;
+        ++count;
+    }
+    ASSERT_OK(closedir(dirp));
+    ASSERT(seen_sub);
+    ASSERT(count == NUM_FILES);
+
+    for (int i = 0; i < NUM_FILES; ++i) {
+        (void)snprintf(path, sizeof(path), "/tmp/ext2/test/file%d", i);
+        ASSERT_OK(unlink(path));
+        ASSERT_ERR(stat(path, &st));
+        ASSERT(errno == ENOENT);
+    }
+
+    ASSERT_ERR(rmdir("/tmp/ext2/test/sub"));
+    ASSERT(errno == ENOTEMPTY);
+    ASSERT_OK(unlink("/tmp/ext2/test/sub/c"));
+    ASSERT_OK(rmdir("/tmp/ext2/test/sub"));
+    ASSERT_OK(rmdir("/tmp/ext2/test"));
+    ASSERT_ERR(stat("/tmp/ext2/test", &st));
+    ASSERT(errno == ENOENT);
+
+    // Left for the second boot of run_tests.sh to check
+    unlink("/tmp/ext2/persisted/file");
+    rmdir("/tmp/ext2/persisted");
+    ASSERT_OK(mkdir("/tmp/ext2/persisted", 0755));
+    {
+        int fd =
+            open("/tmp/ext2/persisted/file", O_WRONLY | O_CREAT | O_EXCL, 0644);
+        ASSERT_OK(fd);
+        fill_ext2_pattern(buf, 0, EXT2_TEST_FILE_SIZE);
+        ASSERT(write_all(fd, buf, EXT2_TEST_FILE_SIZE) == EXT2_TEST_FILE_SIZE);
+        ASSERT_OK(close(fd));
+    }
+    free(buf);
+    sync();
+}
+
+// Only depends on the offset, so that any part of the disk can be checked
+static unsigned char disk_pattern_at(size_t offset) {
+    return offset * 13 + offset / 512;
+}
+
+static void test_block_device(void) {
+    puts("Block device");
+
+    // run_tests.sh attaches a 16 MiB scratch disk as /dev/vdb.
+    if (mknod("/dev/vdb", S_IFBLK, makedev(254, 1)) < 0)
+        ASSERT(errno == EEXIST);
+    int fd = open("/dev/vdb", O_RDWR);
+    ASSERT_OK(fd);
+    size_t capacity = 16 * 1024 * 1024;
+
+    // Larger than a single request and the bounce buffer, and made up of
+    // physically discontiguous pages. Neither end is sector-aligned.
+    size_t offset = 12345;
+    size_t size = 3 * 1024 * 1024 + 777;
+    unsigned char* buf = malloc(size);
+    ASSERT(buf);
+    for (size_t i = 0; i < size; ++i)
+        buf[i] = disk_pattern_at(offset + i);
+    ASSERT(pwrite(fd, buf, size, offset) == (ssize_t)size);
+    memset(buf, 0, size);
+    ASSERT(pread(fd, buf, size, offset) == (ssize_t)size);
+    for (size_t i = 0; i < size; ++i)
+        ASSERT(buf[i] == disk_pattern_at(offset + i));
+
+    // Small writes within and across sectors keep the rest of the sectors
+    ASSERT(pwrite(fd, "abc", 3, offset + 100) == 3);
+    ASSERT(pwrite(fd, "defgh", 5, offset + 1022) == 5);
+    ASSERT(pread(fd, buf, 2048, offset) == 2048);
+    for (size_t i = 0; i < 2048; ++i) {
+        if (100 <= i && i < 103)
+            ASSERT(buf[i] == "abc"[i - 100]);
+        else if (1022 <= i && i < 1027)
+            ASSERT(buf[i] == "defgh"[i - 1022]);
+        else
+            ASSERT(buf[i] == disk_pattern_at(offset + i));
+    }
+
+    // Small reads within and across sectors
+    ASSERT(pread(fd, buf, 7, offset + 3000) == 7);
+    for (size_t i = 0; i < 7; ++i)
+        ASSERT(buf[i] == disk_pattern_at(offset + 3000 + i));
+    ASSERT(pread(fd, buf, 600, offset + 4000) == 600);
+    for (size_t i = 0; i < 600; ++i)
+        ASSERT(buf[i] == disk_pattern_at(offset + 4000 + i));
+
+    // Sequential access through the file offset
+    ASSERT(lseek(fd, offset + 5000, SEEK_SET) == (off_t)(offset + 5000));
+    for (size_t i = 0; i < 10; ++i) {
+        ASSERT(read(fd, buf, 333) == 333);
+        for (size_t j = 0; j < 333; ++j)
+            ASSERT(buf[j] == disk_pattern_at(offset + 5000 + i * 333 + j));
+    }
+
+    // Accesses are truncated at the end of the device.
+    memset(buf, 0x5a, 1000);
+    ASSERT(pwrite(fd, buf, 1000, capacity - 300) == 300);
+    ASSERT(pread(fd, buf, 1000, capacity - 400) == 400);
+    for (size_t i = 100; i < 400; ++i)
+        ASSERT(buf[i] == 0x5a);
+    ASSERT(pread(fd, buf, 1000, capacity) == 0);
+    ASSERT_ERR(pwrite(fd, buf, 1000, capacity));
+    ASSERT(errno == ENOSPC);
+
+    free(buf);
+    ASSERT_OK(close(fd));
+}
+
 static void test_malloc(void) {
     puts("malloc");
     free(malloc(0));
@@ -520,11 +1160,23 @@ static void test_malloc(void) {
 
 int main(void) {
     test_fs();
+    test_dentry_cache();
+    test_large_dir();
     test_fifo();
+    test_splice();
     test_socket();
     test_mmap_private();
+    test_sparse_file();
     test_mmap_shared();
+    test_mmap_anonymous();
+    test_rss();
+    test_proc_getdents();
+    test_write_unpopulated();
+    test_fork_cow();
+    test_mmap_hugetlb();
     test_framebuffer();
+    test_ext2();
+    test_block_device();
     test_malloc();
 
     return EXIT_SUCCESS;